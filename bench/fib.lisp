@@ -0,0 +1,10 @@
+; Naive recursion: nearly all of the time goes into calls and arithmetic.
+(define fib
+  (lambda (n)
+    (if (< n 2)
+      n
+      (+ (fib (- n 1)) (fib (- n 2))))))
+
+(define main
+  (lambda (args)
+    (fib 25)))
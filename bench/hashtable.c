@@ -0,0 +1,230 @@
+/*
+ * hashtable.c: compare the general hash table with the pointer table
+ *
+ * Each workload imitates a use of the tables within the interpreter, and is
+ * run against both struct hashtable (hashtable.h) and struct ptable
+ * (ptable.h). Build with "make bin/bench_hashtable", and optionally give a
+ * scale factor for the number of operations as an argument.
+ *
+ * Stephen Brennan <stephen@brennan.io>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "hashtable.h"
+#include "ptable.h"
+
+#define NKEYS 512
+
+/* shaped like struct lisp_text, whose first pointer is its string */
+struct key {
+	char *s;
+};
+
+static struct key keys[NKEYS];   /* the "interned" keys in each table */
+static struct key copies[NKEYS]; /* equal keys at different addresses */
+static struct key absent[NKEYS]; /* keys not in any table */
+static long scale = 1;
+static volatile unsigned long sink;
+
+static unsigned int key_hash(void *k)
+{
+	struct key *key = k;
+	return ht_string_hash(&key->s);
+}
+
+static int key_compare(void *l, void *r)
+{
+	return strcmp(((struct key *) l)->s, ((struct key *) r)->s);
+}
+
+static unsigned int ht_key_hash(void *k)
+{
+	return key_hash(*(void **) k);
+}
+
+static int ht_key_compare(void *l, void *r)
+{
+	return key_compare(*(void **) l, *(void **) r);
+}
+
+static unsigned int ptr_hash(void *p)
+{
+	return (unsigned int) ((unsigned long) p / 16);
+}
+
+static unsigned int ht_ptr_hash(void *p)
+{
+	return ptr_hash(*(void **) p);
+}
+
+static int ht_ptr_compare(void *l, void *r)
+{
+	return *(void **) l != *(void **) r;
+}
+
+static char *make_name(const char *prefix, int i)
+{
+	char *s = malloc(32);
+	sprintf(s, "%s-%d", prefix, i);
+	return s;
+}
+
+/* scope lookups of symbols, which the symbol cache makes unique */
+static void ht_lookup(struct key *probe)
+{
+	struct hashtable ht;
+	long r, i;
+
+	ht_init(&ht, ht_key_hash, ht_key_compare, sizeof(void *), sizeof(void *));
+	for (i = 0; i < NKEYS; i++)
+		ht_insert_ptr(&ht, &keys[i], &keys[i]);
+	for (r = 0; r < 20000 * scale; r++)
+		for (i = 0; i < NKEYS; i++)
+			sink += (unsigned long) ht_get_ptr(&ht, &probe[i]);
+	ht_destroy(&ht);
+}
+
+static void pt_lookup(struct key *probe)
+{
+	struct ptable pt;
+	long r, i;
+
+	pt_init(&pt, key_hash, key_compare);
+	for (i = 0; i < NKEYS; i++)
+		pt_insert(&pt, &keys[i], &keys[i]);
+	for (r = 0; r < 20000 * scale; r++)
+		for (i = 0; i < NKEYS; i++)
+			sink += (unsigned long) pt_get(&pt, &probe[i]);
+	pt_destroy(&pt);
+}
+
+static void ht_interned(void) { ht_lookup(keys); }
+static void pt_interned(void) { pt_lookup(keys); }
+static void ht_equal(void) { ht_lookup(copies); }
+static void pt_equal(void) { pt_lookup(copies); }
+static void ht_missing(void) { ht_lookup(absent); }
+static void pt_missing(void) { pt_lookup(absent); }
+
+/* the set of objects allocated outside the pool, keyed by address */
+static void ht_churn(void)
+{
+	struct hashtable *ht;
+	long r, i;
+
+	ht = ht_create(ht_ptr_hash, ht_ptr_compare, sizeof(void *), 0);
+	for (r = 0; r < 5000 * scale; r++) {
+		for (i = 0; i < NKEYS; i++)
+			ht_insert_ptr(ht, &keys[i], NULL);
+		for (i = 0; i < NKEYS; i++)
+			sink += ht_contains_ptr(ht, &absent[i]);
+		for (i = 0; i < NKEYS; i++)
+			ht_remove_ptr(ht, &keys[i]);
+	}
+	ht_delete(ht);
+}
+
+static void pt_churn(void)
+{
+	struct ptable *pt;
+	long r, i;
+
+	pt = pt_create(ptr_hash, NULL);
+	for (r = 0; r < 5000 * scale; r++) {
+		for (i = 0; i < NKEYS; i++)
+			pt_insert(pt, &keys[i], NULL);
+		for (i = 0; i < NKEYS; i++)
+			sink += pt_contains(pt, &absent[i]);
+		for (i = 0; i < NKEYS; i++)
+			pt_remove(pt, &keys[i]);
+	}
+	pt_delete(pt);
+}
+
+/* short lived scopes, which bind a few names and look them up */
+static void ht_small(void)
+{
+	struct hashtable ht;
+	long r, i;
+
+	for (r = 0; r < 2000000 * scale; r++) {
+		ht_init(&ht, ht_key_hash, ht_key_compare,
+		        sizeof(void *), sizeof(void *));
+		for (i = 0; i < 4; i++)
+			ht_insert_ptr(&ht, &keys[(r + i) % NKEYS], &keys[i]);
+		for (i = 0; i < 4; i++)
+			sink += (unsigned long) ht_get_ptr(&ht, &keys[(r + i) % NKEYS]);
+		ht_destroy(&ht);
+	}
+}
+
+static void pt_small(void)
+{
+	struct ptable pt;
+	long r, i;
+
+	for (r = 0; r < 2000000 * scale; r++) {
+		pt_init(&pt, key_hash, key_compare);
+		for (i = 0; i < 4; i++)
+			pt_insert(&pt, &keys[(r + i) % NKEYS], &keys[i]);
+		for (i = 0; i < 4; i++)
+			sink += (unsigned long) pt_get(&pt, &keys[(r + i) % NKEYS]);
+		pt_destroy(&pt);
+	}
+}
+
+static double time_it(void (*func)(void))
+{
+	clock_t start = clock();
+	func();
+	return (double) (clock() - start) / CLOCKS_PER_SEC;
+}
+
+struct workload {
+	const char *name;
+	void (*ht)(void);
+	void (*pt)(void);
+};
+
+static struct workload workloads[] = {
+	{"interned lookup", ht_interned, pt_interned},
+	{"equal lookup", ht_equal, pt_equal},
+	{"missing lookup", ht_missing, pt_missing},
+	{"insert/remove", ht_churn, pt_churn},
+	{"small tables", ht_small, pt_small},
+};
+
+int main(int argc, char **argv)
+{
+	unsigned int i;
+	double ht, pt;
+
+	if (argc > 1)
+		scale = atol(argv[1]);
+	if (scale < 1)
+		scale = 1;
+
+	for (i = 0; i < NKEYS; i++) {
+		keys[i].s = make_name("name", i);
+		copies[i].s = make_name("name", i);
+		absent[i].s = make_name("absent", i);
+	}
+
+	printf("%-16s %10s %10s %8s\n", "workload", "hashtable", "ptable",
+	       "speedup");
+	for (i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++) {
+		ht = time_it(workloads[i].ht);
+		pt = time_it(workloads[i].pt);
+		printf("%-16s %9.3fs %9.3fs %7.2fx\n", workloads[i].name, ht, pt,
+		       pt > 0 ? ht / pt : 0.0);
+	}
+
+	for (i = 0; i < NKEYS; i++) {
+		free(keys[i].s);
+		free(copies[i].s);
+		free(absent[i].s);
+	}
+	return 0;
+}
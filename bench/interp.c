@@ -0,0 +1,211 @@
+/*
+ * interp.c: microbenchmarks of the interpreter's hot paths
+ *
+ * Each workload exercises one part of the interpreter: allocating and sweeping
+ * objects, looking up a symbol through nested scopes, calling a lambda, and
+ * expanding macros, with and without the macro cache and the optimizer, and
+ * running a pipeline of maps and a reduce over lists and over a sequence.
+ * Those which evaluate code run on both evaluators. They
+ * report operations per second, and objects allocated per operation, as
+ * counted by lisp_get_stats(). Build with "make bin/bench_interp", and
+ * optionally give a scale factor for the number of operations as an argument.
+ *
+ * Stephen Brennan <stephen@brennan.io>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "funlisp_internal.h"
+
+static long scale = 1;
+
+static unsigned long allocations(lisp_runtime *rt)
+{
+	struct lisp_stats stats;
+	lisp_get_stats(rt, &stats);
+	return stats.allocations;
+}
+
+static void report(const char *name, const char *evaluator, unsigned long ops,
+                   double seconds, unsigned long allocs)
+{
+	printf("%-24s %-5s %12.0f %10.2f\n", name, evaluator,
+	       seconds > 0 ? ops / seconds : 0.0, (double) allocs / ops);
+}
+
+/* lisp_new() and lisp_sweep(): build lists of garbage and collect them */
+static void bench_alloc(void)
+{
+	lisp_runtime *rt = lisp_runtime_new();
+	lisp_scope *scope = lisp_new_default_scope(rt);
+	unsigned long ops = 0, before = allocations(rt);
+	lisp_list *list;
+	clock_t start = clock();
+	long r;
+	int i;
+
+	for (r = 0; r < 1000 * scale; r++) {
+		list = (lisp_list *) lisp_nil_new(rt);
+		for (i = 0; i < 1000; i++)
+			list = lisp_list_new(rt, (lisp_value *) list, rt->nil);
+		ops += 1000;
+		lisp_mark(rt, (lisp_value *) scope);
+		lisp_sweep(rt);
+	}
+	report("alloc and sweep", "-", ops,
+	       (double) (clock() - start) / CLOCKS_PER_SEC,
+	       allocations(rt) - before);
+	lisp_runtime_free(rt);
+}
+
+/* lisp_scope_lookup() of a global, from a scope nested @a depth deep */
+static void bench_lookup(int depth)
+{
+	lisp_runtime *rt = lisp_runtime_new();
+	lisp_scope *scope = lisp_new_default_scope(rt), *inner = scope, *s;
+	lisp_symbol *global = lisp_symbol_new(rt, "car", 0);
+	lisp_symbol *local = lisp_symbol_new(rt, "x", 0);
+	unsigned long ops = 200000 * (unsigned long) scale, i, before;
+	clock_t start;
+	char name[32];
+	int d;
+
+	for (d = 0; d < depth; d++) {
+		s = lisp_new_empty_scope(rt);
+		s->up = inner;
+		lisp_scope_bind(s, local, (lisp_value *) local);
+		inner = s;
+	}
+	before = allocations(rt);
+	start = clock();
+	for (i = 0; i < ops; i++)
+		if (!lisp_scope_lookup(rt, inner, global))
+			exit(1);
+	sprintf(name, "lookup at depth %d", depth);
+	report(name, "-", ops, (double) (clock() - start) / CLOCKS_PER_SEC,
+	       allocations(rt) - before);
+	lisp_runtime_free(rt);
+}
+
+/* Features enabled for bench_eval(). */
+#define EXPAND_ONCE 1
+#define OPTIMIZE 2
+
+/*
+ * Define some functions with @a setup, and time the evaluation of @a code,
+ * which performs @a ops operations, with or without the VM, and with the
+ * features in @a flags.
+ */
+static void bench_eval(const char *name, int vm, int flags, char *setup,
+                       char *code, unsigned long ops)
+{
+	lisp_runtime *rt = lisp_runtime_new();
+	lisp_scope *scope;
+	lisp_value *v;
+	unsigned long before;
+	clock_t start;
+	char *input;
+
+	if (vm)
+		lisp_enable_bytecode(rt);
+	else
+		lisp_disable_bytecode(rt);
+	if (flags & EXPAND_ONCE)
+		lisp_enable_macro_cache(rt);
+	if (flags & OPTIMIZE)
+		lisp_enable_optimizer(rt);
+	lisp_enable_auto_gc(rt, 0);
+	scope = lisp_new_default_scope(rt);
+	v = lisp_parse_progn(rt, setup);
+	if (!v || !lisp_eval(rt, scope, v))
+		goto error;
+
+	input = malloc(strlen(code) + 32);
+	sprintf(input, code, ops);
+	v = lisp_parse_progn(rt, input);
+	free(input);
+	if (!v)
+		goto error;
+	before = allocations(rt);
+	start = clock();
+	if (!lisp_eval(rt, scope, v))
+		goto error;
+	report(name, vm ? "vm" : "tree", ops,
+	       (double) (clock() - start) / CLOCKS_PER_SEC,
+	       allocations(rt) - before);
+	lisp_runtime_free(rt);
+	return;
+error:
+	lisp_print_error(rt, stderr);
+	exit(1);
+}
+
+static char *call_setup =
+	"(define id (lambda (x) x))"
+	"(define loop (lambda (n)"
+	"  (if (= n 0) 0 (progn (id n) (loop (- n 1))))))";
+
+static char *tail_setup =
+	"(define loop (lambda (n) (if (= n 0) 0 (loop (- n 1)))))";
+
+static char *macro_setup =
+	"(define inc (macro (x) `(+ ,x 1)))"
+	"(define twice (macro (x) `(inc (inc ,x))))"
+	"(define loop (lambda (n acc)"
+	"  (if (= n 0) acc (loop (- n 1) (twice acc)))))";
+
+static char *builtin_setup =
+	"(define loop (lambda (n l)"
+	"  (if (= n 0) 0 (progn (car l) (cdr l) (cons n l) (loop (- n 1) l)))))";
+
+static char *arith_setup =
+	"(define loop (lambda (n acc)"
+	"  (if (= n 0) acc (loop (- n 1) (+ acc (* 2 3) (- 10 4))))))";
+
+static char *pipeline_setup =
+	"(define half (lambda (x) (/ x 2)))"
+	"(define big (lambda (x) (> x 10)))";
+
+int main(int argc, char **argv)
+{
+	unsigned long ops;
+	int vm;
+
+	if (argc > 1)
+		scale = atol(argv[1]);
+	if (scale < 1)
+		scale = 1;
+	ops = 200000 * (unsigned long) scale;
+
+	printf("%-24s %-5s %12s %10s\n", "workload", "eval", "ops/sec",
+	       "allocs/op");
+	bench_alloc();
+	bench_lookup(1);
+	bench_lookup(8);
+	bench_lookup(32);
+	for (vm = 0; vm < 2; vm++) {
+		bench_eval("lambda call", vm, 0, call_setup, "(loop %lu)", ops);
+		bench_eval("tail call", vm, 0, tail_setup, "(loop %lu)", ops);
+		bench_eval("builtin call", vm, 0, builtin_setup,
+		           "(loop %lu '(1 2))", ops);
+		bench_eval("macro expansion", vm, 0, macro_setup,
+		           "(loop %lu 0)", ops);
+		bench_eval("cached macro expansion", vm, EXPAND_ONCE,
+		           macro_setup, "(loop %lu 0)", ops);
+		bench_eval("arithmetic", vm, 0, arith_setup, "(loop %lu 0)",
+		           ops);
+		bench_eval("optimized builtin call", vm, OPTIMIZE,
+		           builtin_setup, "(loop %lu '(1 2))", ops);
+		bench_eval("optimized arithmetic", vm, OPTIMIZE,
+		           arith_setup, "(loop %lu 0)", ops);
+		bench_eval("list pipeline", vm, 0, pipeline_setup,
+		           "(reduce + 0 (map big (map half"
+		           " (seq->list (range %lu)))))", ops);
+		bench_eval("sequence pipeline", vm, 0, pipeline_setup,
+		           "(seq-reduce + 0 (seq-map big (seq-map half"
+		           " (range %lu))))", ops);
+	}
+	return 0;
+}
@@ -0,0 +1,20 @@
+; Build lists, and run them through map and reduce with short lambdas.
+(define range
+  (lambda (n acc)
+    (if (= n 0)
+      acc
+      (range (- n 1) (cons n acc)))))
+
+(define sum-of-squares
+  (lambda (l)
+    (reduce + 0 (map (lambda (x) (* x x)) l))))
+
+(define repeat
+  (lambda (n last)
+    (if (= n 0)
+      last
+      (repeat (- n 1) (sum-of-squares (range 1000 '()))))))
+
+(define main
+  (lambda (args)
+    (repeat 300 0)))
@@ -0,0 +1,117 @@
+/*
+ * parse.c: measure the throughput of the parser
+ *
+ * Generates a data file of the shape produced by programs which emit funlisp
+ * code, and times parsing it with lisp_parse_progn(), and with an incremental
+ * lisp_parser fed in chunks the size of those read by lisp_load_file(). Build
+ * with "make bin/bench_parse", and optionally give the size of the generated
+ * input in megabytes as an argument.
+ *
+ * Stephen Brennan <stephen@brennan.io>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "funlisp.h"
+
+#define CHUNK 4096
+#define REPEAT 5
+
+static char *generate(unsigned long size, unsigned long *length)
+{
+	char *buf = malloc(size + 256);
+	unsigned long len = 0;
+	int i = 0;
+
+	while (len < size) {
+		len += sprintf(buf + len,
+			"; record %d\n"
+			"(define record-%d '(%d %d \"name of record %d\" (tag-%d . value)\n"
+			"  \"a longer description of the record, which has \\\"quotes\\\"\"\n"
+			"  os.getenv))\n",
+			i, i % 1000, i, i * 7 % 10007, i, i % 13);
+		i++;
+	}
+	*length = len;
+	return buf;
+}
+
+static double parse_progn(char *input, unsigned long length)
+{
+	lisp_runtime *rt = lisp_runtime_new();
+	clock_t start = clock();
+	lisp_value *v = lisp_parse_progn(rt, input);
+	double t = (double) (clock() - start) / CLOCKS_PER_SEC;
+
+	(void) length;
+	if (!v) {
+		lisp_print_error(rt, stderr);
+		exit(1);
+	}
+	lisp_runtime_free(rt);
+	return t;
+}
+
+static double parse_chunks(char *input, unsigned long length)
+{
+	lisp_runtime *rt = lisp_runtime_new();
+	lisp_parser *parser = lisp_parser_new(rt);
+	lisp_value *v;
+	unsigned long pos, n;
+	clock_t start = clock();
+	double t;
+
+	for (pos = 0; pos < length; pos += n) {
+		n = length - pos < CHUNK ? length - pos : CHUNK;
+		lisp_parser_feed(parser, input + pos, n);
+		while (lisp_parser_next(parser, &v) > 0)
+			;
+		/* without collecting, the expressions would pile up */
+		lisp_mark(rt, (lisp_value *) lisp_nil_new(rt));
+		lisp_sweep(rt);
+	}
+	lisp_parser_finish(parser);
+	if (lisp_parser_next(parser, &v) < 0) {
+		lisp_print_error(rt, stderr);
+		exit(1);
+	}
+	t = (double) (clock() - start) / CLOCKS_PER_SEC;
+	lisp_parser_free(parser);
+	lisp_runtime_free(rt);
+	return t;
+}
+
+static void run(const char *name, double (*func)(char *, unsigned long),
+                char *input, unsigned long length)
+{
+	double best = 0, t;
+	int i;
+
+	for (i = 0; i < REPEAT; i++) {
+		t = func(input, length);
+		if (i == 0 || t < best)
+			best = t;
+	}
+	printf("%-16s %9.3fs %9.1f MB/s\n", name, best,
+	       best > 0 ? length / best / 1e6 : 0.0);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long size = 8, length;
+	char *input;
+
+	if (argc > 1)
+		size = atol(argv[1]);
+	if (size < 1)
+		size = 1;
+
+	input = generate(size * 1000000, &length);
+	printf("parsing %lu bytes, best of %d\n", length, REPEAT);
+	run("lisp_parse_progn", parse_progn, input, length);
+	run("lisp_parser", parse_chunks, input, length);
+	free(input);
+	return 0;
+}
@@ -0,0 +1,120 @@
+/*
+ * scripts.c: time whole scripts, such as the ones in the bench directory
+ *
+ * Each script is loaded, and its main function is run several times on each
+ * evaluator. The best time is reported, along with the calls it made per
+ * second, counted with the fuel of lisp_set_fuel(), and the objects it
+ * allocated per run. Scripts may use string-append, which this program adds
+ * to the language, since funlisp has no builtin to build strings. Build with
+ * "make bin/bench_scripts", and give the scripts as arguments.
+ *
+ * Stephen Brennan <stephen@brennan.io>
+ */
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "funlisp.h"
+
+#define REPEAT 3
+
+/* (string-append s...) returns the concatenation of its arguments */
+static lisp_value *string_append(lisp_runtime *rt, lisp_scope *scope,
+                                 lisp_value **argv, int argc, void *user)
+{
+	unsigned long len = 0, n;
+	char *buf;
+	int i;
+
+	(void) scope;
+	(void) user;
+	for (i = 0; i < argc; i++) {
+		if (!lisp_is(argv[i], type_string))
+			return lisp_error(rt, LE_TYPE, "expected strings");
+		len += lisp_string_length((lisp_string *) argv[i]);
+	}
+	buf = malloc(len + 1);
+	for (i = 0, len = 0; i < argc; i++) {
+		n = lisp_string_length((lisp_string *) argv[i]);
+		memcpy(buf + len, lisp_string_get((lisp_string *) argv[i]), n);
+		len += n;
+	}
+	buf[len] = '\0';
+	return (lisp_value *) lisp_string_new_len(rt, buf, len, LS_OWN);
+}
+
+static unsigned long allocations(lisp_runtime *rt)
+{
+	struct lisp_stats stats;
+	lisp_get_stats(rt, &stats);
+	return stats.allocations;
+}
+
+static int run(char *name, int vm)
+{
+	lisp_runtime *rt = lisp_runtime_new();
+	lisp_scope *scope;
+	unsigned long calls = 0, allocs = 0, before;
+	double best = 0, t;
+	clock_t start;
+	FILE *file;
+	int i;
+
+	if (vm)
+		lisp_enable_bytecode(rt);
+	else
+		lisp_disable_bytecode(rt);
+	lisp_enable_auto_gc(rt, 0);
+	scope = lisp_new_default_scope(rt);
+	lisp_scope_add_builtin_argv(rt, scope, "string-append", string_append,
+	                            NULL);
+
+	file = fopen(name, "r");
+	if (!file) {
+		perror(name);
+		lisp_runtime_free(rt);
+		return 1;
+	}
+	if (!lisp_load_file(rt, scope, file))
+		goto error;
+
+	for (i = 0; i < REPEAT; i++) {
+		lisp_set_fuel(rt, ULONG_MAX);
+		before = allocations(rt);
+		start = clock();
+		if (!lisp_run_main_if_exists(rt, scope, 0, NULL))
+			goto error;
+		t = (double) (clock() - start) / CLOCKS_PER_SEC;
+		if (i == 0 || t < best)
+			best = t;
+		calls = ULONG_MAX - lisp_get_fuel(rt);
+		allocs = allocations(rt) - before;
+		/* each run starts from a clean heap */
+		lisp_mark(rt, (lisp_value *) scope);
+		lisp_sweep(rt);
+	}
+	printf("%-24s %-5s %9.3fs %12.0f %12lu\n", name, vm ? "vm" : "tree",
+	       best, best > 0 ? calls / best : 0.0, allocs);
+	fclose(file);
+	lisp_runtime_free(rt);
+	return 0;
+error:
+	lisp_print_error(rt, stderr);
+	fclose(file);
+	lisp_runtime_free(rt);
+	return 1;
+}
+
+int main(int argc, char **argv)
+{
+	int i, vm, rv = 0;
+
+	printf("%-24s %-5s %10s %12s %12s\n", "script", "eval", "best",
+	       "calls/sec", "allocs/run");
+	for (i = 1; i < argc; i++)
+		for (vm = 0; vm < 2; vm++)
+			rv |= run(argv[i], vm);
+	return rv;
+}
@@ -0,0 +1,22 @@
+; Build a long string a word at a time, and then take it apart again.
+(define words '("lorem" "ipsum" "dolor" "sit" "amet" "consectetur" "adipiscing"))
+
+(define build
+  (lambda (n l acc)
+    (cond
+      ((= n 0) acc)
+      ((null? l) (build n words acc))
+      (1 (build (- n 1) (cdr l) (string-append acc (car l) " "))))))
+
+; count the words of s, starting from index i
+(define count-words
+  (lambda (s i start n)
+    (cond
+      ((= i (string-length s)) n)
+      ((equal? (substring s i 1) " ")
+        (count-words s (+ i 1) (+ i 1) (+ n 1)))
+      (1 (count-words s (+ i 1) start n)))))
+
+(define main
+  (lambda (args)
+    (count-words (build 3000 words "") 0 0 0)))
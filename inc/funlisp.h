@@ -26,6 +26,16 @@
  * embedding application may want its builtin functions to have access to.
  * Context is added with lisp_runtime_set_ctx() and retrieved with
  * lisp_runtime_get_ctx().
+ *
+ * Runtimes share no mutable state with each other, so different threads may
+ * use different runtimes at the same time. A runtime, and every object created
+ * in it, must only be used by one thread at a time. The exception is a runtime
+ * frozen with lisp_runtime_freeze(), which is never written again: any number
+ * of threads may spawn runtimes from it with lisp_runtime_spawn() and use them
+ * at once, sharing the template's modules, compiled code and symbols. The
+ * library reads the environment when a runtime is created, and for the
+ * ``os.getenv`` builtin, so the host must not change it on another thread
+ * meanwhile.
  */
 typedef struct lisp_runtime lisp_runtime;
 
@@ -71,13 +81,11 @@ void lisp_runtime_free(lisp_runtime *rt);
 void lisp_enable_strcache(lisp_runtime *rt);
 
 /**
- * Enable runtime support for caching symbols.
- *
- * When symbol caching is enabled, symbols created with lisp_symbol_new() will
- * be looked up from a cache first, and if they already exist, a cached object
- * will be returned. This reduces the number of unique objects and memory
- * objects, which both improves memory utilization and garbage collection times.
- * @param rt runtime to enable symbol caching on
+ * Formerly enabled caching of symbols. Symbols are now always interned:
+ * lisp_symbol_new() returns the existing symbol with the same name, if there
+ * is one, so that the interpreter may compare symbols by pointer. This function
+ * does nothing.
+ * @param rt runtime
  */
 void lisp_enable_symcache(lisp_runtime *rt);
 
@@ -88,11 +96,125 @@ void lisp_enable_symcache(lisp_runtime *rt);
 void lisp_disable_strcache(lisp_runtime *rt);
 
 /**
- * Disable symbol caching.
- * @param rt runtime to disable caching
+ * Formerly disabled caching of symbols. Symbols are always interned, so this
+ * function does nothing.
+ * @param rt runtime
  */
 void lisp_disable_symcache(lisp_runtime *rt);
 
+/**
+ * Enable the object pool allocator. This is the default.
+ *
+ * When the pool is enabled, language objects are allocated from large pages
+ * owned by the runtime, which are divided into a handful of size classes. Freed
+ * objects are kept for reuse by the runtime rather than returned to the system,
+ * which makes allocation and garbage collection much cheaper. All pages are
+ * released by lisp_runtime_free().
+ * @param rt runtime to enable the pool on
+ */
+void lisp_enable_pool(lisp_runtime *rt);
+
+/**
+ * Disable the object pool allocator, so that each new language object is
+ * allocated with malloc() and released with free(). Objects which were already
+ * allocated from the pool remain valid.
+ *
+ * This is slower, but it allows memory debugging tools such as valgrind to
+ * detect use-after-free of language objects. The pool is also disabled for
+ * every new runtime when the ``FUNLISP_NOPOOL`` environment variable is set.
+ * @param rt runtime to disable the pool on
+ */
+void lisp_disable_pool(lisp_runtime *rt);
+
+/**
+ * Enable the bytecode virtual machine. By default, code is evaluated by walking
+ * it directly.
+ *
+ * While the VM is enabled, the body of each lambda is compiled to bytecode the
+ * first time it is called, and run by a stack based virtual machine, which is
+ * several times faster for code that makes many calls. Code loaded by
+ * lisp_load_file() is compiled and run too. Compiled code behaves exactly as
+ * the code it came from, and builtins are called as usual. That includes
+ * special forms like ``if`` whose names are bound to something else after the
+ * code was compiled, though code doing so runs slower. The VM is also
+ * enabled for every new runtime when the ``FUNLISP_BYTECODE`` environment
+ * variable is set.
+ * @param rt runtime to enable the VM on
+ */
+void lisp_enable_bytecode(lisp_runtime *rt);
+
+/**
+ * Disable the bytecode virtual machine, going back to evaluating code by
+ * walking it.
+ * @param rt runtime to disable the VM on
+ */
+void lisp_disable_bytecode(lisp_runtime *rt);
+
+/**
+ * Enable the macro cache, so that each macro call is expanded once. By
+ * default, a macro is run on its arguments each time the call is evaluated.
+ *
+ * While the cache is enabled, the code which a call expands to is kept, and
+ * evaluated again the next time the call is reached, so a macro used within a
+ * loop costs no more than the code it expands to. A call is expanded again when
+ * its head evaluates to a different macro, for instance once the macro was
+ * redefined. Macros must therefore depend only on their arguments: one which
+ * has side effects, or whose expansion depends on variables which change, sees
+ * them only the first time. The cache is also enabled for every new runtime
+ * when the ``FUNLISP_MACRO_CACHE`` environment variable is set.
+ * @param rt runtime to enable the macro cache on
+ */
+void lisp_enable_macro_cache(lisp_runtime *rt);
+
+/**
+ * Disable the macro cache, discarding the expansions it holds.
+ * @param rt runtime to disable the macro cache on
+ */
+void lisp_disable_macro_cache(lisp_runtime *rt);
+
+/**
+ * Enable the optimizer. By default, each name in code is looked up when the
+ * code is evaluated.
+ *
+ * While the optimizer is enabled, lambda bodies are optimized when the lambda
+ * is created. References to core builtins, such as ``+``, ``if`` or ``car``,
+ * which nothing in the body can shadow, refer to the builtin directly rather
+ * than being looked up in each call, and arithmetic and comparisons of
+ * integer constants are computed once. Binding the name of a core builtin in
+ * a scope which optimized code could see, for instance with a global
+ * ``define``, makes optimized code look such names up again, so optimized code
+ * behaves exactly as the code it came from. Bindings in the new scopes of a
+ * ``let`` or a lambda call leave optimized code alone.
+ * The optimizer is also enabled for every new runtime when the
+ * ``FUNLISP_OPTIMIZE`` environment variable is set.
+ * @param rt runtime to enable the optimizer on
+ */
+void lisp_enable_optimizer(lisp_runtime *rt);
+
+/**
+ * Disable the optimizer. Lambdas which were already optimized remain so.
+ * @param rt runtime to disable the optimizer on
+ */
+void lisp_disable_optimizer(lisp_runtime *rt);
+
+/**
+ * Set the number of threads which the ``pmap`` and ``preduce`` builtins may
+ * use, including the thread calling them. With one thread, they are the same as
+ * ``map`` and ``reduce``. By default, this is the number of processors online,
+ * or the value of the ``FUNLISP_THREADS`` environment variable when it is set.
+ *
+ * The threads are started when first needed, and kept until the runtime is
+ * freed or the number changes. Each evaluates in a runtime of its own, which
+ * reads the caller's objects while the caller waits. So the function given to
+ * ``pmap`` must not change objects it did not create, and runs on the tree
+ * walking evaluator even when the bytecode VM is enabled. Its results are
+ * copied into the caller's runtime, and must be built from lists, integers,
+ * strings and symbols, or be objects of the caller.
+ * @param rt runtime to set the number of threads of
+ * @param n number of threads, where anything below one means one
+ */
+void lisp_set_threads(lisp_runtime *rt, int n);
+
 /** @} */
 
 /*
@@ -151,8 +273,11 @@ typedef struct lisp_scope lisp_scope;
 typedef struct lisp_text lisp_symbol;
 
 /**
- * ::lisp_integer contains an int object of whatever size the C implementation
- * supports.
+ * ::lisp_integer is an integer of any size. Arithmetic which overflows a long
+ * carries on with an arbitrary precision ("bignum") representation. Small
+ * integers are encoded in the pointer itself rather than allocated, so a
+ * ::lisp_integer must only be accessed through lisp_integer_get() or
+ * lisp_integer_get_long().
  * @ingroup types
  */
 typedef struct lisp_integer lisp_integer;
@@ -196,6 +321,30 @@ typedef struct lisp_lambda lisp_lambda;
  */
 typedef struct lisp_list lisp_list;
 
+/**
+ * A vector is an array of values, which may be indexed in constant time and
+ * grows at its end. Vectors evaluate to themselves, and print as ``#(1 2 3)``.
+ * @ingroup vector
+ */
+typedef struct lisp_vector lisp_vector;
+
+/**
+ * A hash map associates keys with values. Keys may be of any type, and are
+ * equal when lisp_compare() finds them so. Hash maps evaluate to themselves,
+ * and print as ``#hash((a . 1) (b . 2))``, in no particular order.
+ * @ingroup hashmap
+ */
+typedef struct lisp_hashmap lisp_hashmap;
+
+/**
+ * A sequence yields items one at a time, as they are asked for, rather than
+ * holding them all. Sequences are made from lists, vectors, ranges of integers,
+ * or a host function, and may only be consumed once. They evaluate to
+ * themselves, and print as ``<sequence>``.
+ * @ingroup sequence
+ */
+typedef struct lisp_sequence lisp_sequence;
+
 /**
  * Data structure representing a module.
  * @ingroup types
@@ -312,6 +461,49 @@ lisp_scope *lisp_new_default_scope(lisp_runtime *rt);
  */
 lisp_scope *lisp_new_empty_scope(lisp_runtime *rt);
 
+/**
+ * Freeze a runtime into a template, from which new runtimes may be created
+ * cheaply with lisp_runtime_spawn().
+ *
+ * Set up the runtime as every spawned runtime should begin, for instance with
+ * a default scope and imported modules, then freeze it along with @a scope.
+ * Only the objects reachable from @a scope, the runtime's modules, and values
+ * registered with lisp_pin() are kept. They become read only, and are shared
+ * by the spawned runtimes instead of being copied, so a spawned runtime starts
+ * with a handful of allocations.
+ *
+ * Afterwards, the template may only be used to spawn runtimes, which any
+ * number of threads may do at once, and must not be freed until every runtime
+ * spawned from it has been. Its objects are never
+ * collected, and must not be modified, for instance by lisp_scope_bind().
+ * @param rt runtime to freeze
+ * @param scope the scope which lisp_new_template_scope() continues in
+ */
+void lisp_runtime_freeze(lisp_runtime *rt, lisp_scope *scope);
+
+/**
+ * Create a runtime which shares the objects of a frozen template. Its symbols
+ * are those of the template, along with any it creates, and it may import the
+ * modules imported by the template without loading them again. Its settings,
+ * such as the user context and whether it uses the bytecode VM, start from the
+ * template's. Free it with lisp_runtime_free(), which leaves the template
+ * untouched.
+ * @param template a runtime frozen by lisp_runtime_freeze()
+ * @return new runtime
+ */
+lisp_runtime *lisp_runtime_spawn(lisp_runtime *template);
+
+/**
+ * Create a new, empty scope in a runtime created by lisp_runtime_spawn(),
+ * which continues in the scope frozen in its template. Definitions made in it
+ * shadow those of the template without changing them, so each spawned runtime
+ * sees its own. Lambdas of the template are closed over the frozen scope, and
+ * continue to see the template's definitions.
+ * @param rt a runtime created by lisp_runtime_spawn()
+ * @returns new scope
+ */
+lisp_scope *lisp_new_template_scope(lisp_runtime *rt);
+
 /**
  * Add all language defaults to a scope. This is critical for the language work,
  * at all, since most language elements are implemented as builtin functions.
@@ -321,6 +513,18 @@ lisp_scope *lisp_new_empty_scope(lisp_runtime *rt);
  */
 void lisp_scope_populate_builtins(lisp_runtime *rt, lisp_scope *scope);
 
+/**
+ * Add builtins which look into the interpreter to a scope, for its tests. They
+ * are not part of the language, and lisp_new_default_scope() leaves them out.
+ * ``(inlined? f)`` tells whether the body of the lambda ``f`` still holds
+ * builtins inlined by the optimizer, see lisp_enable_optimizer().
+ * ``(interior-pointer-kept?)`` tells whether a collection keeps an object from
+ * malloc() alive while only a pointer into its middle is on the C stack.
+ * @param rt runtime
+ * @param scope scope to add builtins to
+ */
+void lisp_scope_populate_debug(lisp_runtime *rt, lisp_scope *scope);
+
 /**
  * Bind a symbol to a value in a scope.
  * @param scope scope to define the name in
@@ -477,6 +681,203 @@ lisp_value *lisp_nil_new(lisp_runtime *rt);
  */
 int lisp_nil_p(lisp_value *l);
 
+/**
+ * @}
+ * @defgroup vector Lisp Vectors
+ * @{
+ */
+
+/**
+ * Type object of ::lisp_vector, for type checking.
+ * @sa lisp_is()
+ */
+extern lisp_type *type_vector;
+
+/**
+ * Create a new vector of @a len items, each of which is nil.
+ * @param rt runtime
+ * @param len number of items
+ * @return newly allocated ::lisp_vector
+ */
+lisp_vector *lisp_vector_new(lisp_runtime *rt, unsigned long len);
+
+/**
+ * Create a new vector holding a copy of an array of values.
+ * @param rt runtime
+ * @param items the values
+ * @param n length of the array
+ * @return newly allocated ::lisp_vector
+ */
+lisp_vector *lisp_vector_from_array(lisp_runtime *rt, lisp_value **items,
+                                    unsigned long n);
+
+/**
+ * Convert an array of ints into a vector of integers.
+ * @param rt runtime
+ * @param items the ints
+ * @param n length of the array
+ * @return ::lisp_vector containing ::lisp_integer objects
+ */
+lisp_vector *lisp_vector_of_integers(lisp_runtime *rt, const int *items,
+                                     unsigned long n);
+
+/**
+ * Convert an array of strings into a vector of string objects.
+ * @param rt runtime
+ * @param list an array of strings
+ * @param n length of the array
+ * @param flags same flags passed to lisp_string_new()
+ * @return ::lisp_vector containing ::lisp_string objects
+ */
+lisp_vector *lisp_vector_of_strings(lisp_runtime *rt, char **list,
+                                    unsigned long n, int flags);
+
+/**
+ * Return the number of items in a vector.
+ * @param v the vector
+ * @return length of @a v
+ */
+unsigned long lisp_vector_length(lisp_vector *v);
+
+/**
+ * Return an item of a vector.
+ * @param v the vector
+ * @param i index of the item
+ * @return the item, or NULL when @a i is not less than the length
+ */
+lisp_value *lisp_vector_get(lisp_vector *v, unsigned long i);
+
+/**
+ * Replace an item of a vector.
+ * @warning @a i must be less than the length of @a v.
+ * @param v the vector
+ * @param i index of the item
+ * @param item the value to store
+ */
+void lisp_vector_set(lisp_vector *v, unsigned long i, lisp_value *item);
+
+/**
+ * Append an item to the end of a vector, growing it by one.
+ * @param v the vector
+ * @param item the value to append
+ */
+void lisp_vector_push(lisp_vector *v, lisp_value *item);
+
+/**
+ * @}
+ * @defgroup hashmap Lisp Hash Maps
+ * @{
+ */
+
+/**
+ * Type object of ::lisp_hashmap, for type checking.
+ * @sa lisp_is()
+ */
+extern lisp_type *type_hashmap;
+
+/**
+ * Create a new, empty hash map.
+ * @param rt runtime
+ * @return newly allocated ::lisp_hashmap
+ */
+lisp_hashmap *lisp_hashmap_new(lisp_runtime *rt);
+
+/**
+ * Return the value associated with a key.
+ * @param map the hash map
+ * @param key the key to look up
+ * @return the value, or NULL when @a key is not in @a map
+ */
+lisp_value *lisp_hashmap_get(lisp_hashmap *map, lisp_value *key);
+
+/**
+ * Associate a value with a key, replacing any value it had.
+ * @warning A key must not be changed while it is in a hash map, or it may not
+ * be found again.
+ * @param map the hash map
+ * @param key the key
+ * @param value the value
+ */
+void lisp_hashmap_put(lisp_hashmap *map, lisp_value *key, lisp_value *value);
+
+/**
+ * Remove a key and its value from a hash map.
+ * @param map the hash map
+ * @param key the key to remove
+ * @retval 1 when @a key was removed
+ * @retval 0 when @a key was not in @a map
+ */
+int lisp_hashmap_remove(lisp_hashmap *map, lisp_value *key);
+
+/**
+ * Return the number of keys in a hash map.
+ * @param map the hash map
+ * @return number of keys
+ */
+unsigned long lisp_hashmap_length(lisp_hashmap *map);
+
+/**
+ * @}
+ * @defgroup sequence Lisp Sequences
+ * @{
+ */
+
+/**
+ * Type object of ::lisp_sequence, for type checking.
+ * @sa lisp_is()
+ */
+extern lisp_type *type_sequence;
+
+/**
+ * A function which produces the items of a sequence created with
+ * lisp_sequence_new(). It is called each time the sequence is asked for an
+ * item, and takes three arguments:
+ * 1. The ::lisp_runtime consuming the sequence.
+ * 2. The user context given to lisp_sequence_new().
+ * 3. Where to store the item.
+ *
+ * It returns 1 after storing an item, 0 when there are no more, or -1 after
+ * reporting an error with lisp_error(). Either of the last two ends the
+ * sequence, and the function is not called again.
+ */
+typedef int (*lisp_sequence_func)(lisp_runtime *rt, void *user,
+                                  lisp_value **item);
+
+/**
+ * A function which releases the user context of a sequence. It is called once
+ * the sequence has ended, or when it is freed before that, and must not use
+ * the runtime.
+ */
+typedef void (*lisp_sequence_close_func)(void *user);
+
+/**
+ * Create a sequence of the items produced by a host function. Nothing is
+ * produced until the sequence is consumed, so a script may process a dataset
+ * of any size with ``seq-map``, ``seq-filter`` and ``seq-reduce`` while only
+ * one item at a time is in memory.
+ * @param rt runtime
+ * @param next function producing the items
+ * @param close function releasing @a user, or NULL
+ * @param user user context given to @a next and @a close
+ * @return newly allocated ::lisp_sequence
+ */
+lisp_sequence *lisp_sequence_new(lisp_runtime *rt, lisp_sequence_func next,
+                                 lisp_sequence_close_func close, void *user);
+
+/**
+ * Take the next item of a sequence. This runs the functions of any
+ * ``seq-map`` or ``seq-filter`` the sequence was made by, in @a scope.
+ * @param rt runtime
+ * @param scope scope to call the functions of the sequence in
+ * @param seq the sequence
+ * @param[out] item where to store the item
+ * @retval 1 when an item was stored
+ * @retval 0 when the sequence has ended
+ * @retval -1 on error, which is reported to @a rt
+ */
+int lisp_sequence_next(lisp_runtime *rt, lisp_scope *scope, lisp_sequence *seq,
+                       lisp_value **item);
+
 /**
  * @}
  * @defgroup types Lisp Types
@@ -565,9 +966,48 @@ extern lisp_type *type_module;
  */
 lisp_string *lisp_string_new(lisp_runtime *rt, char *str, int flags);
 
+/**
+ * Return a new string of a known length, which may contain NUL bytes. The flags
+ * are the same as for lisp_string_new(). Strings which are copied or owned, and
+ * are short enough, are stored within the ::lisp_string object itself, in which
+ * case an owned @a str is freed immediately.
+ * @param rt runtime
+ * @param str the string, which must be followed by a NUL at @a len unless
+ * ::LS_CPY is given
+ * @param len number of bytes in the string, not including the NUL
+ * @param flags flags related to copying and ownership of @a str
+ * @return a new ::lisp_string
+ * @see LS_CPY
+ * @see LS_OWN
+ */
+lisp_string *lisp_string_new_len(lisp_runtime *rt, char *str,
+                                 unsigned long len, int flags);
+
+/**
+ * Return the part of a string which begins at @a start and has at most @a len
+ * bytes. Both are clamped to the end of the string. Long slices share the
+ * memory of @a s without copying it, and keep @a s alive.
+ * @param rt runtime
+ * @param s the string to slice
+ * @param start index of the first byte of the slice
+ * @param len maximum length of the slice
+ * @return a ::lisp_string, which is @a s itself if the slice is all of it
+ */
+lisp_string *lisp_string_slice(lisp_runtime *rt, lisp_string *s,
+                               unsigned long start, unsigned long len);
+
+/**
+ * Return the length of a string in bytes, not including the NUL.
+ * @param s the lisp string
+ * @return the length of @a s
+ */
+unsigned long lisp_string_length(lisp_string *s);
+
 /**
  * Return a pointer to the string contained within a ::lisp_string. The
- * application must **not** modify or free the string.
+ * application must **not** modify or free the string. The string is terminated
+ * by a NUL, so the first time this is called on a slice which shares memory,
+ * the slice is copied. Use lisp_string_length() for strings containing NUL.
  * @param s the lisp string to access
  * @return the contained string
  */
@@ -575,7 +1015,8 @@ char *lisp_string_get(lisp_string *s);
 
 /**
  * Return a new symbol. This function will copy the @a string and free the copy
- * it on garbage collection (much like lisp_string_new()).
+ * it on garbage collection (much like lisp_string_new()). Symbols are interned,
+ * so if a symbol with the same name exists, it is returned instead.
  * @param rt runtime
  * @param string the symbol to create
  * @param flags flags related to copying and ownership of @a string
@@ -596,17 +1037,34 @@ char *lisp_symbol_get(lisp_symbol *s);
  * Create a new integer.
  * @param rt runtime
  * @param n the integer value
- * @return newly allocated integer
+ * @return new integer, which is usually not allocated at all
  */
 lisp_integer *lisp_integer_new(lisp_runtime *rt, int n);
 
+/**
+ * Create a new integer from a long.
+ * @param rt runtime
+ * @param n the integer value
+ * @return new integer, which is not allocated unless it is very large
+ */
+lisp_integer *lisp_integer_new_long(lisp_runtime *rt, long n);
+
 /**
  * Retrieve the integer value from a ::lisp_integer.
  * @param integer ::lisp_integer to return from
- * @return the int value
+ * @return the int value, or INT_MAX or INT_MIN when it is out of range
  */
 int lisp_integer_get(lisp_integer *integer);
 
+/**
+ * Retrieve the value of a ::lisp_integer which fits in a long.
+ * @param integer ::lisp_integer to return from
+ * @param[out] n where to store the value
+ * @retval 1 when the value was stored
+ * @retval 0 when it does not fit, and @a n is unchanged
+ */
+int lisp_integer_get_long(lisp_integer *integer, long *n);
+
 /**
  * @}
  * @defgroup builtins Builtin Functions
@@ -657,6 +1115,46 @@ lisp_builtin *lisp_builtin_new(lisp_runtime *rt, char *name,
 void lisp_scope_add_builtin(lisp_runtime *rt, lisp_scope *scope, char *name,
                             lisp_builtin_func call, void *user, int evald);
 
+/**
+ * A built-in function which receives its arguments as an array, rather than as
+ * a list. Its arguments are always evaluated. Since no list of arguments is
+ * created for each call, this is the faster choice for builtins which are
+ * called often. Takes five arguments:
+ * 1. The ::lisp_runtime associated with it.
+ * 2. The ::lisp_scope this function is being called executed within.
+ * 3. The evaluated arguments to this function. The array lives on a value
+ *    stack owned by the runtime, so it is only valid until the builtin
+ *    evaluates code or calls a function. Copy the arguments you need first.
+ * 4. The number of arguments in the array.
+ * 5. The user context associated with this builtin.
+ */
+typedef lisp_value * (*lisp_builtin_argv_func)(lisp_runtime*, lisp_scope*, lisp_value**, int, void*);
+
+/**
+ * Create a new ::lisp_builtin from a function which takes its arguments as an
+ * array. See lisp_builtin_new() for the rules about its name.
+ * @param rt runtime
+ * @param name name of the builtin. the interpreter will never free the name!
+ * @param call function pointer of the builtin
+ * @param user a user context pointer which will be given to the builtin
+ * @return new builtin object
+ */
+lisp_builtin *lisp_builtin_new_argv(lisp_runtime *rt, char *name,
+                                    lisp_builtin_argv_func call, void *user);
+
+/**
+ * Shortcut to declare a builtin function which takes its arguments as an
+ * array, and bind it in the given scope.
+ * @param rt runtime
+ * @param scope scope to bind builtin in
+ * @param name name of builtin
+ * @param call function pointer defining the builtin
+ * @param user a user context pointer which will be given to the builtin
+ */
+void lisp_scope_add_builtin_argv(lisp_runtime *rt, lisp_scope *scope,
+                                 char *name, lisp_builtin_argv_func call,
+                                 void *user);
+
 /**
  * Given a list of arguments, evaluate each of them within a scope and return a
  * new list containing the evaluated arguments. This is most useful for
@@ -688,6 +1186,9 @@ lisp_value *lisp_progn(lisp_runtime *rt, lisp_scope *scope, lisp_list *l);
  *
  *     d - integer
  *     l - list
+ *     v - vector
+ *     h - hash map
+ *     q - sequence
  *     s - symbol
  *     S - string
  *     o - scope
@@ -722,6 +1223,22 @@ lisp_value *lisp_progn(lisp_runtime *rt, lisp_scope *scope, lisp_list *l);
  */
 int lisp_get_args(lisp_runtime *rt, lisp_list *list, char *format, ...);
 
+/**
+ * Perform the same type checking and counting as lisp_get_args(), on an array
+ * of arguments given to a ::lisp_builtin_argv_func. All of the format codes
+ * are recognized except for 'R'. The rest of the arguments are simply the
+ * remainder of the array.
+ * @param rt runtime
+ * @param argv Argument array to type check
+ * @param argc Number of arguments in the array
+ * @param format Format string
+ * @param ... Destination pointer to place results
+ * @retval 1 on success (true)
+ * @retval 0 on failure (false)
+ */
+int lisp_get_argv(lisp_runtime *rt, lisp_value **argv, int argc, char *format,
+                  ...);
+
 /**
  * @}
  * @defgroup modules Modules
@@ -792,6 +1309,30 @@ lisp_module *lisp_import_file(lisp_runtime *rt, lisp_string *name, lisp_string *
  */
 lisp_module *lisp_do_import(lisp_runtime *rt, lisp_symbol *name);
 
+/**
+ * @brief Keep images of the code of imported files in a directory
+ *
+ * When the module cache is enabled, lisp_import_file() and lisp_do_import()
+ * store the parsed code of each file they import in @a dir, in the format of
+ * lisp_write_image(). A later import of the same file, by this or any other
+ * runtime, reads the image instead of parsing the file again, provided that
+ * the file's size, modification time and the hash of its contents are
+ * unchanged. A missing or invalid image is ignored, and the file is parsed as
+ * usual. The cache is also enabled when the ``FUNLISP_MODULE_CACHE``
+ * environment variable names a directory.
+ *
+ * @param rt runtime
+ * @param dir an existing directory, writable by the runtime's process, which
+ * is copied
+ */
+void lisp_enable_module_cache(lisp_runtime *rt, char *dir);
+
+/**
+ * @brief Parse every imported file. This is the default.
+ * @param rt runtime
+ */
+void lisp_disable_module_cache(lisp_runtime *rt);
+
 /**
  * @}
  * @defgroup embed Embedding API
@@ -852,16 +1393,101 @@ lisp_value *lisp_parse_progn(lisp_runtime *rt, char *input);
 lisp_value *lisp_parse_progn_f(lisp_runtime *rt, FILE *file);
 
 /**
- * Parse a file and evaluate its contents. This is roughly equivalent to:
- * @code
- * lisp_value *progn = lisp_parse_progn_f(rt, scope, input)
- * lisp_eval(rt, scope, progn);
- * @endcode
+ * An incremental parser, which is given its input in chunks of any size, and
+ * returns each expression as soon as it is complete. It only keeps the input
+ * of the expression it is in the middle of, so it may parse large files and
+ * streams (such as sockets) in bounded memory, and it never parses the same
+ * input twice. Create one with lisp_parser_new().
+ */
+typedef struct lisp_parser lisp_parser;
+
+/**
+ * Create an incremental parser, which creates language objects in @a rt.
+ * @param rt runtime
+ * @return a new parser, to be freed with lisp_parser_free()
+ */
+lisp_parser *lisp_parser_new(lisp_runtime *rt);
+
+/**
+ * Free a parser and the input it holds. Expressions it returned belong to the
+ * runtime, and are not affected.
+ * @param parser parser to free
+ */
+void lisp_parser_free(lisp_parser *parser);
+
+/**
+ * Give the parser more input. The input is copied, and may end anywhere,
+ * including within a token.
+ * @param parser parser
+ * @param input text to parse, which need not be NUL terminated
+ * @param len number of bytes of @a input
+ */
+void lisp_parser_feed(lisp_parser *parser, char *input, unsigned long len);
+
+/**
+ * Tell the parser that no more input will be fed. Afterward, an integer or
+ * symbol at the end of the input is complete, and lisp_parser_next() reports
+ * an expression which is not as an error.
+ * @param parser parser
+ */
+void lisp_parser_finish(lisp_parser *parser);
+
+/**
+ * Return the next complete expression from the input fed so far.
+ *
+ * When a parse error occurs, it is set in the runtime, with a line number
+ * counted from the beginning of the input. The erroneous expression is skipped,
+ * so parsing may continue after the error has been cleared.
+ * @param parser parser
+ * @param[out] output the expression, or NULL when there is none
+ * @retval 1 when an expression is stored in @a output
+ * @retval 0 when more input is needed, or when all input is finished
+ * @retval -1 on a parse error
+ */
+int lisp_parser_next(lisp_parser *parser, lisp_value **output);
+
+/**
+ * Return true when the parser holds the beginning of an expression which is
+ * not yet complete, for example to show a continuation prompt in a REPL.
+ * @param parser parser
+ */
+int lisp_parser_pending(lisp_parser *parser);
+
+/**
+ * Write a compact binary image of parsed code to a file, which
+ * lisp_read_image() turns back into the same code without parsing it again.
+ * The image stores the name of each symbol once, however often it is used. It
+ * may hold nil, integers, symbols, strings and lists of them, so any
+ * expression returned by the parser may be written.
+ * @param rt runtime
+ * @param code the value to write
+ * @param file file to write the image to, opened in binary mode
+ * @retval 0 on success
+ * @retval -1 on error, which is set in the runtime: ::LE_TYPE when @a code
+ * contains another type of value, or ::LE_FERROR when writing fails
+ */
+int lisp_write_image(lisp_runtime *rt, lisp_value *code, FILE *file);
+
+/**
+ * Read an image written by lisp_write_image(), to the end of the file. Its
+ * symbols are interned in the runtime as they are read.
+ * @param rt runtime
+ * @param file file to read the image from, opened in binary mode
+ * @return the value stored in the image
+ * @retval NULL on error: ::LE_SYNTAX when the file is not a valid image, or
+ * ::LE_FERROR when reading fails
+ */
+lisp_value *lisp_read_image(lisp_runtime *rt, FILE *file);
+
+/**
+ * Parse a file and evaluate its contents. Each expression is evaluated as soon
+ * as it is parsed, so that memory use does not depend on the size of the file.
+ * As a result, the expressions before a syntax error are still evaluated.
  * @param rt runtime
  * @param scope scope to evaluate within (usually a default scope)
  * @param input file to load as funlisp code
- * @return the result of evaluating the last item
- * @retval NULL on empty file, or file read error
+ * @return the result of evaluating the last item, or nil for an empty file
+ * @retval NULL on a parse, evaluation, or file read error
  */
 lisp_value *lisp_load_file(lisp_runtime *rt, lisp_scope *scope, FILE *input);
 
@@ -906,10 +1532,284 @@ void lisp_mark(lisp_runtime *rt, lisp_value *v);
 /**
  * Free every object associated with the runtime, which is not marked or
  * reachable from a marked object.
+ *
+ * The garbage collector is generational: objects which survive a sweep are
+ * promoted to an "old" generation. Most sweeps are minor collections, which
+ * only examine objects created since the previous sweep, and assume the old
+ * generation is still reachable. So, unreachable old objects are only freed by
+ * a major collection. A major collection happens automatically once the old
+ * generation has roughly doubled in size, or on request, see
+ * lisp_gc_request_major().
+ *
+ * When incremental sweeping is enabled (see lisp_enable_incremental()), this
+ * function only frees a bounded number of objects, and the rest are freed
+ * gradually by later allocations and calls to lisp_gc_step().
  * @param rt runtime
  */
 void lisp_sweep(lisp_runtime *rt);
 
+/**
+ * Enable automatic garbage collection during evaluation. Normally, objects are
+ * only freed when you call lisp_sweep(), so a single long running call into
+ * the interpreter may use unbounded memory. With automatic collection, the
+ * interpreter collects garbage by itself once @a threshold objects have been
+ * allocated since the last collection (or more, if lots of recently created
+ * data is still in use).
+ *
+ * Automatic collections only happen within calls which evaluate code, such as
+ * lisp_eval(), lisp_call(), lisp_progn(), lisp_eval_list() and
+ * lisp_import_file(). Besides the objects reachable from the runtime, they
+ * preserve the arguments of the outermost such call, along with objects
+ * referenced by the C stack, including the local variables of any builtins
+ * you have written. Any other object which must survive, for instance one your
+ * program keeps in a global variable or in heap memory, needs to be registered
+ * with lisp_pin().
+ *
+ * Automatic collection is disabled by default.
+ * @param rt runtime
+ * @param threshold minimum number of allocations between collections, or 0 for
+ * a reasonable default
+ */
+void lisp_enable_auto_gc(lisp_runtime *rt, unsigned long threshold);
+
+/**
+ * Disable automatic garbage collection.
+ * @param rt runtime
+ */
+void lisp_disable_auto_gc(lisp_runtime *rt);
+
+/**
+ * Register a value as a garbage collection root. Pinned values, and everything
+ * reachable from them, survive every collection (both lisp_sweep() and
+ * automatic collections) until they are unpinned. A value may be pinned more
+ * than once, and remains pinned until it has been unpinned as many times.
+ * @param rt runtime
+ * @param v value to preserve
+ */
+void lisp_pin(lisp_runtime *rt, lisp_value *v);
+
+/**
+ * Remove one registration of a value made by lisp_pin().
+ * @param rt runtime
+ * @param v value which was pinned
+ */
+void lisp_unpin(lisp_runtime *rt, lisp_value *v);
+
+/**
+ * Make the next collection a major collection, which examines every object and
+ * frees all unreachable objects, regardless of their generation.
+ * @param rt runtime
+ */
+void lisp_gc_request_major(lisp_runtime *rt);
+
+/**
+ * Enable generational garbage collection. This is the default.
+ * @param rt runtime
+ */
+void lisp_enable_generational(lisp_runtime *rt);
+
+/**
+ * Disable generational garbage collection, so that every collection is a major
+ * collection.
+ * @param rt runtime
+ */
+void lisp_disable_generational(lisp_runtime *rt);
+
+/**
+ * Enable incremental sweeping. Rather than freeing all garbage at once, each
+ * lisp_sweep() frees at most @a budget objects. The remainder of the sweep is
+ * performed a few objects at a time with each new allocation, or explicitly
+ * with lisp_gc_step(). Marking still happens all at once, but since most
+ * collections are minor, it only needs to trace recently created objects.
+ * Incremental sweeping is disabled by default.
+ * @param rt runtime
+ * @param budget maximum number of objects to examine in lisp_sweep()
+ */
+void lisp_enable_incremental(lisp_runtime *rt, int budget);
+
+/**
+ * Disable incremental sweeping, finishing any sweep in progress.
+ * @param rt runtime
+ */
+void lisp_disable_incremental(lisp_runtime *rt);
+
+/**
+ * Perform part of a pending incremental sweep. This is a good thing to call
+ * when your application is idle.
+ * @param rt runtime
+ * @param budget maximum number of objects to examine
+ * @retval 0 when no sweep is pending after this call
+ * @retval 1 when there is more sweeping to do
+ */
+int lisp_gc_step(lisp_runtime *rt, int budget);
+
+/** The number of types which lisp_stats has room for. */
+#define LISP_STATS_TYPES 16
+
+/**
+ * The objects of one type, in ::lisp_stats.
+ */
+struct lisp_type_stats {
+	const char *name;      /* the type's name, or "other" for the last entry
+	                          when there are more types than entries */
+	unsigned long objects; /* objects allocated */
+	unsigned long bytes;   /* bytes they take, within the runtime's heap,
+	                          including the items of vectors and the
+	                          tables of hash maps */
+};
+
+/**
+ * Statistics of a runtime's heap and garbage collector, filled in by
+ * lisp_get_stats(). The counts of objects and bytes describe the heap as it is,
+ * while the rest are totals since the runtime was created.
+ */
+struct lisp_stats {
+	unsigned long objects; /* objects allocated, including garbage which
+	                          has not been swept yet */
+	unsigned long bytes;   /* bytes they take */
+	struct lisp_type_stats types[LISP_STATS_TYPES]; /* by type */
+	int ntypes;            /* entries of types in use */
+
+	unsigned long allocations;       /* objects ever allocated */
+	unsigned long collections;       /* lisp_sweep() and automatic ones */
+	unsigned long major_collections; /* those which examined every object */
+	unsigned long marked;            /* objects found reachable */
+	unsigned long freed;             /* objects swept */
+	double mark_seconds;             /* time spent marking */
+	double sweep_seconds;            /* time spent sweeping */
+	unsigned long mark_queue_max;    /* most objects waiting to be traced */
+
+	unsigned long symbol_hits;   /* symbols found already interned */
+	unsigned long symbol_misses; /* symbols created */
+	unsigned long string_hits;   /* strings found in the string cache */
+	unsigned long string_misses; /* strings created while it is enabled */
+};
+
+/**
+ * Fill in the statistics of the runtime's heap and garbage collector. Counting
+ * the objects by type visits the whole heap, so avoid calling this very often
+ * on a large heap.
+ * @param rt runtime
+ * @param stats where to store the statistics
+ */
+void lisp_get_stats(lisp_runtime *rt, struct lisp_stats *stats);
+
+/**
+ * Limit the number of calls which the runtime may make, counting tail calls
+ * and calls made by builtins. Once they run out, each further call raises
+ * ::LE_LIMIT, unless the hook set with lisp_set_yield() provides more. A loop
+ * in lisp is a recursive call, so this bounds all evaluation. Checking the
+ * limit costs a decrement on each call.
+ * @param rt runtime
+ * @param calls number of calls allowed from now on
+ */
+void lisp_set_fuel(lisp_runtime *rt, unsigned long calls);
+
+/**
+ * Remove the limit set by lisp_set_fuel(). There is no limit by default.
+ * @param rt runtime
+ */
+void lisp_disable_fuel(lisp_runtime *rt);
+
+/**
+ * Return the number of calls the runtime may still make.
+ * @param rt runtime
+ * @return the remaining fuel, or ULONG_MAX when there is no limit
+ */
+unsigned long lisp_get_fuel(lisp_runtime *rt);
+
+/**
+ * Raise ::LE_LIMIT from the first call made once a time has passed, unless
+ * the hook set with lisp_set_yield() extends it. The clock is read once every
+ * few hundred calls, so the error comes a little later.
+ * @param rt runtime
+ * @param msec milliseconds from now, or 0 to remove the deadline
+ */
+void lisp_set_deadline(lisp_runtime *rt, unsigned long msec);
+
+/**
+ * Limit the depth of nested calls, so that runaway recursion raises
+ * ::LE_LIMIT rather than exhausting the C stack. Tail calls do not nest.
+ * @param rt runtime
+ * @param depth maximum number of calls in progress, or 0 for no limit (the
+ * default)
+ */
+void lisp_set_max_depth(lisp_runtime *rt, unsigned int depth);
+
+/**
+ * Limit the memory taken by the runtime's objects. When allocation takes it
+ * past the limit, garbage is collected first, if automatic collection is
+ * enabled. If the objects still exceed the limit, ::LE_LIMIT is raised by the
+ * next call, or by a builtin which allocates as it consumes a sequence, unless
+ * the hook set with lisp_set_yield() raises the limit. The items of vectors
+ * and the tables of hash maps are counted, but the text of strings is not.
+ * @param rt runtime
+ * @param bytes maximum size of all objects, or 0 for no limit (the default)
+ */
+void lisp_set_max_heap(lisp_runtime *rt, unsigned long bytes);
+
+/**
+ * A function called when evaluation reaches a limit. It may supply more fuel,
+ * a later deadline or a larger heap, and return 0 to continue, or return
+ * nonzero to raise ::LE_LIMIT.
+ */
+typedef int (*lisp_yield_func)(lisp_runtime *rt, void *arg);
+
+/**
+ * Set a hook called when the runtime's fuel runs out, its deadline passes, or
+ * its objects exceed their limit. The call which reached the limit waits for
+ * the hook, and then carries on or fails, so the hook is a point where
+ * evaluation may be suspended and later resumed. For instance, a scheduler
+ * which runs each runtime on a coroutine of its own may give each a slice of
+ * fuel, and switch to the next one from the hook. The runtime is in a
+ * consistent state during the hook, but the hook must not evaluate anything
+ * in it.
+ * @param rt runtime
+ * @param func the hook, or NULL to raise ::LE_LIMIT right away (the default)
+ * @param arg passed to @a func
+ */
+void lisp_set_yield(lisp_runtime *rt, lisp_yield_func func, void *arg);
+
+/**
+ * Start profiling, discarding the data of any previous profile. Each call is
+ * counted under the name of its callee: the first name a lambda was bound to,
+ * or the name of a builtin. Each call and return also reads the clock, and
+ * once @a usec microseconds have passed since the last sample, it samples the
+ * stack of calls in progress, weighted by the time since then. The samples
+ * give each function's inclusive and exclusive time, which are exact when every
+ * call and return is sampled. Profiling slows evaluation down, and while it is
+ * on, pmap and preduce run on the calling thread.
+ * @param rt runtime
+ * @param usec microseconds between samples, or 0 to sample on every call
+ */
+void lisp_profile_start(lisp_runtime *rt, unsigned long usec);
+
+/**
+ * Stop profiling, keeping the profile for lisp_profile_report() and
+ * lisp_profile_write_folded(). The data is freed with the runtime, or by the
+ * next lisp_profile_start().
+ * @param rt runtime
+ */
+void lisp_profile_stop(lisp_runtime *rt);
+
+/**
+ * Print a table of the profiled functions to @a file, with their number of
+ * calls and their inclusive and exclusive time in milliseconds, the most
+ * expensive first.
+ * @param rt runtime
+ * @param file where to print the table
+ */
+void lisp_profile_report(lisp_runtime *rt, FILE *file);
+
+/**
+ * Write the sampled stacks to @a file in the folded format read by flame graph
+ * tools: a line for each stack, listing its functions from the outermost
+ * call, separated by semicolons, followed by the microseconds spent in it.
+ * @param rt runtime
+ * @param file where to write the stacks
+ */
+void lisp_profile_write_folded(lisp_runtime *rt, FILE *file);
+
 /**
  * Return @a value, but inside a list containing the symbol ``quote``. When this
  * evaluated, it will return its contents (@a value) un-evaluated.
@@ -946,6 +1846,7 @@ enum lisp_errno {
 	LE_ASSERT,   /* assertion error */
 	LE_VALUE,    /* invalid argument */
 	LE_ERRNO,    /* used for C library errors, does perror() */
+	LE_LIMIT,    /* a limit on evaluation was reached */
 
 	LE_MAX_ERR   /* not a real error, don't use */
 };
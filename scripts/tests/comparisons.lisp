@@ -27,4 +27,14 @@
 (assert-error 'LE_TYPE (- 1 'a))
 (assert (= (+) 0))
 (assert-error 'LE_TYPE (+ 'a))
+
+; small integers are immediate values, so equal ones are identical
+(assert (eq? (+ 1 2) 3))
+(assert (= (- (- 1000000)) 1000000))
+(assert (= (cdr (cons 1 2)) 2))
+(assert (equal? (cons 1 2) '(1 . 2)))
+
+; symbols are interned, so equal names are the same symbol
+(assert (eq? 'name (car '(name))))
+(assert (eq? (eval ''eval) 'eval))
 ; OUTPUT(0)
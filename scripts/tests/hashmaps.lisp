@@ -0,0 +1,42 @@
+; keys of any type, found by equal? rather than eq?
+(define m (hash-map 'a 1 "b" 2 '(1 2) 3 (vector 1 2) 4 5 6))
+(assert (equal? (hash-length m) 5))
+(assert (equal? (hash-get m 'a) 1))
+(assert (equal? (hash-get m "b") 2))
+(assert (equal? (hash-get m (list 1 2)) 3))
+(assert (equal? (hash-get m (vector 1 2)) 4))
+(assert (equal? (hash-get m 5) 6))
+(assert (equal? (hash-get m 'missing 'default) 'default))
+(assert (hash-contains? m "b"))
+(assert (= 0 (hash-contains? m 'b)))
+
+; changing in place
+(hash-put! m 'a 10)
+(hash-remove! m 5)
+(hash-remove! m 'never-there)
+(assert (equal? (hash-get m 'a) 10))
+(assert (equal? (hash-length m) 4))
+(assert (= 0 (hash-contains? m 5)))
+
+; many keys, and keys and values listed in the same order
+(define squares (hash-map))
+(define fill (lambda (n)
+  (if (= n 0) squares (progn (hash-put! squares n (* n n)) (fill (- n 1))))))
+(fill 1000)
+(assert (equal? (hash-length squares) 1000))
+(assert (equal? (hash-get squares 999) 998001))
+(assert (equal? (map (lambda (k) (hash-get squares k)) (hash-keys squares))
+                (hash-values squares)))
+(assert (equal? (hash-map 1 2 3 4) (hash-map 3 4 1 2)))
+(assert (= 0 (equal? (hash-map 1 2) (hash-map 1 3))))
+
+; errors
+(assert-error 'LE_NOTFOUND (hash-get m 'missing))
+(assert-error 'LE_VALUE (hash-map 'a))
+(assert-error 'LE_TYPE (hash-get '((a . 1)) 'a))
+(assert-error 'LE_2FEW (hash-put! m 'a))
+
+(print (hash-map 'x 1))
+
+; OUTPUT(0)
+; #hash((x . 1))
@@ -0,0 +1,23 @@
+; OPTIONS(-H 1000000)
+
+; a builtin which allocates in a loop is stopped by the limit, not just calls
+(assert-error 'LE_LIMIT (define x (seq->list (range 3000000))))
+(assert-error 'LE_LIMIT (seq->vector (seq-map (lambda (i) (cons i i))
+                                              (range 3000000))))
+
+; so is a lambda which does the same
+(define build (lambda (n acc) (if (= n 0) acc (build (- n 1) (cons n acc)))))
+(assert-error 'LE_LIMIT (build 3000000 '()))
+
+; the items of vectors and the tables of hash maps count too
+(assert-error 'LE_LIMIT (make-vector 50000000 0))
+(define push (lambda (v n) (if (= n 0) v (push (vector-push! v n) (- n 1)))))
+(assert-error 'LE_LIMIT (push (vector) 500000))
+(define put (lambda (m n) (if (= n 0) m (put (hash-put! m n n) (- n 1)))))
+(assert-error 'LE_LIMIT (put (hash-map) 200000))
+
+; garbage doesn't count, so work within the limit carries on afterwards
+(assert (equal? (vector-length (seq->vector (range 1000))) 1000))
+(assert (equal? (car (build 1000 '())) 1))
+
+; OUTPUT(0)
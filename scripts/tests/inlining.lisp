@@ -0,0 +1,34 @@
+; OPTIONS(-O -D)
+; inlined? is a debugging builtin, only in scopes of funlisp -D
+
+; core builtins are inlined into bodies which nothing can shadow them in
+(define first (lambda (l) (car l)))
+(define seven (lambda () (+ 3 4)))
+(assert (inlined? first))
+(assert (inlined? seven))
+
+; local bindings of their names leave other bodies optimized
+(assert (equal? (let ((car cdr)) (car '(1 2))) '(2)))
+(define shadow (lambda (car) (car '(1 2))))
+(assert (equal? (shadow cdr) '(2)))
+(define local-def (lambda (l) (progn (define car cdr) (car l))))
+(assert (equal? (local-def '(1 2)) '(2)))
+(assert (inlined? first))
+(assert (inlined? seven))
+(assert (equal? (first '(1 2)) 1))
+
+; unless code which inlined the builtin can see them
+(let ((f (lambda (l) (car l)))
+      (car cdr))
+  (assert (equal? (f '(1 2)) '(2))))
+(define first (lambda (l) (car l)))
+(assert (inlined? first))
+
+; a global define undoes inlining
+(define car cdr)
+(assert (= (inlined? first) 0))
+(assert (= (inlined? seven) 0))
+(assert (equal? (first '(1 2)) '(2)))
+(assert-error 'LE_TYPE (inlined? car))
+
+; OUTPUT(0)
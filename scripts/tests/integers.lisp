@@ -0,0 +1,63 @@
+; arithmetic past 32 and 64 bits
+(assert (equal? (+ 2147483647 1) 2147483648))
+(assert (equal? (* 65536 65536) 4294967296))
+(assert (equal? (+ 4611686018427387903 1) 4611686018427387904))
+(assert (equal? (+ 9223372036854775807 1) 9223372036854775808))
+(assert (equal? (* 4294967296 2147483648) 9223372036854775808))
+(assert (equal? (* 9223372036854775807 9223372036854775807)
+                85070591730234615847396907784232501249))
+(assert (equal? (* 18446744073709551616 18446744073709551616)
+                340282366920938463463374607431768211456))
+
+; negatives, and results which shrink back to small integers
+(assert (equal? (- 9223372036854775808) (- 0 9223372036854775808)))
+(assert (equal? (- 0 9223372036854775808 1) (- 0 9223372036854775809)))
+(assert (equal? (- (+ 9223372036854775807 10) 10) 9223372036854775807))
+(assert (equal? (- 340282366920938463463374607431768211456
+                   340282366920938463463374607431768211455) 1))
+(assert (equal? (* (* 1267650600228229401496703205376 (- 3)) 0) 0))
+(assert (equal? (+ 1267650600228229401496703205376
+                   (* 1267650600228229401496703205376 (- 1))) 0))
+
+; division truncates toward zero
+(assert (equal? (/ 340282366920938463463374607431768211456 18446744073709551616)
+                18446744073709551616))
+(assert (equal? (/ 4201016837757989640353848340555259910258034633801649805739211
+                   18219006492780381153502587057)
+                230584298843228382952100686077232))
+(assert (equal? (/ 10000000000000000000000000000000000000000 300000000000000000007)
+                33333333333333333332))
+(assert (equal? (/ (* 1267650600228229401496703205376 (- 3)) 7)
+                (- 0 543278828669241172070015659446)))
+(assert (equal? (/ 5 18446744073709551616) 0))
+(assert-error 'LE_VALUE (/ 18446744073709551616 0))
+
+; comparison and hashing
+(assert (< 9223372036854775807 9223372036854775808))
+(assert (> 18446744073709551616 (- 0 18446744073709551616)))
+(assert (< (- 0 18446744073709551617) (- 0 18446744073709551616)))
+(assert (= (* 4294967296 4294967296) 18446744073709551616))
+(assert (!= 18446744073709551616 18446744073709551617))
+(define m (hash-map 18446744073709551616 'big 9223372036854775807 'boxed))
+(assert (equal? (hash-get m (* 4294967296 4294967296)) 'big))
+(assert (equal? (hash-get m (- 9223372036854775808 1)) 'boxed))
+
+; errors
+(assert-error 'LE_TYPE (- "a"))
+(assert-error 'LE_TYPE (/ 'a 1))
+(assert-error 'LE_VALUE (range 18446744073709551616))
+
+(print (* 9223372036854775807 9223372036854775807))
+(print (- 0 1000000000000000000000000000001))
+(print (+ 4611686018427387903 1))
+(print 000018446744073709551616)
+(print (- 0 9223372036854775808))
+(print (- 9223372036854775807 9223372036854775807))
+
+; OUTPUT(0)
+; 85070591730234615847396907784232501249
+; -1000000000000000000000000000001
+; 4611686018427387904
+; 18446744073709551616
+; -9223372036854775808
+; 0
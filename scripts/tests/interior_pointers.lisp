@@ -0,0 +1,7 @@
+; OPTIONS(-D)
+; the stack scan keeps an object which is too large for the pool alive, while C
+; code only holds a pointer into its middle, such as to the digits of a bignum
+(assert (interior-pointer-kept?))
+(assert (interior-pointer-kept?))
+
+; OUTPUT(0)
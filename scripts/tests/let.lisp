@@ -20,6 +20,18 @@
   (assert (equal? (return2) 2))
   (assert (equal? (return1) 1)))
 
+; scopes with more bindings than they hold inline
+(let ((a 1) (b 2) (c 3) (d 4) (e 5) (f 6))
+  (assert (equal? (list a b c d e f) '(1 2 3 4 5 6)))
+  (define b 20)
+  (define g 7)
+  (assert (equal? (+ a b c d e f g) 46)))
+(let ((a 1) (b 2) (c 3))
+  (define b 20)
+  (assert (equal? (+ a b c) 24))
+  (define d 4)
+  (assert (equal? (+ a b c d) 28)))
+
 ; it should even work fine without any bindings...
 (assert (equal? (let () 5) 5))
 
@@ -10,4 +10,12 @@
 (setvalue test 5)
 (assert (= test 5))
 
+; A macro call within a loop is expanded for each iteration, or once with the
+; macro cache, and a redefined macro is expanded again either way
+(defmacro double (x) `(+ ,x ,x))
+(defun sum-doubles (n acc) (if (= n 0) acc (sum-doubles (- n 1) (double acc))))
+(assert (= (sum-doubles 3 1) 8))
+(defmacro double (x) `(* ,x 3))
+(assert (= (sum-doubles 3 1) 27))
+
 ; OUTPUT(0)
@@ -6,6 +6,11 @@
 (assert (equal?
           (map + '(1 2 3) '(3 2 1))
           '(4 4 4)))
+; lambdas, and lists which end early
+(assert (equal?
+          (map (lambda (x y) (list y x)) '(a b c) '(1 2))
+          '((1 a) (2 b))))
+(assert (null? (map car '())))
 
 ; argument errors:
 (assert-error 'LE_2FEW
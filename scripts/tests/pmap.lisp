@@ -0,0 +1,60 @@
+; pmap gives the same results as map, in order
+(define range (lambda (n)
+  (let ((loop (lambda (i acc)
+                (if (< i 0) acc (loop (- i 1) (cons i acc))))))
+    (loop (- n 1) '()))))
+(define square (lambda (x) (* x x)))
+(define big (range 1000))
+(assert (equal? (pmap square big) (map square big)))
+(assert (equal? (pmap square '(1 2 3)) '(1 4 9)))
+(assert (equal? (pmap square '(7)) '(49)))
+(assert (equal? (pmap square '()) '()))
+
+; several lists, stopping at the shortest
+(assert (equal? (pmap + '(1 2 3 4) '(10 20 30)) '(11 22 33)))
+
+; results made by the workers are copied back
+(define tag (lambda (x) (list 'item x (substring "abcdefghij" 0 (+ 1 (- x (* 10 (/ x 10))))))))
+(assert (equal? (pmap tag big) (map tag big)))
+(assert (equal? (car (pmap (lambda (x) 'fresh-symbol-from-a-worker) '(1 2)))
+                'fresh-symbol-from-a-worker))
+(assert (equal? (pmap (lambda (x) (pmap square (list x x))) '(1 2 3))
+                '((1 1) (4 4) (9 9))))
+
+; objects of the caller may be returned as they are
+(define shared '(a b c))
+(assert (eq? (car (pmap (lambda (x) shared) big)) shared))
+
+; preduce gives the same result as reduce for associative functions
+(assert (equal? (preduce + 0 big) (reduce + 0 big)))
+(assert (equal? (preduce + big) (reduce + big)))
+(assert (equal? (preduce + 5 '(1 2)) 8))
+(assert (equal? (preduce (lambda (a b) (list (+ (car a) (car b)))) (map list big))
+                (list (reduce + big))))
+
+; slices of the caller's strings may be read by every worker at once
+(import os)
+(define text "abcdefghijklmnopqrstuvwxyz0123456789abcdefghijklmnopqrstuvwx
+abcdefghijklmnopqrstuvwxyz0123456789abcdefghijklmnopqrstuvwx
+abcdefghijklmnopqrstuvwxyz0123456789abcdefghijklmnopqrstuvwx
+abcdefghijklmnopqrstuvwxyz0123456789abcdefghijklmnopqrstuvwx
+abcdefghijklmnopqrstuvwxyz0123456789abcdefghijklmnopqrstuvwx
+abcdefghijklmnopqrstuvwxyz0123456789abcdefghijklmnopqrstuvwx
+abcdefghijklmnopqrstuvwxyz0123456789abcdefghijklmnopqrstuvwx
+abcdefghijklmnopqrstuvwxyz0123456789abcdefghijklmnopqrstuvwx
+abcdefghijklmnopqrstuvwxyz0123456789abcdefghijklmnopqrstuvwx
+abcdefghijklmnopqrstuvwxyz0123456789abcdefghijklmnopqrstuvwx")
+(define slice (substring text 0 400))
+(assert (equal? (pmap (lambda (x) (os.getenv slice)) big)
+                (map (lambda (x) '()) big)))
+(assert (equal? (pmap (lambda (x) (string-length slice)) '(1 2 3)) '(400 400 400)))
+(assert (equal? slice (substring text 0 400)))
+
+; the first error in order is reported
+(assert-error 'LE_TYPE
+  (pmap (lambda (x) (if (> x 500) (car x) x)) big))
+(assert-error 'LE_VALUE (pmap square 5))
+(assert-error 'LE_2FEW (pmap square))
+(assert-error 'LE_VALUE (preduce + '(1)))
+
+; OUTPUT(0)
@@ -0,0 +1,29 @@
+; builtins may be rebound, even after code which uses them was created, and
+; the optimizer must notice
+(define add (lambda (x) (+ x 1)))
+(define seven (lambda () (+ 3 4)))
+(define first (lambda (l) (car l)))
+(assert (= (add 1) 2))
+(assert (= (seven) 7))
+(assert (= (first '(1 2)) 1))
+
+; constants which fail to fold still fail when called
+(define broken (lambda () (/ 1 0)))
+(assert-error 'LE_VALUE (broken))
+
+; names of builtins shadowed within a body
+(define shadow (lambda (car) (car 5)))
+(assert (= (shadow (lambda (x) (* x 2))) 10))
+(define local-def (lambda (x) (progn (define cdr (lambda (y) (- y 1))) (cdr x))))
+(assert (= (local-def 5) 4))
+(define in-let (lambda (x) (let ((+ -)) (+ x 1))))
+(assert (= (in-let 5) 4))
+
+; redefining a builtin changes code created before
+(define + (lambda (a b) (* a b)))
+(assert (= (add 5) 5))
+(assert (= (seven) 12))
+(define car cdr)
+(assert (equal? (first '(1 2)) '(2)))
+
+; OUTPUT(0)
@@ -0,0 +1,64 @@
+; OPTIONS(-B)
+; special forms may be rebound after code which uses them was compiled
+(define f (lambda (x) (if x 'yes 'no)))
+(print (f 1))
+(define old-if if)
+(define if (lambda (c a b) b))
+(print (f 1))
+(define if old-if)
+(print (f 1))
+
+(define g (lambda () (progn 1 42)))
+(print (g))
+(define old-progn progn)
+(define progn (lambda (a b) a))
+(print (g))
+(define progn old-progn)
+
+(define c (lambda (x) (cond ((= x 1) 'one) (1 'other))))
+(print (c 1))
+(define old-cond cond)
+(define cond (macro (a b) 3))
+(print (c 1))
+(define cond old-cond)
+
+(define l (lambda () (let ((a 1)) a)))
+(print (l))
+(define old-let let)
+(define let (macro (bindings body) 7))
+(print (l))
+(define let old-let)
+
+(define q (lambda () (quote (1 2))))
+(print (q))
+(define old-quote quote)
+(define quote (macro (x) 0))
+(print (q))
+(define quote old-quote)
+
+; and within the body which uses them
+(define m (lambda (x) (define if (lambda (c a b) b)) (if x 'yes 'no)))
+(print (m 1))
+(print (f 1))
+
+(define d (lambda (v) (define y v)))
+(print (d 5))
+(define define (macro (n v) 0))
+(print (d 5))
+
+; OUTPUT(0)
+; yes
+; no
+; yes
+; 42
+; 1
+; one
+; 3
+; 1
+; 7
+; (1 2 )
+; 0
+; no
+; yes
+; 5
+; 0
@@ -5,6 +5,10 @@
 (assert (equal?
           (reduce + 1 '(2))
           3))
+; the accumulator and items are passed as they are, not evaluated again
+(assert (equal?
+          (reduce (lambda (acc x) (cons x acc)) '() '(a b c))
+          '(c b a)))
 
 ; errors
 (assert-error 'LE_2FEW
@@ -0,0 +1,25 @@
+; Lambda arguments, closures, and the scopes which may shadow them.
+(define make-adder (lambda (n) (lambda (x) (+ x n))))
+(assert (= ((make-adder 3) 4) 7))
+
+; define within a lambda rebinds its argument, or shadows outer ones
+(assert (= ((lambda (x) (progn (define x 10) x)) 1) 10))
+(assert (= ((lambda (q) (progn (define q2 (* q 2)) ((lambda () (+ q q2))))) 3) 9))
+(assert (= ((lambda (a) (progn (define f (lambda (b) (+ a b))) (f 5))) 1) 6))
+(assert (= ((lambda (k) (progn (eval '(define k 7)) ((lambda () k)))) 0) 7))
+
+; let scopes between a lambda and its arguments
+(assert (= ((lambda (y) (let ((z 2)) ((lambda (w) (+ w y z)) 1))) 10) 13))
+(assert (= ((lambda (x) (let ((x 99)) x)) 1) 99))
+
+; macro arguments and quoted data are not code
+(define when (macro (c e) `(if ,c ,e '())))
+(assert (= ((lambda (v) (when (> v 1) (+ v 100))) 5) 105))
+(assert (equal? ((lambda (x) `(x ,x)) 5) '(x 5)))
+(assert (equal? ((lambda (x) '(x)) 5) '(x)))
+
+(assert (equal? ((lambda (a b c d e f) (list f e d c b a)) 1 2 3 4 5 6)
+                '(6 5 4 3 2 1)))
+(assert-error 'LE_2FEW ((lambda (a b) a) 1))
+(assert-error 'LE_2MANY ((lambda (a) a) 1 2))
+; OUTPUT(0)
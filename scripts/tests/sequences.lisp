@@ -0,0 +1,53 @@
+; sources
+(assert (equal? (seq->list (range 5)) '(0 1 2 3 4)))
+(assert (equal? (seq->list (range 2 5)) '(2 3 4)))
+(assert (equal? (seq->list (range 5 2)) '()))
+(assert (equal? (seq->list (seq '(a b c))) '(a b c)))
+(assert (equal? (seq->vector (seq (vector 1 2 3))) (vector 1 2 3)))
+(assert (equal? (seq->list '(1 2)) '(1 2)))
+(define s (range 3))
+(assert (eq? (seq s) s))
+
+; pipelines
+(define square (lambda (x) (* x x)))
+(define even? (lambda (x) (= 0 (- x (* 2 (/ x 2))))))
+(assert (equal? (seq->list (seq-map square (range 5))) '(0 1 4 9 16)))
+(assert (equal? (seq->list (seq-filter even? (range 10))) '(0 2 4 6 8)))
+(assert (equal? (seq->list (seq-take 3 (range 100))) '(0 1 2)))
+(assert (equal? (seq->list (seq-take 0 (range 100))) '()))
+(assert (equal? (seq->list (seq-take 5 '(1 2))) '(1 2)))
+(assert (equal? (seq-reduce + (seq-map square (seq-filter even? (range 10))))
+                120))
+(assert (equal? (seq-reduce + 0 (range 0)) 0))
+(assert (equal? (seq-reduce (lambda (acc x) (cons x acc)) '() (vector 'a 'b))
+                '(b a)))
+
+; items are pulled one at a time, and only as many as are needed
+(define pulled (vector 0))
+(define counted (lambda (x)
+  (progn (vector-set! pulled 0 (+ 1 (vector-ref pulled 0))) x)))
+(define lazy (seq-take 2 (seq-map counted (range 1000))))
+(assert (= (vector-ref pulled 0) 0))
+(assert (equal? (seq->list lazy) '(0 1)))
+(assert (= (vector-ref pulled 0) 2))
+
+; a large pipeline runs without building its intermediate results
+(assert (equal? (seq-reduce + (seq-filter even? (range 10000))) 24995000))
+
+; a sequence is consumed once
+(define once (range 3))
+(assert (equal? (seq->list once) '(0 1 2)))
+(assert (equal? (seq->list once) '()))
+
+; errors
+(assert-error 'LE_TYPE (seq 1))
+(assert-error 'LE_TYPE (seq-map square "abc"))
+(assert-error 'LE_VALUE (seq-take (- 0 1) (range 3)))
+(assert-error 'LE_VALUE (seq-reduce + (range 0)))
+(assert-error 'LE_2FEW (seq-reduce +))
+(assert-error 'LE_TYPE (seq->list (seq-map car (range 3))))
+
+(print (range 3))
+
+; OUTPUT(0)
+; <sequence>
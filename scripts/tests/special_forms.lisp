@@ -0,0 +1,32 @@
+; Special forms within lambdas, which the bytecode VM compiles itself.
+(define sign (lambda (n) (cond ((< n 0) 'neg) ((= n 0) 'zero) (1 'pos))))
+(assert (equal? (map sign (list (- 2) 0 2)) '(neg zero pos)))
+(assert (null? ((lambda () (cond (0 1))))))
+(assert (null? ((lambda () (progn)))))
+(assert (= ((lambda (x) (if x 1 2)) 0) 2))
+(assert (= ((lambda (x) (if (if x 0 1) 3 4)) 1) 4))
+
+; let and define bind in the scope of the form
+(define twice (lambda (n) (let ((d (* n 2)) (e (+ d 1))) (define f (+ d e)) f)))
+(assert (= (twice 3) 13))
+(assert (= ((lambda () (define g 5) (+ g g))) 10))
+
+; closures created by the same lambda form
+(define counter (lambda (n) (lambda (m) (+ n m))))
+(define c1 (counter 1))
+(define c2 (counter 2))
+(assert (= (+ (c1 10) (c2 10)) 23))
+
+; a name which is bound to a macro only when the code runs
+(define apply-to-one (lambda (f) (f 1)))
+(assert (= (apply-to-one (lambda (x) (+ x 1))) 2))
+(assert (equal? (apply-to-one quote) 1))
+
+(define loop (lambda (i acc) (if (= i 0) acc (loop (- i 1) (+ acc i)))))
+(assert (= (loop 100 0) 5050))
+(assert-error 'LE_NOTFOUND ((lambda () undefined-name)))
+; debugging builtins are left out of default scopes
+(assert-error 'LE_NOTFOUND ((lambda () inlined?)))
+(assert-error 'LE_2FEW (twice))
+(assert-error 'LE_SYNTAX ((lambda () (cond 1))))
+; OUTPUT(0)
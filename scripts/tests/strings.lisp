@@ -0,0 +1,35 @@
+; string length
+(assert (equal? (string-length "") 0))
+(assert (equal? (string-length "hello") 5))
+(assert (equal? (string-length "tab\tand\nnewline") 15))
+
+; substrings of short strings
+(assert (equal? (substring "hello world" 6) "world"))
+(assert (equal? (substring "hello world" 0 5) "hello"))
+(assert (equal? (substring "hello" 5) ""))
+(assert (equal? (string-length (substring "hello" 1 3)) 3))
+
+; substrings of a long string share its memory
+(define long "the quick brown fox jumps over the lazy dog, then the quick brown fox jumps over the lazy dog again, and then once more for good measure")
+(define tail (substring long 4))
+(assert (equal? (string-length tail) (- (string-length long) 4)))
+(assert (equal? (substring tail 0 5) "quick"))
+(assert (equal? (substring long 4 (string-length tail)) tail))
+(define middle (substring tail 12 110))
+(assert (equal? (substring middle 0 3) "fox"))
+(assert (equal? (string-length middle) 110))
+(assert (eq? (substring long 0) long))
+
+; bad ranges
+(assert-error 'LE_VALUE (substring "hello" 6))
+(assert-error 'LE_VALUE (substring "hello" 2 4))
+(assert-error 'LE_VALUE (substring "hello" (- 1)))
+(assert-error 'LE_TYPE (substring 'hello 1))
+(assert-error 'LE_TYPE (string-length 5))
+
+(print (substring long 4 15))
+(print middle)
+
+; OUTPUT(0)
+; quick brown fox
+; fox jumps over the lazy dog, then the quick brown fox jumps over the lazy dog again, and then once more for go
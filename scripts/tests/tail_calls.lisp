@@ -0,0 +1,22 @@
+; Calls in tail position do not grow the stack, so loops may run for as many
+; iterations as they like.
+(define count (lambda (i acc) (if (= i 0) acc (count (- i 1) (+ acc 1)))))
+(define count-down (lambda (i)
+  (cond ((= i 0) 'done)
+        (1 (let ((j (- i 1))) (progn (count-down j)))))))
+(define even? (lambda (n) (if (= n 0) 1 (odd? (- n 1)))))
+(define odd? (lambda (n) (if (= n 0) 0 (even? (- n 1)))))
+
+(define main (lambda (args)
+  (progn
+    (print (count 20000 0))
+    (print (count-down 20000))
+    (print (even? 20001))
+    ; calls which are not in tail position still return to their caller
+    (print (+ 1 (count 10 0)))
+    0)))
+; OUTPUT(0)
+; 20000
+; done
+; 0
+; 11
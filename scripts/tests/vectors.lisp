@@ -0,0 +1,46 @@
+; construction and indexing
+(define v (vector 1 2 3))
+(assert (equal? (vector-length v) 3))
+(assert (equal? (vector-ref v 0) 1))
+(assert (equal? (vector-ref v 2) 3))
+(assert (equal? (make-vector 2 'x) (vector 'x 'x)))
+(assert (equal? (make-vector 2) (vector '() '())))
+(assert (equal? (vector-length (vector)) 0))
+(assert (equal? (list->vector '(1 2 3)) v))
+(assert (equal? (vector->list v) '(1 2 3)))
+(assert (= 0 (eq? (vector 1) (vector 1))))
+
+; changing in place
+(vector-set! v 0 10)
+(assert (equal? (vector-ref v 0) 10))
+(define grown (make-vector 0))
+(define fill (lambda (n)
+  (if (= n 0) grown (progn (vector-push! grown n) (fill (- n 1))))))
+(fill 100)
+(assert (equal? (vector-length grown) 100))
+(assert (equal? (vector-ref grown 99) 1))
+
+; bulk operations
+(assert (equal? (vector-map (lambda (x) (* x x)) (vector 1 2 3))
+                (vector 1 4 9)))
+(assert (equal? (vector-map + (vector 1 2 3) (vector 10 20))
+                (vector 11 22)))
+(assert (equal? (vector-filter (lambda (x) (> x 1)) (vector 1 2 3))
+                (vector 2 3)))
+(assert (equal? (vector-reduce + grown) 5050))
+(assert (equal? (vector-reduce (lambda (acc x) (cons x acc)) '() (vector 'a 'b))
+                '(b a)))
+
+; errors
+(assert-error 'LE_VALUE (vector-ref v 3))
+(assert-error 'LE_VALUE (vector-set! v (- 0 1) 0))
+(assert-error 'LE_VALUE (make-vector (- 0 1)))
+(assert-error 'LE_TYPE (vector-ref '(1 2) 0))
+(assert-error 'LE_TYPE (vector-map + '(1 2)))
+(assert-error 'LE_VALUE (vector-reduce + (vector 1)))
+(assert-error 'LE_2FEW (vector-reduce +))
+
+(print v)
+
+; OUTPUT(0)
+; #(10 2 3)
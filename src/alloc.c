@@ -0,0 +1,368 @@
+/*
+ * alloc.c: size-class pool allocator for funlisp objects
+ *
+ * Nearly every lisp_value is a small struct of a few dozen bytes, and the
+ * interpreter creates and frees them at a furious rate. Rather than sending
+ * each one through malloc() and free(), the runtime keeps a set of pools, one
+ * per size class. Each pool carves objects out of large pages, and freed
+ * objects are pushed onto a per-class free list to be handed out again.
+ *
+ * The pages double as the garbage collector's heap. Each page header holds a
+ * bitmap of allocated objects and a bitmap of marked objects, so the sweep is
+ * a linear scan over the pages, which only touches the objects it frees. Pages
+ * are aligned to LISP_PAGE_SIZE, so an object finds its page by masking its
+ * address. To get aligned pages out of malloc(), they are allocated in chunks
+ * of several pages.
+ *
+ * Pages belong to the runtime, and are returned to the system when the runtime
+ * is destroyed. Objects which are too large for any size class, or which are
+ * allocated while the pool is disabled, come from malloc() with a single
+ * object page header in front of them. Each object records which of these
+ * happened in its header, so the pool may be enabled or disabled at any time.
+ *
+ * The garbage collector scans the C stack for words which may point at
+ * objects, see gc.c. To answer that question, the pool keeps its chunks sorted
+ * by address, and an index of the single object pages of the objects which came
+ * from malloc(), so that a word pointing anywhere inside an object is found.
+ *
+ * Stephen Brennan <stephen@brennan.io>
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "funlisp_internal.h"
+
+/*
+ * Freed objects are threaded onto their free list through their first word.
+ */
+struct lisp_free_obj {
+	struct lisp_free_obj *next;
+};
+
+#define class_of(size) (((size) + LISP_CLASS_GRAIN - 1) / LISP_CLASS_GRAIN - 1)
+#define class_size(cls) (((cls) + 1) * LISP_CLASS_GRAIN)
+#define page_start(page) ((char *) (page) + LISP_PAGE_HEADER)
+#define page_slots(cls) \
+	((LISP_PAGE_SIZE - LISP_PAGE_HEADER) / class_size(cls))
+
+void lisp_pool_init(struct lisp_pool *pool)
+{
+	int i;
+	pool->pages = NULL;
+	pool->big = NULL;
+	for (i = 0; i < LISP_NCLASSES; i++) {
+		pool->free[i] = NULL;
+		pool->bump[i] = NULL;
+		pool->bump_end[i] = NULL;
+	}
+	pool->enabled = 1;
+	pool->chunks = NULL;
+	pool->nchunks = 0;
+	pool->chunks_size = 0;
+	pool->unpooled = NULL;
+	pool->nunpooled = 0;
+	pool->unpooled_size = 0;
+	pool->unpooled_stale = 0;
+	pool->chunk_next = NULL;
+	pool->chunk_end = NULL;
+	pool->bytes = 0;
+}
+
+void lisp_pool_destroy(struct lisp_pool *pool)
+{
+	struct lisp_page *page = pool->big, *next;
+	unsigned int i;
+
+	while (page) {
+		next = page->next;
+		free(page);
+		page = next;
+	}
+	pool->big = NULL;
+	pool->pages = NULL;
+
+	for (i = 0; i < pool->nchunks; i++)
+		free(pool->chunks[i].mem);
+	free(pool->chunks);
+	pool->chunks = NULL;
+	pool->nchunks = 0;
+
+	free(pool->unpooled);
+	pool->unpooled = NULL;
+	pool->nunpooled = 0;
+}
+
+/*
+ * Return the index of the first chunk in the sorted array whose address is
+ * greater than @a ptr.
+ */
+static unsigned int lisp_pool_search(struct lisp_pool *pool, void *ptr)
+{
+	unsigned int lo = 0, hi = pool->nchunks, mid;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (pool->chunks[mid].start <= (char *) ptr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static int lisp_page_cmp(const void *a, const void *b)
+{
+	const char *x = *(char * const *) a, *y = *(char * const *) b;
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Sort the single object pages by address, if any were allocated or freed
+ * since they last were. Only the stack scan looks them up, so this is done
+ * once per collection rather than on each allocation, which matters when the
+ * pool is disabled and every object has a page of its own.
+ */
+static void lisp_unpooled_index(struct lisp_pool *pool)
+{
+	struct lisp_page *page;
+	unsigned long n = 0;
+
+	if (!pool->unpooled_stale)
+		return;
+	for (page = pool->big; page; page = page->next) {
+		if (n == pool->unpooled_size) {
+			pool->unpooled_size = pool->unpooled_size ?
+				2 * pool->unpooled_size : 64;
+			pool->unpooled = realloc(pool->unpooled,
+					pool->unpooled_size * sizeof(struct lisp_page *));
+		}
+		pool->unpooled[n++] = page;
+	}
+	qsort(pool->unpooled, n, sizeof(struct lisp_page *), lisp_page_cmp);
+	pool->nunpooled = n;
+	pool->unpooled_stale = 0;
+}
+
+/*
+ * Return the single object page holding the byte at @a ptr, or NULL.
+ */
+static struct lisp_page *lisp_unpooled_search(struct lisp_pool *pool,
+                                              void *ptr)
+{
+	unsigned long lo = 0, hi, mid;
+	struct lisp_page *page;
+
+	lisp_unpooled_index(pool);
+	hi = pool->nunpooled;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if ((char *) pool->unpooled[mid] <= (char *) ptr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == 0)
+		return NULL;
+	page = pool->unpooled[lo - 1];
+	if ((char *) ptr < page_start(page) ||
+	    (char *) ptr >= page_start(page) + page->size)
+		return NULL;
+	return page;
+}
+
+/*
+ * Obtain a new chunk of zeroed pages from the system, and insert it into the
+ * sorted array of chunks.
+ */
+static void lisp_pool_add_chunk(struct lisp_pool *pool)
+{
+	struct lisp_chunk chunk;
+	unsigned long addr;
+	unsigned int pos;
+
+	chunk.mem = calloc(1, (LISP_CHUNK_PAGES + 1) * LISP_PAGE_SIZE);
+	addr = (unsigned long) chunk.mem;
+	addr = (addr + LISP_PAGE_SIZE - 1) & ~(unsigned long) (LISP_PAGE_SIZE - 1);
+	chunk.start = (char *) chunk.mem + (addr - (unsigned long) chunk.mem);
+
+	if (pool->nchunks == pool->chunks_size) {
+		pool->chunks_size = pool->chunks_size ? 2 * pool->chunks_size : 8;
+		pool->chunks = realloc(pool->chunks,
+				pool->chunks_size * sizeof(struct lisp_chunk));
+	}
+	pos = lisp_pool_search(pool, chunk.start);
+	memmove(pool->chunks + pos + 1, pool->chunks + pos,
+			(pool->nchunks - pos) * sizeof(struct lisp_chunk));
+	pool->chunks[pos] = chunk;
+	pool->nchunks++;
+
+	pool->chunk_next = chunk.start;
+	pool->chunk_end = chunk.start + LISP_CHUNK_PAGES * LISP_PAGE_SIZE;
+}
+
+/*
+ * Add a fresh page to the pool, and point the bump allocator for @a cls at its
+ * slots. Slots are handed out from the bump pointer in order, so that a new
+ * page need not be threaded onto the free list up front.
+ */
+static void lisp_pool_grow(struct lisp_pool *pool, int cls)
+{
+	struct lisp_page *page;
+
+	if (pool->chunk_next == pool->chunk_end)
+		lisp_pool_add_chunk(pool);
+	page = (struct lisp_page *) pool->chunk_next;
+	pool->chunk_next += LISP_PAGE_SIZE;
+
+	page->next = pool->pages;
+	page->cls = cls;
+	page->owner = pool;
+	pool->pages = page;
+	pool->bump[cls] = page_start(page);
+	pool->bump_end[cls] = page_start(page) + page_slots(cls) * class_size(cls);
+}
+
+/*
+ * Allocate an object with malloc(), in a single object page.
+ */
+static lisp_value *lisp_alloc_big(struct lisp_pool *pool, size_t size)
+{
+	struct lisp_page *page = malloc(LISP_PAGE_HEADER + size);
+	lisp_value *v = (lisp_value *) page_start(page);
+
+	memset(page, 0, sizeof(struct lisp_page));
+	page->cls = LISP_POOL_NONE;
+	page->owner = pool;
+	page->size = size;
+	page->prev = NULL;
+	page->next = pool->big;
+	if (pool->big)
+		pool->big->prev = page;
+	pool->big = page;
+
+	lisp_bit_set(page->live, lisp_bit_of(page, v));
+	pool->unpooled_stale = 1;
+	v->pool = LISP_POOL_NONE;
+	pool->bytes += size;
+	return v;
+}
+
+lisp_value *lisp_alloc(lisp_runtime *rt, size_t size)
+{
+	struct lisp_pool *pool = &rt->pool;
+	struct lisp_free_obj *obj;
+	struct lisp_page *page;
+	lisp_value *v;
+	int cls;
+
+	if (!pool->enabled || size > LISP_MAX_POOLED)
+		return lisp_alloc_big(pool, size);
+
+	cls = class_of(size);
+	if (pool->free[cls]) {
+		obj = pool->free[cls];
+		pool->free[cls] = obj->next;
+		v = (lisp_value *) obj;
+	} else {
+		if (pool->bump[cls] == pool->bump_end[cls])
+			lisp_pool_grow(pool, cls);
+		v = (lisp_value *) pool->bump[cls];
+		pool->bump[cls] += class_size(cls);
+	}
+	pool->bytes += class_size(cls);
+	v->pool = (unsigned char) cls;
+	page = lisp_page_of(v);
+	lisp_bit_set(page->live, lisp_bit_of(page, v));
+	return v;
+}
+
+void lisp_dealloc(lisp_runtime *rt, lisp_value *v)
+{
+	struct lisp_pool *pool = &rt->pool;
+	struct lisp_page *page = lisp_page_of(v);
+	struct lisp_free_obj *obj;
+	int cls = v->pool;
+
+	if (cls == LISP_POOL_NONE) {
+		if (page->prev)
+			page->prev->next = page->next;
+		else
+			pool->big = page->next;
+		if (page->next)
+			page->next->prev = page->prev;
+		pool->unpooled_stale = 1;
+		pool->bytes -= page->size;
+		free(page);
+		return;
+	}
+
+	lisp_bit_clear(page->live, lisp_bit_of(page, v));
+	pool->bytes -= class_size(cls);
+	obj = (struct lisp_free_obj *) v;
+	obj->next = pool->free[cls];
+	pool->free[cls] = obj;
+}
+
+unsigned long lisp_alloc_size(lisp_value *v)
+{
+	if (v->pool == LISP_POOL_NONE)
+		return lisp_page_of(v)->size;
+	return class_size(v->pool);
+}
+
+void lisp_storage_account(lisp_runtime *rt, unsigned long old,
+                          unsigned long size)
+{
+	rt->pool.bytes = rt->pool.bytes - old + size;
+
+	/* the next call, or item of a sequence, collects garbage and checks */
+	if (size > old && rt->max_heap && rt->pool.bytes > rt->max_heap &&
+	    !rt->heap_over) {
+		rt->heap_over = 1;
+		lisp_poll_soon(rt);
+	}
+}
+
+lisp_value *lisp_alloc_find(lisp_runtime *rt, void *ptr)
+{
+	struct lisp_pool *pool = &rt->pool;
+	struct lisp_page *page;
+	unsigned int pos;
+	unsigned long offset;
+	lisp_value *v;
+
+	/* pointers into the middle of an object keep it alive too */
+	page = lisp_unpooled_search(pool, ptr);
+	if (page)
+		return (lisp_value *) page_start(page);
+
+	pos = lisp_pool_search(pool, ptr);
+	if (pos == 0 || (char *) ptr >= pool->chunks[pos - 1].start +
+			LISP_CHUNK_PAGES * LISP_PAGE_SIZE)
+		return NULL;
+
+	page = (struct lisp_page *) ((unsigned long) ptr &
+			~(unsigned long) (LISP_PAGE_SIZE - 1));
+	if ((char *) ptr < page_start(page))
+		return NULL;
+
+	offset = (char *) ptr - page_start(page);
+	if (offset >= page_slots(page->cls) * class_size(page->cls))
+		return NULL;
+	v = (lisp_value *) (page_start(page) +
+		offset / class_size(page->cls) * class_size(page->cls));
+
+	/* this also rejects the pages of a chunk which are not in use yet */
+	if (!lisp_bit_get(page->live, lisp_bit_of(page, v)))
+		return NULL;
+	return v;
+}
+
+void lisp_enable_pool(lisp_runtime *rt)
+{
+	rt->pool.enabled = 1;
+}
+
+void lisp_disable_pool(lisp_runtime *rt)
+{
+	rt->pool.enabled = 0;
+}
@@ -0,0 +1,485 @@
+/*
+ * bignum.c: integers of any size
+ *
+ * Integers are fixnums while they fit in one, boxed while they fit in a long,
+ * and bignums beyond that (see struct lisp_integer). Nearly every operation is
+ * given two fixnums, so each handles them first, without allocating. Two
+ * fixnums can't overflow a long when added or subtracted, and when multiplied
+ * they only can if either is larger than MUL_SAFE. Everything else works on the
+ * magnitudes of the operands, as arrays of lisp_digits, whose products and
+ * carries are computed in an unsigned long, and lisp_integer_from_digits()
+ * returns the result in the smallest form it fits.
+ *
+ * Stephen Brennan <stephen@brennan.io>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "funlisp_internal.h"
+
+/* fixnums of smaller magnitude than this have a product which fits a long */
+#define MUL_SAFE (1L << (sizeof(long) * CHAR_BIT / 2 - 1))
+
+/* results of up to this many digits are computed on the stack */
+#define SMALL_DIGITS 8
+
+/* for printing, the largest power of ten which is a digit, and its log2 */
+#if LISP_DIGIT_BITS == 32
+#define DECIMAL_BASE 1000000000U
+#define DECIMAL_DIGITS 9
+#define DECIMAL_BITS 29
+#else
+#define DECIMAL_BASE 10000U
+#define DECIMAL_DIGITS 4
+#define DECIMAL_BITS 13
+#endif
+
+void lisp_integer_digits(lisp_integer *v, struct lisp_digits *out)
+{
+	unsigned long m;
+	long x;
+
+	if (!lisp_fixnum_p(v) && v->n) {
+		out->sign = v->sign;
+		out->n = v->n;
+		out->d = v->digits;
+		return;
+	}
+	x = lisp_fixnum_p(v) ? lisp_fixnum_get(v) : v->x;
+	m = x < 0 ? -(unsigned long) x : (unsigned long) x;
+	out->sign = x < 0 ? -1 : 1;
+	out->small[0] = (lisp_digit) (m & LISP_DIGIT_MASK);
+	out->small[1] = (lisp_digit) (m >> LISP_DIGIT_BITS);
+	out->n = out->small[1] ? 2 : out->small[0] ? 1 : 0;
+	out->d = out->small;
+}
+
+lisp_integer *lisp_integer_from_digits(lisp_runtime *rt, int sign,
+                                       const lisp_digit *d, int n)
+{
+	lisp_integer *integer;
+	unsigned long m;
+
+	while (n && !d[n - 1])
+		n--;
+
+	if (n <= 2) {
+		m = n == 2 ? (unsigned long) d[1] << LISP_DIGIT_BITS | d[0] :
+			n ? d[0] : 0;
+		if (sign > 0 && m <= (unsigned long) LONG_MAX)
+			return lisp_integer_new_long(rt, (long) m);
+		if (sign < 0 && m <= (unsigned long) LONG_MAX + 1)
+			return lisp_integer_new_long(rt, -(long) (m - 1) - 1);
+	}
+
+	integer = lisp_integer_alloc(rt, n);
+	integer->sign = sign;
+	memcpy(integer->digits, d, n * sizeof(lisp_digit));
+	return integer;
+}
+
+/*
+ * Magnitudes. Each takes its operands as a digit array and a length, and
+ * returns the length of its result, which may have leading zeros.
+ */
+
+static int mag_cmp(const lisp_digit *a, int an, const lisp_digit *b, int bn)
+{
+	while (an && !a[an - 1])
+		an--;
+	while (bn && !b[bn - 1])
+		bn--;
+	if (an != bn)
+		return an < bn ? -1 : 1;
+	while (an--)
+		if (a[an] != b[an])
+			return a[an] < b[an] ? -1 : 1;
+	return 0;
+}
+
+/* r has room for max(an, bn) + 1 digits */
+static int mag_add(lisp_digit *r, const lisp_digit *a, int an,
+                   const lisp_digit *b, int bn)
+{
+	unsigned long carry = 0;
+	int i;
+
+	if (an < bn)
+		return mag_add(r, b, bn, a, an);
+	for (i = 0; i < an; i++) {
+		carry += (unsigned long) a[i] + (i < bn ? b[i] : 0);
+		r[i] = (lisp_digit) (carry & LISP_DIGIT_MASK);
+		carry >>= LISP_DIGIT_BITS;
+	}
+	r[i] = (lisp_digit) carry;
+	return an + 1;
+}
+
+/* r has room for an digits, and a is not less than b */
+static int mag_sub(lisp_digit *r, const lisp_digit *a, int an,
+                   const lisp_digit *b, int bn)
+{
+	long borrow = 0;
+	int i;
+
+	for (i = 0; i < an; i++) {
+		borrow += (long) a[i] - (long) (i < bn ? b[i] : 0);
+		r[i] = (lisp_digit) ((unsigned long) borrow & LISP_DIGIT_MASK);
+		borrow = borrow < 0 ? -1 : 0;
+	}
+	return an;
+}
+
+/* r has room for an + bn digits */
+static int mag_mul(lisp_digit *r, const lisp_digit *a, int an,
+                   const lisp_digit *b, int bn)
+{
+	unsigned long carry;
+	int i, j;
+
+	memset(r, 0, (an + bn) * sizeof(lisp_digit));
+	for (i = 0; i < an; i++) {
+		carry = 0;
+		for (j = 0; j < bn; j++) {
+			carry += (unsigned long) a[i] * b[j] + r[i + j];
+			r[i + j] = (lisp_digit) (carry & LISP_DIGIT_MASK);
+			carry >>= LISP_DIGIT_BITS;
+		}
+		r[i + bn] = (lisp_digit) carry;
+	}
+	return an + bn;
+}
+
+/* q = u / v, returning the remainder; q has room for un digits, and may be u */
+static lisp_digit mag_div_small(lisp_digit *q, const lisp_digit *u, int un,
+                                lisp_digit v)
+{
+	unsigned long rem = 0;
+	int i;
+
+	for (i = un - 1; i >= 0; i--) {
+		rem = rem << LISP_DIGIT_BITS | u[i];
+		q[i] = (lisp_digit) (rem / v);
+		rem %= v;
+	}
+	return (lisp_digit) rem;
+}
+
+/* the digit hi shifted left by s bits, taking the bits shifted in from lo */
+static lisp_digit shift_in(lisp_digit hi, lisp_digit lo, int s)
+{
+	unsigned long both = (unsigned long) hi << LISP_DIGIT_BITS | lo;
+	return (lisp_digit) (both >> (LISP_DIGIT_BITS - s) & LISP_DIGIT_MASK);
+}
+
+static int leading_zeros(lisp_digit x)
+{
+	int n = 0;
+
+	while (!(x & 1UL << (LISP_DIGIT_BITS - 1))) {
+		x <<= 1;
+		n++;
+	}
+	return n;
+}
+
+/*
+ * q = u / v, by long division (Knuth's algorithm D). The top digit of v is not
+ * zero, and u has at least as many digits as v. q has room for un - vn + 1
+ * digits.
+ */
+static int mag_div(lisp_digit *q, const lisp_digit *u, int un,
+                   const lisp_digit *v, int vn)
+{
+	lisp_digit *un_, *vn_;
+	unsigned long qhat, rhat, p;
+	long t, k;
+	int s, i, j;
+
+	if (vn == 1) {
+		mag_div_small(q, u, un, v[0]);
+		return un;
+	}
+
+	/* normalize, so that the top digit of the divisor has its top bit set */
+	s = leading_zeros(v[vn - 1]);
+	vn_ = malloc(vn * sizeof(lisp_digit));
+	un_ = malloc((un + 1) * sizeof(lisp_digit));
+	for (i = vn - 1; i > 0; i--)
+		vn_[i] = shift_in(v[i], v[i - 1], s);
+	vn_[0] = shift_in(v[0], 0, s);
+	un_[un] = shift_in(0, u[un - 1], s);
+	for (i = un - 1; i > 0; i--)
+		un_[i] = shift_in(u[i], u[i - 1], s);
+	un_[0] = shift_in(u[0], 0, s);
+
+	for (j = un - vn; j >= 0; j--) {
+		/* estimate the quotient digit, which is at most two too large */
+		p = (unsigned long) un_[j + vn] << LISP_DIGIT_BITS | un_[j + vn - 1];
+		qhat = p / vn_[vn - 1];
+		rhat = p % vn_[vn - 1];
+		while (qhat >> LISP_DIGIT_BITS ||
+		       qhat * vn_[vn - 2] >
+		       (rhat << LISP_DIGIT_BITS | un_[j + vn - 2])) {
+			qhat--;
+			rhat += vn_[vn - 1];
+			if (rhat >> LISP_DIGIT_BITS)
+				break;
+		}
+
+		/* multiply and subtract, borrowing as many digits as t is short */
+		k = 0;
+		for (i = 0; i < vn; i++) {
+			p = qhat * vn_[i];
+			t = (long) un_[i + j] - k - (long) (p & LISP_DIGIT_MASK);
+			un_[i + j] = (lisp_digit) ((unsigned long) t & LISP_DIGIT_MASK);
+			k = (long) (p >> LISP_DIGIT_BITS);
+			if (t < 0)
+				k += (long) (((unsigned long) -t + LISP_DIGIT_MASK) >>
+					LISP_DIGIT_BITS);
+		}
+		t = (long) un_[j + vn] - k;
+		un_[j + vn] = (lisp_digit) ((unsigned long) t & LISP_DIGIT_MASK);
+
+		/* the estimate was one too large: add back */
+		q[j] = (lisp_digit) qhat;
+		if (t < 0) {
+			q[j]--;
+			p = 0;
+			for (i = 0; i < vn; i++) {
+				p += (unsigned long) un_[i + j] + vn_[i];
+				un_[i + j] = (lisp_digit) (p & LISP_DIGIT_MASK);
+				p >>= LISP_DIGIT_BITS;
+			}
+			un_[j + vn] = (lisp_digit) ((un_[j + vn] + p) & LISP_DIGIT_MASK);
+		}
+	}
+
+	free(vn_);
+	free(un_);
+	return un - vn + 1;
+}
+
+/*
+ * Signed arithmetic on digits. The result array r is given room for
+ * @a size digits by the caller, on the stack when it is small.
+ */
+
+static lisp_digit *digits_buffer(lisp_digit *small, int size)
+{
+	return size <= SMALL_DIGITS ? small : malloc(size * sizeof(lisp_digit));
+}
+
+static void digits_release(lisp_digit *small, lisp_digit *r)
+{
+	if (r != small)
+		free(r);
+}
+
+/* a + b, where b is negated when @a negate_b is -1 */
+static lisp_integer *digits_add(lisp_runtime *rt, struct lisp_digits *a,
+                                struct lisp_digits *b, int negate_b)
+{
+	lisp_digit small[SMALL_DIGITS], *r;
+	lisp_integer *result;
+	int bsign = b->sign * negate_b;
+	int size = (a->n > b->n ? a->n : b->n) + 1;
+	int n, sign;
+
+	r = digits_buffer(small, size);
+	if (a->sign == bsign) {
+		n = mag_add(r, a->d, a->n, b->d, b->n);
+		sign = a->sign;
+	} else if (mag_cmp(a->d, a->n, b->d, b->n) >= 0) {
+		n = mag_sub(r, a->d, a->n, b->d, b->n);
+		sign = a->sign;
+	} else {
+		n = mag_sub(r, b->d, b->n, a->d, a->n);
+		sign = bsign;
+	}
+	result = lisp_integer_from_digits(rt, sign, r, n);
+	digits_release(small, r);
+	return result;
+}
+
+lisp_integer *lisp_integer_add(lisp_runtime *rt, lisp_integer *a,
+                               lisp_integer *b)
+{
+	struct lisp_digits da, db;
+
+	if (lisp_fixnum_p(a) && lisp_fixnum_p(b))
+		return lisp_integer_new_long(rt,
+			lisp_fixnum_get(a) + lisp_fixnum_get(b));
+
+	lisp_integer_digits(a, &da);
+	lisp_integer_digits(b, &db);
+	return digits_add(rt, &da, &db, 1);
+}
+
+lisp_integer *lisp_integer_sub(lisp_runtime *rt, lisp_integer *a,
+                               lisp_integer *b)
+{
+	struct lisp_digits da, db;
+
+	if (lisp_fixnum_p(a) && lisp_fixnum_p(b))
+		return lisp_integer_new_long(rt,
+			lisp_fixnum_get(a) - lisp_fixnum_get(b));
+
+	lisp_integer_digits(a, &da);
+	lisp_integer_digits(b, &db);
+	return digits_add(rt, &da, &db, -1);
+}
+
+lisp_integer *lisp_integer_mul(lisp_runtime *rt, lisp_integer *a,
+                               lisp_integer *b)
+{
+	lisp_digit small[SMALL_DIGITS], *r;
+	struct lisp_digits da, db;
+	lisp_integer *result;
+	long x, y;
+	int n;
+
+	if (lisp_fixnum_p(a) && lisp_fixnum_p(b)) {
+		x = lisp_fixnum_get(a);
+		y = lisp_fixnum_get(b);
+		if (x > -MUL_SAFE && x < MUL_SAFE && y > -MUL_SAFE && y < MUL_SAFE)
+			return lisp_integer_new_long(rt, x * y);
+	}
+
+	lisp_integer_digits(a, &da);
+	lisp_integer_digits(b, &db);
+	r = digits_buffer(small, da.n + db.n);
+	n = mag_mul(r, da.d, da.n, db.d, db.n);
+	result = lisp_integer_from_digits(rt, da.sign * db.sign, r, n);
+	digits_release(small, r);
+	return result;
+}
+
+lisp_integer *lisp_integer_div(lisp_runtime *rt, lisp_integer *a,
+                               lisp_integer *b)
+{
+	lisp_digit small[SMALL_DIGITS], *q;
+	struct lisp_digits da, db;
+	lisp_integer *result;
+	int n;
+
+	/* the only fixnum quotient which isn't one is LISP_FIXNUM_MIN / -1 */
+	if (lisp_fixnum_p(a) && lisp_fixnum_p(b))
+		return lisp_integer_new_long(rt,
+			lisp_fixnum_get(a) / lisp_fixnum_get(b));
+
+	lisp_integer_digits(a, &da);
+	lisp_integer_digits(b, &db);
+	if (mag_cmp(da.d, da.n, db.d, db.n) < 0)
+		return (lisp_integer *) lisp_fixnum_new(0);
+
+	q = digits_buffer(small, da.n);
+	n = mag_div(q, da.d, da.n, db.d, db.n);
+	result = lisp_integer_from_digits(rt, da.sign * db.sign, q, n);
+	digits_release(small, q);
+	return result;
+}
+
+int lisp_integer_cmp(lisp_integer *a, lisp_integer *b)
+{
+	struct lisp_digits da, db;
+	long x, y;
+	int c;
+
+	if (lisp_fixnum_p(a) && lisp_fixnum_p(b)) {
+		x = lisp_fixnum_get(a);
+		y = lisp_fixnum_get(b);
+		return x < y ? -1 : x > y;
+	}
+
+	lisp_integer_digits(a, &da);
+	lisp_integer_digits(b, &db);
+	if (da.sign != db.sign)
+		return da.sign < db.sign ? -1 : 1;
+	c = mag_cmp(da.d, da.n, db.d, db.n);
+	return da.sign > 0 ? c : -c;
+}
+
+lisp_integer *lisp_integer_parse(lisp_runtime *rt, const char *s, int len)
+{
+	lisp_digit small[SMALL_DIGITS], *r;
+	lisp_integer *result;
+	unsigned long carry;
+	long x = 0;
+	int i, j, n = 0;
+
+	/* most literals fit in a long */
+	for (i = 0; i < len && x <= (LONG_MAX - 9) / 10; i++)
+		x = x * 10 + (s[i] - '0');
+	if (i == len)
+		return lisp_integer_new_long(rt, x);
+
+	/* each decimal digit adds less than four bits */
+	r = digits_buffer(small, len * 4 / LISP_DIGIT_BITS + 1);
+	for (i = 0; i < len; i++) {
+		carry = (unsigned long) (s[i] - '0');
+		for (j = 0; j < n; j++) {
+			carry += (unsigned long) r[j] * 10;
+			r[j] = (lisp_digit) (carry & LISP_DIGIT_MASK);
+			carry >>= LISP_DIGIT_BITS;
+		}
+		if (carry)
+			r[n++] = (lisp_digit) carry;
+	}
+	result = lisp_integer_from_digits(rt, 1, r, n);
+	digits_release(small, r);
+	return result;
+}
+
+void lisp_integer_print(FILE *f, lisp_integer *v)
+{
+	struct lisp_digits d;
+	lisp_digit *q, *chunks;
+	int n, nchunks = 0;
+	long x;
+
+	if (lisp_integer_get_long(v, &x)) {
+		fprintf(f, "%ld", x);
+		return;
+	}
+
+	/* divide by a power of ten repeatedly, and print the remainders */
+	lisp_integer_digits(v, &d);
+	n = d.n;
+	q = malloc(n * sizeof(lisp_digit));
+	chunks = malloc((n * LISP_DIGIT_BITS / DECIMAL_BITS + 2) *
+		sizeof(lisp_digit));
+	memcpy(q, d.d, n * sizeof(lisp_digit));
+	while (n) {
+		chunks[nchunks++] = mag_div_small(q, q, n, DECIMAL_BASE);
+		while (n && !q[n - 1])
+			n--;
+	}
+
+	fprintf(f, "%s%lu", d.sign < 0 ? "-" : "",
+		(unsigned long) chunks[--nchunks]);
+	while (nchunks)
+		fprintf(f, "%0*lu", DECIMAL_DIGITS,
+			(unsigned long) chunks[--nchunks]);
+	free(q);
+	free(chunks);
+}
+
+unsigned int lisp_integer_hash(lisp_integer *v)
+{
+	unsigned int hash;
+	int i;
+
+	if (lisp_fixnum_p(v))
+		return (unsigned int) lisp_fixnum_get(v);
+	if (!v->n)
+		return (unsigned int) ((unsigned long) v->x ^
+			(unsigned long) v->x >> LISP_DIGIT_BITS);
+
+	hash = (unsigned int) v->sign;
+	for (i = 0; i < v->n; i++)
+		hash = hash * 31 + v->digits[i];
+	return hash;
+}
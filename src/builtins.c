@@ -5,6 +5,7 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 
@@ -19,14 +20,14 @@ static lisp_value *lisp_builtin_eval(lisp_runtime *rt, lisp_scope *scope,
 }
 
 static lisp_value *lisp_builtin_car(lisp_runtime *rt, lisp_scope *scope,
-                                    lisp_list *arglist, void *user)
+                                    lisp_value **argv, int argc, void *user)
 {
 	/* args are evaluated */
 	lisp_list *firstarg;
 	(void) user; /* unused */
 	(void) scope;
 
-	if (!lisp_get_args(rt, arglist, "l", &firstarg)) {
+	if (!lisp_get_argv(rt, argv, argc, "l", &firstarg)) {
 		return NULL;
 	}
 	if (lisp_nil_p((lisp_value*) firstarg)) {
@@ -36,14 +37,14 @@ static lisp_value *lisp_builtin_car(lisp_runtime *rt, lisp_scope *scope,
 }
 
 static lisp_value *lisp_builtin_cdr(lisp_runtime *rt, lisp_scope *scope,
-                                    lisp_list *arglist, void *user)
+                                    lisp_value **argv, int argc, void *user)
 {
 	/* args are evaluated */
 	lisp_list *firstarg;
 	(void) user; /* unused */
 	(void) scope;
 
-	if (!lisp_get_args(rt, arglist, "l", &firstarg)) {
+	if (!lisp_get_argv(rt, argv, argc, "l", &firstarg)) {
 		return NULL;
 	}
 	if (lisp_nil_p((lisp_value*) firstarg)) {
@@ -67,21 +68,17 @@ static lisp_value *lisp_builtin_quote(lisp_runtime *rt, lisp_scope *scope,
 }
 
 static lisp_value *lisp_builtin_cons(lisp_runtime *rt, lisp_scope *scope,
-                                     lisp_list *arglist, void *user)
+                                     lisp_value **argv, int argc, void *user)
 {
 	/* args are evaluated */
 	lisp_value *a1, *l;
-	lisp_list *new;
 	(void) user; /* unused */
 	(void) scope;
 
-	if (!lisp_get_args(rt, arglist, "**", &a1, &l)) {
+	if (!lisp_get_argv(rt, argv, argc, "**", &a1, &l)) {
 		return NULL;
 	}
-	new = (lisp_list*)lisp_new(rt, type_list);
-	new->left = a1;
-	new->right = (lisp_value*)l;
-	return (lisp_value*)new;
+	return (lisp_value*) lisp_list_new(rt, a1, l);
 }
 
 static lisp_value *lisp_builtin_lambda(lisp_runtime *rt, lisp_scope *scope,
@@ -99,16 +96,17 @@ static lisp_value *lisp_builtin_lambda(lisp_runtime *rt, lisp_scope *scope,
 
 	it = argnames;
 	lisp_for_each(it) {
-		if (it->left->type != type_symbol) {
+		if (lisp_type_of(it->left) != type_symbol) {
 			return lisp_error(rt, LE_TYPE, "argument names must be symbols");
 		}
 	}
 
 	lambda = (lisp_lambda*)lisp_new(rt, type_lambda);
 	lambda->args = argnames;
-	lambda->code = code;
+	lambda->code = lisp_resolve_body(rt, scope, argnames, code);
 	lambda->closure = scope;
 	lambda->lambda_type = TP_LAMBDA;
+	lambda->nargs = lisp_list_length(argnames);
 	return (lisp_value*) lambda;
 }
 
@@ -127,16 +125,17 @@ static lisp_value *lisp_builtin_macro(lisp_runtime *rt, lisp_scope *scope,
 
 	it = argnames;
 	lisp_for_each(it) {
-		if (it->left->type != type_symbol) {
+		if (lisp_type_of(it->left) != type_symbol) {
 			return lisp_error(rt, LE_TYPE, "argument names must be symbols");
 		}
 	}
 
 	lambda = (lisp_lambda*)lisp_new(rt, type_lambda);
 	lambda->args = argnames;
-	lambda->code = code;
+	lambda->code = lisp_resolve_body(rt, scope, argnames, code);
 	lambda->closure = scope;
 	lambda->lambda_type = TP_MACRO;
+	lambda->nargs = lisp_list_length(argnames);
 	return (lisp_value*) lambda;
 }
 
@@ -159,117 +158,101 @@ static lisp_value *lisp_builtin_define(lisp_runtime *rt, lisp_scope *scope,
 }
 
 static lisp_value *lisp_builtin_plus(lisp_runtime *rt, lisp_scope *scope,
-                                     lisp_list *args, void *user)
+                                     lisp_value **argv, int argc, void *user)
 {
 	/* args are evaluated */
-	lisp_integer *i;
-	int sum = 0;
+	lisp_integer *sum = (lisp_integer *) lisp_fixnum_new(0);
+	int i;
 	(void) user; /* unused */
 	(void) scope;
 
-	lisp_for_each(args) {
-		if (args->left->type != type_integer) {
+	for (i = 0; i < argc; i++) {
+		if (lisp_type_of(argv[i]) != type_integer) {
 			return lisp_error(rt, LE_TYPE, "expect integers for addition");
 		}
-		i = (lisp_integer*) args->left;
-		sum += i->x;
+		sum = lisp_integer_add(rt, sum, (lisp_integer*) argv[i]);
 	}
 
-	i = (lisp_integer*)lisp_new(rt, type_integer);
-	i->x = sum;
-	return (lisp_value*)i;
+	return (lisp_value*) sum;
 }
 
 static lisp_value *lisp_builtin_minus(lisp_runtime *rt, lisp_scope *scope,
-                                      lisp_list *args, void *user)
+                                      lisp_value **argv, int argc, void *user)
 {
 	/* args are evaluated */
-	lisp_integer *i;
-	int val = 0, len;
+	lisp_integer *val;
+	int i;
 	(void) user; /* unused */
 	(void) scope;
 
-	len = lisp_list_length(args);
-
-	if (len < 1) {
+	if (argc < 1) {
 		return lisp_error(rt, LE_2FEW, "expected at least one arg");
-	} else if (len == 1) {
-		i = (lisp_integer*) args->left;
-		val = - i->x;
-	} else {
-		if (args->left->type != type_integer) {
+	}
+	for (i = 0; i < argc; i++) {
+		if (lisp_type_of(argv[i]) != type_integer) {
 			return lisp_error(rt, LE_TYPE, "expected integer");
 		}
-		i = (lisp_integer*) args->left;
-		val = i->x;
-		args = (lisp_list*)args->right;
-		lisp_for_each(args) {
-			if (args->left->type != type_integer) {
-				return lisp_error(rt, LE_TYPE, "expected integer");
-			}
-			i = (lisp_integer*) args->left;
-			val -= i->x;
-		}
 	}
 
-	i = (lisp_integer*)lisp_new(rt, type_integer);
-	i->x = val;
-	return (lisp_value*)i;
+	if (argc == 1) {
+		return (lisp_value*) lisp_integer_sub(rt,
+			(lisp_integer*) lisp_fixnum_new(0), (lisp_integer*) argv[0]);
+	}
+	val = (lisp_integer*) argv[0];
+	for (i = 1; i < argc; i++) {
+		val = lisp_integer_sub(rt, val, (lisp_integer*) argv[i]);
+	}
+
+	return (lisp_value*) val;
 }
 
 static lisp_value *lisp_builtin_multiply(lisp_runtime *rt, lisp_scope *scope,
-                                         lisp_list *args, void *user)
+                                         lisp_value **argv, int argc, void *user)
 {
 	/* args are evaluated */
-	lisp_integer *i;
-	int product = 1;
+	lisp_integer *product = (lisp_integer *) lisp_fixnum_new(1);
+	int i;
 	(void) user; /* unused */
 	(void) scope;
 
-	lisp_for_each(args) {
-		if (args->left->type != type_integer) {
+	for (i = 0; i < argc; i++) {
+		if (lisp_type_of(argv[i]) != type_integer) {
 			return lisp_error(rt, LE_TYPE, "expect integers for multiplication");
 		}
-		i = (lisp_integer*) args->left;
-		product *= i->x;
+		product = lisp_integer_mul(rt, product, (lisp_integer*) argv[i]);
 	}
 
-	i = (lisp_integer*)lisp_new(rt, type_integer);
-	i->x = product;
-	return (lisp_value*)i;
+	return (lisp_value*) product;
 }
 
 static lisp_value *lisp_builtin_divide(lisp_runtime *rt, lisp_scope *scope,
-                                       lisp_list *args, void *user)
+                                       lisp_value **argv, int argc, void *user)
 {
 	/* args are evaluated */
-	lisp_integer *i;
-	int val = 0, len;
+	lisp_integer *val;
+	int i;
 	(void) user; /* unused */
 	(void) scope;
 
-	len = lisp_list_length(args);
-
-	if (len < 1) {
+	if (argc < 1) {
 		return lisp_error(rt, LE_2FEW, "expected at least one arg");
 	}
-	i = (lisp_integer*) args->left;
-	val = i->x;
-	args = (lisp_list*)args->right;
-	lisp_for_each(args) {
-		if (args->left->type != type_integer) {
+	if (lisp_type_of(argv[0]) != type_integer) {
+		return lisp_error(rt, LE_TYPE, "expected integer");
+	}
+	val = (lisp_integer*) argv[0];
+	for (i = 1; i < argc; i++) {
+		if (lisp_type_of(argv[i]) != type_integer) {
 			return lisp_error(rt, LE_TYPE, "expected integer");
 		}
-		i = (lisp_integer*) args->left;
-		if (i->x == 0) {
+		/* zero is always a fixnum */
+		if (argv[i] == lisp_fixnum_new(0)) {
 			return lisp_error(rt, LE_VALUE, "divide by zero");
 		}
-		val /= i->x;
+		val = lisp_integer_div(rt, val, (lisp_integer*) argv[i]);
 	}
 
-	i = (lisp_integer*)lisp_new(rt, type_integer);
-	i->x = val;
-	return (lisp_value*)i;
+	return (lisp_value*) val;
 }
 
 #define CMP_EQ (void*) 1
@@ -280,205 +263,940 @@ static lisp_value *lisp_builtin_divide(lisp_runtime *rt, lisp_scope *scope,
 #define CMP_GE (void*) 6
 
 static lisp_value *lisp_builtin_cmp(lisp_runtime *rt, lisp_scope *scope,
-                                    lisp_list *args, void *op)
+                                    lisp_value **argv, int argc, void *op)
 {
 	/* args are evaluated */
-	lisp_integer *first, *second, *result;
+	lisp_integer *first_arg, *second_arg;
+	int cmp, result;
 	(void) scope; /* unused */
 
-	if (!lisp_get_args(rt, args, "dd", &first, &second)) {
+	if (!lisp_get_argv(rt, argv, argc, "dd", &first_arg, &second_arg)) {
 		return NULL;
 	}
+	cmp = lisp_integer_cmp(first_arg, second_arg);
 
-	result = (lisp_integer*)lisp_new(rt, type_integer);
 	if (op == CMP_EQ) {
-		result->x = first->x == second->x;
+		result = cmp == 0;
 	} else if (op == CMP_NE) {
-		result->x = first->x != second->x;
+		result = cmp != 0;
 	} else if (op == CMP_LT) {
-		result->x = first->x < second->x;
+		result = cmp < 0;
 	} else if (op == CMP_LE) {
-		result->x = first->x <= second->x;
+		result = cmp <= 0;
 	} else if (op == CMP_GT) {
-		result->x = first->x > second->x;
+		result = cmp > 0;
 	} else {
-		result->x = first->x >= second->x;
+		result = cmp >= 0;
 	}
 
-	return (lisp_value*)result;
+	return (lisp_value*) lisp_integer_new(rt, result);
 }
 
-static lisp_value *lisp_builtin_if(lisp_runtime *rt, lisp_scope *scope,
-                                   lisp_list *a, void *user)
+static lisp_value *lisp_builtin_string_length(lisp_runtime *rt,
+                                              lisp_scope *scope,
+                                              lisp_value **argv, int argc,
+                                              void *user)
+{
+	/* args are evaluated */
+	lisp_string *str;
+	(void) user; /* unused */
+	(void) scope;
+
+	if (!lisp_get_argv(rt, argv, argc, "S", &str)) {
+		return NULL;
+	}
+	return (lisp_value*) lisp_integer_new(rt, (int) lisp_string_length(str));
+}
+
+static lisp_value *lisp_builtin_substring(lisp_runtime *rt, lisp_scope *scope,
+                                          lisp_value **argv, int argc,
+                                          void *user)
+{
+	/* args are evaluated */
+	lisp_string *str;
+	lisp_integer *start_arg, *len_arg;
+	long start, len;
+	(void) user; /* unused */
+	(void) scope;
+
+	if (argc == 2) {
+		if (!lisp_get_argv(rt, argv, argc, "Sd", &str, &start_arg))
+			return NULL;
+		start = lisp_integer_get(start_arg);
+		len = (long) lisp_string_length(str) - start;
+	} else {
+		if (!lisp_get_argv(rt, argv, argc, "Sdd", &str, &start_arg, &len_arg))
+			return NULL;
+		start = lisp_integer_get(start_arg);
+		len = lisp_integer_get(len_arg);
+	}
+
+	if (start < 0 || len < 0 ||
+			(unsigned long) (start + len) > lisp_string_length(str)) {
+		return lisp_error(rt, LE_VALUE, "substring out of range");
+	}
+	return (lisp_value*) lisp_string_slice(rt, str, start, len);
+}
+
+/*
+ * Tail positions
+ *
+ * The special forms if, cond, progn and let end by evaluating one of their
+ * arguments, and returning its value. Each is implemented by a function which
+ * does everything except that final evaluation, and instead reports which
+ * expression must be evaluated, and in which scope. The builtin finishes by
+ * evaluating it. A lambda body whose last expression is one of these forms
+ * evaluates it itself in place of the form, so that a call there is a tail
+ * call (see lisp_builtin_tail()).
+ */
+
+/*
+ * Evaluate all but the last expression of @a body, leaving that one in
+ * @a expr.
+ */
+int lisp_tail_progn(lisp_runtime *rt, lisp_scope *scope, lisp_list *body,
+                    lisp_value **expr)
+{
+	lisp_value *v;
+
+	if (lisp_nil_p((lisp_value *) body)) {
+		*expr = lisp_nil_new(rt);
+		return LISP_TAIL_DONE;
+	}
+
+	while (!lisp_nil_p(body->right)) {
+		v = lisp_eval(rt, scope, body->left);
+		if (!v) {
+			*expr = NULL;
+			return LISP_TAIL_DONE;
+		}
+		body = (lisp_list *) body->right;
+	}
+	*expr = body->left;
+	return LISP_TAIL_EXPR;
+}
+
+static lisp_value *lisp_tail_finish(lisp_runtime *rt, lisp_scope *scope,
+                                    int rv, lisp_value *expr)
+{
+	if (rv == LISP_TAIL_EXPR)
+		return lisp_eval(rt, scope, expr);
+	return expr;
+}
+
+static int lisp_tail_if(lisp_runtime *rt, lisp_scope *scope, lisp_list *a,
+                        lisp_value **expr)
 {
 	/* args NOT evaluated */
 	lisp_value *condition, *body_true, *body_false;
-	(void) user; /* unused */
 
+	*expr = NULL;
 	if (!lisp_get_args(rt, a, "***", &condition, &body_true, &body_false)) {
-		return NULL;
+		return LISP_TAIL_DONE;
 	}
 
 	condition = lisp_eval(rt, scope, condition);
-	lisp_error_check(condition);
+	if (!condition)
+		return LISP_TAIL_DONE;
 	if (lisp_truthy(condition)) {
-		return lisp_eval(rt, scope, body_true);
+		*expr = body_true;
 	} else {
-		return lisp_eval(rt, scope, body_false);
+		*expr = body_false;
 	}
+	return LISP_TAIL_EXPR;
+}
+
+static lisp_value *lisp_builtin_if(lisp_runtime *rt, lisp_scope *scope,
+                                   lisp_list *a, void *user)
+{
+	lisp_value *expr;
+	int rv;
+	(void) user; /* unused */
+
+	rv = lisp_tail_if(rt, scope, a, &expr);
+	return lisp_tail_finish(rt, scope, rv, expr);
 }
 
 static lisp_value *lisp_builtin_null_p(lisp_runtime *rt, lisp_scope *scope,
-                                       lisp_list *args, void *user)
+                                       lisp_value **argv, int argc, void *user)
+{
+	/* args are evaluated */
+	lisp_value *v;
+	(void) user; /* unused */
+	(void) scope;
+
+	if (!lisp_get_argv(rt, argv, argc, "*", &v)) {
+		return NULL;
+	}
+
+	return (lisp_value*) lisp_integer_new(rt, (int) lisp_nil_p(v));
+}
+
+static lisp_value *lisp_builtin_map(lisp_runtime *rt, lisp_scope *scope,
+                                    lisp_value **argv, int argc, void *user)
 {
 	/* args are evaluated */
-	lisp_integer *result;
+	lisp_list *ret = NULL, *rv = NULL, *l;
+	unsigned long args, sp;
 	lisp_value *v;
+	int i;
+	(void) user; /* unused */
+
+	if (argc < 2) {
+		return lisp_error(rt, LE_2FEW, "need at least two arguments");
+	}
+
+	/* Make sure the arguments are well-behaved lists */
+	for (i = 1; i < argc; i++) {
+		if (lisp_is_bad_list((lisp_list *) argv[i])) {
+			return lisp_error(rt, LE_VALUE,
+				"arguments after callable must be lists");
+		}
+	}
+
+	/*
+	 * Each call gets the next item of every list, pushed onto the value
+	 * stack after the callable. The arguments are on the value stack too,
+	 * so they are reached by index, since argv moves when the stack grows.
+	 * The list arguments are replaced by what remains of each list.
+	 */
+	args = argv - rt->vm_stack;
+	for (;;) {
+		sp = rt->vm_sp;
+		lisp_values_reserve(rt, argc);
+		rt->vm_stack[rt->vm_sp++] = rt->vm_stack[args];
+		for (i = 1; i < argc; i++) {
+			l = (lisp_list *) rt->vm_stack[args + i];
+			/* Termination condition: one of the lists of args ends */
+			if (lisp_nil_p((lisp_value *) l)) {
+				rt->vm_sp = sp;
+				return ret ? (lisp_value *) rv : lisp_nil_new(rt);
+			}
+			rt->vm_stack[rt->vm_sp++] = l->left;
+			rt->vm_stack[args + i] = l->right;
+		}
+
+		v = lisp_call_values(rt, scope, argc - 1);
+		lisp_error_check(v);
+		l = lisp_list_new(rt, v, lisp_nil_new(rt));
+		if (ret == NULL) {
+			rv = l;
+		} else {
+			ret->right = (lisp_value *) l;
+			lisp_write_barrier(ret, ret->right);
+		}
+		ret = l;
+	}
+}
+
+static lisp_value *lisp_builtin_reduce(lisp_runtime *rt, lisp_scope *scope,
+                                       lisp_value **argv, int argc, void *user)
+{
+	/* args are evaluated */
+	lisp_list *list;
+	lisp_value *callable, *initializer;
+	(void) user; /* unused */
+
+	if (argc == 2) {
+		if (!lisp_get_argv(rt, argv, argc, "*l", &callable, &list)) {
+			return NULL;
+		}
+		if (lisp_list_length(list) < 2) {
+			return lisp_error(rt, LE_VALUE, "reduce: list must have at least 2 entries");
+		}
+		initializer = list->left;
+		list = (lisp_list*)list->right;
+	} else if (argc == 3) {
+		if (!lisp_get_argv(rt, argv, argc, "**l", &callable, &initializer, &list)) {
+			return NULL;
+		}
+		if (lisp_list_length(list) < 1) {
+			return lisp_error(rt, LE_VALUE, "reduce: list must have at least 1 entry");
+		}
+	} else if (argc <= 2) {
+		return lisp_error(rt, LE_2FEW, "reduce: 2 or 3 arguments required");
+	} else {
+		return lisp_error(rt, LE_2MANY, "reduce: 2 or 3 arguments required");
+	}
+
+	/* each step passes its pair of arguments on the value stack */
+	lisp_for_each(list) {
+		lisp_values_reserve(rt, 3);
+		rt->vm_stack[rt->vm_sp++] = callable;
+		rt->vm_stack[rt->vm_sp++] = initializer;
+		rt->vm_stack[rt->vm_sp++] = list->left;
+		initializer = lisp_call_values(rt, scope, 2);
+		lisp_error_check(initializer);
+	}
+	return initializer;
+}
+
+/*
+ * pmap and preduce behave as map and reduce, but spread their calls over the
+ * runtime's threads (see threads.c). The items are first gathered into an
+ * array, from which each thread takes runs of them.
+ */
+static lisp_value *lisp_builtin_pmap(lisp_runtime *rt, lisp_scope *scope,
+                                     lisp_value **argv, int argc, void *user)
+{
+	/* args are evaluated */
+	lisp_value **items, *rv;
+	lisp_list *l;
+	int i, n, ncalls = -1;
+
+	for (i = 1; i < argc; i++) {
+		if (lisp_is_bad_list((lisp_list *) argv[i]))
+			break;
+		n = lisp_list_length((lisp_list *) argv[i]);
+		if (ncalls < 0 || n < ncalls)
+			ncalls = n;
+	}
+	/* map itself reports bad arguments */
+	if (argc < 2 || i < argc || ncalls < 2 || !lisp_parallel_ok(rt))
+		return lisp_builtin_map(rt, scope, argv, argc, user);
+
+	items = malloc(ncalls * (argc - 1) * sizeof(lisp_value *));
+	for (i = 1; i < argc; i++) {
+		l = (lisp_list *) argv[i];
+		for (n = 0; n < ncalls; n++, l = (lisp_list *) l->right)
+			items[n * (argc - 1) + i - 1] = l->left;
+	}
+	rv = lisp_parallel(rt, scope, argv[0], items, argc - 1, ncalls, 0);
+	free(items);
+	return rv;
+}
+
+static lisp_value *lisp_builtin_preduce(lisp_runtime *rt, lisp_scope *scope,
+                                        lisp_value **argv, int argc, void *user)
+{
+	/* args are evaluated */
+	lisp_list *list, *results;
+	lisp_value *callable, *acc, **items;
+	int n;
+
+	if (argc < 2 || argc > 3 || !lisp_parallel_ok(rt) ||
+			lisp_is_bad_list((lisp_list *) argv[argc - 1]))
+		return lisp_builtin_reduce(rt, scope, argv, argc, user);
+	list = (lisp_list *) argv[argc - 1];
+	n = lisp_list_length(list);
+	if (n < 3)
+		return lisp_builtin_reduce(rt, scope, argv, argc, user);
+
+	/*
+	 * Each thread folds runs of the items, and we fold the results of the
+	 * runs in turn, onto the initializer if there is one. This gives the
+	 * same result as reduce when the callable is associative.
+	 */
+	callable = argv[0];
+	acc = argc == 3 ? argv[1] : NULL;
+	items = malloc(n * sizeof(lisp_value *));
+	for (n = 0; !lisp_nil_p((lisp_value *) list);
+			n++, list = (lisp_list *) list->right)
+		items[n] = list->left;
+	results = (lisp_list *) lisp_parallel(rt, scope, callable, items, 1,
+	                                      n, 1);
+	free(items);
+	lisp_error_check(results);
+
+	lisp_for_each(results) {
+		if (!acc) {
+			acc = results->left;
+			continue;
+		}
+		lisp_values_reserve(rt, 3);
+		rt->vm_stack[rt->vm_sp++] = callable;
+		rt->vm_stack[rt->vm_sp++] = acc;
+		rt->vm_stack[rt->vm_sp++] = results->left;
+		acc = lisp_call_values(rt, scope, 2);
+		lisp_error_check(acc);
+	}
+	return acc;
+}
+
+/*
+ * Vectors
+ *
+ * A vector may change while a callable runs over it, so the bulk builtins read
+ * its length and items afresh for each call, rather than holding on to them.
+ */
+
+static int lisp_vector_index(lisp_runtime *rt, lisp_vector *v,
+                             lisp_integer *index, unsigned long *i)
+{
+	int n = lisp_integer_get(index);
+
+	if (n < 0 || (unsigned long) n >= v->len) {
+		lisp_error(rt, LE_VALUE, "vector index out of range");
+		return 0;
+	}
+	*i = (unsigned long) n;
+	return 1;
+}
+
+static lisp_value *lisp_builtin_make_vector(lisp_runtime *rt,
+                                            lisp_scope *scope,
+                                            lisp_value **argv, int argc,
+                                            void *user)
+{
+	/* args are evaluated */
+	lisp_integer *len;
+	lisp_value *fill = NULL;
+	lisp_vector *v;
+	unsigned long i;
+	(void) user; /* unused */
+	(void) scope;
+
+	if (argc == 2) {
+		if (!lisp_get_argv(rt, argv, argc, "d*", &len, &fill))
+			return NULL;
+	} else if (!lisp_get_argv(rt, argv, argc, "d", &len)) {
+		return NULL;
+	}
+	if (lisp_integer_get(len) < 0)
+		return lisp_error(rt, LE_VALUE, "vector length is negative");
+	/* the items are allocated at once, so check them against the limit */
+	if (!lisp_heap_check(rt, (unsigned long) lisp_integer_get(len) *
+	                         sizeof(lisp_value *)))
+		return NULL;
+
+	v = lisp_vector_new(rt, (unsigned long) lisp_integer_get(len));
+	if (fill)
+		for (i = 0; i < v->len; i++)
+			lisp_vector_set(v, i, fill);
+	return (lisp_value *) v;
+}
+
+static lisp_value *lisp_builtin_vector(lisp_runtime *rt, lisp_scope *scope,
+                                       lisp_value **argv, int argc, void *user)
+{
+	/* args are evaluated */
+	(void) user; /* unused */
+	(void) scope;
+	return (lisp_value *) lisp_vector_from_array(rt, argv,
+		(unsigned long) argc);
+}
+
+static lisp_value *lisp_builtin_vector_length(lisp_runtime *rt,
+                                              lisp_scope *scope,
+                                              lisp_value **argv, int argc,
+                                              void *user)
+{
+	/* args are evaluated */
+	lisp_vector *v;
+	(void) user; /* unused */
+	(void) scope;
+
+	if (!lisp_get_argv(rt, argv, argc, "v", &v))
+		return NULL;
+	return (lisp_value *) lisp_integer_new(rt, (int) v->len);
+}
+
+static lisp_value *lisp_builtin_vector_ref(lisp_runtime *rt, lisp_scope *scope,
+                                           lisp_value **argv, int argc,
+                                           void *user)
+{
+	/* args are evaluated */
+	lisp_vector *v;
+	lisp_integer *index;
+	unsigned long i;
+	(void) user; /* unused */
+	(void) scope;
+
+	if (!lisp_get_argv(rt, argv, argc, "vd", &v, &index))
+		return NULL;
+	if (!lisp_vector_index(rt, v, index, &i))
+		return NULL;
+	return v->items[i];
+}
+
+static lisp_value *lisp_builtin_vector_set(lisp_runtime *rt, lisp_scope *scope,
+                                           lisp_value **argv, int argc,
+                                           void *user)
+{
+	/* args are evaluated */
+	lisp_vector *v;
+	lisp_integer *index;
+	lisp_value *item;
+	unsigned long i;
+	(void) user; /* unused */
+	(void) scope;
+
+	if (!lisp_get_argv(rt, argv, argc, "vd*", &v, &index, &item))
+		return NULL;
+	if (!lisp_vector_index(rt, v, index, &i) || !lisp_writable(rt, (lisp_value *) v))
+		return NULL;
+	lisp_vector_set(v, i, item);
+	return (lisp_value *) v;
+}
+
+static lisp_value *lisp_builtin_vector_push(lisp_runtime *rt,
+                                            lisp_scope *scope,
+                                            lisp_value **argv, int argc,
+                                            void *user)
+{
+	/* args are evaluated */
+	lisp_vector *v;
+	lisp_value *item;
+	(void) user; /* unused */
+	(void) scope;
+
+	if (!lisp_get_argv(rt, argv, argc, "v*", &v, &item))
+		return NULL;
+	if (!lisp_writable(rt, (lisp_value *) v))
+		return NULL;
+	lisp_vector_push(v, item);
+	return (lisp_value *) v;
+}
+
+static lisp_value *lisp_builtin_vector_to_list(lisp_runtime *rt,
+                                               lisp_scope *scope,
+                                               lisp_value **argv, int argc,
+                                               void *user)
+{
+	/* args are evaluated */
+	lisp_vector *v;
+	lisp_list *head, *tail;
+	unsigned long i;
+	(void) user; /* unused */
+	(void) scope;
+
+	if (!lisp_get_argv(rt, argv, argc, "v", &v))
+		return NULL;
+	head = tail = (lisp_list *) lisp_nil_new(rt);
+	for (i = 0; i < v->len; i++)
+		lisp_list_append(rt, &head, &tail, v->items[i]);
+	return (lisp_value *) head;
+}
+
+static lisp_value *lisp_builtin_list_to_vector(lisp_runtime *rt,
+                                               lisp_scope *scope,
+                                               lisp_value **argv, int argc,
+                                               void *user)
+{
+	/* args are evaluated */
+	lisp_list *l;
+	lisp_vector *v;
+	unsigned long i;
+	(void) user; /* unused */
+	(void) scope;
+
+	if (!lisp_get_argv(rt, argv, argc, "l", &l))
+		return NULL;
+	if (lisp_is_bad_list(l))
+		return lisp_error(rt, LE_VALUE, "list->vector: expected a list");
+	v = lisp_vector_new(rt, (unsigned long) lisp_list_length(l));
+	for (i = 0; !lisp_nil_p((lisp_value *) l);
+			i++, l = (lisp_list *) l->right)
+		lisp_vector_set(v, i, l->left);
+	return (lisp_value *) v;
+}
+
+static lisp_value *lisp_builtin_vector_map(lisp_runtime *rt, lisp_scope *scope,
+                                           lisp_value **argv, int argc,
+                                           void *user)
+{
+	/* args are evaluated */
+	lisp_vector *rv, *v;
+	unsigned long args, i;
+	lisp_value *item;
+	int j;
+	(void) user; /* unused */
+
+	if (argc < 2)
+		return lisp_error(rt, LE_2FEW, "need at least two arguments");
+	for (j = 1; j < argc; j++)
+		if (lisp_type_of(argv[j]) != type_vector)
+			return lisp_error(rt, LE_TYPE,
+				"arguments after callable must be vectors");
+
+	/* as in map, the arguments are reached by index on the value stack */
+	args = argv - rt->vm_stack;
+	rv = lisp_vector_new(rt, 0);
+	for (i = 0;; i++) {
+		lisp_values_reserve(rt, argc);
+		rt->vm_stack[rt->vm_sp++] = rt->vm_stack[args];
+		for (j = 1; j < argc; j++) {
+			v = (lisp_vector *) rt->vm_stack[args + j];
+			/* the shortest vector ends the map */
+			if (i >= v->len) {
+				rt->vm_sp -= j;
+				return (lisp_value *) rv;
+			}
+			rt->vm_stack[rt->vm_sp++] = v->items[i];
+		}
+		item = lisp_call_values(rt, scope, argc - 1);
+		lisp_error_check(item);
+		lisp_vector_push(rv, item);
+	}
+}
+
+static lisp_value *lisp_builtin_vector_filter(lisp_runtime *rt,
+                                              lisp_scope *scope,
+                                              lisp_value **argv, int argc,
+                                              void *user)
+{
+	/* args are evaluated */
+	lisp_value *callable, *keep;
+	lisp_vector *rv, *v;
+	unsigned long i;
+	(void) user; /* unused */
+
+	if (!lisp_get_argv(rt, argv, argc, "*v", &callable, &v))
+		return NULL;
+
+	rv = lisp_vector_new(rt, 0);
+	for (i = 0; i < v->len; i++) {
+		lisp_values_reserve(rt, 2);
+		rt->vm_stack[rt->vm_sp++] = callable;
+		rt->vm_stack[rt->vm_sp++] = v->items[i];
+		keep = lisp_call_values(rt, scope, 1);
+		lisp_error_check(keep);
+		if (lisp_truthy(keep))
+			lisp_vector_push(rv, v->items[i]);
+	}
+	return (lisp_value *) rv;
+}
+
+static lisp_value *lisp_builtin_vector_reduce(lisp_runtime *rt,
+                                              lisp_scope *scope,
+                                              lisp_value **argv, int argc,
+                                              void *user)
+{
+	/* args are evaluated */
+	lisp_value *callable, *initializer;
+	lisp_vector *v;
+	unsigned long i = 0;
+	(void) user; /* unused */
+
+	if (argc == 2) {
+		if (!lisp_get_argv(rt, argv, argc, "*v", &callable, &v))
+			return NULL;
+		if (v->len < 2)
+			return lisp_error(rt, LE_VALUE,
+				"vector-reduce: vector must have at least 2 entries");
+		initializer = v->items[i++];
+	} else if (argc == 3) {
+		if (!lisp_get_argv(rt, argv, argc, "**v", &callable,
+				&initializer, &v))
+			return NULL;
+		if (v->len < 1)
+			return lisp_error(rt, LE_VALUE,
+				"vector-reduce: vector must have at least 1 entry");
+	} else if (argc < 2) {
+		return lisp_error(rt, LE_2FEW,
+			"vector-reduce: 2 or 3 arguments required");
+	} else {
+		return lisp_error(rt, LE_2MANY,
+			"vector-reduce: 2 or 3 arguments required");
+	}
+
+	for (; i < v->len; i++) {
+		lisp_values_reserve(rt, 3);
+		rt->vm_stack[rt->vm_sp++] = callable;
+		rt->vm_stack[rt->vm_sp++] = initializer;
+		rt->vm_stack[rt->vm_sp++] = v->items[i];
+		initializer = lisp_call_values(rt, scope, 2);
+		lisp_error_check(initializer);
+	}
+	return initializer;
+}
+
+/*
+ * Hash maps
+ */
+static lisp_value *lisp_builtin_hash_map(lisp_runtime *rt, lisp_scope *scope,
+                                         lisp_value **argv, int argc,
+                                         void *user)
+{
+	/* args are evaluated */
+	lisp_hashmap *map;
+	int i;
 	(void) user; /* unused */
 	(void) scope;
 
-	if (!lisp_get_args(rt, args, "*", &v)) {
+	if (argc % 2)
+		return lisp_error(rt, LE_VALUE,
+			"hash-map: expected pairs of keys and values");
+	map = lisp_hashmap_new(rt);
+	for (i = 0; i < argc; i += 2)
+		lisp_hashmap_put(map, argv[i], argv[i + 1]);
+	return (lisp_value *) map;
+}
+
+static lisp_value *lisp_builtin_hash_get(lisp_runtime *rt, lisp_scope *scope,
+                                         lisp_value **argv, int argc,
+                                         void *user)
+{
+	/* args are evaluated */
+	lisp_hashmap *map;
+	lisp_value *key, *value, *fallback = NULL;
+	(void) user; /* unused */
+	(void) scope;
+
+	if (argc == 3) {
+		if (!lisp_get_argv(rt, argv, argc, "h**", &map, &key, &fallback))
+			return NULL;
+	} else if (!lisp_get_argv(rt, argv, argc, "h*", &map, &key)) {
 		return NULL;
 	}
+	value = lisp_hashmap_get(map, key);
+	if (!value)
+		value = fallback;
+	if (!value)
+		return lisp_error(rt, LE_NOTFOUND, "key not found in hash map");
+	return value;
+}
+
+static lisp_value *lisp_builtin_hash_put(lisp_runtime *rt, lisp_scope *scope,
+                                         lisp_value **argv, int argc,
+                                         void *user)
+{
+	/* args are evaluated */
+	lisp_hashmap *map;
+	lisp_value *key, *value;
+	(void) user; /* unused */
+	(void) scope;
+
+	if (!lisp_get_argv(rt, argv, argc, "h**", &map, &key, &value))
+		return NULL;
+	if (!lisp_writable(rt, (lisp_value *) map))
+		return NULL;
+	lisp_hashmap_put(map, key, value);
+	return (lisp_value *) map;
+}
+
+static lisp_value *lisp_builtin_hash_remove(lisp_runtime *rt,
+                                            lisp_scope *scope,
+                                            lisp_value **argv, int argc,
+                                            void *user)
+{
+	/* args are evaluated */
+	lisp_hashmap *map;
+	lisp_value *key;
+	(void) user; /* unused */
+	(void) scope;
+
+	if (!lisp_get_argv(rt, argv, argc, "h*", &map, &key))
+		return NULL;
+	if (!lisp_writable(rt, (lisp_value *) map))
+		return NULL;
+	lisp_hashmap_remove(map, key);
+	return (lisp_value *) map;
+}
+
+static lisp_value *lisp_builtin_hash_contains(lisp_runtime *rt,
+                                              lisp_scope *scope,
+                                              lisp_value **argv, int argc,
+                                              void *user)
+{
+	/* args are evaluated */
+	lisp_hashmap *map;
+	lisp_value *key;
+	(void) user; /* unused */
+	(void) scope;
+
+	if (!lisp_get_argv(rt, argv, argc, "h*", &map, &key))
+		return NULL;
+	return (lisp_value *) lisp_integer_new(rt,
+		lisp_hashmap_get(map, key) != NULL);
+}
+
+static lisp_value *lisp_builtin_hash_length(lisp_runtime *rt,
+                                            lisp_scope *scope,
+                                            lisp_value **argv, int argc,
+                                            void *user)
+{
+	/* args are evaluated */
+	lisp_hashmap *map;
+	(void) user; /* unused */
+	(void) scope;
+
+	if (!lisp_get_argv(rt, argv, argc, "h", &map))
+		return NULL;
+	return (lisp_value *) lisp_integer_new(rt,
+		(int) lisp_hashmap_length(map));
+}
+
+/* hash-keys and hash-values, which list the items in the same order */
+static lisp_value *lisp_builtin_hash_items(lisp_runtime *rt, lisp_scope *scope,
+                                           lisp_value **argv, int argc,
+                                           void *values)
+{
+	/* args are evaluated */
+	lisp_hashmap *map;
+	lisp_list *head, *tail;
+	struct iterator it;
+	(void) scope;
+
+	if (!lisp_get_argv(rt, argv, argc, "h", &map))
+		return NULL;
+	head = tail = (lisp_list *) lisp_nil_new(rt);
+	it = values ? pt_iter_values(&map->table) : pt_iter_keys(&map->table);
+	while (it.has_next(&it))
+		lisp_list_append(rt, &head, &tail, it.next(&it));
+	it.close(&it);
+	return (lisp_value *) head;
+}
+
+/*
+ * Sequences
+ *
+ * seq-map, seq-filter and seq-take only add a stage to a pipeline, and no item
+ * passes through it until seq-reduce, seq->list or seq->vector consume it.
+ * They accept lists and vectors too, making a sequence of them first.
+ */
+
+static lisp_value *lisp_builtin_seq(lisp_runtime *rt, lisp_scope *scope,
+                                    lisp_value **argv, int argc, void *user)
+{
+	/* args are evaluated */
+	lisp_value *v;
+	(void) user; /* unused */
+	(void) scope;
 
-	result = (lisp_integer*) lisp_new(rt, type_integer);
-	result->x = (int) lisp_nil_p(v);
-	return (lisp_value*)result;
+	if (!lisp_get_argv(rt, argv, argc, "*", &v))
+		return NULL;
+	return (lisp_value *) lisp_sequence_of(rt, v);
 }
 
-static lisp_list *get_quoted_left_items(lisp_runtime *rt, lisp_list *list_of_lists)
+static lisp_value *lisp_builtin_range(lisp_runtime *rt, lisp_scope *scope,
+                                      lisp_value **argv, int argc, void *user)
 {
-	lisp_list *left_items = NULL, *rv, *l;
+	/* args are evaluated */
+	lisp_integer *start = NULL, *end;
+	long from = 0, to;
+	(void) user; /* unused */
+	(void) scope;
 
-	lisp_for_each(list_of_lists) {
-		/* Create or advance left_items to the next list. */
-		if (left_items == NULL) {
-			left_items = (lisp_list*) lisp_new(rt, type_list);
-			rv = left_items;
-		} else {
-			left_items->right = lisp_new(rt, type_list);
-			left_items = (lisp_list*) left_items->right;
-		}
-		/* Termination condition: one of the lists of args ends */
-		if (lisp_nil_p(list_of_lists->left)) {
+	if (argc == 2) {
+		if (!lisp_get_argv(rt, argv, argc, "dd", &start, &end))
 			return NULL;
-		}
-		/* Get the next node in the list and get the argument. */
-		l = (lisp_list*) list_of_lists->left;
-		left_items->left = (lisp_value*) lisp_quote(rt, l->left);
+	} else if (!lisp_get_argv(rt, argv, argc, "d", &end)) {
+		return NULL;
 	}
-	left_items->right = lisp_nil_new(rt);
-	return rv;
+	if ((start && !lisp_integer_get_long(start, &from)) ||
+	    !lisp_integer_get_long(end, &to))
+		return lisp_error(rt, LE_VALUE, "range bounds must fit in a long");
+	return (lisp_value *) lisp_sequence_range(rt, from, to);
 }
 
-static lisp_list *advance_lists(lisp_runtime *rt, lisp_list *list_of_lists)
+/* seq-map and seq-filter, whose stage kind is given as user */
+static lisp_value *lisp_builtin_seq_stage(lisp_runtime *rt, lisp_scope *scope,
+                                          lisp_value **argv, int argc,
+                                          void *kind)
 {
-	lisp_list *right_items = NULL, *rv, *l;
-
-	lisp_for_each(list_of_lists) {
-		/* Create or advance left_items to the next list. */
-		if (right_items == NULL) {
-			right_items = (lisp_list*) lisp_new(rt, type_list);
-			rv = right_items;
-		} else {
-			right_items->right = lisp_new(rt, type_list);
-			right_items = (lisp_list*) right_items->right;
-		}
+	/* args are evaluated */
+	lisp_value *callable, *v;
+	lisp_sequence *s;
+	(void) scope;
 
-		/* Get the next node in the list and get the argument. */
-		l = (lisp_list*) list_of_lists->left;
-		right_items->left = l->right;
-	}
-	right_items->right = lisp_nil_new(rt);
-	return rv;
+	if (!lisp_get_argv(rt, argv, argc, "**", &callable, &v))
+		return NULL;
+	s = lisp_sequence_of(rt, v);
+	lisp_error_check(s);
+	return (lisp_value *) lisp_sequence_stage(rt,
+		(enum lisp_seq_kind) (long) kind, s, callable, 0);
 }
 
-static lisp_value *lisp_builtin_map(lisp_runtime *rt, lisp_scope *scope,
-                                    lisp_list *map_args, void *user)
+static lisp_value *lisp_builtin_seq_take(lisp_runtime *rt, lisp_scope *scope,
+                                         lisp_value **argv, int argc,
+                                         void *user)
 {
 	/* args are evaluated */
-	lisp_value *f;
-	lisp_list *ret = NULL, *rv, *args;
+	lisp_integer *n;
+	lisp_value *v;
+	lisp_sequence *s;
 	(void) user; /* unused */
+	(void) scope;
 
-	/* Get the function from the first argument in the list. */
-	f = map_args->left;
-	if (lisp_nil_p(map_args->right)) {
-		return lisp_error(rt, LE_2FEW, "need at least two arguments");
-	}
-	map_args = (lisp_list*) map_args->right;
-
-	/* Make sure the arguments are well-behaved lists */
-	if (lisp_is_bad_list_of_lists(map_args)) {
-		return lisp_error(rt, LE_VALUE,
-			"arguments after callable must be lists");
-	}
-	while ((args = get_quoted_left_items(rt, map_args)) != NULL) {
-		if (ret == NULL) {
-			ret = (lisp_list*) lisp_new(rt, type_list);
-			rv = ret;
-		} else {
-			ret->right = lisp_new(rt, type_list);
-			ret = (lisp_list*) ret->right;
-		}
-		ret->left = lisp_call(rt, scope, f, args);
-		lisp_error_check(ret->left);
-		map_args = advance_lists(rt, map_args);
-	}
-	ret->right = lisp_nil_new(rt);
-	return (lisp_value*) rv;
-}
-
-static lisp_list *lisp_new_pair_list(lisp_runtime *rt, lisp_value *one, lisp_value *two)
-{
-	lisp_list *first_node = (lisp_list*) lisp_new(rt, type_list);
-	lisp_list *second_node = (lisp_list*) lisp_new(rt, type_list);
-	first_node->left = one;
-	first_node->right = (lisp_value*) second_node;
-	second_node->left = two;
-	second_node->right = lisp_nil_new(rt);
-	return first_node;
+	if (!lisp_get_argv(rt, argv, argc, "d*", &n, &v))
+		return NULL;
+	if (lisp_integer_get(n) < 0)
+		return lisp_error(rt, LE_VALUE, "seq-take: count is negative");
+	s = lisp_sequence_of(rt, v);
+	lisp_error_check(s);
+	return (lisp_value *) lisp_sequence_stage(rt, LISP_SEQ_TAKE, s, NULL,
+		(unsigned long) lisp_integer_get(n));
 }
 
-static lisp_value *lisp_builtin_reduce(lisp_runtime *rt, lisp_scope *scope,
-                                       lisp_list *args, void *user)
+static lisp_value *lisp_builtin_seq_reduce(lisp_runtime *rt, lisp_scope *scope,
+                                           lisp_value **argv, int argc,
+                                           void *user)
 {
 	/* args are evaluated */
-	lisp_list *list;
-	lisp_value *callable, *initializer;
-	int length;
+	lisp_value *callable, *initializer, *item;
+	lisp_sequence *s;
+	int rv;
 	(void) user; /* unused */
 
-	length = lisp_list_length(args);
-
-	if (length == 2) {
-		if (!lisp_get_args(rt, args, "*l", &callable, &list)) {
+	if (argc == 2) {
+		if (!lisp_get_argv(rt, argv, argc, "**", &callable, &item))
 			return NULL;
-		}
-		if (lisp_list_length(list) < 2) {
-			return lisp_error(rt, LE_VALUE, "reduce: list must have at least 2 entries");
-		}
-		initializer = list->left;
-		list = (lisp_list*)list->right;
-	} else if (length == 3) {
-		if (!lisp_get_args(rt, args, "**l", &callable, &initializer, &list)) {
+	} else if (argc == 3) {
+		if (!lisp_get_argv(rt, argv, argc, "***", &callable,
+				&initializer, &item))
 			return NULL;
-		}
-		if (lisp_list_length(list) < 1) {
-			return lisp_error(rt, LE_VALUE, "reduce: list must have at least 1 entry");
-		}
-	} else if (length <= 2) {
-		return lisp_error(rt, LE_2FEW, "reduce: 2 or 3 arguments required");
+	} else if (argc < 2) {
+		return lisp_error(rt, LE_2FEW,
+			"seq-reduce: 2 or 3 arguments required");
 	} else {
-		return lisp_error(rt, LE_2MANY, "reduce: 2 or 3 arguments required");
+		return lisp_error(rt, LE_2MANY,
+			"seq-reduce: 2 or 3 arguments required");
 	}
+	s = lisp_sequence_of(rt, item);
+	lisp_error_check(s);
 
-	lisp_for_each(list) {
-		initializer = lisp_call(rt, scope, callable,
-			lisp_new_pair_list(rt, initializer, list->left));
+	/* the items are never known all at once, so only emptiness is checked */
+	if (argc == 2) {
+		rv = lisp_sequence_pull(rt, scope, s, &initializer);
+		if (rv < 0)
+			return NULL;
+		if (rv == 0)
+			return lisp_error(rt, LE_VALUE,
+				"seq-reduce: sequence must have at least 1 entry");
+	}
+
+	while ((rv = lisp_sequence_pull(rt, scope, s, &item)) > 0) {
+		lisp_values_reserve(rt, 3);
+		rt->vm_stack[rt->vm_sp++] = callable;
+		rt->vm_stack[rt->vm_sp++] = initializer;
+		rt->vm_stack[rt->vm_sp++] = item;
+		initializer = lisp_call_values(rt, scope, 2);
 		lisp_error_check(initializer);
 	}
-	return initializer;
+	return rv < 0 ? NULL : initializer;
+}
+
+/* seq->list and seq->vector, the latter when user is set */
+static lisp_value *lisp_builtin_seq_collect(lisp_runtime *rt,
+                                            lisp_scope *scope,
+                                            lisp_value **argv, int argc,
+                                            void *vector)
+{
+	/* args are evaluated */
+	lisp_value *item;
+	lisp_sequence *s;
+	lisp_list *head, *tail;
+	lisp_vector *v = NULL;
+	int rv;
+
+	if (!lisp_get_argv(rt, argv, argc, "*", &item))
+		return NULL;
+	s = lisp_sequence_of(rt, item);
+	lisp_error_check(s);
+
+	head = tail = (lisp_list *) lisp_nil_new(rt);
+	if (vector)
+		v = lisp_vector_new(rt, 0);
+	while ((rv = lisp_sequence_pull(rt, scope, s, &item)) > 0) {
+		if (v)
+			lisp_vector_push(v, item);
+		else
+			lisp_list_append(rt, &head, &tail, item);
+	}
+	if (rv < 0)
+		return NULL;
+	return v ? (lisp_value *) v : (lisp_value *) head;
 }
 
 static lisp_value *lisp_builtin_print(lisp_runtime *rt, lisp_scope *scope,
@@ -511,8 +1229,12 @@ static lisp_value *lisp_builtin_progn(lisp_runtime *rt, lisp_scope *scope,
                                       lisp_list *a, void *user)
 {
 	/* args NOT evaluated */
+	lisp_value *expr;
+	int rv;
 	(void) user; /* unused */
-	return lisp_progn(rt, scope, a);
+
+	rv = lisp_tail_progn(rt, scope, a, &expr);
+	return lisp_tail_finish(rt, scope, rv, expr);
 }
 
 static lisp_value *lisp_builtin_unquote(lisp_runtime *rt, lisp_scope *scope,
@@ -536,12 +1258,12 @@ static lisp_value *lisp_quasiquote(lisp_runtime *rt, lisp_scope *scope,
 	lisp_symbol *vlls;
 	(void)user;
 
-	if (v->type != type_list || lisp_nil_p(v)) {
+	if (lisp_type_of(v) != type_list || lisp_nil_p(v)) {
 		return v;
 	}
 
 	vl = (lisp_list *) v;
-	if (vl->left->type == type_symbol) {
+	if (lisp_type_of(vl->left) == type_symbol) {
 		vlls = (lisp_symbol *) vl->left;
 		if (strcmp(vlls->s, "unquote") == 0) {
 			return lisp_eval(rt, scope, v);
@@ -566,14 +1288,14 @@ static lisp_value *lisp_builtin_quasiquote(lisp_runtime *rt, lisp_scope *scope,
 }
 
 static lisp_value *lisp_builtin_eq(lisp_runtime *rt, lisp_scope *scope,
-                                   lisp_list *arglist, void *user)
+                                   lisp_value **argv, int argc, void *user)
 {
 	/* args are evaluated */
 	lisp_value *lhs, *rhs;
 	(void) user;
 	(void) scope;
 
-	if (!lisp_get_args(rt, arglist, "**", &lhs, &rhs)) {
+	if (!lisp_get_argv(rt, argv, argc, "**", &lhs, &rhs)) {
 		return NULL;
 	}
 
@@ -581,14 +1303,14 @@ static lisp_value *lisp_builtin_eq(lisp_runtime *rt, lisp_scope *scope,
 }
 
 static lisp_value *lisp_builtin_equal(lisp_runtime *rt, lisp_scope *scope,
-                                      lisp_list *arglist, void *user)
+                                      lisp_value **argv, int argc, void *user)
 {
 	/* args are evaluated */
 	lisp_value *lhs, *rhs;
 	(void) user;
 	(void) scope;
 
-	if (!lisp_get_args(rt, arglist, "**", &lhs, &rhs)) {
+	if (!lisp_get_argv(rt, argv, argc, "**", &lhs, &rhs)) {
 		return NULL;
 	}
 
@@ -606,7 +1328,7 @@ static lisp_value *lisp_builtin_assert(lisp_runtime *rt, lisp_scope *scope,
 	if (!lisp_get_args(rt, arglist, "d", &expr))
 		return NULL;
 
-	if (expr->x == 0)
+	if (lisp_integer_get(expr) == 0)
 		return lisp_error(rt, LE_ASSERT, "assertion error");
 	else
 		return (lisp_value*) expr;
@@ -627,7 +1349,7 @@ static lisp_value *lisp_builtin_assert_error(
 
 	sym_evald = (lisp_symbol*) lisp_eval(rt, scope, sym);
 	lisp_error_check(sym_evald);
-	if (sym_evald->type != type_symbol)
+	if (lisp_type_of(sym_evald) != type_symbol)
 		return lisp_error(rt, LE_TYPE, "error type must be symbol");
 	err_num = lisp_sym_to_errno(sym_evald);
 	if (err_num == LE_MAX_ERR)
@@ -656,36 +1378,57 @@ static lisp_value *lisp_builtin_assert_error(
  *   [(TEST2 VALUE2) ...]
  * )
  */
-static lisp_value *lisp_builtin_cond(
-		lisp_runtime *rt, lisp_scope *scope, lisp_list *arglist, void *user)
+static int lisp_tail_cond(lisp_runtime *rt, lisp_scope *scope,
+                          lisp_list *arglist, lisp_value **expr)
 {
 	/* args NOT evaluated */
 	lisp_list *clause, *node;
-	lisp_value *expr, *value;
-	(void) user; /* unused */
+	lisp_value *test, *value;
 
-	if (lisp_nil_p((lisp_value*)arglist))
-		return lisp_error(rt, LE_SYNTAX, "bad syntax for cond");
+	*expr = NULL;
+	if (lisp_nil_p((lisp_value*)arglist)) {
+		lisp_error(rt, LE_SYNTAX, "bad syntax for cond");
+		return LISP_TAIL_DONE;
+	}
 
 	lisp_for_each(arglist) {
-		if (arglist->left->type != type_list)
-			return lisp_error(rt, LE_SYNTAX, "bad syntax for cond");
+		if (lisp_type_of(arglist->left) != type_list) {
+			lisp_error(rt, LE_SYNTAX, "bad syntax for cond");
+			return LISP_TAIL_DONE;
+		}
 		clause = (lisp_list*) arglist->left;
 
-		if (lisp_is_bad_list(clause) || lisp_list_length(clause) != 2)
-			return lisp_error(rt, LE_SYNTAX, "bad syntax for cond");
+		if (lisp_is_bad_list(clause) || lisp_list_length(clause) != 2) {
+			lisp_error(rt, LE_SYNTAX, "bad syntax for cond");
+			return LISP_TAIL_DONE;
+		}
 
-		expr = clause->left;
+		test = clause->left;
 		node = (lisp_list*) clause->right;
 		value = node->left;
 
-		expr = lisp_eval(rt, scope, expr);
-		lisp_error_check(expr);
+		test = lisp_eval(rt, scope, test);
+		if (!test)
+			return LISP_TAIL_DONE;
 
-		if (lisp_truthy(expr))
-			return lisp_eval(rt, scope, value);
+		if (lisp_truthy(test)) {
+			*expr = value;
+			return LISP_TAIL_EXPR;
+		}
 	}
-	return lisp_nil_new(rt);
+	*expr = lisp_nil_new(rt);
+	return LISP_TAIL_DONE;
+}
+
+static lisp_value *lisp_builtin_cond(
+		lisp_runtime *rt, lisp_scope *scope, lisp_list *arglist, void *user)
+{
+	lisp_value *expr;
+	int rv;
+	(void) user; /* unused */
+
+	rv = lisp_tail_cond(rt, scope, arglist, &expr);
+	return lisp_tail_finish(rt, scope, rv, expr);
 }
 
 static lisp_value *lisp_builtin_list(
@@ -698,8 +1441,8 @@ static lisp_value *lisp_builtin_list(
 	return (lisp_value*)arglist;
 }
 
-static lisp_value *lisp_builtin_let(
-		lisp_runtime *rt, lisp_scope *scope, lisp_list *arglist, void *user)
+static int lisp_tail_let(lisp_runtime *rt, lisp_scope **scope,
+                         lisp_list *arglist, lisp_value **expr)
 {
 	/*
 	 * args are NOT evaluated.
@@ -715,31 +1458,58 @@ static lisp_value *lisp_builtin_let(
 	lisp_value *binding;
 	lisp_scope *new_scope;
 
-	(void) user;
-
+	*expr = NULL;
 	if (!lisp_get_args(rt, arglist, "lR", &binding_list, &expressions))
-		return NULL;
+		return LISP_TAIL_DONE;
 
 	/*
 	 * It feels dirty to just create a scope and never clean it up, but rest
 	 * assured it will be garbage collected.
 	 */
 	new_scope = lisp_new_empty_scope(rt);
-	new_scope->up = scope;
+	new_scope->up = *scope;
 
 	it = binding_list;
 	lisp_for_each(it) {
-		if (!lisp_is(it->left, type_list))
-			return lisp_error(rt, LE_TYPE, "expected binding list");
+		if (!lisp_is(it->left, type_list)) {
+			lisp_error(rt, LE_TYPE, "expected binding list");
+			return LISP_TAIL_DONE;
+		}
 		if (!lisp_get_args(rt, (lisp_list*)it->left, "s*", &sym, &binding))
-			return NULL;
+			return LISP_TAIL_DONE;
 		binding = lisp_eval(rt, new_scope, binding);
 		if (!binding)
-			return NULL;
+			return LISP_TAIL_DONE;
 		lisp_scope_bind(new_scope, sym, binding);
 	}
 
-	return lisp_progn(rt, new_scope, expressions);
+	*scope = new_scope;
+	return lisp_tail_progn(rt, new_scope, expressions, expr);
+}
+
+static lisp_value *lisp_builtin_let(
+		lisp_runtime *rt, lisp_scope *scope, lisp_list *arglist, void *user)
+{
+	lisp_value *expr;
+	int rv;
+	(void) user;
+
+	rv = lisp_tail_let(rt, &scope, arglist, &expr);
+	return lisp_tail_finish(rt, scope, rv, expr);
+}
+
+int lisp_builtin_tail(lisp_runtime *rt, lisp_builtin *builtin,
+                      lisp_scope **scope, lisp_list *args, lisp_value **expr)
+{
+	if (builtin->call == lisp_builtin_if)
+		return lisp_tail_if(rt, *scope, args, expr);
+	if (builtin->call == lisp_builtin_cond)
+		return lisp_tail_cond(rt, *scope, args, expr);
+	if (builtin->call == lisp_builtin_progn)
+		return lisp_tail_progn(rt, *scope, args, expr);
+	if (builtin->call == lisp_builtin_let)
+		return lisp_tail_let(rt, scope, args, expr);
+	return LISP_TAIL_NONE;
 }
 
 static lisp_value *lisp_builtin_import(
@@ -780,38 +1550,648 @@ static lisp_value *lisp_builtin_getattr(
 	return lisp_scope_lookup(rt, mod->contents, sym);
 }
 
+/*
+ * Lexical addressing
+ *
+ * When a lambda is created, its body is rewritten so that each reference to an
+ * argument of that lambda, or of a lambda around it in the same body, holds
+ * the location of the argument: the number of scopes to walk up, and the index
+ * of the slot in that lambda's frame. Every other symbol is left alone, and is
+ * looked up by name when evaluated, as before.
+ *
+ * We must be sure that the scopes found at runtime are the ones we predict,
+ * and that no binding made at runtime will shadow a resolved reference. So, the
+ * resolver recognizes the special forms which create scopes (lambda, macro and
+ * let) and which bind names (define and import). It leaves quoted data alone,
+ * as well as the arguments of macros and of builtins which don't evaluate
+ * their arguments, since those may not be code at all. A scope whose code
+ * calls eval or a macro may receive bindings we cannot see, so references
+ * which pass through it are not resolved. Whether a form is a special form is
+ * determined by looking up its head in the scope the lambda is created in.
+ *
+ * When the optimizer is enabled, a reference which is not resolved to an
+ * argument, and which no scope of the body can shadow, is looked up when the
+ * lambda is created. If it finds a core builtin, such as + or car, the
+ * reference becomes a lisp_inline holding the builtin, so that it is not
+ * looked up again at each call. A call of an arithmetic or comparison builtin
+ * whose arguments are integer constants is then folded into a lisp_inline of
+ * its result. Since a define of the same name in a scope above the lambda
+ * could shadow the builtin later, every binding of a core builtin's name
+ * invalidates the existing lisp_inline objects, which go back to evaluating
+ * the code they replaced.
+ */
+
+/* The resolver's model of a scope which will exist at runtime. */
+struct lisp_level {
+	struct lisp_level *up;
+	lisp_list *args;    /* arguments of a lambda frame, NULL for let */
+	lisp_list *bound;   /* names bound by define, import or let */
+	lisp_list *unknown; /* which of those may not be bound to a lambda */
+	int opaque;         /* code may bind names we cannot see */
+};
+
+static int lisp_list_has(lisp_list *list, lisp_symbol *sym)
+{
+	lisp_for_each(list) {
+		if (lisp_symbol_eq((lisp_symbol *) list->left, sym))
+			return 1;
+	}
+	return 0;
+}
+
+static int lisp_list_index(lisp_list *list, lisp_symbol *sym)
+{
+	int i = 0;
+	lisp_for_each(list) {
+		if (lisp_symbol_eq((lisp_symbol *) list->left, sym))
+			return i;
+		i++;
+	}
+	return -1;
+}
+
+static lisp_value *lisp_list_nth(lisp_list *list, int n)
+{
+	while (n-- > 0)
+		list = (lisp_list *) list->right;
+	return list->left;
+}
+
+enum lisp_form lisp_classify(lisp_scope *scope, struct lisp_level *level,
+                             lisp_value *head)
+{
+	lisp_symbol *sym;
+	lisp_builtin *builtin;
+	lisp_value *value;
+
+	/* a form is what it was before the optimizer inlined its head */
+	if (lisp_type_of(head) == type_inline)
+		head = ((lisp_inline *) head)->expr;
+	sym = (lisp_symbol *) head;
+	if (lisp_type_of(head) != type_symbol)
+		return FORM_CALL;
+
+	for (; level; level = level->up) {
+		if (level->args && lisp_list_has(level->args, sym))
+			return FORM_CALL;
+		if (lisp_list_has(level->unknown, sym))
+			return FORM_OPAQUE;
+		if (lisp_list_has(level->bound, sym))
+			return FORM_CALL;
+	}
+
+	/* names not bound yet are assumed to be functions defined later */
+	value = lisp_scope_find(scope, sym);
+	if (!value)
+		return FORM_CALL;
+	if (lisp_type_of(value) == type_lambda)
+		return ((lisp_lambda *) value)->lambda_type == TP_MACRO ?
+			FORM_OPAQUE : FORM_CALL;
+	if (lisp_type_of(value) != type_builtin)
+		return FORM_CALL;
+
+	builtin = (lisp_builtin *) value;
+	if (builtin->call == lisp_builtin_quote)
+		return FORM_QUOTE;
+	if (builtin->call == lisp_builtin_quasiquote)
+		return FORM_QUASIQUOTE;
+	if (builtin->call == lisp_builtin_eval)
+		return FORM_EVAL;
+	if (builtin->call == lisp_builtin_lambda)
+		return FORM_LAMBDA;
+	if (builtin->call == lisp_builtin_macro)
+		return FORM_MACRO;
+	if (builtin->call == lisp_builtin_let)
+		return FORM_LET;
+	if (builtin->call == lisp_builtin_define)
+		return FORM_DEFINE;
+	if (builtin->call == lisp_builtin_import)
+		return FORM_IMPORT;
+	if (builtin->call == lisp_builtin_if)
+		return FORM_IF;
+	if (builtin->call == lisp_builtin_progn)
+		return FORM_PROGN;
+	if (builtin->call == lisp_builtin_cond)
+		return FORM_COND;
+	if (builtin->evald ||
+	    builtin->call == lisp_builtin_unquote ||
+	    builtin->call == lisp_builtin_assert_error)
+		return FORM_CALL;
+	return FORM_OPAQUE;
+}
+
+/*
+ * Return the list of @a expr, or NULL if it is not a (proper) list form.
+ */
+static lisp_list *lisp_form_of(lisp_value *expr)
+{
+	if (lisp_type_of(expr) != type_list || lisp_nil_p(expr) ||
+	    lisp_is_bad_list((lisp_list *) expr))
+		return NULL;
+	return (lisp_list *) expr;
+}
+
+static void lisp_level_bind(lisp_runtime *rt, lisp_scope *scope,
+                            struct lisp_level *level, lisp_value *name,
+                            lisp_value *value)
+{
+	lisp_list *form;
+
+	if (lisp_type_of(name) != type_symbol)
+		return;
+	level->bound = lisp_list_new(rt, name, (lisp_value *) level->bound);
+	form = value ? lisp_form_of(value) : NULL;
+	if (!form || lisp_classify(scope, level, form->left) != FORM_LAMBDA)
+		level->unknown = lisp_list_new(rt, name,
+			(lisp_value *) level->unknown);
+}
+
+/*
+ * Find the names which code in a level will bind, before resolving it.
+ */
+static void lisp_prescan(lisp_runtime *rt, lisp_scope *scope,
+                         struct lisp_level *level, lisp_value *expr)
+{
+	lisp_list *form = lisp_form_of(expr);
+	lisp_list *it;
+	int length;
+
+	if (!form)
+		return;
+
+	length = lisp_list_length(form);
+	switch (lisp_classify(scope, level, form->left)) {
+	case FORM_QUOTE:
+	case FORM_QUASIQUOTE:
+	case FORM_LAMBDA:
+	case FORM_MACRO:
+	case FORM_LET:
+		/* nested levels bind names in their own scopes */
+		return;
+	case FORM_OPAQUE:
+		level->opaque = 1;
+		return;
+	case FORM_IMPORT:
+		if (length == 2)
+			lisp_level_bind(rt, scope, level,
+				lisp_list_nth(form, 1), NULL);
+		return;
+	case FORM_DEFINE:
+		if (length == 3) {
+			lisp_level_bind(rt, scope, level,
+				lisp_list_nth(form, 1), lisp_list_nth(form, 2));
+			lisp_prescan(rt, scope, level, lisp_list_nth(form, 2));
+		}
+		return;
+	case FORM_EVAL:
+		level->opaque = 1;
+		/* fall through */
+	case FORM_CALL:
+	case FORM_IF:
+	case FORM_PROGN:
+	case FORM_COND:
+		it = form;
+		lisp_for_each(it) {
+			lisp_prescan(rt, scope, level, it->left);
+		}
+		return;
+	}
+}
+
+static lisp_value *lisp_resolve(lisp_runtime *rt, lisp_scope *scope,
+                                void *level, lisp_value *expr);
+
+static lisp_value *lisp_inline_new(lisp_runtime *rt, lisp_value *value,
+                                   lisp_value *expr)
+{
+	lisp_inline *node = (lisp_inline *) lisp_new(rt, type_inline);
+	node->value = value;
+	node->expr = expr;
+	node->version = rt->builtins_version;
+	return (lisp_value *) node;
+}
+
+static lisp_value *lisp_resolve_symbol(lisp_runtime *rt, lisp_scope *scope,
+                                       struct lisp_level *level,
+                                       lisp_symbol *sym)
+{
+	lisp_local *local;
+	lisp_value *value = NULL;
+	lisp_scope *s;
+	int depth, slot;
+
+	for (depth = 0; level; level = level->up, depth++) {
+		if (level->args && (slot = lisp_list_index(level->args, sym)) >= 0) {
+			local = (lisp_local *) lisp_new(rt, type_local);
+			local->sym = sym;
+			local->depth = depth;
+			local->slot = slot;
+			return (lisp_value *) local;
+		}
+		if (level->opaque || lisp_list_has(level->bound, sym))
+			break;
+	}
+
+	/* only the scopes above the body can bind it now */
+	if (!level && rt->optimize && sym->core) {
+		for (s = scope; s; s = s->up)
+			if ((value = lisp_scope_find_local(s, sym)))
+				break;
+		if (value && lisp_type_of(value) == type_builtin) {
+			/* scopes of other runtimes, and frozen ones, are not
+			 * bound from here while this code can run */
+			for (; scope != s->up; scope = scope->up)
+				if (lisp_owned(rt, (lisp_value *) scope) &&
+				    scope->gen != LISP_GEN_FROZEN)
+					scope->inlined = 1;
+			return lisp_inline_new(rt, value, (lisp_value *) sym);
+		}
+	}
+	return (lisp_value *) sym;
+}
+
+/* Arguments of a call which the optimizer will fold. */
+#define LISP_FOLD_MAX 8
+
+/*
+ * Fold a resolved call, of an arithmetic or comparison builtin on integer
+ * constants, into its result. Other calls, and those which fail, are returned
+ * as they are.
+ */
+static lisp_value *lisp_fold(lisp_runtime *rt, lisp_scope *scope,
+                             lisp_list *form)
+{
+	lisp_value *argv[LISP_FOLD_MAX], *v;
+	lisp_builtin *builtin;
+	lisp_list *it;
+	int n = 0;
+
+	if (lisp_type_of(form->left) != type_inline)
+		return (lisp_value *) form;
+	builtin = (lisp_builtin *) ((lisp_inline *) form->left)->value;
+	if (lisp_type_of((lisp_value *) builtin) != type_builtin ||
+	    (builtin->argv_call != lisp_builtin_plus &&
+	     builtin->argv_call != lisp_builtin_minus &&
+	     builtin->argv_call != lisp_builtin_multiply &&
+	     builtin->argv_call != lisp_builtin_divide &&
+	     builtin->argv_call != lisp_builtin_cmp))
+		return (lisp_value *) form;
+
+	it = (lisp_list *) form->right;
+	lisp_for_each(it) {
+		v = it->left;
+		if (lisp_type_of(v) == type_inline)
+			v = ((lisp_inline *) v)->value;
+		if (n == LISP_FOLD_MAX || lisp_type_of(v) != type_integer)
+			return (lisp_value *) form;
+		argv[n++] = v;
+	}
+
+	/* errors, such as division by zero, are left for the call to raise */
+	v = builtin->argv_call(rt, scope, argv, n, builtin->user);
+	if (!v) {
+		lisp_clear_error(rt);
+		return (lisp_value *) form;
+	}
+	return lisp_inline_new(rt, v, (lisp_value *) form);
+}
+
+static lisp_list *lisp_resolve_level(lisp_runtime *rt, lisp_scope *scope,
+                                     struct lisp_level *level, lisp_list *code)
+{
+	lisp_list *it = code;
+	lisp_for_each(it) {
+		lisp_prescan(rt, scope, level, it->left);
+	}
+	return lisp_map(rt, scope, level, lisp_resolve, code);
+}
+
+static lisp_value *lisp_resolve_lambda(lisp_runtime *rt, lisp_scope *scope,
+                                       struct lisp_level *level,
+                                       lisp_list *form, int lambda_type)
+{
+	struct lisp_level inner;
+	lisp_lambda *template;
+	lisp_list *args, *it;
+
+	if (lisp_list_length(form) < 3)
+		return (lisp_value *) form;
+	args = (lisp_list *) lisp_list_nth(form, 1);
+	if (lisp_type_of((lisp_value *) args) != type_list ||
+	    lisp_is_bad_list(args))
+		return (lisp_value *) form;
+	it = args;
+	lisp_for_each(it) {
+		if (lisp_type_of(it->left) != type_symbol)
+			return (lisp_value *) form;
+	}
+
+	inner.up = level;
+	inner.args = args;
+	inner.bound = (lisp_list *) lisp_nil_new(rt);
+	inner.unknown = inner.bound;
+	inner.opaque = 0;
+
+	template = (lisp_lambda *) lisp_new(rt, type_lambda);
+	template->args = args;
+	template->code = lisp_resolve_level(rt, scope, &inner,
+		(lisp_list *) ((lisp_list *) form->right)->right);
+	template->lambda_type = lambda_type;
+	template->nargs = lisp_list_length(args);
+	return (lisp_value *) template;
+}
+
+static lisp_value *lisp_resolve_let(lisp_runtime *rt, lisp_scope *scope,
+                                    struct lisp_level *level, lisp_list *form)
+{
+	struct lisp_level inner;
+	lisp_list *bindings, *binding, *it, *head = NULL, *tail = NULL;
+	lisp_list *body;
+
+	if (lisp_list_length(form) < 3)
+		return (lisp_value *) form;
+	bindings = (lisp_list *) lisp_list_nth(form, 1);
+	if (lisp_type_of((lisp_value *) bindings) != type_list ||
+	    lisp_is_bad_list(bindings))
+		return (lisp_value *) form;
+
+	inner.up = level;
+	inner.args = NULL;
+	inner.bound = (lisp_list *) lisp_nil_new(rt);
+	inner.unknown = inner.bound;
+	inner.opaque = 0;
+
+	it = bindings;
+	lisp_for_each(it) {
+		binding = lisp_form_of(it->left);
+		if (!binding || lisp_list_length(binding) != 2 ||
+		    lisp_type_of(binding->left) != type_symbol)
+			return (lisp_value *) form;
+		lisp_level_bind(rt, scope, &inner, binding->left,
+			lisp_list_nth(binding, 1));
+	}
+	it = bindings;
+	lisp_for_each(it) {
+		lisp_prescan(rt, scope, &inner,
+			lisp_list_nth((lisp_list *) it->left, 1));
+	}
+
+	body = (lisp_list *) ((lisp_list *) form->right)->right;
+	it = bindings;
+	head = tail = (lisp_list *) lisp_nil_new(rt);
+	lisp_for_each(it) {
+		binding = (lisp_list *) it->left;
+		lisp_list_append(rt, &head, &tail, (lisp_value *) lisp_list_new(
+			rt, binding->left, (lisp_value *) lisp_singleton_list(rt,
+				lisp_resolve(rt, scope, &inner,
+					lisp_list_nth(binding, 1)))));
+	}
+	body = lisp_resolve_level(rt, scope, &inner, body);
+	return (lisp_value *) lisp_list_new(rt, form->left,
+		(lisp_value *) lisp_list_new(rt, (lisp_value *) head,
+			(lisp_value *) body));
+}
+
+static lisp_value *lisp_resolve(lisp_runtime *rt, lisp_scope *scope,
+                                void *user, lisp_value *expr)
+{
+	struct lisp_level *level = user;
+	lisp_list *form;
+
+	if (lisp_type_of(expr) == type_symbol)
+		return lisp_resolve_symbol(rt, scope, level,
+			(lisp_symbol *) expr);
+
+	form = lisp_form_of(expr);
+	if (!form)
+		return expr;
+
+	switch (lisp_classify(scope, level, form->left)) {
+	case FORM_QUOTE:
+	case FORM_QUASIQUOTE:
+	case FORM_OPAQUE:
+	case FORM_IMPORT:
+		break;
+	case FORM_LAMBDA:
+		return lisp_resolve_lambda(rt, scope, level, form, TP_LAMBDA);
+	case FORM_MACRO:
+		return lisp_resolve_lambda(rt, scope, level, form, TP_MACRO);
+	case FORM_LET:
+		return lisp_resolve_let(rt, scope, level, form);
+	case FORM_DEFINE:
+		if (lisp_list_length(form) != 3)
+			break;
+		return (lisp_value *) lisp_list_new(rt, form->left,
+			(lisp_value *) lisp_list_new(rt, lisp_list_nth(form, 1),
+				(lisp_value *) lisp_singleton_list(rt,
+					lisp_resolve(rt, scope, level,
+						lisp_list_nth(form, 2)))));
+	case FORM_CALL:
+		form = lisp_map(rt, scope, level, lisp_resolve, form);
+		if (rt->optimize)
+			return lisp_fold(rt, scope, form);
+		return (lisp_value *) form;
+	case FORM_EVAL:
+	case FORM_IF:
+	case FORM_PROGN:
+	case FORM_COND:
+		return (lisp_value *) lisp_map(rt, scope, level, lisp_resolve,
+			form);
+	}
+	return expr;
+}
+
+lisp_list *lisp_resolve_body(lisp_runtime *rt, lisp_scope *scope,
+                             lisp_list *args, lisp_list *code)
+{
+	struct lisp_level level;
+
+	level.up = NULL;
+	level.args = args;
+	level.bound = (lisp_list *) lisp_nil_new(rt);
+	level.unknown = level.bound;
+	level.opaque = 0;
+	return lisp_resolve_level(rt, scope, &level, code);
+}
+
+void lisp_enable_optimizer(lisp_runtime *rt)
+{
+	rt->optimize = 1;
+}
+
+void lisp_disable_optimizer(lisp_runtime *rt)
+{
+	rt->optimize = 0;
+}
+
+/*
+ * Return whether resolved @a code, or a lambda nested in it, holds a
+ * lisp_inline which is still in use.
+ */
+static int lisp_code_inlined(lisp_runtime *rt, lisp_value *code)
+{
+	lisp_list *it;
+
+	if (lisp_type_of(code) == type_inline)
+		return ((lisp_inline *) code)->version == rt->builtins_version;
+	if (lisp_type_of(code) == type_lambda)
+		return lisp_code_inlined(rt,
+			(lisp_value *) ((lisp_lambda *) code)->code);
+	it = (lisp_list *) code;
+	lisp_for_each(it) {
+		if (lisp_code_inlined(rt, it->left))
+			return 1;
+	}
+	return 0;
+}
+
+static lisp_value *lisp_builtin_inlined_p(lisp_runtime *rt, lisp_scope *scope,
+                                          lisp_value **argv, int argc,
+                                          void *user)
+{
+	/* args are evaluated */
+	lisp_value *v;
+	(void) user;
+	(void) scope;
+
+	if (!lisp_get_argv(rt, argv, argc, "*", &v))
+		return NULL;
+	if (lisp_type_of(v) != type_lambda)
+		return lisp_error(rt, LE_TYPE, "expected a lambda or macro");
+	return (lisp_value *) lisp_integer_new(rt, lisp_code_inlined(rt, v));
+}
+
+/* digits of a bignum which is too large for the pool */
+#define INTERIOR_DIGITS (LISP_MAX_POOLED / sizeof(lisp_digit) + 1)
+
+/*
+ * Allocate a bignum, and return a pointer to its last digit, which is all that
+ * is left of it once this frame is gone.
+ */
+static lisp_digit *lisp_interior_pointer(lisp_runtime *rt)
+{
+	lisp_digit digits[INTERIOR_DIGITS];
+	lisp_integer *integer;
+	unsigned int i;
+
+	for (i = 0; i < INTERIOR_DIGITS; i++)
+		digits[i] = (lisp_digit) (i + 1);
+	integer = lisp_integer_from_digits(rt, 1, digits, INTERIOR_DIGITS);
+	return integer->digits + INTERIOR_DIGITS - 1;
+}
+
+/* Overwrite the stack which lisp_interior_pointer() used. */
+static void lisp_scrub_stack(void)
+{
+	volatile char junk[4 * LISP_MAX_POOLED];
+	unsigned int i;
+
+	for (i = 0; i < sizeof(junk); i++)
+		junk[i] = 0;
+}
+
+static lisp_value *lisp_builtin_interior_kept_p(lisp_runtime *rt,
+                                                lisp_scope *scope,
+                                                lisp_value **argv, int argc,
+                                                void *user)
+{
+	/* args are evaluated */
+	lisp_digit *volatile last;
+	int kept;
+	(void) user;
+	(void) scope;
+
+	if (!lisp_get_argv(rt, argv, argc, ""))
+		return NULL;
+	last = lisp_interior_pointer(rt);
+	lisp_scrub_stack();
+	lisp_gc_collect(rt);
+	lisp_gc_finish_sweep(rt);
+	kept = lisp_alloc_find(rt, last) && *last == INTERIOR_DIGITS;
+	return (lisp_value *) lisp_integer_new(rt, kept);
+}
+
+/*
+ * The builtins which the optimizer may inline. Scripts seldom bind their
+ * names, and each binding of one makes the optimized code look them up again.
+ */
+static char *lisp_core_builtins[] = {
+	"+", "-", "*", "/", "==", "=", "!=", ">", ">=", "<", "<=",
+	"car", "cdr", "cons", "null?", "eq?", "equal?", "if", "cond", "progn",
+};
+
+/*
+ * The special forms which the bytecode compiler turns into instructions, and
+ * which compiled code must check are still bound to their builtins.
+ */
+static char *lisp_compiled_forms[] = {
+	"quote", "if", "cond", "progn", "let", "define",
+};
+
 void lisp_scope_populate_builtins(lisp_runtime *rt, lisp_scope *scope)
 {
+	lisp_symbol *sym;
+	size_t i;
+
 	lisp_scope_add_builtin(rt, scope, "eval", lisp_builtin_eval, NULL, 1);
-	lisp_scope_add_builtin(rt, scope, "car", lisp_builtin_car, NULL, 1);
-	lisp_scope_add_builtin(rt, scope, "cdr", lisp_builtin_cdr, NULL, 1);
+	lisp_scope_add_builtin_argv(rt, scope, "car", lisp_builtin_car, NULL);
+	lisp_scope_add_builtin_argv(rt, scope, "cdr", lisp_builtin_cdr, NULL);
 	lisp_scope_add_builtin(rt, scope, "quote", lisp_builtin_quote, NULL, 0);
-	lisp_scope_add_builtin(rt, scope, "cons", lisp_builtin_cons, NULL, 1);
+	lisp_scope_add_builtin_argv(rt, scope, "cons", lisp_builtin_cons, NULL);
 	lisp_scope_add_builtin(rt, scope, "lambda", lisp_builtin_lambda, NULL, 0);
 	lisp_scope_add_builtin(rt, scope, "macro", lisp_builtin_macro, NULL, 0);
 	lisp_scope_add_builtin(rt, scope, "define", lisp_builtin_define, NULL, 0);
-	lisp_scope_add_builtin(rt, scope, "+", lisp_builtin_plus, NULL, 1);
-	lisp_scope_add_builtin(rt, scope, "-", lisp_builtin_minus, NULL, 1);
-	lisp_scope_add_builtin(rt, scope, "*", lisp_builtin_multiply, NULL, 1);
-	lisp_scope_add_builtin(rt, scope, "/", lisp_builtin_divide, NULL, 1);
-	lisp_scope_add_builtin(rt, scope, "==", lisp_builtin_cmp, CMP_EQ, 1);
-	lisp_scope_add_builtin(rt, scope, "=", lisp_builtin_cmp, CMP_EQ, 1);
-	lisp_scope_add_builtin(rt, scope, "!=", lisp_builtin_cmp, CMP_NE, 1);
-	lisp_scope_add_builtin(rt, scope, ">", lisp_builtin_cmp, CMP_GT, 1);
-	lisp_scope_add_builtin(rt, scope, ">=", lisp_builtin_cmp, CMP_GE, 1);
-	lisp_scope_add_builtin(rt, scope, "<", lisp_builtin_cmp, CMP_LT, 1);
-	lisp_scope_add_builtin(rt, scope, "<=", lisp_builtin_cmp, CMP_LE, 1);
+	lisp_scope_add_builtin_argv(rt, scope, "+", lisp_builtin_plus, NULL);
+	lisp_scope_add_builtin_argv(rt, scope, "-", lisp_builtin_minus, NULL);
+	lisp_scope_add_builtin_argv(rt, scope, "*", lisp_builtin_multiply, NULL);
+	lisp_scope_add_builtin_argv(rt, scope, "/", lisp_builtin_divide, NULL);
+	lisp_scope_add_builtin_argv(rt, scope, "==", lisp_builtin_cmp, CMP_EQ);
+	lisp_scope_add_builtin_argv(rt, scope, "=", lisp_builtin_cmp, CMP_EQ);
+	lisp_scope_add_builtin_argv(rt, scope, "!=", lisp_builtin_cmp, CMP_NE);
+	lisp_scope_add_builtin_argv(rt, scope, ">", lisp_builtin_cmp, CMP_GT);
+	lisp_scope_add_builtin_argv(rt, scope, ">=", lisp_builtin_cmp, CMP_GE);
+	lisp_scope_add_builtin_argv(rt, scope, "<", lisp_builtin_cmp, CMP_LT);
+	lisp_scope_add_builtin_argv(rt, scope, "<=", lisp_builtin_cmp, CMP_LE);
 	lisp_scope_add_builtin(rt, scope, "if", lisp_builtin_if, NULL, 0);
-	lisp_scope_add_builtin(rt, scope, "null?", lisp_builtin_null_p, NULL, 1);
-	lisp_scope_add_builtin(rt, scope, "map", lisp_builtin_map, NULL, 1);
-	lisp_scope_add_builtin(rt, scope, "reduce", lisp_builtin_reduce, NULL, 1);
+	lisp_scope_add_builtin_argv(rt, scope, "null?", lisp_builtin_null_p, NULL);
+	lisp_scope_add_builtin_argv(rt, scope, "map", lisp_builtin_map, NULL);
+	lisp_scope_add_builtin_argv(rt, scope, "reduce", lisp_builtin_reduce, NULL);
+	lisp_scope_add_builtin_argv(rt, scope, "pmap", lisp_builtin_pmap, NULL);
+	lisp_scope_add_builtin_argv(rt, scope, "preduce", lisp_builtin_preduce, NULL);
+	lisp_scope_add_builtin_argv(rt, scope, "make-vector", lisp_builtin_make_vector, NULL);
+	lisp_scope_add_builtin_argv(rt, scope, "vector", lisp_builtin_vector, NULL);
+	lisp_scope_add_builtin_argv(rt, scope, "vector-length", lisp_builtin_vector_length, NULL);
+	lisp_scope_add_builtin_argv(rt, scope, "vector-ref", lisp_builtin_vector_ref, NULL);
+	lisp_scope_add_builtin_argv(rt, scope, "vector-set!", lisp_builtin_vector_set, NULL);
+	lisp_scope_add_builtin_argv(rt, scope, "vector-push!", lisp_builtin_vector_push, NULL);
+	lisp_scope_add_builtin_argv(rt, scope, "vector->list", lisp_builtin_vector_to_list, NULL);
+	lisp_scope_add_builtin_argv(rt, scope, "list->vector", lisp_builtin_list_to_vector, NULL);
+	lisp_scope_add_builtin_argv(rt, scope, "vector-map", lisp_builtin_vector_map, NULL);
+	lisp_scope_add_builtin_argv(rt, scope, "vector-filter", lisp_builtin_vector_filter, NULL);
+	lisp_scope_add_builtin_argv(rt, scope, "vector-reduce", lisp_builtin_vector_reduce, NULL);
+	lisp_scope_add_builtin_argv(rt, scope, "hash-map", lisp_builtin_hash_map, NULL);
+	lisp_scope_add_builtin_argv(rt, scope, "hash-get", lisp_builtin_hash_get, NULL);
+	lisp_scope_add_builtin_argv(rt, scope, "hash-put!", lisp_builtin_hash_put, NULL);
+	lisp_scope_add_builtin_argv(rt, scope, "hash-remove!", lisp_builtin_hash_remove, NULL);
+	lisp_scope_add_builtin_argv(rt, scope, "hash-contains?", lisp_builtin_hash_contains, NULL);
+	lisp_scope_add_builtin_argv(rt, scope, "hash-length", lisp_builtin_hash_length, NULL);
+	lisp_scope_add_builtin_argv(rt, scope, "hash-keys", lisp_builtin_hash_items, NULL);
+	lisp_scope_add_builtin_argv(rt, scope, "hash-values", lisp_builtin_hash_items, (void *) 1);
+	lisp_scope_add_builtin_argv(rt, scope, "seq", lisp_builtin_seq, NULL);
+	lisp_scope_add_builtin_argv(rt, scope, "range", lisp_builtin_range, NULL);
+	lisp_scope_add_builtin_argv(rt, scope, "seq-map", lisp_builtin_seq_stage, (void *) LISP_SEQ_MAP);
+	lisp_scope_add_builtin_argv(rt, scope, "seq-filter", lisp_builtin_seq_stage, (void *) LISP_SEQ_FILTER);
+	lisp_scope_add_builtin_argv(rt, scope, "seq-take", lisp_builtin_seq_take, NULL);
+	lisp_scope_add_builtin_argv(rt, scope, "seq-reduce", lisp_builtin_seq_reduce, NULL);
+	lisp_scope_add_builtin_argv(rt, scope, "seq->list", lisp_builtin_seq_collect, NULL);
+	lisp_scope_add_builtin_argv(rt, scope, "seq->vector", lisp_builtin_seq_collect, (void *) 1);
 	lisp_scope_add_builtin(rt, scope, "print", lisp_builtin_print, NULL, 1);
 	lisp_scope_add_builtin(rt, scope, "dump-stack", lisp_builtin_dump_stack, NULL, 1);
 	lisp_scope_add_builtin(rt, scope, "progn", lisp_builtin_progn, NULL, 0);
 	lisp_scope_add_builtin(rt, scope, "unquote", lisp_builtin_unquote, NULL, 0);
 	lisp_scope_add_builtin(rt, scope, "quasiquote", lisp_builtin_quasiquote, NULL, 0);
-	lisp_scope_add_builtin(rt, scope, "eq?", lisp_builtin_eq, NULL, 1);
-	lisp_scope_add_builtin(rt, scope, "equal?", lisp_builtin_equal, NULL, 1);
+	lisp_scope_add_builtin_argv(rt, scope, "eq?", lisp_builtin_eq, NULL);
+	lisp_scope_add_builtin_argv(rt, scope, "equal?", lisp_builtin_equal, NULL);
 	lisp_scope_add_builtin(rt, scope, "assert", lisp_builtin_assert, NULL, 1);
 	lisp_scope_add_builtin(rt, scope, "assert-error", lisp_builtin_assert_error, NULL, 0);
 	lisp_scope_add_builtin(rt, scope, "cond", lisp_builtin_cond, NULL, 0);
@@ -819,4 +2199,24 @@ void lisp_scope_populate_builtins(lisp_runtime *rt, lisp_scope *scope)
 	lisp_scope_add_builtin(rt, scope, "let", lisp_builtin_let, NULL, 0);
 	lisp_scope_add_builtin(rt, scope, "import", lisp_builtin_import, NULL, 0);
 	lisp_scope_add_builtin(rt, scope, "getattr", lisp_builtin_getattr, NULL, 1);
+	lisp_scope_add_builtin_argv(rt, scope, "string-length", lisp_builtin_string_length, NULL);
+	lisp_scope_add_builtin_argv(rt, scope, "substring", lisp_builtin_substring, NULL);
+
+	/* symbols of a template are shared, and may not be written */
+	for (i = 0; i < sizeof(lisp_core_builtins) / sizeof(char *); i++) {
+		sym = lisp_symbol_new(rt, lisp_core_builtins[i], 0);
+		if (sym->gen != LISP_GEN_FROZEN)
+			sym->core = 1;
+	}
+	for (i = 0; i < sizeof(lisp_compiled_forms) / sizeof(char *); i++) {
+		sym = lisp_symbol_new(rt, lisp_compiled_forms[i], 0);
+		if (sym->gen != LISP_GEN_FROZEN)
+			sym->form = 1;
+	}
+}
+
+void lisp_scope_populate_debug(lisp_runtime *rt, lisp_scope *scope)
+{
+	lisp_scope_add_builtin_argv(rt, scope, "inlined?", lisp_builtin_inlined_p, NULL);
+	lisp_scope_add_builtin_argv(rt, scope, "interior-pointer-kept?", lisp_builtin_interior_kept_p, NULL);
 }
@@ -72,6 +72,14 @@ void cb_concat(struct charbuf *obj, char *buf)
 	obj->length += length;
 }
 
+void cb_concat_n(struct charbuf *obj, char *buf, int length)
+{
+	cb_expand_to_fit(obj, obj->length + length + 1);
+	memcpy(obj->buf + obj->length, buf, length);
+	obj->length += length;
+	obj->buf[obj->length] = '\0';
+}
+
 void cb_append(struct charbuf *obj, char next)
 {
 	cb_expand_to_fit(obj, obj->length + 2); /* include new character + nul */
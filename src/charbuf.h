@@ -66,6 +66,13 @@ void cb_delete(struct charbuf *obj);
  * @param str The string to concat.
  */
 void cb_concat(struct charbuf *obj, char *str);
+/**
+ * @brief Concat the first bytes of a string onto the end of the buffer.
+ * @param obj The buffer to concat onto.
+ * @param str The string to concat, which need not be NUL terminated.
+ * @param length The number of bytes to concat.
+ */
+void cb_concat_n(struct charbuf *obj, char *str, int length);
 /**
  * @brief Append a character onto the end of the character buffer.
  * @param obj The buffer to append onto.
@@ -7,28 +7,74 @@
 #ifndef _FUNLISP_INTERNAL_H
 #define _FUNLISP_INTERNAL_H
 
+#include <limits.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 
 #include "funlisp.h"
 #include "iter.h"
 #include "ringbuf.h"
 #include "hashtable.h"
+#include "ptable.h"
 
-#define GC_NOMARK 'w'
-#define GC_QUEUED 'g'
-#define GC_MARKED 'b'
+/*
+ * Generations. Objects are born young and promoted to old when they survive a
+ * collection. A young object which an old object has been made to point at is
+ * "remembered", so that a minor collection treats it as a root. See gc.c.
+ */
+#define LISP_GEN_YOUNG 'y'
+#define LISP_GEN_REMEMBERED 'r'
+#define LISP_GEN_OLD 'o'
+/*
+ * Objects of a runtime frozen by lisp_runtime_freeze(). They are shared with
+ * the runtimes spawned from it, so are never traced, swept or written.
+ */
+#define LISP_GEN_FROZEN 'f'
+
+/* Default for lisp_enable_auto_gc(), in objects allocated. */
+#define LISP_GC_DEFAULT_THRESHOLD 100000
+
+/* Objects swept by each allocation while an incremental sweep is pending. */
+#define LISP_SWEEP_PER_ALLOC 4
+
+/*
+ * Write barrier: must be used whenever a reference to @a value is stored into
+ * an object @a holder which may already have been promoted.
+ */
+#define lisp_write_barrier(holder, value)                             \
+	do {                                                          \
+		if ((holder)->gen == LISP_GEN_OLD &&                  \
+		    !lisp_fixnum_p(value) &&                          \
+		    (value)->gen == LISP_GEN_YOUNG)                   \
+			(value)->gen = LISP_GEN_REMEMBERED;           \
+	} while (0)
+
+/*
+ * Small integers ("fixnums") are stored in the lisp_value pointer itself,
+ * shifted left by one with the low bit set. Objects are always aligned, so no
+ * real pointer has that bit. A fixnum has no header, so code which may be
+ * handed any value must use lisp_type_of() rather than reading ->type.
+ * Integers outside the fixnum range are allocated as usual.
+ */
+#define LISP_FIXNUM_MIN (LONG_MIN / 2)
+#define LISP_FIXNUM_MAX (LONG_MAX / 2)
+#define lisp_fixnum_p(v) ((unsigned long) (v) & 1UL)
+#define lisp_fixnum_fits(n) ((n) >= LISP_FIXNUM_MIN && (n) <= LISP_FIXNUM_MAX)
+#define lisp_fixnum_new(n) ((lisp_value *) (((unsigned long) (n) << 1) | 1UL))
+#define lisp_fixnum_get(v) ((long) ((unsigned long) (v) & ~1UL) / 2)
+#define lisp_type_of(v) (lisp_fixnum_p(v) ? type_integer : (v)->type)
 
 /*
  * WARNING - if you change this, you must update "TYPE_HEADER" in types.c.
  */
 #define LISP_VALUE_HEAD                 \
 	struct lisp_type  *type;        \
-	struct lisp_value *next;        \
-	char mark                       \
+	char gen;                       \
+	unsigned char pool              \
 
 #define lisp_for_each(list) \
-	for (; list->type == type_list && !lisp_nil_p((lisp_value *) list); list = (lisp_list*) list->right)
+	for (; lisp_type_of(list) == type_list && !lisp_nil_p((lisp_value *) list); list = (lisp_list*) list->right)
 
 
 /*
@@ -39,13 +85,113 @@ struct lisp_value {
 	LISP_VALUE_HEAD;
 };
 
+/*
+ * Objects are allocated from pages of LISP_PAGE_SIZE bytes, each of which is
+ * dedicated to one size class. Size classes are multiples of LISP_CLASS_GRAIN,
+ * up to LISP_MAX_POOLED. Pages are aligned to their size, and are obtained
+ * from the system LISP_CHUNK_PAGES at a time. See alloc.c.
+ */
+#define LISP_PAGE_SIZE 16384
+#define LISP_CHUNK_PAGES 16
+#define LISP_CLASS_GRAIN 16
+#define LISP_NCLASSES 8
+#define LISP_MAX_POOLED (LISP_NCLASSES * LISP_CLASS_GRAIN)
+
+/* Value of the "pool" header field for objects which came from malloc() */
+#define LISP_POOL_NONE 0xFF
+/* Value of the "pool" header field for statically allocated objects (types) */
+#define LISP_POOL_STATIC 0xFE
+
+/*
+ * Side bitmaps hold one bit per grain of a page, and an object is represented
+ * by the bit of its first grain.
+ */
+#define LISP_ULONG_BITS (CHAR_BIT * sizeof(unsigned long))
+#define LISP_BITMAP_WORDS (LISP_PAGE_SIZE / LISP_CLASS_GRAIN / LISP_ULONG_BITS)
+
+#define lisp_bit_get(map, i) (((map)[(i) / LISP_ULONG_BITS] >> ((i) % LISP_ULONG_BITS)) & 1UL)
+#define lisp_bit_set(map, i) ((map)[(i) / LISP_ULONG_BITS] |= 1UL << ((i) % LISP_ULONG_BITS))
+#define lisp_bit_clear(map, i) ((map)[(i) / LISP_ULONG_BITS] &= ~(1UL << ((i) % LISP_ULONG_BITS)))
+
+struct lisp_page {
+	struct lisp_page *next;
+	struct lisp_page *prev; /* only maintained for single object pages */
+	int cls;
+	/* the pool whose objects these are */
+	struct lisp_pool *owner;
+	/* size of the object of a single object page */
+	size_t size;
+	/* set for every allocated object */
+	unsigned long live[LISP_BITMAP_WORDS];
+	/* set for every object found reachable by the garbage collector */
+	unsigned long mark[LISP_BITMAP_WORDS];
+};
+
+/*
+ * Objects start this far into their page. Objects which came from malloc()
+ * live at this offset within a single object page of their own, so that they
+ * have bitmaps too.
+ */
+#define LISP_PAGE_HEADER \
+	((sizeof(struct lisp_page) + LISP_CLASS_GRAIN - 1) / LISP_CLASS_GRAIN * LISP_CLASS_GRAIN)
+
+#define lisp_page_of(v)                                                       \
+	((v)->pool == LISP_POOL_NONE ?                                        \
+		(struct lisp_page *) ((char *) (v) - LISP_PAGE_HEADER) :     \
+		(struct lisp_page *) ((unsigned long) (v) &                   \
+			~(unsigned long) (LISP_PAGE_SIZE - 1)))
+#define lisp_bit_of(page, v) \
+	((unsigned long) ((char *) (v) - (char *) (page)) / LISP_CLASS_GRAIN)
+/* the runtime whose pool @a v, which is not a fixnum, was allocated from */
+#define lisp_runtime_of(v) \
+	((lisp_runtime *) ((char *) lisp_page_of(v)->owner - \
+		offsetof(struct lisp_runtime, pool)))
+/* is @a v an object of the pool of @a rt? */
+#define lisp_owned(rt, v)                                                     \
+	(!lisp_fixnum_p(v) && (v)->pool != LISP_POOL_STATIC &&                \
+	 lisp_page_of(v)->owner == &(rt)->pool)
+
+struct lisp_chunk {
+	void *mem;   /* as returned by malloc() */
+	char *start; /* first page */
+};
+
+struct lisp_pool {
+	/* pages handed out to size classes */
+	struct lisp_page *pages;
+	/* single object pages, for objects from malloc() */
+	struct lisp_page *big;
+	/* per-class list of freed objects */
+	void *free[LISP_NCLASSES];
+	/* per-class region of the newest page which has never been used */
+	char *bump[LISP_NCLASSES];
+	char *bump_end[LISP_NCLASSES];
+	/* when zero, new objects come from malloc() */
+	int enabled;
+	/* chunks sorted by address, and the single object pages likewise, so
+	 * that the garbage collector can tell whether a word points into an
+	 * object. The pages are sorted again by the first lookup after one is
+	 * allocated or freed. */
+	struct lisp_chunk *chunks;
+	unsigned int nchunks;
+	unsigned int chunks_size;
+	struct lisp_page **unpooled;
+	unsigned long nunpooled;
+	unsigned long unpooled_size;
+	int unpooled_stale;
+	/* pages of the newest chunk which are yet to be handed out */
+	char *chunk_next;
+	char *chunk_end;
+	/* total size of the allocated objects */
+	unsigned long bytes;
+};
+
 /* A lisp_runtime is NOT a lisp_value! */
 struct lisp_runtime {
-	/* Maintains a list of all lisp values allocated with this runtime, so
-	 * that we can do garbage collection with mark-and-sweep.
+	/* Every lisp value allocated with this runtime lives in the pool's
+	 * pages, so that we can do garbage collection with mark-and-sweep.
 	 */
-	lisp_value *head;
-	lisp_value *tail;
+	struct lisp_pool pool;
 
 	/* This is used as a stack/queue for traversing objects during garbage
 	 * collection. It's allocated ahead of time to try to avoid allocating
@@ -54,6 +200,45 @@ struct lisp_runtime {
 	struct ringbuf rb;
 	int has_marked;
 
+	/* Generational state. The young objects are listed in allocation
+	 * order. The counts drive the choice between minor and major
+	 * collections, and are in objects. */
+	lisp_value **young;
+	unsigned long nyoung;
+	unsigned long young_size;
+	unsigned long old_count;
+	unsigned long old_after_major;
+	int gen_enabled;
+	int major_requested;
+	int gc_major; /* is the current collection major? */
+
+	/* Incremental sweeping. A sweep first goes over young[sweep_read] up
+	 * to young[sweep_end], compacting survivors to young[sweep_write].
+	 * Then a major sweep goes over every page, starting at sweep_page.
+	 * Objects from young[sweep_new] onward were allocated during a major
+	 * sweep. */
+	int sweeping;
+	unsigned long sweep_read;
+	unsigned long sweep_write;
+	unsigned long sweep_end;
+	unsigned long sweep_new;
+	struct lisp_page *sweep_page;
+	int sweep_big; /* is sweep_page in the list of single object pages? */
+	int sweep_budget;
+	int sweep_promote;
+
+	/* Automatic collection. While code is being evaluated, stack_base
+	 * points into the frame of the outermost call into the interpreter,
+	 * and entry_roots holds that call's arguments. Collections happen
+	 * in lisp_new() once gc_allocs reaches gc_trigger. */
+	void *stack_base;
+	lisp_value *entry_roots[3];
+	unsigned long gc_threshold; /* zero when disabled */
+	unsigned long gc_trigger;
+	unsigned long gc_allocs;
+	/* values registered with lisp_pin() */
+	lisp_list *pins;
+
 	/* Nil is used so much that we keep a global instance and don't bother
 	 * ever freeing it. */
 	lisp_value *nil;
@@ -61,8 +246,8 @@ struct lisp_runtime {
 	/* Some data the user may want to keep track of. */
 	void *user;
 
-	/* Data we use for reporting errors. This is very single-threaded of me,
-	 * but it works for now.
+	/* Data we use for reporting errors. Each runtime has its own, so that
+	 * runtimes on different threads do not share it.
 	 * REQUIREMENTS:
 	 *   - error and err_num must both always be non-NULL and non-0
 	 *     respectively when an error occurs
@@ -74,25 +259,131 @@ struct lisp_runtime {
 	char *error;
 	enum lisp_errno err_num;
 	unsigned int error_line;
-	lisp_list *error_stack;
-
-	/* Maintain a stack as we go, can dump it at any time if we want. */
-	lisp_list *stack;
+	lisp_value **error_stack;
+	unsigned int error_depth;
+	unsigned int error_size;
+
+	/* Maintain a stack as we go, can dump it at any time if we want. It is
+	 * an array of the callee of each call, with the most recent last, and
+	 * it grows as needed (see lisp_stack_push()). */
+	lisp_value **stack;
 	unsigned int stack_depth;
+	unsigned int stack_size;
 
-	/* Maintain cache of lisp_symbol */
-	struct hashtable *symcache;
+	/* Every symbol is interned in this table, so that symbols can be
+	 * compared by pointer. Its entries are weak: lisp_gc_sweep() removes
+	 * the symbols which marking did not reach. */
+	struct ptable *symcache;
 	/* Maintain cache of lisp_string */
-	struct hashtable *strcache;
+	struct ptable *strcache;
+	/* Slices which still share the text of another string. Reading one
+	 * with lisp_string_get() may copy it, so lisp_parallel() copies them
+	 * all before workers read them. */
+	unsigned long slices;
 	/* Maintain builtin module list */
 	lisp_scope *modules;
+	/* Directory of images of imported files (image.c), or NULL */
+	char *module_cache;
+
+	/* Templates. A frozen runtime's objects are shared, read only, by the
+	 * runtimes spawned from it, whose parent it is. Those look up symbols
+	 * in the parent's symcache before their own, and their modules scope
+	 * continues in the parent's. */
+	struct lisp_runtime *parent;
+	int frozen;
+	lisp_scope *frozen_scope;
+
+	/* Parallel evaluation (threads.c). pmap and preduce use up to
+	 * nthreads threads, including the calling one: those of the pool,
+	 * which is started when first needed, and NULL until then. */
+	int nthreads;
+	struct lisp_threads *threads;
+
+	/* Limits (limits.c). Each call counts poll_countdown down, and the
+	 * call which takes it to zero runs lisp_poll(), so that checking the
+	 * limits costs a decrement per call. The countdown started from
+	 * poll_period, which is never more than the fuel left, plus one. */
+	long poll_countdown;
+	long poll_period;
+	int fuel_enabled;
+	unsigned long fuel;
+	double deadline; /* in seconds of the monotonic clock, or zero */
+	unsigned int max_depth;
+	unsigned long max_heap;
+	int heap_over; /* allocation went past max_heap, even after collecting */
+	lisp_yield_func yield;
+	void *yield_arg;
+
+	/* Profiling (profile.c). While profiling is set, every call polls, so
+	 * that lisp_poll() can pass it to lisp_profile_call(). The profile is
+	 * kept after profiling stops, until it is restarted or freed. */
+	int profiling;
+	struct lisp_profile *profile;
+
+	/* Bytecode VM (vm.c). While vm is set, lambda bodies are compiled and
+	 * run on this value stack, whose first vm_sp entries are in use. Both
+	 * evaluators also pass evaluated arguments to calls on it. Binding the
+	 * name of a special form which the compiler specializes to anything
+	 * but its builtin increments forms_version, and code compiled before
+	 * then evaluates those forms with the tree walker. */
+	int vm;
+	lisp_value **vm_stack;
+	unsigned long vm_sp;
+	unsigned long vm_size;
+	unsigned long forms_version;
+
+	/* Macro expansions (types.c). While this is set, the expansion of each
+	 * macro call is kept, keyed by the argument list of the call, with the
+	 * macro that produced it: a list (macro . expansion). The keys are
+	 * weak, and the garbage collector removes those it did not reach. */
+	struct ptable *expansions;
+
+	/* Optimizer (builtins.c). While optimize is set, lambda bodies are
+	 * optimized as they are resolved. Binding a name of a core builtin in
+	 * a scope which inlined code looked through increments
+	 * builtins_version, which turns the lisp_inline objects made before
+	 * back into the code they replaced. */
+	int optimize;
+	unsigned long builtins_version;
+
+	/* Statistics (gc.c, textcache.c): the totals of lisp_get_stats(),
+	 * which fills in the rest. The count of allocations lags behind by
+	 * gc_allocs, to keep it off the path of allocation. They come last,
+	 * out of the way of the fields which evaluation uses. */
+	struct lisp_stats stats;
 };
 
+/* Argument slots which a lambda frame holds without a separate allocation. */
+#define LISP_FRAME_INLINE 4
+/* Bindings which a scope holds before it needs a hash table, chosen so that a
+ * scope still fits in the largest size class of the pool. */
+#define LISP_SCOPE_SMALL 3
+
 /* The below ARE lisp_values! */
 struct lisp_scope {
 	LISP_VALUE_HEAD;
-	struct hashtable scope;
+	/* these fill the padding of the header */
+	unsigned char nsmall;
+	/* set once inlined code looked through this scope for a builtin, so
+	 * that binding a core builtin's name here must undo it */
+	unsigned char inlined;
+	int nslots;
+	/*
+	 * Names bound by define and let live in the small arrays, which are
+	 * searched linearly, until there are more than LISP_SCOPE_SMALL. Then
+	 * they all move to the table, which is NULL until then.
+	 */
+	struct ptable *table;
 	struct lisp_scope *up;
+	/*
+	 * Lambda frames hold their arguments in an array of slots, which are
+	 * named by the lambda's argument list. For other scopes, slots is NULL.
+	 */
+	lisp_list *names;
+	lisp_value **slots;
+	lisp_value *inline_slots[LISP_FRAME_INLINE];
+	lisp_symbol *small_names[LISP_SCOPE_SMALL];
+	lisp_value *small_values[LISP_SCOPE_SMALL];
 };
 
 struct lisp_list {
@@ -101,6 +392,53 @@ struct lisp_list {
 	lisp_value *right;
 };
 
+/*
+ * The items of a vector are in an array of their own, with room for @a size,
+ * which grows by doubling as items are pushed.
+ */
+struct lisp_vector {
+	LISP_VALUE_HEAD;
+	unsigned long len;
+	unsigned long size;
+	lisp_value **items;
+};
+
+/*
+ * Keys of a hash map are hashed with lisp_hash() and compared with
+ * lisp_compare(), so a key which is changed after it was inserted may not be
+ * found again.
+ */
+struct lisp_hashmap {
+	LISP_VALUE_HEAD;
+	struct ptable table;
+};
+
+/*
+ * A sequence is a pipeline of stages, each of which pulls the items of the one
+ * before it, @a upstream, one at a time (see lisp_sequence_pull()). No stage
+ * holds more than the item passing through it. The first stage is a source,
+ * whose iterator @a it yields the items of @a holder, or those a host function
+ * produces. A source iterator which stops because of an error sets its
+ * state_int to -1.
+ */
+enum lisp_seq_kind {
+	LISP_SEQ_SOURCE,
+	LISP_SEQ_MAP,
+	LISP_SEQ_FILTER,
+	LISP_SEQ_TAKE
+};
+
+struct lisp_sequence {
+	LISP_VALUE_HEAD;
+	enum lisp_seq_kind kind;
+	int done; /* ended, and the iterator of a source is closed */
+	struct lisp_sequence *upstream;
+	lisp_value *fn;          /* map and filter: the callable */
+	unsigned long remaining; /* take: items still to pass */
+	struct iterator it;      /* source */
+	lisp_value *holder;      /* source: what the iterator walks, or NULL */
+};
+
 /*
  * WARNING - any changes to this structure requires updating the initializers in
  * src/types.c.
@@ -115,22 +453,61 @@ struct lisp_type {
 	lisp_value * (*eval)(lisp_runtime *rt, lisp_scope *scope, lisp_value *value);
 	lisp_value * (*call)(lisp_runtime *rt, lisp_scope *scope, lisp_value *callable, lisp_list *arg);
 	int (*compare)(lisp_value *self, lisp_value *other);
+	/* objects which compare equal must have equal hashes */
+	unsigned int (*hash)(lisp_value *self);
 };
 
 struct lisp_text {
 	LISP_VALUE_HEAD;
 	char can_free;
+	char core; /* symbols: names a builtin which the optimizer inlines */
+	char form; /* symbols: names a form which the bytecode compiler
+	              specializes */
+	unsigned int hash; /* of s, computed when the text is created */
 	char *s;
+	unsigned long len; /* s[len] is the NUL, except in slices */
+	struct lisp_text *base; /* the string a slice shares s with, or NULL */
 };
 
+/*
+ * Short text is stored in the object itself, following the struct, as long as
+ * the object still fits in the pool.
+ */
+#define LISP_TEXT_INLINE (LISP_MAX_POOLED - sizeof(struct lisp_text))
+
+/*
+ * Bignum digits are half as wide as an unsigned long, so that arithmetic on two
+ * of them, with a carry, fits in one: C89 has no wider type. A long is then
+ * exactly two digits.
+ */
+#if ULONG_MAX > 0xFFFFFFFFUL
+typedef unsigned int lisp_digit;
+#define LISP_DIGIT_BITS 32
+#else
+typedef unsigned short lisp_digit;
+#define LISP_DIGIT_BITS 16
+#endif
+#define LISP_DIGIT_MASK ((1UL << LISP_DIGIT_BITS) - 1)
+
+/*
+ * Integers outside the fixnum range are allocated. One which fits in a long
+ * holds its value in x, and has no digits. Larger ones are bignums: their
+ * magnitude is in n base 2^LISP_DIGIT_BITS digits, least significant first,
+ * which follow the struct, and sign is 1 or -1. An integer always takes the
+ * smallest of these forms it fits, so two of different forms are never equal.
+ */
 struct lisp_integer {
 	LISP_VALUE_HEAD;
-	int x;
+	long x;
+	int sign;
+	int n;
+	lisp_digit *digits;
 };
 
 struct lisp_builtin {
 	LISP_VALUE_HEAD;
 	lisp_builtin_func call;
+	lisp_builtin_argv_func argv_call;
 	char *name;
 	void *user;
 	int evald;
@@ -143,8 +520,58 @@ struct lisp_lambda {
 	lisp_scope *closure;
 	lisp_symbol *first_binding;
 	int lambda_type;
+	int nargs;
+	/* the body compiled for the bytecode VM, once it has been called */
+	struct lisp_code *compiled;
+};
+
+/*
+ * A reference to an argument of a lambda, resolved when the lambda was created
+ * (see lisp_resolve_body()). It finds the frame by walking up @a depth scopes
+ * from the scope it is evaluated in.
+ */
+struct lisp_local {
+	LISP_VALUE_HEAD;
+	lisp_symbol *sym;
+	int depth;
+	int slot;
+};
+
+typedef struct lisp_local lisp_local;
+
+/*
+ * Code replaced by the optimizer (see lisp_resolve_body()): a reference to a
+ * core builtin, or a call of one which was folded into its result. It
+ * evaluates to @a value while the runtime's builtins_version is still
+ * @a version, and like @a expr, the code it replaced, once it is not.
+ */
+struct lisp_inline {
+	LISP_VALUE_HEAD;
+	lisp_value *value;
+	lisp_value *expr;
+	unsigned long version;
 };
 
+typedef struct lisp_inline lisp_inline;
+
+/*
+ * A lambda body compiled to bytecode (see vm.c). Operands are stored inline in
+ * the ops array, and refer to values by their index in the consts array.
+ */
+struct lisp_code {
+	LISP_VALUE_HEAD;
+	int *ops;
+	int nops;
+	int ops_size;
+	lisp_value **consts;
+	int nconsts;
+	int consts_size;
+	int maxstack; /* value stack entries used at once */
+	unsigned long version; /* forms_version when it was compiled */
+};
+
+typedef struct lisp_code lisp_code;
+
 struct lisp_module {
 	LISP_VALUE_HEAD;
 	lisp_scope *contents;
@@ -174,13 +601,222 @@ lisp_list *lisp_map(lisp_runtime *rt, lisp_scope *scope, void *user, lisp_mapper
 #define TP_LAMBDA 0
 #define TP_MACRO  1
 
+extern lisp_type *type_local;
+extern lisp_type *type_inline;
+extern lisp_type *type_code;
+
+/*
+ * Forms which the resolver and the bytecode compiler treat specially. The kind
+ * of a form is determined by looking up its head, see lisp_classify() in
+ * builtins.c. A NULL @a level classifies code which has been resolved already.
+ */
+enum lisp_form {
+	FORM_CALL,   /* evaluates all its elements in the current scope */
+	FORM_QUOTE,  /* contains data, not code */
+	FORM_QUASIQUOTE,
+	FORM_OPAQUE, /* a macro or unknown special form */
+	FORM_EVAL,
+	FORM_LAMBDA,
+	FORM_MACRO,
+	FORM_LET,
+	FORM_DEFINE,
+	FORM_IMPORT,
+	FORM_IF,     /* if, progn and cond evaluate their elements as CALL does */
+	FORM_PROGN,
+	FORM_COND
+};
+
+struct lisp_level;
+enum lisp_form lisp_classify(lisp_scope *scope, struct lisp_level *level,
+                             lisp_value *head);
+
+/*
+ * Lexical addressing (builtins.c). Returns a copy of the lambda body @a code
+ * in which references to @a args, and to arguments of lambdas nested within
+ * it, are replaced by lisp_local objects. Nested lambda forms are replaced by
+ * lambdas without a closure, which evaluate to a closure over their scope.
+ * With the optimizer enabled, references to core builtins which nothing in the
+ * body can shadow become lisp_inline objects, and so do calls of arithmetic
+ * and comparison builtins on constants, folded into their result.
+ */
+lisp_list *lisp_resolve_body(lisp_runtime *rt, lisp_scope *scope,
+                             lisp_list *args, lisp_list *code);
+
+/*
+ * Tail positions (builtins.c). These do the work of a special form, except for
+ * evaluating its final expression. They return LISP_TAIL_EXPR when that
+ * expression, stored in @a expr, must still be evaluated in @a scope, or
+ * LISP_TAIL_DONE when @a expr holds the result (NULL on error).
+ * lisp_builtin_tail() returns LISP_TAIL_NONE for builtins which are not such a
+ * special form.
+ */
+#define LISP_TAIL_NONE 0
+#define LISP_TAIL_EXPR 1
+#define LISP_TAIL_DONE 2
+int lisp_tail_progn(lisp_runtime *rt, lisp_scope *scope, lisp_list *body,
+                    lisp_value **expr);
+int lisp_builtin_tail(lisp_runtime *rt, lisp_builtin *builtin,
+                      lisp_scope **scope, lisp_list *args, lisp_value **expr);
+
+/* Create the scope for a call to @a lambda, with a slot for each argument. */
+lisp_scope *lisp_frame_new(lisp_runtime *rt, lisp_lambda *lambda);
+
+/*
+ * Limits (limits.c). Every call, including a tail call, must pass
+ * lisp_poll_check(), which is false with an error raised when a limit has been
+ * reached. lisp_poll_soon() makes the next call check the limits.
+ */
+int lisp_poll(lisp_runtime *rt, lisp_value *callee);
+void lisp_poll_soon(lisp_runtime *rt);
+
+/*
+ * Allocation calls lisp_heap_exceeded() when the heap is past its limit, and
+ * it marks the heap as over if collecting garbage doesn't help. Loops which
+ * allocate without making calls test lisp_heap_ok() as they go, which is
+ * false with ::LE_LIMIT raised while the heap is still over. Builtins about to
+ * allocate a large block test lisp_heap_check() with its size beforehand.
+ */
+void lisp_heap_exceeded(lisp_runtime *rt);
+int lisp_heap_check(lisp_runtime *rt, unsigned long bytes);
+#define lisp_heap_ok(rt) (!(rt)->heap_over || lisp_heap_check(rt, 0))
+void lisp_limits_init(lisp_runtime *rt);
+double lisp_now(void);
+#define lisp_poll_check(rt, callee) \
+	(--(rt)->poll_countdown > 0 || lisp_poll(rt, (lisp_value *) (callee)))
+
+/*
+ * Profiling (profile.c). lisp_profile_call() counts a call about to be made,
+ * and lisp_profile_return() sees one about to return. Both may sample the stack
+ * beforehand, which has been the same since the previous call or return.
+ */
+void lisp_profile_call(lisp_runtime *rt, lisp_value *callee);
+void lisp_profile_return(lisp_runtime *rt);
+void lisp_profile_free(lisp_runtime *rt);
+
+/*
+ * The stack of calls in progress, kept for stack traces. Pushing a frame
+ * doesn't allocate a lisp_value, so calls create no garbage. lisp_stack_push()
+ * passes lisp_poll_check() too, and is false with an error raised when a limit
+ * stops the call, including the maximum depth of the stack.
+ */
+int lisp_stack_grow(lisp_runtime *rt);
+#define lisp_stack_push(rt, callee)                                          \
+	(lisp_poll_check(rt, callee) &&                                      \
+	 ((rt)->stack_depth < (rt)->stack_size || lisp_stack_grow(rt)) &&    \
+	 ((rt)->stack[(rt)->stack_depth++] = (lisp_value *) (callee), 1))
+#define lisp_stack_pop(rt)                                                   \
+	((rt)->profiling ? lisp_profile_return(rt) : (void) 0,               \
+	 (rt)->stack_depth--)
+#define lisp_stack_top(rt) ((rt)->stack[(rt)->stack_depth - 1])
+
+/*
+ * Calls with evaluated arguments (types.c). The callee is pushed onto the value
+ * stack, followed by its @a n arguments. lisp_apply_values() calls it, and pops
+ * the callee and arguments. lisp_call_values() does the same within a new stack
+ * frame, like lisp_call(). Only builtins created with lisp_builtin_new() need
+ * a list of their arguments. Callees which take their arguments unevaluated
+ * are given a list of them, quoted. lisp_frame_values() creates the frame for
+ * a lambda called this way, and pops its callee and arguments too.
+ */
+void lisp_values_reserve(lisp_runtime *rt, unsigned long n);
+void lisp_values_push(lisp_runtime *rt, lisp_value *value);
+lisp_value *lisp_apply_values(lisp_runtime *rt, lisp_scope *scope, int n);
+lisp_value *lisp_call_values(lisp_runtime *rt, lisp_scope *scope, int n);
+lisp_scope *lisp_frame_values(lisp_runtime *rt, lisp_lambda *lambda, int n);
+
+/*
+ * Bytecode VM (vm.c). lisp_vm_run_body() runs the body of @a lambda in its
+ * @a frame, compiling it first if necessary, and lisp_vm_compile() compiles it
+ * without running it. lisp_vm_eval() compiles and runs a single expression.
+ */
+void lisp_vm_compile(lisp_runtime *rt, lisp_lambda *lambda);
+lisp_value *lisp_vm_run_body(lisp_runtime *rt, lisp_lambda *lambda,
+                             lisp_scope *frame);
+lisp_value *lisp_vm_eval(lisp_runtime *rt, lisp_scope *scope,
+                         lisp_value *value);
+
+/* Like lisp_scope_lookup(), but returns NULL rather than raising an error. */
+lisp_value *lisp_scope_find(lisp_scope *scope, lisp_symbol *symbol);
+/* Like lisp_scope_find(), but does not search the scopes above this one. */
+lisp_value *lisp_scope_find_local(lisp_scope *scope, lisp_symbol *symbol);
+int lisp_symbol_eq(lisp_symbol *left, lisp_symbol *right);
+
 /* Interpreter stuff */
 void lisp_init(lisp_runtime *rt);
+/* Initialize @a rt to share the objects of @a parent, which is frozen. */
+void lisp_init_spawned(lisp_runtime *rt, lisp_runtime *parent);
 void lisp_destroy(lisp_runtime *rt);
 
+/*
+ * Parallel evaluation (threads.c). lisp_parallel() calls @a callable on each
+ * group of @a nargs consecutive items, @a ncalls times, spread over the pool's
+ * threads. It returns a list of the results in order, in the heap of @a rt.
+ * When @a reduce is set, the items are instead split into runs which are each
+ * folded with @a callable, and the list holds the result of each run, for the
+ * caller to fold in turn.
+ */
+lisp_value *lisp_parallel(lisp_runtime *rt, lisp_scope *scope,
+                          lisp_value *callable, lisp_value **items,
+                          int nargs, unsigned long ncalls, int reduce);
+int lisp_threads_default(void);
+void lisp_threads_stop(lisp_runtime *rt);
+/* Fuel, the yield hook and the profile account for the calls of one thread. */
+#define lisp_parallel_ok(rt) \
+	((rt)->nthreads > 1 && !(rt)->fuel_enabled && !(rt)->yield && \
+	 !(rt)->profiling)
+
 /* Shortcuts for type operations. */
 void lisp_free(lisp_runtime *rt, lisp_value *value);
 lisp_value *lisp_new(lisp_runtime *rt, lisp_type *typ);
+/* A hash of @a v, equal for values which lisp_compare() finds equal. */
+unsigned int lisp_hash(lisp_value *v);
+
+/*
+ * Garbage collector internals (gc.c). lisp_gc_retain() keeps an object which
+ * is pending sweep alive, for caches which hand out existing objects.
+ * lisp_gc_unshare_slices() gives every slice of the heap its own text, so
+ * that other threads may read them.
+ */
+void lisp_gc_finish_sweep(lisp_runtime *rt);
+void lisp_gc_retain(lisp_runtime *rt, lisp_value *v);
+void lisp_gc_collect(lisp_runtime *rt);
+void lisp_gc_add_young(lisp_runtime *rt, lisp_value *v);
+void lisp_gc_unshare_slices(lisp_runtime *rt);
+
+/*
+ * Public functions which evaluate code must call lisp_gc_enter() before doing
+ * anything else, and if it returned true, lisp_gc_leave() before returning.
+ * For the outermost such call, this records where the stack scan must stop,
+ * and roots the arguments (which may be NULL). Any other objects the function
+ * uses must be held by the frames of functions it calls.
+ */
+#define lisp_gc_enter(rt, base, a, b, c) \
+	(!(rt)->stack_base && lisp_gc_enter_outer(rt, base, \
+		(lisp_value *) (a), (lisp_value *) (b), (lisp_value *) (c)))
+int lisp_gc_enter_outer(lisp_runtime *rt, void *base, lisp_value *a,
+                        lisp_value *b, lisp_value *c);
+void lisp_gc_leave(lisp_runtime *rt);
+
+/*
+ * Object memory management (alloc.c). Type "new" methods obtain their memory
+ * from lisp_alloc(), and type "free" methods return it with lisp_dealloc().
+ * lisp_alloc_size() is the memory an object takes, as counted in pool.bytes.
+ *
+ * Memory which objects keep outside of the pool, such as the items of a vector
+ * and the table of a hash map, is counted in pool.bytes too, so that the heap
+ * limit covers it: lisp_storage_account() records that such storage changed
+ * size from @a old to @a size bytes. lisp_storage_size() is how much an object
+ * keeps.
+ */
+void lisp_pool_init(struct lisp_pool *pool);
+void lisp_pool_destroy(struct lisp_pool *pool);
+lisp_value *lisp_alloc(lisp_runtime *rt, size_t size);
+void lisp_dealloc(lisp_runtime *rt, lisp_value *v);
+lisp_value *lisp_alloc_find(lisp_runtime *rt, void *ptr);
+unsigned long lisp_alloc_size(lisp_value *v);
+void lisp_storage_account(lisp_runtime *rt, unsigned long old,
+                          unsigned long size);
+unsigned long lisp_storage_size(lisp_value *v);
 
 lisp_list *lisp_quote_with(lisp_runtime *rt, lisp_value *value, char *sym);
 
@@ -192,11 +828,92 @@ int lisp_is_bad_list_of_lists(lisp_list *l);
 unsigned int lisp_text_hash(void *t);
 int lisp_text_compare(void *left, void *right);
 
-void lisp_textcache_remove(struct hashtable *cache, struct lisp_text *t);
+/* Allocate a bignum with room for @a n digits, which the caller fills in. */
+lisp_integer *lisp_integer_alloc(lisp_runtime *rt, int n);
+
+/*
+ * Integer arithmetic (bignum.c), on integers of any form. Results are only
+ * allocated when they are outside the fixnum range, and the common case of
+ * two fixnums is handled before anything else. lisp_integer_div() truncates
+ * towards zero, like C, and its divisor must not be zero.
+ */
+lisp_integer *lisp_integer_add(lisp_runtime *rt, lisp_integer *a,
+                               lisp_integer *b);
+lisp_integer *lisp_integer_sub(lisp_runtime *rt, lisp_integer *a,
+                               lisp_integer *b);
+lisp_integer *lisp_integer_mul(lisp_runtime *rt, lisp_integer *a,
+                               lisp_integer *b);
+lisp_integer *lisp_integer_div(lisp_runtime *rt, lisp_integer *a,
+                               lisp_integer *b);
+/* Return -1, 0 or 1 as @a a is less than, equal to, or greater than @a b. */
+int lisp_integer_cmp(lisp_integer *a, lisp_integer *b);
+/* Parse @a len decimal digits. */
+lisp_integer *lisp_integer_parse(lisp_runtime *rt, const char *s, int len);
+void lisp_integer_print(FILE *f, lisp_integer *v);
+unsigned int lisp_integer_hash(lisp_integer *v);
+
+/*
+ * The magnitude and sign of an integer of any form, as lisp_digits, least
+ * significant first. Those of an integer which is not a bignum are kept in
+ * small. Zero has no digits, and a sign of 1.
+ */
+struct lisp_digits {
+	int sign;
+	int n;
+	lisp_digit *d;
+	lisp_digit small[2];
+};
+
+void lisp_integer_digits(lisp_integer *v, struct lisp_digits *out);
+/* The integer of a sign and magnitude, which need not be normalized. */
+lisp_integer *lisp_integer_from_digits(lisp_runtime *rt, int sign,
+                                       const lisp_digit *d, int n);
+
+/* Allocate a text object with @a extra bytes of inline storage after it. */
+struct lisp_text *lisp_text_alloc(lisp_runtime *rt, lisp_type *typ,
+                                  unsigned long extra);
+struct ptable *lisp_textcache_create(void);
+void lisp_textcache_remove(struct ptable *cache, struct lisp_text *t);
+/* Give a slice its own copy of the text it shares. */
+void lisp_string_unshare(lisp_string *s);
+/* As lisp_string_new_len(), but for symbols. */
+lisp_symbol *lisp_symbol_new_len(lisp_runtime *rt, char *sym,
+                                 unsigned long len, int flags);
+/* Return the interned symbol named @a name, or NULL if there is none. */
+lisp_symbol *lisp_symbol_find(lisp_runtime *rt, char *name);
 
 int lisp_truthy(lisp_value *v);
 
+/*
+ * Objects of other runtimes, including the frozen template of this one, may
+ * only be read. Returns 0 with an error set for them.
+ */
+int lisp_writable(lisp_runtime *rt, lisp_value *v);
+
+/*
+ * Sequences (util.c). lisp_sequence_of() returns a sequence unchanged, and
+ * makes a source of the items of a list or vector. lisp_sequence_of_iterator()
+ * makes a source of an iterator of values, which it takes ownership of.
+ * lisp_sequence_stage() adds a map, filter or take stage after @a upstream.
+ * lisp_sequence_pull() is lisp_sequence_next() without the lisp_gc_enter().
+ */
+lisp_sequence *lisp_sequence_of(lisp_runtime *rt, lisp_value *v);
+lisp_sequence *lisp_sequence_of_iterator(lisp_runtime *rt, struct iterator it,
+                                         lisp_value *holder);
+lisp_sequence *lisp_sequence_range(lisp_runtime *rt, long start, long end);
+lisp_sequence *lisp_sequence_stage(lisp_runtime *rt, enum lisp_seq_kind kind,
+                                   lisp_sequence *upstream, lisp_value *fn,
+                                   unsigned long remaining);
+int lisp_sequence_pull(lisp_runtime *rt, lisp_scope *scope, lisp_sequence *s,
+                       lisp_value **item);
+
 lisp_module *create_os_module(lisp_runtime *rt);
 lisp_module *lisp_lookup_module(lisp_runtime *rt, lisp_symbol *name);
+/*
+ * Return the progn of the code in @a file, which is open at its beginning, read
+ * from the module cache when it holds a current image of the file, or parsed
+ * and stored in the cache otherwise.
+ */
+lisp_value *lisp_module_cache_load(lisp_runtime *rt, char *filename, FILE *file);
 
 #endif
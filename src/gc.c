@@ -1,61 +1,253 @@
 /*
- * gc.c: mark and sweep garbage collection for funlisp
+ * gc.c: generational mark and sweep garbage collection for funlisp
+ *
+ * Objects live in the pages of the runtime's pool (see alloc.c), whose headers
+ * hold bitmaps of allocated and of marked objects. Each object's header records
+ * its generation. Everything which has survived a collection is old, and the
+ * young objects are also kept in the rt->young array. A minor collection traces
+ * only young objects, treating old objects as reachable, and sweeps only the
+ * young array. To find young objects reachable only from old ones, stores into
+ * objects go through lisp_write_barrier(), which flags such young objects as
+ * remembered. A major collection traces the whole heap, and then sweeps every
+ * page by scanning its bitmaps.
+ *
+ * Sweeping may also be done incrementally, a bounded number of objects at a
+ * time. Garbage found by marking can never become reachable again, except by
+ * the string cache handing out an existing object, which it prevents with
+ * lisp_gc_retain(). Unreachable symbols are removed from the symbol table
+ * before the sweep begins. Objects allocated while a major sweep is pending are
+ * marked immediately, so that the sweep will not free them.
+ *
+ * When enabled, collections also happen automatically during evaluation. The
+ * roots then include values held by C code in the interpreter, which we find
+ * by conservatively scanning the C stack. Since young objects which such code
+ * holds may be stored into without a write barrier (e.g. a list being built by
+ * lisp_map()), automatic collections never promote survivors.
  *
  * Stephen Brennan <stephen@brennan.io>
  */
 #include <assert.h>
+#include <setjmp.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "funlisp_internal.h"
 
-void lisp_init(lisp_runtime *rt)
+/* values of rt->sweeping */
+#define SWEEP_NONE 0
+#define SWEEP_YOUNG 1
+#define SWEEP_PAGES 2
+
+/* initialize the state which a runtime does not share with its template */
+static void lisp_init_state(lisp_runtime *rt)
 {
-	rt->nil = type_list->new(rt);
-	rt->nil->mark = 0;
-	rt->nil->type = type_list;
-	rt->nil->next = NULL;
-	rt->head = rt->nil;
-	rt->tail = rt->nil;
+	rt->has_marked = 0;
+	rt->young = NULL;
+	rt->nyoung = 0;
+	rt->young_size = 0;
+	rt->old_count = 0;
+	rt->old_after_major = 0;
+	rt->gen_enabled = 1;
+	rt->major_requested = 0;
+	rt->gc_major = 0;
+	rt->sweeping = SWEEP_NONE;
+	rt->sweep_budget = 0;
+	rt->sweep_promote = 1;
+	rt->stack_base = NULL;
+	rt->entry_roots[0] = NULL;
+	rt->entry_roots[1] = NULL;
+	rt->entry_roots[2] = NULL;
+	rt->gc_threshold = 0;
+	rt->gc_trigger = 0;
+	rt->gc_allocs = 0;
+	memset(&rt->stats, 0, sizeof(rt->stats));
 	rt->user = NULL;
 	rb_init(&rt->rb, sizeof(lisp_value*), 16);
 	rt->error= NULL;
 	rt->error_line = 0;
 	rt->error_stack = NULL;
-	rt->stack = (lisp_list *) rt->nil;
+	rt->error_depth = 0;
+	rt->error_size = 0;
+	rt->stack = NULL;
 	rt->stack_depth = 0;
-	rt->symcache = NULL;
+	rt->stack_size = 0;
+	rt->symcache = lisp_textcache_create();
 	rt->strcache = NULL;
+	rt->slices = 0;
+	rt->module_cache = NULL;
+	rt->parent = NULL;
+	rt->frozen = 0;
+	rt->frozen_scope = NULL;
+	rt->nthreads = 1;
+	rt->threads = NULL;
+	rt->profiling = 0;
+	rt->profile = NULL;
+	lisp_limits_init(rt);
+	rt->vm_stack = NULL;
+	rt->vm_sp = 0;
+	rt->vm_size = 0;
+	rt->forms_version = 0;
+	rt->expansions = NULL;
+	rt->optimize = 0;
+	rt->builtins_version = 0;
+}
+
+void lisp_init(lisp_runtime *rt)
+{
+	lisp_pool_init(&rt->pool);
+	/* the pool hides use-after-free from tools like valgrind */
+	if (getenv("FUNLISP_NOPOOL"))
+		lisp_disable_pool(rt);
+	lisp_init_state(rt);
+
+	rt->nil = type_list->new(rt);
+	rt->nil->gen = LISP_GEN_OLD;
+	rt->nil->type = type_list;
+	rt->pins = (lisp_list *) rt->nil;
 	rt->modules = lisp_new_empty_scope(rt);
+	rt->vm = getenv("FUNLISP_BYTECODE") != NULL;
+	if (getenv("FUNLISP_MACRO_CACHE"))
+		lisp_enable_macro_cache(rt);
+	rt->optimize = getenv("FUNLISP_OPTIMIZE") != NULL;
+	rt->nthreads = lisp_threads_default();
+	if (getenv("FUNLISP_MODULE_CACHE"))
+		lisp_enable_module_cache(rt, getenv("FUNLISP_MODULE_CACHE"));
 
 	lisp_register_module(rt, create_os_module(rt));
 }
 
+void lisp_init_spawned(lisp_runtime *rt, lisp_runtime *parent)
+{
+	lisp_pool_init(&rt->pool);
+	rt->pool.enabled = parent->pool.enabled;
+	lisp_init_state(rt);
+	rt->parent = parent;
+
+	/* nil is frozen along with everything else, so it may be shared */
+	rt->nil = parent->nil;
+	rt->pins = (lisp_list *) rt->nil;
+	rt->modules = lisp_new_empty_scope(rt);
+	rt->modules->up = parent->modules;
+	rt->user = parent->user;
+	rt->vm = parent->vm;
+	rt->optimize = parent->optimize;
+	/* the parent's inlined code stays valid until this rebinds a builtin */
+	rt->builtins_version = parent->builtins_version;
+	rt->forms_version = parent->forms_version;
+	rt->gen_enabled = parent->gen_enabled;
+	rt->sweep_budget = parent->sweep_budget;
+	rt->gc_threshold = parent->gc_threshold;
+	rt->gc_trigger = parent->gc_threshold;
+	rt->nthreads = parent->nthreads;
+	/* limits on the use of memory and time apply to each runtime */
+	rt->deadline = parent->deadline;
+	rt->max_depth = parent->max_depth;
+	rt->max_heap = parent->max_heap;
+	lisp_poll_soon(rt);
+	if (parent->strcache)
+		lisp_enable_strcache(rt);
+	if (parent->module_cache)
+		lisp_enable_module_cache(rt, parent->module_cache);
+	if (parent->expansions)
+		lisp_enable_macro_cache(rt);
+}
+
 void lisp_destroy(lisp_runtime *rt)
 {
+	lisp_threads_stop(rt);
+	lisp_profile_free(rt);
+	rt->frozen = 0;
 	rt->has_marked = 0; /* ensure we sweep all */
 	lisp_sweep(rt);
 	rb_destroy(&rt->rb);
-	lisp_free(rt, rt->nil);
-	if (rt->symcache)
-		ht_delete(rt->symcache);
+	if (!rt->parent)
+		lisp_free(rt, rt->nil);
+	pt_delete(rt->symcache);
 	if (rt->strcache)
-		ht_delete(rt->strcache);
+		pt_delete(rt->strcache);
+	if (rt->expansions)
+		pt_delete(rt->expansions);
+	free(rt->module_cache);
+	free(rt->young);
+	free(rt->vm_stack);
+	free(rt->stack);
+	free(rt->error_stack);
+	lisp_pool_destroy(&rt->pool);
 }
 
-void lisp_mark(lisp_runtime *rt, lisp_value *v)
+/*
+ * Once the old generation has grown by this many objects, plus its size after
+ * the previous major collection, the next collection is major.
+ */
+#define LISP_MAJOR_MIN_GROWTH 10000
+
+/*
+ * During a minor collection, the old generation is assumed reachable, so its
+ * objects are neither traced nor swept. Static objects have no page to hold
+ * their mark, and frozen objects may belong to another runtime, so neither is
+ * ever traced. Nor are the objects of its parent which a spawned runtime may
+ * reach, such as those a pmap worker is handed (see threads.c).
+ */
+#define lisp_gc_traced(rt, v) \
+	((v)->pool != LISP_POOL_STATIC && (v)->gen != LISP_GEN_FROZEN && \
+	 (!(rt)->parent || lisp_page_of(v)->owner == &(rt)->pool) && \
+	 ((rt)->gc_major || (v)->gen != LISP_GEN_OLD))
+
+static int lisp_gc_marked(lisp_value *v)
 {
-	rb_push_back(&rt->rb, &v);
+	struct lisp_page *page = lisp_page_of(v);
+	return lisp_bit_get(page->mark, lisp_bit_of(page, v));
+}
+
+static void lisp_gc_set_mark(lisp_value *v)
+{
+	struct lisp_page *page = lisp_page_of(v);
+	lisp_bit_set(page->mark, lisp_bit_of(page, v));
+}
+
+static void lisp_gc_clear_mark(lisp_value *v)
+{
+	struct lisp_page *page = lisp_page_of(v);
+	lisp_bit_clear(page->mark, lisp_bit_of(page, v));
+}
+
+/*
+ * Begin a collection cycle, deciding whether it is minor or major.
+ */
+static void lisp_gc_begin(lisp_runtime *rt)
+{
+	lisp_gc_finish_sweep(rt);
 	rt->has_marked = 1;
+	rt->gc_major = !rt->gen_enabled || rt->major_requested ||
+		rt->old_count >= 2 * rt->old_after_major + LISP_MAJOR_MIN_GROWTH;
+	rt->major_requested = 0;
+}
+
+/*
+ * Mark everything reachable from @a v, once a collection has begun. The caller
+ * times the marking.
+ */
+static void lisp_gc_mark(lisp_runtime *rt, lisp_value *v)
+{
+	if (lisp_fixnum_p(v) || !lisp_gc_traced(rt, v) || lisp_gc_marked(v))
+		return;
+
+	lisp_gc_set_mark(v);
+	rt->stats.marked++;
+	rb_push_back(&rt->rb, &v);
 
 	while (rt->rb.count > 0) {
 		struct iterator it;
 
 		rb_pop_front(&rt->rb, &v);
-		v->mark = GC_MARKED;
 		it = v->type->expand(v);
 		while (it.has_next(&it)) {
 			v = it.next(&it);
-			if (v->mark == GC_NOMARK) {
-				v->mark = GC_QUEUED;
+			/* partially initialized objects may hold NULL */
+			if (v && !lisp_fixnum_p(v) && lisp_gc_traced(rt, v) &&
+					!lisp_gc_marked(v)) {
+				lisp_gc_set_mark(v);
+				rt->stats.marked++;
 				rb_push_back(&rt->rb, &v);
 			}
 		}
@@ -63,6 +255,19 @@ void lisp_mark(lisp_runtime *rt, lisp_value *v)
 	}
 }
 
+void lisp_mark(lisp_runtime *rt, lisp_value *v)
+{
+	double start;
+
+	if (rt->frozen)
+		return;
+	if (!rt->has_marked)
+		lisp_gc_begin(rt);
+	start = lisp_now();
+	lisp_gc_mark(rt, v);
+	rt->stats.mark_seconds += lisp_now() - start;
+}
+
 /*
  * The interpreter contains references to several important objects which we
  * must mark to avoid freeing accidentally. We mark them here. See lisp_sweep()
@@ -70,16 +275,151 @@ void lisp_mark(lisp_runtime *rt, lisp_value *v)
  */
 static void lisp_mark_basics(lisp_runtime *rt)
 {
-	if (rt->error_stack)
-		lisp_mark(rt, (lisp_value *) rt->error_stack);
-	lisp_mark(rt, (lisp_value *) rt->stack);
-	lisp_mark(rt, (lisp_value *) rt->modules);
+	struct iterator it;
+	unsigned long i;
+
+	lisp_gc_mark(rt, rt->nil);
+	for (i = 0; i < rt->error_depth; i++)
+		lisp_gc_mark(rt, rt->error_stack[i]);
+	for (i = 0; i < rt->stack_depth; i++)
+		lisp_gc_mark(rt, rt->stack[i]);
+	lisp_gc_mark(rt, (lisp_value *) rt->modules);
+	lisp_gc_mark(rt, (lisp_value *) rt->pins);
+	for (i = 0; i < rt->vm_sp; i++)
+		lisp_gc_mark(rt, rt->vm_stack[i]);
+	if (rt->expansions) {
+		it = pt_iter_values(rt->expansions);
+		while (it.has_next(&it))
+			lisp_gc_mark(rt, it.next(&it));
+		it.close(&it);
+	}
 }
 
-void lisp_sweep(lisp_runtime *rt)
+/*
+ * For a minor collection, young objects which old objects refer to are roots.
+ * The write barrier flagged them, so we find them in the young array.
+ */
+static void lisp_mark_remembered(lisp_runtime *rt)
 {
-	lisp_value *curr = rt->head;
+	unsigned long i;
+	for (i = 0; i < rt->nyoung; i++)
+		if (rt->young[i]->gen == LISP_GEN_REMEMBERED)
+			lisp_gc_mark(rt, rt->young[i]);
+}
 
+void lisp_gc_add_young(lisp_runtime *rt, lisp_value *v)
+{
+	if (rt->nyoung == rt->young_size) {
+		rt->young_size = rt->young_size ? 2 * rt->young_size : 1024;
+		rt->young = realloc(rt->young,
+				rt->young_size * sizeof(lisp_value *));
+	}
+	rt->young[rt->nyoung++] = v;
+
+	/* a pending major sweep must not free it */
+	if (rt->sweeping && rt->gc_major)
+		lisp_gc_set_mark(v);
+}
+
+/*
+ * Free every live object in a page, regardless of marks. Used when the
+ * interpreter data is being cleared.
+ */
+static void lisp_sweep_all_page(lisp_runtime *rt, struct lisp_page *page)
+{
+	unsigned long w, bit, live;
+	lisp_value *v;
+
+	for (w = 0; w < LISP_BITMAP_WORDS; w++) {
+		live = page->live[w];
+		for (bit = 0; live; bit++, live >>= 1) {
+			if (!(live & 1UL))
+				continue;
+			v = (lisp_value *) ((char *) page +
+				(w * LISP_ULONG_BITS + bit) * LISP_CLASS_GRAIN);
+			if (v == rt->nil)
+				continue;
+			/* freeing a single object page's object frees the page */
+			if (page->cls == LISP_POOL_NONE) {
+				lisp_free(rt, v);
+				return;
+			}
+			lisp_free(rt, v);
+		}
+	}
+}
+
+static void lisp_sweep_all(lisp_runtime *rt)
+{
+	struct lisp_page *page, *next;
+
+	for (page = rt->pool.pages; page; page = page->next)
+		lisp_sweep_all_page(rt, page);
+	for (page = rt->pool.big; page; page = next) {
+		next = page->next;
+		lisp_sweep_all_page(rt, page);
+	}
+	for (page = rt->pool.pages; page; page = page->next)
+		memset(page->mark, 0, sizeof(page->mark));
+
+	pt_destroy(rt->symcache);
+	if (rt->expansions)
+		pt_destroy(rt->expansions);
+	rt->nyoung = 0;
+	rt->old_count = 0;
+	rt->old_after_major = 0;
+}
+
+static int lisp_gc_dead_key(void *key, void *value, void *arg)
+{
+	lisp_runtime *rt = arg;
+	lisp_value *v = key;
+	(void) value;
+	return lisp_gc_traced(rt, v) && !lisp_gc_marked(v);
+}
+
+/*
+ * Finish a collection whose roots have been marked. When @a promote is false,
+ * survivors stay in their generation.
+ */
+static void lisp_gc_sweep(lisp_runtime *rt, int promote)
+{
+	double start = lisp_now();
+
+	lisp_mark_basics(rt);
+	if (!rt->gc_major)
+		lisp_mark_remembered(rt);
+	rt->has_marked = 0;
+	rt->stats.mark_seconds += lisp_now() - start;
+	rt->stats.collections++;
+	if (rt->gc_major)
+		rt->stats.major_collections++;
+
+	/* the symbol table does not keep symbols alive, nor the macro cache
+	 * the call sites whose expansions it holds */
+	pt_remove_if(rt->symcache, lisp_gc_dead_key, rt);
+	if (rt->expansions)
+		pt_remove_if(rt->expansions, lisp_gc_dead_key, rt);
+	rt->stats.allocations += rt->gc_allocs;
+	rt->gc_allocs = 0;
+
+	rt->sweeping = SWEEP_YOUNG;
+	rt->sweep_read = 0;
+	rt->sweep_write = 0;
+	rt->sweep_end = rt->nyoung;
+	rt->sweep_promote = promote;
+	if (rt->sweep_budget)
+		lisp_gc_step(rt, rt->sweep_budget);
+	else
+		lisp_gc_finish_sweep(rt);
+
+	/* allow as much allocation as there is live young data */
+	rt->gc_trigger = rt->nyoung > rt->gc_threshold ?
+		rt->nyoung : rt->gc_threshold;
+}
+
+void lisp_sweep(lisp_runtime *rt)
+{
 	/*
 	 * When a user has called lisp_mark() before calling lisp_sweep(), we
 	 * know that they intend to continue using the interpreter. Conversely,
@@ -88,29 +428,457 @@ void lisp_sweep(lisp_runtime *rt)
 	 * to clobber the internal interpreter data.
 	 *
 	 * So, mark some basic data when stuff has already been marked. But, if
-	 * nothing has been marked, then reset internal state and leave the
-	 * basic data unmarked.
+	 * nothing has been marked, then reset internal state and free
+	 * everything.
+	 *
+	 * A frozen runtime has nothing to collect, and must not free what its
+	 * spawned runtimes use, so it is left alone until lisp_destroy().
 	 */
-	if (rt->has_marked) {
-		lisp_mark_basics(rt);
-	} else {
+	if (rt->frozen)
+		return;
+	if (!rt->has_marked) {
+		rt->sweeping = SWEEP_NONE;
 		lisp_clear_error(rt);
-		rt->stack = (lisp_list*)rt->nil;
 		rt->stack_depth = 0;
+		rt->vm_sp = 0;
+		rt->pins = (lisp_list*)rt->nil;
+		lisp_sweep_all(rt);
+		return;
+	}
+
+	lisp_gc_sweep(rt, 1);
+}
+
+/*
+ * Sweep part of the young array: free unmarked objects, and keep or promote
+ * the survivors. Marks of survivors are left for the page sweep to clear in a
+ * major collection. Returns the remaining budget.
+ */
+static int lisp_gc_step_young(lisp_runtime *rt, int budget)
+{
+	unsigned long i;
+	lisp_value *v;
+
+	while (budget > 0 && rt->sweep_read < rt->sweep_end) {
+		v = rt->young[rt->sweep_read++];
+		budget--;
+		if (!lisp_gc_marked(v)) {
+			lisp_free(rt, v);
+			rt->stats.freed++;
+			continue;
+		}
+		if (!rt->gc_major)
+			lisp_gc_clear_mark(v);
+		if (rt->sweep_promote) {
+			v->gen = LISP_GEN_OLD;
+			rt->old_count++;
+		} else {
+			rt->young[rt->sweep_write++] = v;
+		}
+	}
+
+	if (rt->sweep_read < rt->sweep_end)
+		return 0;
+
+	/*
+	 * Survivors which were not swept yet may have been made to point at
+	 * objects allocated during the sweep, while the write barrier saw
+	 * them as young. Those objects are promoted along with them, so no
+	 * old object points at a young one unknown to the barrier.
+	 */
+	if (rt->sweep_promote) {
+		for (i = rt->sweep_end; i < rt->nyoung; i++) {
+			rt->young[i]->gen = LISP_GEN_OLD;
+			rt->old_count++;
+		}
+		rt->nyoung = rt->sweep_write;
+		rt->sweep_new = rt->sweep_write;
+		return budget;
+	}
+
+	/* move down anything allocated during the sweep */
+	memmove(rt->young + rt->sweep_write, rt->young + rt->sweep_end,
+			(rt->nyoung - rt->sweep_end) * sizeof(lisp_value *));
+	rt->nyoung = rt->sweep_write + (rt->nyoung - rt->sweep_end);
+	rt->sweep_new = rt->sweep_write;
+	return budget;
+}
+
+/*
+ * Free the unmarked objects of a page, and clear its marks. Returns the work
+ * done. The page itself is freed along with a single object page's object.
+ */
+static int lisp_gc_sweep_page(lisp_runtime *rt, struct lisp_page *page)
+{
+	unsigned long w, bit, garbage;
+	lisp_value *v;
+	int work = LISP_BITMAP_WORDS;
+
+	for (w = 0; w < LISP_BITMAP_WORDS; w++) {
+		garbage = page->live[w] & ~page->mark[w];
+		page->mark[w] = 0;
+		for (bit = 0; garbage; bit++, garbage >>= 1) {
+			if (!(garbage & 1UL))
+				continue;
+			v = (lisp_value *) ((char *) page +
+				(w * LISP_ULONG_BITS + bit) * LISP_CLASS_GRAIN);
+			if (v->gen == LISP_GEN_OLD)
+				rt->old_count--;
+			rt->stats.freed++;
+			work++;
+			if (page->cls == LISP_POOL_NONE) {
+				lisp_free(rt, v);
+				return work;
+			}
+			lisp_free(rt, v);
+		}
+	}
+	return work;
+}
+
+static void lisp_gc_sweep_done(lisp_runtime *rt)
+{
+	unsigned long i;
+
+	rt->sweeping = SWEEP_NONE;
+	if (!rt->gc_major)
+		return;
+
+	/* objects allocated during the sweep were marked in advance */
+	for (i = rt->sweep_new; i < rt->nyoung; i++)
+		lisp_gc_clear_mark(rt->young[i]);
+	rt->old_after_major = rt->old_count;
+}
+
+static int lisp_gc_sweep_some(lisp_runtime *rt, int budget)
+{
+	struct lisp_page *page;
+
+	if (rt->sweeping == SWEEP_YOUNG) {
+		budget = lisp_gc_step_young(rt, budget);
+		if (rt->sweep_read < rt->sweep_end)
+			return 1;
+		if (!rt->gc_major) {
+			lisp_gc_sweep_done(rt);
+			return 0;
+		}
+		rt->sweeping = SWEEP_PAGES;
+		rt->sweep_page = rt->pool.pages;
+		rt->sweep_big = 0;
+	}
+
+	if (rt->sweeping != SWEEP_PAGES)
+		return 0;
+
+	while (budget > 0) {
+		page = rt->sweep_page;
+		if (!page && !rt->sweep_big) {
+			rt->sweep_big = 1;
+			page = rt->sweep_page = rt->pool.big;
+		}
+		if (!page) {
+			lisp_gc_sweep_done(rt);
+			return 0;
+		}
+		rt->sweep_page = page->next;
+		budget -= lisp_gc_sweep_page(rt, page);
+	}
+	return 1;
+}
+
+int lisp_gc_step(lisp_runtime *rt, int budget)
+{
+	double start;
+	int more;
+
+	if (!rt->sweeping)
+		return 0;
+	start = lisp_now();
+	more = lisp_gc_sweep_some(rt, budget);
+	rt->stats.sweep_seconds += lisp_now() - start;
+	return more;
+}
+
+void lisp_gc_finish_sweep(lisp_runtime *rt)
+{
+	double start;
+
+	if (!rt->sweeping)
+		return;
+	start = lisp_now();
+	while (lisp_gc_sweep_some(rt, 4096))
+		;
+	rt->stats.sweep_seconds += lisp_now() - start;
+}
+
+void lisp_gc_retain(lisp_runtime *rt, lisp_value *v)
+{
+	if (rt->sweeping && lisp_gc_traced(rt, v))
+		lisp_gc_set_mark(v);
+}
+
+void lisp_enable_generational(lisp_runtime *rt)
+{
+	rt->gen_enabled = 1;
+}
+
+void lisp_disable_generational(lisp_runtime *rt)
+{
+	rt->gen_enabled = 0;
+}
+
+void lisp_gc_request_major(lisp_runtime *rt)
+{
+	rt->major_requested = 1;
+}
+
+void lisp_enable_incremental(lisp_runtime *rt, int budget)
+{
+	rt->sweep_budget = budget > 0 ? budget : 1;
+}
+
+void lisp_disable_incremental(lisp_runtime *rt)
+{
+	rt->sweep_budget = 0;
+	lisp_gc_finish_sweep(rt);
+}
+
+/*
+ * Conservative stack scanning reads the whole stack, including parts which
+ * AddressSanitizer considers off limits.
+ */
+#if defined(__GNUC__)
+#define LISP_NO_SANITIZE_ADDRESS __attribute__((no_sanitize_address))
+#else
+#define LISP_NO_SANITIZE_ADDRESS
+#endif
+
+/*
+ * Mark every object which a word on the C stack may point at, between this
+ * frame and the outermost call into the interpreter. setjmp() spills register
+ * contents into a buffer in this frame, so they are scanned too.
+ */
+static LISP_NO_SANITIZE_ADDRESS void lisp_mark_stack(lisp_runtime *rt)
+{
+	jmp_buf regs;
+	void **lo, **hi, **word;
+	lisp_value *v;
+
+	setjmp(regs);
+	lo = (void **) &regs;
+	hi = (void **) rt->stack_base;
+	if (lo > hi) {
+		/* the stack grows upward */
+		lo = hi;
+		hi = (void **) (&regs + 1);
 	}
 
-	while (curr->next) {
-		if (curr->next->mark != GC_MARKED) {
-			lisp_value *tmp = curr->next->next;
-			lisp_free(rt, curr->next);
-			curr->next = tmp;
+	for (word = lo; word < hi; word++) {
+		v = lisp_alloc_find(rt, *word);
+		if (v)
+			lisp_gc_mark(rt, v);
+	}
+}
+
+void lisp_gc_collect(lisp_runtime *rt)
+{
+	double start;
+	int i;
+
+	/* the host is in the middle of marking; let its lisp_sweep() finish */
+	if (rt->has_marked || rt->frozen)
+		return;
+
+	lisp_gc_begin(rt);
+	start = lisp_now();
+	for (i = 0; i < 3; i++)
+		if (rt->entry_roots[i])
+			lisp_gc_mark(rt, rt->entry_roots[i]);
+	lisp_mark_stack(rt);
+	rt->stats.mark_seconds += lisp_now() - start;
+	lisp_gc_sweep(rt, 0);
+}
+
+int lisp_gc_enter_outer(lisp_runtime *rt, void *base, lisp_value *a,
+                        lisp_value *b, lisp_value *c)
+{
+	rt->stack_base = base;
+	rt->entry_roots[0] = a;
+	rt->entry_roots[1] = b;
+	rt->entry_roots[2] = c;
+	return 1;
+}
+
+void lisp_gc_leave(lisp_runtime *rt)
+{
+	rt->stack_base = NULL;
+	rt->entry_roots[0] = NULL;
+	rt->entry_roots[1] = NULL;
+	rt->entry_roots[2] = NULL;
+}
+
+void lisp_enable_auto_gc(lisp_runtime *rt, unsigned long threshold)
+{
+	rt->gc_threshold = threshold ? threshold : LISP_GC_DEFAULT_THRESHOLD;
+	rt->gc_trigger = rt->gc_threshold;
+}
+
+void lisp_disable_auto_gc(lisp_runtime *rt)
+{
+	rt->gc_threshold = 0;
+}
+
+void lisp_pin(lisp_runtime *rt, lisp_value *v)
+{
+	rt->pins = lisp_list_new(rt, v, (lisp_value *) rt->pins);
+}
+
+void lisp_unpin(lisp_runtime *rt, lisp_value *v)
+{
+	lisp_list *l, *prev = NULL;
+
+	for (l = rt->pins; !lisp_nil_p((lisp_value *) l);
+			prev = l, l = (lisp_list *) l->right) {
+		if (l->left == v) {
+			if (prev)
+				lisp_list_set_right(prev, l->right);
+			else
+				rt->pins = (lisp_list *) l->right;
+			return;
+		}
+	}
+}
+
+/*
+ * Return an array of every live object of the runtime, with its length in
+ * @a count. The caller must free it.
+ */
+static lisp_value **lisp_gc_live_objects(lisp_runtime *rt, unsigned long *count)
+{
+	struct lisp_page *page;
+	lisp_value **objects = NULL;
+	unsigned long w, bit, live, n = 0, size = 0;
+	int big;
+
+	for (big = 0; big < 2; big++) {
+		page = big ? rt->pool.big : rt->pool.pages;
+		for (; page; page = page->next) {
+			for (w = 0; w < LISP_BITMAP_WORDS; w++) {
+				live = page->live[w];
+				for (bit = 0; live; bit++, live >>= 1) {
+					if (!(live & 1UL))
+						continue;
+					if (n == size) {
+						size = size ? 2 * size : 1024;
+						objects = realloc(objects,
+							size * sizeof(lisp_value *));
+					}
+					objects[n++] = (lisp_value *) ((char *) page +
+						(w * LISP_ULONG_BITS + bit) *
+						LISP_CLASS_GRAIN);
+				}
+			}
+		}
+	}
+	*count = n;
+	return objects;
+}
+
+/* Count an object in the entry of its type, or in the last one. */
+static void lisp_stats_count(struct lisp_stats *stats, lisp_value *v)
+{
+	unsigned long size = lisp_alloc_size(v) + lisp_storage_size(v);
+	struct lisp_type_stats *entry;
+	int i;
+
+	for (i = 0; i < stats->ntypes; i++)
+		if (stats->types[i].name == v->type->name)
+			break;
+	if (i == stats->ntypes) {
+		if (i == LISP_STATS_TYPES) {
+			i--;
+			stats->types[i].name = "other";
 		} else {
-			curr->mark = GC_NOMARK;
-			curr = curr->next;
+			stats->ntypes++;
+			stats->types[i].name = v->type->name;
+			stats->types[i].objects = 0;
+			stats->types[i].bytes = 0;
 		}
 	}
+	entry = &stats->types[i];
+	entry->objects++;
+	entry->bytes += size;
+	stats->objects++;
+	stats->bytes += size;
+}
+
+void lisp_get_stats(lisp_runtime *rt, struct lisp_stats *stats)
+{
+	lisp_value **objects;
+	unsigned long i, n;
+
+	*stats = rt->stats;
+	stats->allocations += rt->gc_allocs;
+	stats->mark_queue_max = rt->rb.high;
+	stats->objects = 0;
+	stats->bytes = 0;
+	stats->ntypes = 0;
+
+	objects = lisp_gc_live_objects(rt, &n);
+	for (i = 0; i < n; i++)
+		lisp_stats_count(stats, objects[i]);
+	free(objects);
+}
+
+void lisp_gc_unshare_slices(lisp_runtime *rt)
+{
+	lisp_value **objects;
+	unsigned long i, n;
+
+	objects = lisp_gc_live_objects(rt, &n);
+	for (i = 0; i < n; i++)
+		if (objects[i]->type == type_string &&
+		    ((lisp_string *) objects[i])->base)
+			lisp_string_unshare((lisp_string *) objects[i]);
+	free(objects);
+}
+
+void lisp_runtime_freeze(lisp_runtime *rt, lisp_scope *scope)
+{
+	lisp_value **objects;
+	unsigned long i, n;
+	lisp_type *type;
+
+	/* keep only what the scope, modules and pins reach */
+	lisp_clear_error(rt);
+	lisp_gc_request_major(rt);
+	lisp_mark(rt, (lisp_value *) scope);
+	lisp_sweep(rt);
+	lisp_gc_finish_sweep(rt);
+
+	/*
+	 * Spawned runtimes may not write to frozen objects, so do now what
+	 * would be done to them lazily: compile lambdas for the VM, and give
+	 * slices of strings their own copy of the text.
+	 */
+	objects = lisp_gc_live_objects(rt, &n);
+	for (i = 0; i < n; i++) {
+		type = objects[i]->type;
+		if (type == type_lambda && ((lisp_lambda *) objects[i])->closure)
+			lisp_vm_compile(rt, (lisp_lambda *) objects[i]);
+		else if (type == type_string)
+			lisp_string_get((lisp_string *) objects[i]);
+	}
+	free(objects);
+
+	objects = lisp_gc_live_objects(rt, &n);
+	for (i = 0; i < n; i++)
+		objects[i]->gen = LISP_GEN_FROZEN;
+	free(objects);
 
-	curr->mark = GC_NOMARK;
-	rt->tail = curr;
-	rt->has_marked = false;
+	rt->nyoung = 0;
+	rt->old_count = 0;
+	rt->old_after_major = 0;
+	rt->frozen = 1;
+	rt->frozen_scope = scope;
 }
@@ -208,6 +208,9 @@ unsigned int ht_find_retrieve(const struct hashtable *obj, void *key)
 /**
  * @brief Expand the hash table, adding increment to the capacity of the table.
  *
+ * When most of the used slots are gravestones rather than items, the table
+ * keeps its capacity, and is only rebuilt without them.
+ *
  * @param table The table to expand.
  */
 void ht_resize(struct hashtable *table)
@@ -218,8 +221,10 @@ void ht_resize(struct hashtable *table)
 	/* Step one: allocate new space for the table */
 	old_table = table->table;
 	old_allocated = table->allocated;
+	if (table->length >= table->graves)
+		table->allocated = ht_next_size(old_allocated);
 	table->length = 0;
-	table->allocated = ht_next_size(old_allocated);
+	table->graves = 0;
 	table->table = calloc(table->allocated, item_size(table));
 
 	/* Step two, add the old items to the new table. */
@@ -236,14 +241,15 @@ void ht_resize(struct hashtable *table)
 }
 
 /**
- * @brief Return the load factor of a hash table.
+ * @brief Return the load factor of a hash table, counting gravestones.
  *
  * @param table The table to find the load factor of.
  * @returns The load factor of the hash table.
  */
 double ht_load_factor(struct hashtable *table)
 {
-	return ((double) table->length) / ((double) table->allocated);
+	return ((double) (table->length + table->graves)) /
+		((double) table->allocated);
 }
 
 /*
@@ -255,6 +261,7 @@ void ht_init(struct hashtable *table, hash_t hash_func, comp_t equal,
 {
 	/* Initialize values */
 	table->length = 0;
+	table->graves = 0;
 	table->allocated = HASH_TABLE_INITIAL_SIZE;
 	table->key_size = key_size;
 	table->value_size = value_size;
@@ -312,6 +319,8 @@ void ht_insert(struct hashtable *table, void *key, void *value)
 	 * gravestone.
 	 */
 	index = ht_find_insert(table, key);
+	if (mark_at(table, index) == HT_GRAVE)
+		table->graves--;
 	mark_at(table, index) = HT_FULL;
 	memcpy(key_ptr(table, index), key, table->key_size);
 	memcpy(val_ptr(table, index), value, table->value_size);
@@ -335,6 +344,7 @@ int ht_remove(struct hashtable *table, void *key)
 	/* Mark the slot with a "grave stone", indicating it is deleted. */
 	mark_at(table, index) = HT_GRAVE;
 	table->length--;
+	table->graves++;
 	return 0;
 }
 
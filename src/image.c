@@ -0,0 +1,545 @@
+/*
+ * image.c: binary images of parsed code, and the module cache built on them
+ *
+ * An image holds one value made of nil, integers, symbols, strings and lists,
+ * which is everything the parser produces. It begins with a header and a table
+ * of the names of the symbols it uses, each stored once, followed by the value:
+ *
+ *     "FLIM" version
+ *     count (length bytes)...   the symbol table
+ *     value
+ *
+ * Each value is a tag byte followed by its contents. Integers are zigzag
+ * encoded, so that small negative numbers are short, and every count, length
+ * and integer is an unsigned varint of seven bits per byte, least significant
+ * first. An integer too large for a long is a bignum instead: its sign (one for
+ * negative), the number of its base 2^32 digits, and the digits, least
+ * significant first. A list is the number of its items, the items, and the
+ * tail which ends the list (nil, unless it is dotted). When an image is read,
+ * each symbol is interned the first time the value refers to it.
+ *
+ * The module cache stores an image of each module's code in a file named by a
+ * hash of the module's path, after a key which identifies the version of the
+ * source it was made from: its size and modification time, and a digest of its
+ * contents. The source is only hashed once the size and modification time
+ * match, a block at a time, so neither a changed module nor a large one costs
+ * more memory than parsing it. Reading the key needs stat(), which is POSIX.
+ *
+ * Stephen Brennan <stephen@brennan.io>
+ */
+#define _POSIX_C_SOURCE 1
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "funlisp_internal.h"
+#include "charbuf.h"
+
+#define IMAGE_VERSION 2
+
+/* images nested deeper than this are rejected rather than overflow the stack */
+#define IMAGE_MAX_DEPTH 10000
+
+/* value tags */
+#define IMAGE_NIL 0
+#define IMAGE_INTEGER 1
+#define IMAGE_SYMBOL 2
+#define IMAGE_STRING 3
+#define IMAGE_LIST 4
+#define IMAGE_BIGNUM 5
+
+/* images have base 2^32 digits, which may be made of several lisp_digits */
+#define IMAGE_DIGIT_PARTS (32 / LISP_DIGIT_BITS)
+
+struct image_writer {
+	lisp_runtime *rt;
+	struct charbuf value;
+	struct charbuf symbols;
+	/* each symbol already in the table, mapped to its index plus one */
+	struct ptable index;
+	unsigned long nsymbols;
+};
+
+/* where a name of the symbol table is, and its symbol once interned */
+struct image_name {
+	unsigned long offset;
+	unsigned long length;
+	lisp_symbol *symbol;
+};
+
+struct image_reader {
+	lisp_runtime *rt;
+	unsigned char *buf;
+	unsigned long pos;
+	unsigned long length;
+	unsigned long nsymbols;
+	struct image_name *names;
+};
+
+static void image_put_uint(struct charbuf *cb, unsigned long n)
+{
+	while (n >= 0x80) {
+		cb_append(cb, (char) ((n & 0x7f) | 0x80));
+		n >>= 7;
+	}
+	cb_append(cb, (char) n);
+}
+
+static unsigned int image_ptr_hash(void *p)
+{
+	return (unsigned int) ((unsigned long) p / 16);
+}
+
+static void image_put_symbol(struct image_writer *w, lisp_symbol *s)
+{
+	unsigned long index = (unsigned long) pt_get(&w->index, s);
+
+	if (!index) {
+		index = ++w->nsymbols;
+		pt_insert(&w->index, s, (void *) index);
+		image_put_uint(&w->symbols, s->len);
+		cb_concat_n(&w->symbols, s->s, s->len);
+	}
+	cb_append(&w->value, IMAGE_SYMBOL);
+	image_put_uint(&w->value, index - 1);
+}
+
+static int image_put_value(struct image_writer *w, lisp_value *v, int depth)
+{
+	lisp_type *type = lisp_type_of(v);
+	struct lisp_digits digits;
+	lisp_value *item;
+	unsigned long n, digit;
+	long x;
+	int i, k;
+
+	if (depth > IMAGE_MAX_DEPTH) {
+		lisp_error(w->rt, LE_VALUE, "value is nested too deeply for an image");
+		return -1;
+	}
+
+	if (type == type_integer &&
+	    lisp_integer_get_long((lisp_integer *) v, &x)) {
+		cb_append(&w->value, IMAGE_INTEGER);
+		image_put_uint(&w->value, x < 0 ?
+			((unsigned long) -(x + 1) << 1) | 1 : (unsigned long) x << 1);
+	} else if (type == type_integer) {
+		lisp_integer_digits((lisp_integer *) v, &digits);
+		cb_append(&w->value, IMAGE_BIGNUM);
+		image_put_uint(&w->value, digits.sign < 0);
+		image_put_uint(&w->value, (unsigned long) (digits.n +
+			IMAGE_DIGIT_PARTS - 1) / IMAGE_DIGIT_PARTS);
+		for (i = 0; i < digits.n; i += IMAGE_DIGIT_PARTS) {
+			digit = 0;
+			for (k = 0; k < IMAGE_DIGIT_PARTS && i + k < digits.n; k++)
+				digit |= (unsigned long) digits.d[i + k] <<
+					(k * LISP_DIGIT_BITS);
+			image_put_uint(&w->value, digit);
+		}
+	} else if (type == type_symbol) {
+		image_put_symbol(w, (lisp_symbol *) v);
+	} else if (type == type_string) {
+		cb_append(&w->value, IMAGE_STRING);
+		image_put_uint(&w->value, ((lisp_string *) v)->len);
+		cb_concat_n(&w->value, ((lisp_string *) v)->s,
+			((lisp_string *) v)->len);
+	} else if (type == type_list && lisp_nil_p(v)) {
+		cb_append(&w->value, IMAGE_NIL);
+	} else if (type == type_list) {
+		n = 0;
+		for (item = v; lisp_type_of(item) == type_list && !lisp_nil_p(item);
+				item = ((lisp_list *) item)->right)
+			n++;
+		cb_append(&w->value, IMAGE_LIST);
+		image_put_uint(&w->value, n);
+		for (; n; n--, v = ((lisp_list *) v)->right)
+			if (image_put_value(w, ((lisp_list *) v)->left, depth + 1) < 0)
+				return -1;
+		return image_put_value(w, v, depth + 1);
+	} else {
+		lisp_error(w->rt, LE_TYPE, "cannot store this type in an image");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Append the image of @a code to @a out. Returns 0, or -1 with an error set
+ * when @a code holds something other than what the parser produces.
+ */
+static int image_encode(lisp_runtime *rt, lisp_value *code, struct charbuf *out)
+{
+	struct image_writer w;
+	int rv;
+
+	w.rt = rt;
+	cb_init(&w.value, 256);
+	cb_init(&w.symbols, 256);
+	pt_init(&w.index, image_ptr_hash, NULL);
+	w.nsymbols = 0;
+
+	rv = image_put_value(&w, code, 0);
+	if (rv == 0) {
+		cb_concat(out, "FLIM");
+		cb_append(out, IMAGE_VERSION);
+		image_put_uint(out, w.nsymbols);
+		cb_concat_n(out, w.symbols.buf, w.symbols.length);
+		cb_concat_n(out, w.value.buf, w.value.length);
+	}
+
+	cb_destroy(&w.value);
+	cb_destroy(&w.symbols);
+	pt_destroy(&w.index);
+	return rv;
+}
+
+static int image_get_uint(struct image_reader *r, unsigned long *n)
+{
+	unsigned int shift = 0;
+	unsigned char byte;
+
+	*n = 0;
+	do {
+		if (r->pos >= r->length || shift >= sizeof(long) * CHAR_BIT)
+			return -1;
+		byte = r->buf[r->pos++];
+		*n |= (unsigned long) (byte & 0x7f) << shift;
+		shift += 7;
+	} while (byte & 0x80);
+	return 0;
+}
+
+/* read a length and check that that many bytes follow */
+static int image_get_length(struct image_reader *r, unsigned long *n)
+{
+	if (image_get_uint(r, n) < 0 || *n > r->length - r->pos)
+		return -1;
+	return 0;
+}
+
+static lisp_value *image_bad(struct image_reader *r)
+{
+	return lisp_error(r->rt, LE_SYNTAX, "malformed image");
+}
+
+static lisp_value *image_get_value(struct image_reader *r, int depth)
+{
+	lisp_list *head, *prev;
+	lisp_value *item;
+	unsigned long n, len, sign, i;
+	lisp_digit *digits;
+	int tag, k;
+
+	if (r->pos >= r->length || depth > IMAGE_MAX_DEPTH)
+		return image_bad(r);
+
+	tag = r->buf[r->pos++];
+	switch (tag) {
+	case IMAGE_NIL:
+		return lisp_nil_new(r->rt);
+	case IMAGE_INTEGER:
+		if (image_get_uint(r, &n) < 0)
+			return image_bad(r);
+		return (lisp_value *) lisp_integer_new_long(r->rt,
+			n & 1 ? -(long) (n >> 1) - 1 : (long) (n >> 1));
+	case IMAGE_BIGNUM:
+		/* each digit takes at least a byte */
+		if (image_get_uint(r, &sign) < 0 || sign > 1 ||
+		    image_get_length(r, &n) < 0 || n == 0 ||
+		    n > INT_MAX / IMAGE_DIGIT_PARTS)
+			return image_bad(r);
+		digits = malloc(n * IMAGE_DIGIT_PARTS * sizeof(lisp_digit));
+		for (i = 0; i < n; i++) {
+			if (image_get_uint(r, &len) < 0 || len > 0xFFFFFFFFUL) {
+				free(digits);
+				return image_bad(r);
+			}
+			for (k = 0; k < IMAGE_DIGIT_PARTS; k++)
+				digits[i * IMAGE_DIGIT_PARTS + k] = (lisp_digit)
+					(len >> (k * LISP_DIGIT_BITS) & LISP_DIGIT_MASK);
+		}
+		item = (lisp_value *) lisp_integer_from_digits(r->rt,
+			sign ? -1 : 1, digits, (int) (n * IMAGE_DIGIT_PARTS));
+		free(digits);
+		return item;
+	case IMAGE_SYMBOL:
+		if (image_get_uint(r, &n) < 0 || n >= r->nsymbols)
+			return image_bad(r);
+		if (!r->names[n].symbol)
+			r->names[n].symbol = lisp_symbol_new_len(r->rt,
+				(char *) r->buf + r->names[n].offset,
+				r->names[n].length, LS_CPY | LS_OWN);
+		return (lisp_value *) r->names[n].symbol;
+	case IMAGE_STRING:
+		if (image_get_length(r, &len) < 0)
+			return image_bad(r);
+		r->pos += len;
+		return (lisp_value *) lisp_string_new_len(r->rt,
+			(char *) r->buf + r->pos - len, len, LS_CPY | LS_OWN);
+	case IMAGE_LIST:
+		/* each item takes at least a byte */
+		if (image_get_length(r, &n) < 0 || n == 0)
+			return image_bad(r);
+		head = prev = NULL;
+		for (; n; n--) {
+			item = image_get_value(r, depth + 1);
+			lisp_error_check(item);
+			if (prev) {
+				prev->right = (lisp_value *) lisp_list_new(r->rt, item, NULL);
+				prev = (lisp_list *) prev->right;
+			} else {
+				head = prev = lisp_list_new(r->rt, item, NULL);
+			}
+		}
+		item = image_get_value(r, depth + 1);
+		lisp_error_check(item);
+		prev->right = item;
+		return (lisp_value *) head;
+	default:
+		return image_bad(r);
+	}
+}
+
+/*
+ * Return the value in the image in @a buf, or NULL with an error set when it
+ * is not a valid image.
+ */
+static lisp_value *image_decode(lisp_runtime *rt, char *buf, unsigned long length)
+{
+	struct image_reader r;
+	lisp_value *value = NULL;
+	unsigned long i, len;
+
+	r.rt = rt;
+	r.buf = (unsigned char *) buf;
+	r.pos = 5;
+	r.length = length;
+	r.names = NULL;
+
+	if (length < 5 || memcmp(buf, "FLIM", 4) != 0)
+		return image_bad(&r);
+	if (buf[4] != IMAGE_VERSION)
+		return lisp_error(rt, LE_SYNTAX, "image has an unsupported version");
+
+	/* each name takes at least a byte for its length */
+	if (image_get_length(&r, &r.nsymbols) < 0)
+		return image_bad(&r);
+	r.names = calloc(r.nsymbols + 1, sizeof(struct image_name));
+	for (i = 0; i < r.nsymbols; i++) {
+		if (image_get_length(&r, &len) < 0) {
+			image_bad(&r);
+			goto out;
+		}
+		r.names[i].offset = r.pos;
+		r.names[i].length = len;
+		r.pos += len;
+	}
+
+	value = image_get_value(&r, 0);
+	if (value && r.pos != r.length)
+		value = image_bad(&r);
+out:
+	free(r.names);
+	return value;
+}
+
+int lisp_write_image(lisp_runtime *rt, lisp_value *code, FILE *file)
+{
+	struct charbuf cb;
+	int rv;
+
+	cb_init(&cb, 256);
+	rv = image_encode(rt, code, &cb);
+	if (rv == 0 && fwrite(cb.buf, 1, cb.length, file) != (size_t) cb.length) {
+		lisp_error(rt, LE_FERROR, "error writing image");
+		rv = -1;
+	}
+	cb_destroy(&cb);
+	return rv;
+}
+
+/* Append the contents of @a file to @a cb. Returns -1 on a read error. */
+static int image_read_file(FILE *file, struct charbuf *cb)
+{
+	char chunk[4096];
+	size_t len;
+
+	do {
+		len = fread(chunk, 1, sizeof(chunk), file);
+		cb_concat_n(cb, chunk, len);
+	} while (len == sizeof(chunk));
+	return ferror(file) ? -1 : 0;
+}
+
+lisp_value *lisp_read_image(lisp_runtime *rt, FILE *file)
+{
+	struct charbuf cb;
+	lisp_value *value;
+
+	cb_init(&cb, 4096);
+	if (image_read_file(file, &cb) < 0)
+		value = lisp_error(rt, LE_FERROR, "error reading image");
+	else
+		value = image_decode(rt, cb.buf, cb.length);
+	cb_destroy(&cb);
+	return value;
+}
+
+void lisp_enable_module_cache(lisp_runtime *rt, char *dir)
+{
+	char *copy = malloc(strlen(dir) + 1);
+	strcpy(copy, dir);
+	free(rt->module_cache);
+	rt->module_cache = copy;
+}
+
+void lisp_disable_module_cache(lisp_runtime *rt)
+{
+	free(rt->module_cache);
+	rt->module_cache = NULL;
+}
+
+/*
+ * The key which begins a cache file, up to the digest of the source. Together,
+ * the device and inode identify the source file however its path was spelled,
+ * and its size and modification time tell whether it has changed since the
+ * image was made. Modification times are only kept to the second, so an edit
+ * which keeps the size within the same second would go unnoticed without the
+ * digest which follows (see cache_digest()).
+ */
+static void cache_key(struct charbuf *cb, struct stat *st)
+{
+	cb_concat(cb, "FLMC");
+	cb_append(cb, IMAGE_VERSION);
+	image_put_uint(cb, (unsigned long) st->st_dev);
+	image_put_uint(cb, (unsigned long) st->st_ino);
+	image_put_uint(cb, (unsigned long) st->st_size);
+	image_put_uint(cb, (unsigned long) st->st_mtime);
+}
+
+/*
+ * Append a digest of the rest of a file to a key, reading it a block at a time,
+ * and return to @a start. C89 has no 64 bit type, so the digest is two
+ * unrelated 32 bit hashes, FNV-1a and Jenkins' one-at-a-time, which are both
+ * cheap next to parsing the same bytes.
+ */
+static int cache_digest(struct charbuf *key, FILE *file, long start)
+{
+	unsigned char block[4096];
+	unsigned long fnv = 2166136261UL, oat = 0;
+	size_t len, i;
+
+	while ((len = fread(block, 1, sizeof(block), file)) > 0) {
+		for (i = 0; i < len; i++) {
+			fnv = ((fnv ^ block[i]) * 16777619UL) & 0xffffffffUL;
+			oat = (oat + block[i]) & 0xffffffffUL;
+			oat = (oat + (oat << 10)) & 0xffffffffUL;
+			oat ^= oat >> 6;
+		}
+	}
+	oat = (oat + (oat << 3)) & 0xffffffffUL;
+	oat ^= oat >> 11;
+	oat = (oat + (oat << 15)) & 0xffffffffUL;
+
+	if (ferror(file) || fseek(file, start, SEEK_SET) != 0)
+		return -1;
+	image_put_uint(key, fnv);
+	image_put_uint(key, oat);
+	return 0;
+}
+
+/* Write a cache file. Failures are ignored, since the cache is an optimization. */
+static void cache_store(lisp_runtime *rt, char *path, struct charbuf *key,
+                        lisp_value *code)
+{
+	struct charbuf cb;
+	char *tmp;
+	FILE *f;
+	int ok;
+
+	cb_init(&cb, 4096);
+	cb_concat_n(&cb, key->buf, key->length);
+	if (image_encode(rt, code, &cb) < 0) {
+		lisp_clear_error(rt);
+		cb_destroy(&cb);
+		return;
+	}
+
+	/*
+	 * Another process, or another runtime on a thread of this one, may be
+	 * loading the same module, so write a file of our own and rename it
+	 * into place, which replaces the old one at once.
+	 */
+	tmp = malloc(strlen(path) + 64);
+	sprintf(tmp, "%s.%ld.%lx.tmp", path, (long) getpid(),
+		(unsigned long) rt);
+	f = fopen(tmp, "wb");
+	if (f) {
+		ok = fwrite(cb.buf, 1, cb.length, f) == (size_t) cb.length;
+		ok = fclose(f) == 0 && ok;
+		if (!ok || rename(tmp, path) != 0)
+			remove(tmp);
+	}
+	free(tmp);
+	cb_destroy(&cb);
+}
+
+lisp_value *lisp_module_cache_load(lisp_runtime *rt, char *filename, FILE *file)
+{
+	struct charbuf key, cb;
+	struct stat st;
+	lisp_value *code = NULL;
+	int hashed = 0, failed = 0;
+	char *path;
+	long start;
+	FILE *f;
+
+	if (fstat(fileno(file), &st) != 0 || (start = ftell(file)) < 0)
+		return lisp_parse_progn_f(rt, file);
+
+	path = malloc(strlen(rt->module_cache) + 16);
+	sprintf(path, "%s/%08x.flim", rt->module_cache,
+		ht_string_hash(&filename) & 0xffffffffU);
+	cb_init(&key, 64);
+	cache_key(&key, &st);
+
+	/* hash the source only when the rest of the key already matches */
+	f = fopen(path, "rb");
+	if (f) {
+		cb_init(&cb, 4096);
+		if (image_read_file(f, &cb) == 0 && cb.length >= key.length &&
+				memcmp(cb.buf, key.buf, key.length) == 0) {
+			failed = cache_digest(&key, file, start) < 0;
+			hashed = 1;
+		}
+		if (hashed && !failed && cb.length >= key.length &&
+				memcmp(cb.buf, key.buf, key.length) == 0) {
+			code = image_decode(rt, cb.buf + key.length,
+				cb.length - key.length);
+			if (!code)
+				lisp_clear_error(rt);
+		}
+		cb_destroy(&cb);
+		fclose(f);
+	}
+
+	/* otherwise parse it, after hashing it for the new cache file */
+	if (!code && !failed && !hashed)
+		failed = cache_digest(&key, file, start) < 0;
+	if (failed) {
+		code = lisp_error(rt, LE_FERROR, "error reading module");
+	} else if (!code) {
+		code = lisp_parse_progn_f(rt, file);
+		if (code)
+			cache_store(rt, path, &key, code);
+	}
+
+	cb_destroy(&key);
+	free(path);
+	return code;
+}
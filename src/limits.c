@@ -0,0 +1,210 @@
+/*
+ * limits.c: bounds on the calls, time, stack depth and memory of evaluation
+ *
+ * Every call counts rt->poll_countdown down, and the one which takes it to zero
+ * calls lisp_poll(). With no limits set, the countdown starts so high that this
+ * never happens. Otherwise lisp_poll() runs often enough to notice a deadline,
+ * and exactly when the fuel runs out: the countdown never covers more calls
+ * than there is fuel for, and the calls it covered are only deducted from the
+ * fuel when it runs out. The maximum depth is enforced by lisp_stack_grow().
+ * The heap limit is checked as objects are created: once collecting garbage
+ * can't bring the heap back under it, the heap is marked as over, which fails
+ * the next call, and the next item pulled from a sequence, so that builtins
+ * which allocate in a loop stop too. While profiling, every call polls, and is
+ * handed to the profiler.
+ *
+ * Reading the clock needs clock_gettime(), which is POSIX.
+ *
+ * Stephen Brennan <stephen@brennan.io>
+ */
+#define _POSIX_C_SOURCE 199309L
+
+#include <limits.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "funlisp_internal.h"
+
+/* calls between polls while a deadline is set */
+#define LISP_POLL_INTERVAL 256
+
+double lisp_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Start a new countdown, covering no more calls than there is fuel for. */
+static void lisp_poll_reset(lisp_runtime *rt)
+{
+	long period = rt->deadline ? LISP_POLL_INTERVAL : LONG_MAX;
+
+	if (rt->profiling)
+		period = 1;
+
+	if (rt->fuel_enabled && rt->fuel < (unsigned long) period - 1)
+		period = rt->fuel + 1;
+	rt->poll_period = period;
+	rt->poll_countdown = period;
+}
+
+void lisp_limits_init(lisp_runtime *rt)
+{
+	rt->fuel_enabled = 0;
+	rt->fuel = 0;
+	rt->deadline = 0;
+	rt->max_depth = 0;
+	rt->max_heap = 0;
+	rt->heap_over = 0;
+	rt->yield = NULL;
+	rt->yield_arg = NULL;
+	lisp_poll_reset(rt);
+}
+
+void lisp_poll_soon(lisp_runtime *rt)
+{
+	/* keep the number of calls counted since the last reset */
+	if (rt->poll_countdown > 1) {
+		rt->poll_period -= rt->poll_countdown - 1;
+		rt->poll_countdown = 1;
+	}
+}
+
+/* Collect all the garbage we can, and return whether the heap is in bounds. */
+static int lisp_heap_collect(lisp_runtime *rt)
+{
+	if (rt->gc_threshold && rt->stack_base) {
+		lisp_gc_request_major(rt);
+		lisp_gc_collect(rt);
+		lisp_gc_finish_sweep(rt);
+	}
+	return rt->pool.bytes <= rt->max_heap;
+}
+
+void lisp_heap_exceeded(lisp_runtime *rt)
+{
+	/* garbage doesn't count, if we can get rid of it */
+	if (lisp_heap_collect(rt))
+		return;
+	rt->heap_over = 1;
+	lisp_poll_soon(rt);
+}
+
+/* Return why evaluation may not continue, or NULL when it may. */
+static char *lisp_limit_reached(lisp_runtime *rt, int *collected)
+{
+	if (rt->fuel_enabled && rt->fuel == 0)
+		return "out of fuel";
+	if (rt->deadline && lisp_now() >= rt->deadline)
+		return "deadline passed";
+	if (rt->max_heap && rt->pool.bytes > rt->max_heap) {
+		if (!*collected) {
+			*collected = 1;
+			if (lisp_heap_collect(rt))
+				return NULL;
+		}
+		return "heap limit exceeded";
+	}
+	return NULL;
+}
+
+int lisp_heap_check(lisp_runtime *rt, unsigned long bytes)
+{
+	int collected = 0;
+
+	/* the host may raise the limit, or free memory, from its yield hook */
+	while (rt->max_heap && rt->pool.bytes + bytes > rt->max_heap) {
+		if (!collected) {
+			collected = 1;
+			if (lisp_heap_collect(rt) &&
+			    rt->pool.bytes + bytes <= rt->max_heap)
+				break;
+		}
+		if (!rt->yield || rt->yield(rt, rt->yield_arg)) {
+			lisp_error(rt, LE_LIMIT, "heap limit exceeded");
+			return 0;
+		}
+	}
+	rt->heap_over = 0;
+	return 1;
+}
+
+int lisp_poll(lisp_runtime *rt, lisp_value *callee)
+{
+	int collected = 0;
+	char *why;
+
+	/* deduct the calls before this one */
+	if (rt->fuel_enabled)
+		rt->fuel -= rt->poll_period - rt->poll_countdown - 1;
+	rt->poll_period = rt->poll_countdown = 0;
+
+	while ((why = lisp_limit_reached(rt, &collected))) {
+		if (!rt->yield || rt->yield(rt, rt->yield_arg)) {
+			/* every call fails until the host lifts the limit */
+			rt->poll_period = rt->poll_countdown = 1;
+			lisp_error(rt, LE_LIMIT, why);
+			return 0;
+		}
+	}
+
+	rt->heap_over = 0;
+	if (rt->fuel_enabled)
+		rt->fuel--;
+	if (rt->profiling)
+		lisp_profile_call(rt, callee);
+	lisp_poll_reset(rt);
+	return 1;
+}
+
+void lisp_set_fuel(lisp_runtime *rt, unsigned long calls)
+{
+	rt->fuel_enabled = 1;
+	rt->fuel = calls;
+	/* the next call starts a countdown which the fuel covers */
+	rt->poll_period = rt->poll_countdown = 1;
+}
+
+void lisp_disable_fuel(lisp_runtime *rt)
+{
+	rt->fuel_enabled = 0;
+	rt->poll_period = rt->poll_countdown = 1;
+}
+
+unsigned long lisp_get_fuel(lisp_runtime *rt)
+{
+	if (!rt->fuel_enabled)
+		return ULONG_MAX;
+	return rt->fuel - (rt->poll_period - rt->poll_countdown);
+}
+
+void lisp_set_deadline(lisp_runtime *rt, unsigned long msec)
+{
+	rt->deadline = msec ? lisp_now() + msec / 1e3 : 0;
+	lisp_poll_soon(rt);
+}
+
+void lisp_set_max_depth(lisp_runtime *rt, unsigned int depth)
+{
+	rt->max_depth = depth;
+	/* the stack may not grow again, so it must not exceed the limit */
+	if (depth && rt->stack_size > depth && rt->stack_depth <= depth) {
+		rt->stack_size = depth;
+		rt->stack = realloc(rt->stack,
+			rt->stack_size * sizeof(lisp_value *));
+	}
+}
+
+void lisp_set_max_heap(lisp_runtime *rt, unsigned long bytes)
+{
+	rt->max_heap = bytes;
+	rt->heap_over = 0;
+	lisp_poll_soon(rt);
+}
+
+void lisp_set_yield(lisp_runtime *rt, lisp_yield_func func, void *arg)
+{
+	rt->yield = func;
+	rt->yield_arg = arg;
+}
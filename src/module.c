@@ -19,7 +19,7 @@ static lisp_value *lisp_os_getenv(lisp_runtime *rt, lisp_scope *scope,
 	if (!lisp_get_args(rt, arguments, "S", &str))
 		return NULL;
 
-	res = getenv(str->s);
+	res = getenv(lisp_string_get(str));
 	if (res)
 		return (lisp_value*) lisp_string_new(rt, res, LS_CPY | LS_OWN);
 	else
@@ -37,9 +37,9 @@ lisp_module *create_os_module(lisp_runtime *rt)
 
 void lisp_register_module(lisp_runtime *rt, lisp_module *m)
 {
-	/* TODO this depends on symbols and strings hashing to same value and
-	 * comparing equal */
-	lisp_scope_bind(rt->modules, (lisp_symbol*)m->name, (lisp_value*) m);
+	/* the name may be a string, but scopes are keyed by interned symbols */
+	lisp_symbol *name = lisp_symbol_new(rt, m->name->s, LS_CPY | LS_OWN);
+	lisp_scope_bind(rt->modules, name, (lisp_value*) m);
 }
 
 lisp_module *lisp_lookup_module(lisp_runtime *rt, lisp_symbol *name)
@@ -66,7 +66,23 @@ lisp_scope *lisp_module_get_scope(lisp_module *module)
 	return module->contents;
 }
 
-lisp_module *lisp_import_file(lisp_runtime *rt, lisp_string *name, lisp_string *file)
+/* evaluate each expression of a progn, as lisp_load_file() does */
+static lisp_value *import_code(lisp_runtime *rt, lisp_scope *scope, lisp_list *code)
+{
+	lisp_value *v = lisp_nil_new(rt);
+
+	for (code = (lisp_list *) code->right; !lisp_nil_p((lisp_value *) code);
+			code = (lisp_list *) code->right) {
+		if (rt->vm)
+			v = lisp_vm_eval(rt, scope, code->left);
+		else
+			v = lisp_eval(rt, scope, code->left);
+		lisp_error_check(v);
+	}
+	return v;
+}
+
+static lisp_module *import_file(lisp_runtime *rt, lisp_string *name, lisp_string *file)
 {
 	FILE *f;
 	lisp_scope *builtins = lisp_new_default_scope(rt);
@@ -75,12 +91,20 @@ lisp_module *lisp_import_file(lisp_runtime *rt, lisp_string *name, lisp_string *
 	lisp_value *v;
 	modscope->up = builtins;
 
-	f = fopen(file->s, "r");
+	f = fopen(lisp_string_get(file), "r");
 	if (!f) {
 		return (lisp_module*) lisp_error(rt, LE_ERRNO, "error opening file for import");
 	}
 
-	v = lisp_load_file(rt, modscope, f);
+	if (rt->module_cache) {
+		v = lisp_module_cache_load(rt, lisp_string_get(file), f);
+		fclose(f);
+		lisp_error_check(v);
+		v = import_code(rt, modscope, (lisp_list *) v);
+	} else {
+		v = lisp_load_file(rt, modscope, f);
+		fclose(f);
+	}
 	lisp_error_check(v);
 
 	module = (lisp_module *)lisp_new(rt, type_module);
@@ -91,6 +115,16 @@ lisp_module *lisp_import_file(lisp_runtime *rt, lisp_string *name, lisp_string *
 	return module;
 }
 
+lisp_module *lisp_import_file(lisp_runtime *rt, lisp_string *name, lisp_string *file)
+{
+	lisp_module *module;
+	int outer = lisp_gc_enter(rt, &module, name, file, NULL);
+	module = import_file(rt, name, file);
+	if (outer)
+		lisp_gc_leave(rt);
+	return module;
+}
+
 lisp_module *lisp_do_import(lisp_runtime *rt, lisp_symbol *name)
 {
 	lisp_module *m;
@@ -7,7 +7,6 @@
 #include <stdlib.h>
 #include <stddef.h>
 #include <assert.h>
-#include <ctype.h>
 #include <string.h>
 
 #include "funlisp_internal.h"
@@ -32,35 +31,62 @@ typedef struct {
 
 #define COMMENT ';'
 
+/*
+ * Lexing
+ *
+ * The scanning loops look characters up in a table of classes rather than
+ * calling the <ctype.h> functions, which depend on the locale and are not
+ * defined for negative chars. Comments and the bodies of strings can be long,
+ * so they are skipped with strcspn(), which C libraries implement a word or a
+ * vector at a time. Symbols and strings without escapes are created directly
+ * from the input, without copying them into a buffer first, and symbols which
+ * already exist are found without any allocation.
+ */
+#define CC_SPACE  0x1 /* isspace() in the C locale */
+#define CC_DIGIT  0x2
+#define CC_SYMEND 0x4 /* ends a symbol: space, ')', quote, comment, or NUL */
+
+#define cc(c, class) (lisp_cclass[(unsigned char) (c)] & (class))
+
+#define W (CC_SPACE | CC_SYMEND)
+#define D CC_DIGIT
+#define E CC_SYMEND
+static const unsigned char lisp_cclass[256] = {
+	E, 0, 0, 0, 0, 0, 0, 0, 0, W, W, W, W, W, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	W, 0, 0, 0, 0, 0, 0, E, 0, E, 0, 0, 0, 0, 0, 0,
+	D, D, D, D, D, D, D, D, D, D, 0, E, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	/* the rest, non-ASCII bytes, are zero */
+};
+#undef W
+#undef D
+#undef E
 
 static result lisp_parse_value_internal(lisp_runtime *rt, char *input, int index);
 
 static result lisp_parse_integer(lisp_runtime *rt, char *input, int index)
 {
-	int n, rv;
-	lisp_integer *v = (lisp_integer*)lisp_new(rt, type_integer);
-	rv = sscanf(input + index, "%d%n", &v->x, &n);
-	if (rv != 1) {
-		rt->error = "syntax error: error parsing integer";
-		return_result_err(NULL, index, LE_SYNTAX);
-	} else {
-		return_result(v, index + n);
-	}
+	int i;
+
+	for (i = index; cc(input[i], CC_DIGIT); i++)
+		;
+	return_result(lisp_integer_parse(rt, input + index, i - index), i);
 }
 
 static int skip_space_and_comments(char *input, int index)
 {
 	for (;;) {
-		while (isspace(input[index])) {
+		while (cc(input[index], CC_SPACE)) {
 			index++;
 		}
-		if (input[index] && input[index] == COMMENT) {
-			while (input[index] && input[index] != '\n') {
-				index++;
-			}
-		} else {
+		if (input[index] != COMMENT) {
 			return index;
 		}
+		index += strcspn(input + index, "\n");
 	}
 }
 
@@ -88,29 +114,36 @@ static char lisp_escape(char escape)
 
 static result lisp_parse_string(lisp_runtime *rt, char *input, int index)
 {
-	int i;
+	int i, n;
 	struct charbuf cb;
 	lisp_string *str;
 
 	i = index + 1;
-	cb_init(&cb, 16);
-	while (input[i] && input[i] != '"') {
-		if (input[i] == '\\') {
-			cb_append(&cb, lisp_escape(input[++i]));
-		} else {
-			cb_append(&cb, input[i]);
-		}
-		i++;
+	n = strcspn(input + i, "\"\\");
+	if (input[i + n] == '"') {
+		/* no escapes, so the string is exactly the input */
+		str = lisp_string_new_len(rt, input + i, n, LS_CPY | LS_OWN);
+		return_result(str, i + n + 1);
 	}
-	if (!input[i]) {
+
+	cb_init(&cb, n + 16);
+	while (input[i + n] == '\\' && input[i + n + 1]) {
+		cb_concat_n(&cb, input + i, n);
+		cb_append(&cb, lisp_escape(input[i + n + 1]));
+		i += n + 2;
+		n = strcspn(input + i, "\"\\");
+	}
+	cb_concat_n(&cb, input + i, n);
+	i += n;
+	if (input[i] != '"') {
 		cb_destroy(&cb);
 		rt->error = "unexpected eof while parsing string";
 		return_result_err(NULL, i, LE_SYNTAX);
 	}
-	cb_trim(&cb);
-	str = (lisp_string*)lisp_new(rt, type_string);
-	str->s = cb.buf;
-	str->can_free = 1;
+	/* short strings are copied into the object, longer ones keep cb.buf */
+	if ((unsigned long) cb.length >= LISP_TEXT_INLINE)
+		cb_trim(&cb);
+	str = lisp_string_new_len(rt, cb.buf, cb.length, LS_OWN);
 	i++;
 	return_result(str, i);
 }
@@ -175,39 +208,32 @@ static result lisp_parse_list_or_sexp(lisp_runtime *rt, char *input, int index)
 	}
 }
 
-static lisp_value *split_symbol(lisp_runtime *rt, char *string, int dotcount, int remain)
+/*
+ * Turn a symbol of @a len bytes containing dots, like a.b.c, into a chain of
+ * getattr calls: (getattr (getattr a 'b) 'c).
+ */
+static lisp_value *split_symbol(lisp_runtime *rt, char *string, int len)
 {
-	char *delim, *tok;
-	int i, len;
+	char *end = string + len, *delim;
 	lisp_value *prev = NULL;
 	lisp_symbol *sym;
 	lisp_list *list;
 	lisp_symbol *getattr = lisp_symbol_new(rt, "getattr", 0);
 
 	/* Create the first symbol, which is the left hand side */
-	delim = strchr(string, '.');
-	len = (int) (delim - string);
-	tok = malloc(len + 1);
-	strncpy(tok, string, len);
-	tok[len] = '\0';
-	sym = lisp_symbol_new(rt, tok, LS_OWN);
-	prev = (lisp_value*) sym;
-	string = delim + 1;
-	remain -= len + 1;
+	delim = memchr(string, '.', len);
+	prev = (lisp_value*) lisp_symbol_new_len(rt, string, delim - string,
+	                                         LS_CPY | LS_OWN);
 
 	/* Create a "getattr" for each right hand side remaining */
-	for (i = 0; i < dotcount; i++) {
+	while (delim < end) {
 		/* Attribute symbol */
-		if (i < dotcount - 1) {
-			delim = strchr(string, '.');
-			len = (int) (delim - string);
-		} else {
-			len = remain;
-		}
-		tok = malloc(len + 1);
-		strncpy(tok, string, len);
-		tok[len] = '\0';
-		sym = lisp_symbol_new(rt, tok, LS_OWN);
+		string = delim + 1;
+		delim = memchr(string, '.', end - string);
+		if (!delim)
+			delim = end;
+		sym = lisp_symbol_new_len(rt, string, delim - string,
+		                          LS_CPY | LS_OWN);
 
 		/* Create (getattr PREV 'tok) */
 		list = lisp_list_new(rt,
@@ -221,8 +247,6 @@ static lisp_value *split_symbol(lisp_runtime *rt, char *string, int dotcount, in
 			)
 		);
 		prev = (lisp_value *) list;
-		string = delim + 1;
-		remain -= len + 1;
 	}
 	return prev;
 }
@@ -231,12 +255,9 @@ static result lisp_parse_symbol(lisp_runtime *rt, char *input, int index)
 {
 	int n = 0;
 	int dotcount = 0;
-	char *copy;
 	lisp_symbol *s;
 
-	while (input[index + n] && !isspace(input[index + n]) &&
-	       input[index + n] != ')' && /* input[index + n] != '.' && */
-	       input[index + n] != '\'' && input[index + n] != COMMENT) {
+	while (!cc(input[index + n], CC_SYMEND)) {
 		if (input[index + n] == '.')
 			dotcount++;
 		n++;
@@ -251,15 +272,11 @@ static result lisp_parse_symbol(lisp_runtime *rt, char *input, int index)
 			rt->error = "unexpected '.' at beginning or end of symbol";
 			return_result_err(NULL, index, LE_SYNTAX);
 		}
-		return_result(split_symbol(rt, input + index, dotcount, n), index + n);
+		return_result(split_symbol(rt, input + index, n), index + n);
 	}
 
-	copy = malloc(n + 1);
-	strncpy(copy, input + index, n);
-	copy[n] = '\0';
-	/* use lisp_symbol_new(), ensuring that we use the symbol cache if it
-	 * exists */
-	s = lisp_symbol_new(rt, copy, LS_OWN);
+	/* symbols are interned, so this only copies the name of a new one */
+	s = lisp_symbol_new_len(rt, input + index, n, LS_CPY | LS_OWN);
 	return_result(s, index + n);
 }
 
@@ -304,7 +321,7 @@ static result lisp_parse_value_internal(lisp_runtime *rt, char *input, int index
 	case '\'':
 		return lisp_parse_quote(rt, input, index);
 	default:
-		if (isdigit(input[index])) {
+		if (cc(input[index], CC_DIGIT)) {
 			return lisp_parse_integer(rt, input, index);
 		} else {
 			return lisp_parse_symbol(rt, input, index);
@@ -360,48 +377,289 @@ lisp_value *lisp_parse_progn(lisp_runtime *rt, char *input)
 	}
 }
 
-static char *read_file(FILE *input)
+/*
+ * Incremental parsing
+ *
+ * A lisp_parser accepts input in chunks and scans it for the end of each top
+ * level expression, keeping just enough state to resume in the middle of one:
+ * the depth of parentheses, and whether it is within a string, an escape, a
+ * comment, or an atom. Whitespace and comments between expressions are
+ * dropped. Once an expression is complete, its text is parsed by the recursive
+ * descent parser above, and the buffer holds only the input which follows it.
+ * The scanner must agree with that parser about where atoms end, which is why
+ * a symbol may contain '(' and '"' but an integer ends at the first non-digit.
+ */
+enum lisp_parser_state {
+	PS_SPACE,   /* between items */
+	PS_COMMENT,
+	PS_STRING,
+	PS_ESCAPE,  /* after a backslash in a string */
+	PS_INTEGER,
+	PS_SYMBOL
+};
+
+struct lisp_parser {
+	lisp_runtime *rt;
+	char *buf;
+	unsigned long start;     /* beginning of the current expression */
+	unsigned long scan;      /* first byte not yet scanned */
+	unsigned long length;    /* bytes of input in buf */
+	unsigned long allocated; /* always more than length, to fit a NUL */
+	int line;                /* newlines dropped from the beginning of buf */
+	int depth;
+	int begun;               /* the current expression has begun */
+	int quoted;              /* after a quote or dot, ')' is a value */
+	int finished;            /* no more input will be fed */
+	enum lisp_parser_state state;
+};
+
+lisp_parser *lisp_parser_new(lisp_runtime *rt)
 {
-	size_t bufsize = 1024;
-	size_t length = 0;
-	char *buf = malloc(bufsize);
-
-	while (!feof(input) && !ferror(input)) {
-		length += fread(buf + length, sizeof(char), bufsize - length, input);
-		if (length >= bufsize) {
-			bufsize *= 2;
-			buf = realloc(buf, bufsize);
+	lisp_parser *parser = malloc(sizeof(lisp_parser));
+	parser->rt = rt;
+	parser->allocated = 1024;
+	parser->buf = malloc(parser->allocated);
+	parser->buf[0] = '\0';
+	parser->start = 0;
+	parser->scan = 0;
+	parser->length = 0;
+	parser->line = 0;
+	parser->depth = 0;
+	parser->begun = 0;
+	parser->quoted = 0;
+	parser->finished = 0;
+	parser->state = PS_SPACE;
+	return parser;
+}
+
+void lisp_parser_free(lisp_parser *parser)
+{
+	free(parser->buf);
+	free(parser);
+}
+
+void lisp_parser_feed(lisp_parser *parser, char *input, unsigned long len)
+{
+	unsigned long i;
+
+	/* drop the expressions which were already parsed */
+	if (parser->start) {
+		for (i = 0; i < parser->start; i++)
+			if (parser->buf[i] == '\n')
+				parser->line++;
+		parser->length -= parser->start;
+		parser->scan -= parser->start;
+		memmove(parser->buf, parser->buf + parser->start, parser->length);
+		parser->start = 0;
+	}
+
+	if (parser->length + len >= parser->allocated) {
+		while (parser->length + len >= parser->allocated)
+			parser->allocated *= 2;
+		parser->buf = realloc(parser->buf, parser->allocated);
+	}
+	memcpy(parser->buf + parser->length, input, len);
+	parser->length += len;
+	parser->buf[parser->length] = '\0'; /* stops strcspn() in the scanner */
+}
+
+void lisp_parser_finish(lisp_parser *parser)
+{
+	parser->finished = 1;
+}
+
+int lisp_parser_pending(lisp_parser *parser)
+{
+	return parser->begun;
+}
+
+/*
+ * Scan the input until the end of the current expression. Return true when it
+ * is complete, or false when more input is needed.
+ */
+static int lisp_parser_scan(lisp_parser *parser)
+{
+	char c;
+
+	for (; parser->scan < parser->length; parser->scan++) {
+		c = parser->buf[parser->scan];
+		switch (parser->state) {
+		case PS_COMMENT:
+			if (c == '\n')
+				parser->state = PS_SPACE;
+			else if (c) /* skip to just before the newline, or the end */
+				parser->scan += strcspn(parser->buf + parser->scan, "\n") - 1;
+			break;
+		case PS_STRING:
+			if (c == '\\') {
+				parser->state = PS_ESCAPE;
+			} else if (c == '"') {
+				parser->state = PS_SPACE;
+				if (!parser->depth) {
+					parser->scan++;
+					return 1;
+				}
+			} else if (c) {
+				parser->scan += strcspn(parser->buf + parser->scan, "\"\\") - 1;
+			}
+			break;
+		case PS_ESCAPE:
+			parser->state = PS_STRING;
+			break;
+		case PS_INTEGER:
+		case PS_SYMBOL:
+			if (parser->state == PS_INTEGER ? cc(c, CC_DIGIT) : !cc(c, CC_SYMEND))
+				break;
+			/* c begins the next item */
+			parser->state = PS_SPACE;
+			if (!parser->depth)
+				return 1;
+			/* fall through */
+		case PS_SPACE:
+			if (cc(c, CC_SPACE)) {
+				break;
+			} else if (c == COMMENT) {
+				parser->state = PS_COMMENT;
+				break;
+			}
+			parser->begun = 1;
+			if (c == '\'' || c == '`' || c == ',' ||
+					(c == '.' && parser->depth && !parser->quoted)) {
+				/* a quote, or the dot of an s-expression */
+				parser->quoted = 1;
+				break;
+			}
+			if (c == '(') {
+				parser->depth++;
+			} else if (c == ')') {
+				/*
+				 * Where a value is expected, such as at the top
+				 * level, ')' parses as nil rather than closing
+				 * a list.
+				 */
+				if (parser->depth && !parser->quoted)
+					parser->depth--;
+				if (!parser->depth) {
+					parser->scan++;
+					return 1;
+				}
+			} else if (c == '"') {
+				parser->state = PS_STRING;
+			} else if (cc(c, CC_DIGIT)) {
+				parser->state = PS_INTEGER;
+			} else {
+				parser->state = PS_SYMBOL;
+			}
+			parser->quoted = 0;
+			break;
 		}
+		/* drop the whitespace and comments between expressions */
+		if (!parser->begun)
+			parser->start = parser->scan + 1;
 	}
 
-	if (feof(input)) {
-		buf[length] = '\0';
-		return buf;
-	} else {
-		free(buf);
-		return NULL;
+	/* at the end of the input, a symbol or integer is complete */
+	return parser->finished && parser->begun && parser->depth == 0 &&
+		(parser->state == PS_INTEGER || parser->state == PS_SYMBOL);
+}
+
+int lisp_parser_next(lisp_parser *parser, lisp_value **output)
+{
+	lisp_runtime *rt = parser->rt;
+	int bytes;
+	char saved;
+
+	*output = NULL;
+	if (!lisp_parser_scan(parser)) {
+		if (!parser->finished || !parser->begun)
+			return 0;
+		/* the input ended within an expression, let the parser say how */
+		parser->scan = parser->length;
+	}
+
+	saved = parser->buf[parser->scan];
+	parser->buf[parser->scan] = '\0';
+	bytes = lisp_parse_value(rt, parser->buf, (int) parser->start, output);
+	parser->buf[parser->scan] = saved;
+	if (bytes < 0)
+		rt->error_line += parser->line;
+	else
+		parser->scan = parser->start + bytes; /* in case we overshot */
+
+	/* after an error, carry on with the next expression */
+	parser->start = parser->scan;
+	parser->begun = 0;
+	parser->quoted = 0;
+	parser->depth = 0;
+	parser->state = PS_SPACE;
+	return bytes < 0 ? -1 : 1;
+}
+
+/*
+ * Feed @a parser from @a file until it has an expression, or the file ends.
+ * Returns as lisp_parser_next(), except that on a read error, it is set in the
+ * runtime and -1 is returned.
+ */
+static int lisp_parser_next_f(lisp_parser *parser, FILE *file,
+                              lisp_value **output)
+{
+	char chunk[4096];
+	size_t len;
+	int rv;
+
+	while ((rv = lisp_parser_next(parser, output)) == 0 && !parser->finished) {
+		len = fread(chunk, 1, sizeof(chunk), file);
+		if (ferror(file)) {
+			lisp_error(parser->rt, LE_FERROR, "error reading from input file");
+			return -1;
+		}
+		lisp_parser_feed(parser, chunk, len);
+		if (feof(file))
+			lisp_parser_finish(parser);
 	}
+	return rv;
 }
 
 lisp_value *lisp_parse_progn_f(lisp_runtime *rt, FILE *input)
 {
-	lisp_value *result;
-	char *input_string;
-	
-	input_string = read_file(input);
-	if (!input_string) {
-		rt->error = "error reading from input file";
-		rt->err_num = LE_FERROR;
-		return NULL;
+	lisp_parser *parser = lisp_parser_new(rt);
+	lisp_list *final_result, *prev;
+	lisp_value *expression;
+	int rv;
+
+	final_result = (lisp_list*) lisp_new(rt, type_list);
+	final_result->left = (lisp_value*)lisp_symbol_new(rt, "progn", 0);
+	prev = final_result;
+	while ((rv = lisp_parser_next_f(parser, input, &expression)) > 0) {
+		prev->right = (lisp_value*) lisp_list_new(rt, expression, NULL);
+		prev = (lisp_list*) prev->right;
 	}
-	result = lisp_parse_progn(rt, input_string);
-	free(input_string);
-	return result;
+	lisp_parser_free(parser);
+	if (rv < 0)
+		return NULL;
+	prev->right = lisp_nil_new(rt);
+	return (lisp_value*) final_result;
 }
 
 lisp_value *lisp_load_file(lisp_runtime *rt, lisp_scope *scope, FILE *input)
 {
-	lisp_value *progn = lisp_parse_progn_f(rt, input);
-	lisp_error_check(progn);
-	return lisp_eval(rt, scope, progn);
+	lisp_parser *parser = lisp_parser_new(rt);
+	lisp_value *expression, *result = lisp_nil_new(rt);
+	int rv;
+	/* so that the garbage of each expression is collected while parsing */
+	int outer = lisp_gc_enter(rt, &result, scope, NULL, NULL);
+
+	/* evaluate each expression as soon as it is parsed */
+	while ((rv = lisp_parser_next_f(parser, input, &expression)) > 0) {
+		if (rt->vm)
+			result = lisp_vm_eval(rt, scope, expression);
+		else
+			result = lisp_eval(rt, scope, expression);
+		if (!result)
+			break;
+	}
+	lisp_parser_free(parser);
+	if (outer)
+		lisp_gc_leave(rt);
+	return rv < 0 ? NULL : result;
 }
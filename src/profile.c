@@ -0,0 +1,262 @@
+/*
+ * profile.c: counting calls, and sampling the stack of calls in progress
+ *
+ * While profiling, lisp_poll() runs on every call, and it hands the callee to
+ * lisp_profile_call(), which counts the call under the callee's name. Once the
+ * interval has passed, the next call or return takes a sample of the stack,
+ * weighted by the time since the previous sample. Each function keeps the time
+ * of the samples which had it anywhere on the stack (inclusive) and on top
+ * (exclusive), and each distinct stack keeps the time of its samples, for the
+ * flame graph. Since the stack only changes at calls and returns, sampling at
+ * each of them would time every call exactly.
+ *
+ * Functions and stacks are both entries, named by the function or by the
+ * folded stack, in tables which own their entries and names.
+ *
+ * Stephen Brennan <stephen@brennan.io>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "funlisp_internal.h"
+#include "charbuf.h"
+
+struct lisp_prof_entry {
+	char *name;
+	unsigned long calls;
+	double inclusive;     /* in seconds */
+	double exclusive;
+	unsigned long sample; /* the last sample counted in inclusive */
+};
+
+struct lisp_profile {
+	struct ptable funcs;
+	struct ptable stacks;
+	struct charbuf folded; /* the stack being sampled */
+	double interval;
+	double last;           /* time of the previous sample */
+	unsigned long samples;
+};
+
+static unsigned int lisp_prof_hash(void *key)
+{
+	return ht_string_hash(&((struct lisp_prof_entry *) key)->name);
+}
+
+static int lisp_prof_compare(void *left, void *right)
+{
+	return strcmp(((struct lisp_prof_entry *) left)->name,
+		((struct lisp_prof_entry *) right)->name);
+}
+
+static struct lisp_prof_entry *lisp_prof_entry(struct ptable *table,
+                                               char *name)
+{
+	struct lisp_prof_entry key, *e;
+
+	key.name = name;
+	e = pt_get_key(table, &key);
+	if (!e) {
+		e = calloc(1, sizeof(*e));
+		e->name = malloc(strlen(name) + 1);
+		strcpy(e->name, name);
+		pt_insert(table, e, e);
+	}
+	return e;
+}
+
+static void lisp_prof_clear(struct ptable *table)
+{
+	struct iterator it = pt_iter_keys(table);
+	struct lisp_prof_entry *e;
+
+	while (it.has_next(&it)) {
+		e = it.next(&it);
+		free(e->name);
+		free(e);
+	}
+	it.close(&it);
+	pt_destroy(table);
+}
+
+static char *lisp_prof_name(lisp_value *callee)
+{
+	lisp_lambda *lambda;
+
+	if (lisp_type_of(callee) == type_builtin)
+		return ((lisp_builtin *) callee)->name;
+	if (lisp_type_of(callee) == type_lambda) {
+		lambda = (lisp_lambda *) callee;
+		return lambda->first_binding ? lambda->first_binding->s
+			: "(anonymous)";
+	}
+	return (char *) lisp_type_of(callee)->name;
+}
+
+static void lisp_prof_sample(lisp_runtime *rt, double weight)
+{
+	struct lisp_profile *p = rt->profile;
+	struct lisp_prof_entry *e = NULL;
+	unsigned int i;
+	char *name;
+
+	/* time outside of any call belongs to the host */
+	if (!rt->stack_depth)
+		return;
+
+	p->samples++;
+	cb_clear(&p->folded);
+	for (i = 0; i < rt->stack_depth; i++) {
+		name = lisp_prof_name(rt->stack[i]);
+		e = lisp_prof_entry(&p->funcs, name);
+		/* recursion counts once towards the inclusive time */
+		if (e->sample != p->samples) {
+			e->sample = p->samples;
+			e->inclusive += weight;
+		}
+		if (i)
+			cb_append(&p->folded, ';');
+		cb_concat(&p->folded, name);
+	}
+	e->exclusive += weight;
+	lisp_prof_entry(&p->stacks, p->folded.buf)->inclusive += weight;
+}
+
+void lisp_profile_return(lisp_runtime *rt)
+{
+	struct lisp_profile *p = rt->profile;
+	double now = lisp_now();
+
+	if (now - p->last >= p->interval) {
+		lisp_prof_sample(rt, now - p->last);
+		p->last = now;
+	}
+}
+
+void lisp_profile_call(lisp_runtime *rt, lisp_value *callee)
+{
+	lisp_prof_entry(&rt->profile->funcs, lisp_prof_name(callee))->calls++;
+	lisp_profile_return(rt);
+}
+
+void lisp_profile_start(lisp_runtime *rt, unsigned long usec)
+{
+	struct lisp_profile *p = rt->profile;
+
+	if (p) {
+		lisp_prof_clear(&p->funcs);
+		lisp_prof_clear(&p->stacks);
+	} else {
+		p = rt->profile = malloc(sizeof(*p));
+		pt_init(&p->funcs, lisp_prof_hash, lisp_prof_compare);
+		pt_init(&p->stacks, lisp_prof_hash, lisp_prof_compare);
+		cb_init(&p->folded, 256);
+	}
+	p->interval = usec / 1e6;
+	p->last = lisp_now();
+	p->samples = 0;
+	rt->profiling = 1;
+	lisp_poll_soon(rt);
+}
+
+void lisp_profile_stop(lisp_runtime *rt)
+{
+	double now;
+
+	if (!rt->profiling)
+		return;
+	now = lisp_now();
+	lisp_prof_sample(rt, now - rt->profile->last);
+	rt->profiling = 0;
+	/* go back to polling only as often as the limits need */
+	lisp_poll_soon(rt);
+}
+
+void lisp_profile_free(lisp_runtime *rt)
+{
+	struct lisp_profile *p = rt->profile;
+
+	if (!p)
+		return;
+	lisp_prof_clear(&p->funcs);
+	lisp_prof_clear(&p->stacks);
+	cb_destroy(&p->folded);
+	free(p);
+	rt->profile = NULL;
+	rt->profiling = 0;
+}
+
+/* Return the entries of a table in an array, which the caller frees. */
+static struct lisp_prof_entry **lisp_prof_entries(struct ptable *table)
+{
+	struct lisp_prof_entry **entries;
+	struct iterator it = pt_iter_keys(table);
+	unsigned long i = 0;
+
+	entries = malloc((pt_length(table) + 1) * sizeof(*entries));
+	while (it.has_next(&it))
+		entries[i++] = it.next(&it);
+	it.close(&it);
+	return entries;
+}
+
+static int lisp_prof_by_exclusive(const void *left, const void *right)
+{
+	struct lisp_prof_entry *l = *(struct lisp_prof_entry **) left;
+	struct lisp_prof_entry *r = *(struct lisp_prof_entry **) right;
+
+	if (l->exclusive != r->exclusive)
+		return l->exclusive < r->exclusive ? 1 : -1;
+	if (l->inclusive != r->inclusive)
+		return l->inclusive < r->inclusive ? 1 : -1;
+	if (l->calls != r->calls)
+		return l->calls < r->calls ? 1 : -1;
+	return strcmp(l->name, r->name);
+}
+
+static int lisp_prof_by_name(const void *left, const void *right)
+{
+	return strcmp((*(struct lisp_prof_entry **) left)->name,
+		(*(struct lisp_prof_entry **) right)->name);
+}
+
+void lisp_profile_report(lisp_runtime *rt, FILE *file)
+{
+	struct lisp_prof_entry **entries;
+	unsigned long i, n;
+
+	if (!rt->profile)
+		return;
+	n = pt_length(&rt->profile->funcs);
+	entries = lisp_prof_entries(&rt->profile->funcs);
+	qsort(entries, n, sizeof(*entries), lisp_prof_by_exclusive);
+
+	fprintf(file, "%12s %14s %14s  %s\n", "calls", "inclusive ms",
+		"exclusive ms", "function");
+	for (i = 0; i < n; i++)
+		fprintf(file, "%12lu %14.3f %14.3f  %s\n", entries[i]->calls,
+			entries[i]->inclusive * 1e3,
+			entries[i]->exclusive * 1e3, entries[i]->name);
+	fprintf(file, "(%lu samples)\n", rt->profile->samples);
+	free(entries);
+}
+
+void lisp_profile_write_folded(lisp_runtime *rt, FILE *file)
+{
+	struct lisp_prof_entry **entries;
+	unsigned long i, n, usec;
+
+	if (!rt->profile)
+		return;
+	n = pt_length(&rt->profile->stacks);
+	entries = lisp_prof_entries(&rt->profile->stacks);
+	qsort(entries, n, sizeof(*entries), lisp_prof_by_name);
+
+	for (i = 0; i < n; i++) {
+		usec = (unsigned long) (entries[i]->inclusive * 1e6 + 0.5);
+		if (usec)
+			fprintf(file, "%s %lu\n", entries[i]->name, usec);
+	}
+	free(entries);
+}
@@ -0,0 +1,266 @@
+/*
+ * ptable.c: hash table of pointers, with stored hashes
+ *
+ * The table uses linear probing over a power-of-two number of slots, so a
+ * probe sequence walks adjacent slots and the index is found by masking rather
+ * than by a division. The hash function supplied by the user is passed through
+ * a finalizer which mixes all of its bits into the low ones, since a mask would
+ * otherwise see only the low bits of a weak hash (for instance, of an aligned
+ * pointer).
+ *
+ * Each slot holds the mixed hash of its key. During a probe, a slot is only
+ * compared with the equal function when the hashes match, and when the table
+ * grows, the items are moved to their new slots without hashing them again.
+ * Removal shifts the following items of the probe sequence back instead of
+ * leaving a gravestone, so lookups never probe past deleted items.
+ *
+ * Stephen Brennan <stephen@brennan.io>
+ */
+#include <stdlib.h>
+
+#include "ptable.h"
+
+#define PTABLE_INITIAL_SIZE 8
+
+/* grow the table before more than half of its slots are in use */
+#define pt_too_full(table) (2 * ((table)->length + 1) > (table)->allocated)
+
+/*
+ * The 32 bit finalizer of MurmurHash3.
+ */
+static unsigned int pt_mix(unsigned int h)
+{
+	h ^= h >> 16;
+	h *= 0x85ebca6bU;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35U;
+	h ^= h >> 16;
+	return h & 0xffffffffU;
+}
+
+/*
+ * Return the index of the slot containing @a key, or of the empty slot where
+ * it would be inserted. The table must have at least one empty slot.
+ */
+static unsigned long pt_find(struct ptable const *table, void *key,
+                             unsigned int hash)
+{
+	unsigned long mask = table->allocated - 1;
+	unsigned long i = hash & mask;
+	struct pt_slot *slot;
+
+	for (;;) {
+		slot = &table->slots[i];
+		if (slot->key == key || !slot->key)
+			return i;
+		if (slot->hash == hash && table->equal &&
+				table->equal(slot->key, key) == 0)
+			return i;
+		i = (i + 1) & mask;
+	}
+}
+
+static void pt_resize(struct ptable *table)
+{
+	struct pt_slot *old = table->slots;
+	unsigned long old_allocated = table->allocated, i, j, mask;
+
+	table->allocated = old_allocated ? 2 * old_allocated : PTABLE_INITIAL_SIZE;
+	table->slots = calloc(table->allocated, sizeof(struct pt_slot));
+	mask = table->allocated - 1;
+
+	/* keys are already unique, so each only needs an empty slot */
+	for (i = 0; i < old_allocated; i++) {
+		if (!old[i].key)
+			continue;
+		j = old[i].hash & mask;
+		while (table->slots[j].key)
+			j = (j + 1) & mask;
+		table->slots[j] = old[i];
+	}
+	free(old);
+}
+
+void pt_init(struct ptable *table, hash_t hash_func, comp_t equal)
+{
+	table->length = 0;
+	table->allocated = 0;
+	table->hash = hash_func;
+	table->equal = equal;
+	table->slots = NULL;
+}
+
+struct ptable *pt_create(hash_t hash_func, comp_t equal)
+{
+	struct ptable *table = malloc(sizeof(struct ptable));
+	pt_init(table, hash_func, equal);
+	return table;
+}
+
+void pt_destroy(struct ptable *table)
+{
+	free(table->slots);
+	table->slots = NULL;
+	table->length = 0;
+	table->allocated = 0;
+}
+
+void pt_delete(struct ptable *table)
+{
+	pt_destroy(table);
+	free(table);
+}
+
+void pt_insert(struct ptable *table, void *key, void *value)
+{
+	unsigned int hash = pt_mix(table->hash(key));
+	struct pt_slot *slot;
+
+	if (pt_too_full(table))
+		pt_resize(table);
+
+	slot = &table->slots[pt_find(table, key, hash)];
+	if (!slot->key)
+		table->length++;
+	slot->hash = hash;
+	slot->key = key;
+	slot->value = value;
+}
+
+/*
+ * Empty the slot at index @a i by moving back each following item of the probe
+ * sequence, unless its home slot lies cyclically within (i, j], where it would
+ * no longer be found.
+ */
+static void pt_remove_at(struct ptable *table, unsigned long i)
+{
+	unsigned long mask = table->allocated - 1, j, home;
+
+	for (j = (i + 1) & mask; table->slots[j].key; j = (j + 1) & mask) {
+		home = table->slots[j].hash & mask;
+		if (i <= j ? (i < home && home <= j) : (i < home || home <= j))
+			continue;
+		table->slots[i] = table->slots[j];
+		i = j;
+	}
+	table->slots[i].key = NULL;
+	table->slots[i].value = NULL;
+	table->length--;
+}
+
+int pt_remove(struct ptable *table, void *key)
+{
+	unsigned long i;
+
+	if (table->length == 0)
+		return -1;
+
+	i = pt_find(table, key, pt_mix(table->hash(key)));
+	if (!table->slots[i].key)
+		return -1;
+	pt_remove_at(table, i);
+	return 0;
+}
+
+unsigned long pt_remove_if(struct ptable *table,
+                           int (*func)(void *key, void *value, void *arg),
+                           void *arg)
+{
+	unsigned long i = 0, removed = 0;
+	struct pt_slot *slot;
+
+	/*
+	 * Removal only moves items back into slot i, so examining it again
+	 * sees every item. Those moved from the start of the table after
+	 * wrapping around are seen twice, which does no harm.
+	 */
+	while (i < table->allocated && table->length) {
+		slot = &table->slots[i];
+		if (slot->key && func(slot->key, slot->value, arg)) {
+			pt_remove_at(table, i);
+			removed++;
+		} else {
+			i++;
+		}
+	}
+	return removed;
+}
+
+static struct pt_slot *pt_lookup(struct ptable const *table, void *key)
+{
+	struct pt_slot *slot;
+
+	if (table->length == 0)
+		return NULL;
+
+	slot = &table->slots[pt_find(table, key, pt_mix(table->hash(key)))];
+	return slot->key ? slot : NULL;
+}
+
+void *pt_get(struct ptable const *table, void *key)
+{
+	struct pt_slot *slot = pt_lookup(table, key);
+	return slot ? slot->value : NULL;
+}
+
+void *pt_get_key(struct ptable const *table, void *key)
+{
+	struct pt_slot *slot = pt_lookup(table, key);
+	return slot ? slot->key : NULL;
+}
+
+bool pt_contains(struct ptable const *table, void *key)
+{
+	return pt_lookup(table, key) != NULL;
+}
+
+unsigned long pt_length(struct ptable const *table)
+{
+	return table->length;
+}
+
+/*
+ * As in ht_next(), iter->state_int is left one after the slot which was
+ * returned, and iter->state_ptr is non-NULL when values are returned.
+ */
+static void *pt_next(struct iterator *iter)
+{
+	struct ptable *table = iter->ds;
+	struct pt_slot *slot;
+
+	while (iter->state_int < (int)table->allocated &&
+			!table->slots[iter->state_int].key)
+		iter->state_int++;
+	if (iter->state_int >= (int)table->allocated)
+		return NULL;
+
+	slot = &table->slots[iter->state_int++];
+	iter->index++;
+	return iter->state_ptr ? slot->value : slot->key;
+}
+
+static bool pt_has_next(struct iterator *iter)
+{
+	struct ptable *table = iter->ds;
+	return iter->index < (int)table->length;
+}
+
+struct iterator pt_iter_keys(struct ptable *table)
+{
+	struct iterator it = {0};
+	it.ds = table;
+	it.index = 0;
+	it.state_int = 0;
+	it.state_ptr = NULL;
+	it.has_next = pt_has_next;
+	it.next = pt_next;
+	it.close = iterator_close_noop;
+	return it;
+}
+
+struct iterator pt_iter_values(struct ptable *table)
+{
+	struct iterator it = pt_iter_keys(table);
+	it.state_ptr = table;
+	return it;
+}
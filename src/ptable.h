@@ -0,0 +1,123 @@
+/*
+ * ptable.h: hash table of pointers, with stored hashes
+ *
+ * A variant of the hash table in hashtable.h, specialized for tables whose keys
+ * and values are pointers, which is the case for scopes and the text caches.
+ * Each slot stores the key's hash next to the key and value, the table size is
+ * a power of two, and keys are compared by pointer before calling the equal
+ * function, so interned keys are found without it.
+ *
+ * Stephen Brennan <stephen@brennan.io>
+ */
+#include <stdbool.h>
+
+#include "hashtable.h"
+#include "iter.h"
+
+#ifndef PTABLE_H
+#define PTABLE_H
+
+struct pt_slot {
+	unsigned int hash;
+	void *key;   /* NULL when the slot is empty */
+	void *value;
+};
+
+struct ptable {
+	unsigned long length;    /* number of items currently in the table */
+	unsigned long allocated; /* number of slots, zero or a power of two */
+
+	/* these receive the key pointers themselves, not pointers to them */
+	hash_t hash;
+	comp_t equal;
+
+	struct pt_slot *slots;
+};
+
+/**
+ * @brief Initialize a pointer table in memory already allocated. No slots are
+ * allocated until the first insertion.
+ * @param table A pointer to the table to initialize.
+ * @param hash_func A hash function for keys. Its result is mixed before use,
+ * so it need not spread its values over the low bits.
+ * @param equal A comparison function for keys returning zero when they are
+ * equal, or NULL to compare keys by pointer only.
+ */
+void pt_init(struct ptable *table, hash_t hash_func, comp_t equal);
+/**
+ * @brief Allocate and initialize a pointer table.
+ * @param hash_func A hash function for keys.
+ * @param equal A comparison function for keys, or NULL.
+ * @returns A pointer to the new table.
+ */
+struct ptable *pt_create(hash_t hash_func, comp_t equal);
+/**
+ * @brief Free the slots of the table, but not the table itself.
+ * @param table The table to destroy.
+ */
+void pt_destroy(struct ptable *table);
+/**
+ * @brief Free the table and its slots.
+ * @param table The table to delete.
+ */
+void pt_delete(struct ptable *table);
+
+/**
+ * @brief Insert a key, value pair, replacing the value of an equal key.
+ * @param table A pointer to the table.
+ * @param key The key, which may not be NULL.
+ * @param value The value.
+ */
+void pt_insert(struct ptable *table, void *key, void *value);
+/**
+ * @brief Remove the item with an equal key.
+ * @param table A pointer to the table.
+ * @param key The key to remove.
+ * @returns 0 on success, -1 when the key is not in the table
+ */
+int pt_remove(struct ptable *table, void *key);
+/**
+ * @brief Remove every item for which a function returns true.
+ * @param table A pointer to the table.
+ * @param func Called with each key, value and @a arg.
+ * @param arg Passed to @a func.
+ * @returns The number of items removed.
+ */
+unsigned long pt_remove_if(struct ptable *table,
+                           int (*func)(void *key, void *value, void *arg),
+                           void *arg);
+/**
+ * @brief Return the value associated with an equal key.
+ * @param table A pointer to the table.
+ * @param key The key whose value to get.
+ * @returns The value, or NULL when the key is not in the table.
+ */
+void *pt_get(struct ptable const *table, void *key);
+/**
+ * @brief Return the key in the table which is equal to the given one.
+ * @param table A pointer to the table.
+ * @param key The key to look for.
+ * @returns The stored key, or NULL when the key is not in the table.
+ */
+void *pt_get_key(struct ptable const *table, void *key);
+/**
+ * @brief Return true when the table contains an equal key.
+ * @param table A pointer to the table.
+ * @param key The key to look for.
+ */
+bool pt_contains(struct ptable const *table, void *key);
+/**
+ * @brief Return the number of items in the table.
+ * @param table A pointer to the table.
+ */
+unsigned long pt_length(struct ptable const *table);
+
+/**
+ * @brief Return an iterator over the keys, or the values, of the table. Both
+ * visit the items in the same order, provided the table is not modified.
+ * @param table A pointer to the table.
+ */
+struct iterator pt_iter_keys(struct ptable *table);
+struct iterator pt_iter_values(struct ptable *table);
+
+#endif
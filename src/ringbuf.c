@@ -9,6 +9,7 @@ void rb_init(struct ringbuf *rb, int dsize, int init)
 	rb->nalloc = init;
 	rb->start = 0;
 	rb->count = 0;
+	rb->high = 0;
 	rb->data = calloc(dsize, init);
 }
 
@@ -32,7 +33,7 @@ void rb_grow(struct ringbuf *rb)
 		if (oldindex != newindex) {
 			memcpy((char*) rb->data + newindex * rb->dsize,
 			       (char*) rb->data + oldindex * rb->dsize,
-			       rb->nalloc);
+			       rb->dsize);
 		}
 	}
 }
@@ -50,6 +51,8 @@ void rb_push_front(struct ringbuf *rb, void *src)
 	rb->start = newstart;
 	memcpy((char*)rb->data + rb->start * rb->dsize, src, rb->dsize);
 	rb->count++;
+	if (rb->count > rb->high)
+		rb->high = rb->count;
 }
 
 void rb_pop_front(struct ringbuf *rb, void *dst)
@@ -72,6 +75,8 @@ void rb_push_back(struct ringbuf *rb, void *src)
 	index = (rb->start + rb->count) % rb->nalloc;
 	memcpy((char*)rb->data + index * rb->dsize, src, rb->dsize);
 	rb->count++;
+	if (rb->count > rb->high)
+		rb->high = rb->count;
 }
 
 void rb_pop_back(struct ringbuf *rb, void *dst)
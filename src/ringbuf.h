@@ -22,6 +22,7 @@ struct ringbuf {
 	int nalloc;
 	int start;
 	int count;
+	int high; /* the most items it has held at once */
 
 };
 
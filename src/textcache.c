@@ -9,54 +9,70 @@
 
 #include "funlisp_internal.h"
 
-static struct lisp_text *lisp_textcache_lookup(struct hashtable *cache,
-		char *str)
+/*
+ * The same function as ht_string_hash(), over a length rather than up to a NUL,
+ * so that slices hash like the strings they are equal to.
+ */
+static unsigned int lisp_text_hash_of(char *str, unsigned long len)
+{
+	unsigned int hash = 0;
+	unsigned long i;
+
+	for (i = 0; i < len; i++)
+		hash = (hash << 5) - hash + str[i];
+	return hash;
+}
+
+static struct lisp_text *lisp_textcache_lookup(struct ptable *cache,
+		char *str, unsigned long len, unsigned int hash)
 {
 	struct lisp_text text;
 	text.s = str;
-	return ht_get_key_ptr(cache, &text);
+	text.len = len;
+	text.hash = hash;
+	return pt_get_key(cache, &text);
 }
 
-static void lisp_textcache_save(struct hashtable *cache, struct lisp_text *t)
+static void lisp_textcache_save(struct ptable *cache, struct lisp_text *t)
 {
-	ht_insert_ptr(cache, t, NULL); /* no value :) */
+	pt_insert(cache, t, NULL); /* no value :) */
 }
 
-void lisp_textcache_remove(struct hashtable *cache, struct lisp_text *t)
+void lisp_textcache_remove(struct ptable *cache, struct lisp_text *t)
 {
 	struct lisp_text *existing;
-	existing = ht_get_key_ptr(cache, t);
+	existing = pt_get_key(cache, t);
 	if (existing == t) {
 		/*
 		 * The same text object may exist multiple times, and only some
 		 * could be cached. We only care if this is the same pointer
 		 * value.
 		 */
-		ht_remove_ptr(cache, t);
+		pt_remove(cache, t);
 	}
 }
 
-struct hashtable *lisp_textcache_create(void)
-{
-	return ht_create(lisp_text_hash, lisp_text_compare, sizeof(struct lisp_text*), 0);
-}
-
-static char *my_strdup(char *s)
+struct ptable *lisp_textcache_create(void)
 {
-	int len = strlen(s);
-	char *new = malloc(len + 1);
-	strncpy(new, s, len);
-	new[len] = '\0';
-	return new;
+	return pt_create(lisp_text_hash, lisp_text_compare);
 }
 
 static struct lisp_text *lisp_text_new(lisp_runtime *rt, lisp_type *tp,
-		struct hashtable *cache, char *str, int flags)
+		struct ptable *cache, char *str, unsigned long len, int flags)
 {
 	struct lisp_text *string;
+	unsigned int hash = lisp_text_hash_of(str, len);
 
 	if (cache) {
-		string = lisp_textcache_lookup(cache, str);
+		string = lisp_textcache_lookup(cache, str, len, hash);
+		if (tp == type_symbol && string)
+			rt->stats.symbol_hits++;
+		else if (tp == type_symbol)
+			rt->stats.symbol_misses++;
+		else if (string)
+			rt->stats.string_hits++;
+		else
+			rt->stats.string_misses++;
 		if (string) {
 			/* If it's cached, we do not need to actually LS_CPY,
 			 * since we will not be using the pointer to the string
@@ -71,16 +87,34 @@ static struct lisp_text *lisp_text_new(lisp_runtime *rt, lisp_type *tp,
 			if ((flags & LS_OWN) && !(flags & LS_CPY))
 				free(str);
 
+			/* it may be garbage which is yet to be swept */
+			lisp_gc_retain(rt, (lisp_value *) string);
 			return string;
 		}
 	}
 
 	/* Uncached (or no cache), so create new text */
-	string = (struct lisp_text *) lisp_new(rt, tp);
-	if (flags & LS_CPY)
-		str = my_strdup(str);
-	string->s = str;
-	string->can_free = flags & LS_OWN;
+	if ((flags & (LS_CPY | LS_OWN)) && len < LISP_TEXT_INLINE) {
+		/* we may keep our own copy, and it is small enough to inline */
+		string = lisp_text_alloc(rt, tp, len + 1);
+		string->s = (char *) (string + 1);
+		memcpy(string->s, str, len);
+		string->s[len] = '\0';
+		if ((flags & LS_OWN) && !(flags & LS_CPY))
+			free(str);
+	} else {
+		string = lisp_text_alloc(rt, tp, 0);
+		if (flags & LS_CPY) {
+			string->s = malloc(len + 1);
+			memcpy(string->s, str, len);
+			string->s[len] = '\0';
+		} else {
+			string->s = str;
+		}
+		string->can_free = flags & LS_OWN;
+	}
+	string->len = len;
+	string->hash = hash;
 
 	if (cache) {
 		/* since this string was previously uncached, let's save it for
@@ -93,12 +127,89 @@ static struct lisp_text *lisp_text_new(lisp_runtime *rt, lisp_type *tp,
 
 lisp_string *lisp_string_new(lisp_runtime *rt, char *str, int flags)
 {
-	return (lisp_string*) lisp_text_new(rt, type_string, rt->strcache, str, flags);
+	return lisp_string_new_len(rt, str, strlen(str), flags);
+}
+
+lisp_string *lisp_string_new_len(lisp_runtime *rt, char *str,
+                                 unsigned long len, int flags)
+{
+	return (lisp_string*) lisp_text_new(rt, type_string, rt->strcache, str,
+	                                    len, flags);
+}
+
+lisp_string *lisp_string_slice(lisp_runtime *rt, lisp_string *s,
+                               unsigned long start, unsigned long len)
+{
+	struct lisp_text *slice;
+
+	if (start > s->len)
+		start = s->len;
+	if (len > s->len - start)
+		len = s->len - start;
+
+	if (len == s->len)
+		return s;
+	/* short slices are cheaper to copy than to share */
+	if (len < LISP_TEXT_INLINE)
+		return lisp_string_new_len(rt, s->s + start, len, LS_CPY);
+
+	slice = lisp_text_alloc(rt, type_string, 0);
+	slice->s = s->s + start;
+	slice->len = len;
+	slice->hash = lisp_text_hash_of(slice->s, len);
+	slice->base = s->base ? s->base : s;
+	rt->slices++;
+	return slice;
+}
+
+unsigned long lisp_string_length(lisp_string *s)
+{
+	return s->len;
 }
 
 lisp_symbol *lisp_symbol_new(lisp_runtime *rt, char *sym, int flags)
 {
-	return (lisp_symbol*) lisp_text_new(rt, type_symbol, rt->symcache, sym, flags);
+	return lisp_symbol_new_len(rt, sym, strlen(sym), flags);
+}
+
+/* Return the symbol interned by a template of @a rt, if there is one. */
+static lisp_symbol *lisp_symbol_inherited(lisp_runtime *rt, char *sym,
+                                          unsigned long len)
+{
+	lisp_symbol *symbol;
+	unsigned int hash = lisp_text_hash_of(sym, len);
+
+	for (rt = rt->parent; rt; rt = rt->parent) {
+		symbol = lisp_textcache_lookup(rt->symcache, sym, len, hash);
+		if (symbol)
+			return symbol;
+	}
+	return NULL;
+}
+
+lisp_symbol *lisp_symbol_new_len(lisp_runtime *rt, char *sym,
+                                 unsigned long len, int flags)
+{
+	lisp_symbol *symbol;
+
+	if (rt->parent && (symbol = lisp_symbol_inherited(rt, sym, len))) {
+		rt->stats.symbol_hits++;
+		if ((flags & LS_OWN) && !(flags & LS_CPY))
+			free(sym);
+		return symbol;
+	}
+	return (lisp_symbol*) lisp_text_new(rt, type_symbol, rt->symcache, sym,
+	                                    len, flags);
+}
+
+lisp_symbol *lisp_symbol_find(lisp_runtime *rt, char *name)
+{
+	unsigned long len = strlen(name);
+	lisp_symbol *symbol = lisp_textcache_lookup(rt->symcache, name, len,
+	                                            lisp_text_hash_of(name, len));
+	if (!symbol && rt->parent)
+		symbol = lisp_symbol_inherited(rt, name, len);
+	return symbol;
 }
 
 void lisp_enable_strcache(lisp_runtime *rt)
@@ -108,16 +219,15 @@ void lisp_enable_strcache(lisp_runtime *rt)
 
 void lisp_enable_symcache(lisp_runtime *rt)
 {
-	rt->symcache = lisp_textcache_create();
+	(void) rt; /* symbols are always interned */
 }
 void lisp_disable_strcache(lisp_runtime *rt)
 {
-	ht_delete(rt->strcache);
+	pt_delete(rt->strcache);
 	rt->strcache = NULL;
 }
 
 void lisp_disable_symcache(lisp_runtime *rt)
 {
-	ht_delete(rt->symcache);
-	rt->symcache = NULL;
+	(void) rt; /* symbols are always interned */
 }
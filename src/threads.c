@@ -0,0 +1,454 @@
+/*
+ * threads.c: parallel map and reduce over a pool of threads
+ *
+ * A runtime starts a pool of threads the first time pmap or preduce needs one,
+ * and stops it in lisp_destroy(). A call splits its items into tasks, each a
+ * run of consecutive items, and the pool's threads and the calling thread take
+ * tasks from a shared counter until none remain. Tasks are several times more
+ * numerous than threads, so that a thread which finishes its tasks early takes
+ * more of them, rather than waiting on the others.
+ *
+ * Each thread evaluates in a worker runtime of its own, spawned from the
+ * caller's, so it allocates and collects garbage without taking any lock. The
+ * calling thread is busy as a worker too, so nothing writes the caller's
+ * objects during the call, and the workers may read them: a worker's garbage
+ * collector only traces objects of its own pool, and workers use the tree
+ * walking evaluator, since the VM compiles lambdas the first time they are
+ * called, which writes them. For the same reason, the caller's slices of
+ * strings get their own copy of their text before a call starts, rather than
+ * when lisp_string_get() first reads them. When every task is done, the
+ * calling thread copies the results into its own heap, in order, and frees
+ * the workers.
+ *
+ * Stephen Brennan <stephen@brennan.io>
+ */
+#define _POSIX_C_SOURCE 199506L
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "funlisp_internal.h"
+
+/* tasks per thread, so that threads which finish early can take more */
+#define LISP_TASKS_PER_THREAD 4
+/* limit for lisp_set_threads() and FUNLISP_THREADS */
+#define LISP_MAX_THREADS 256
+
+struct lisp_job {
+	lisp_runtime *rt;
+	lisp_scope *scope;
+	lisp_value *callable;
+	/* nargs items for each of the ncalls calls */
+	lisp_value **items;
+	int nargs;
+	unsigned long ncalls;
+	int reduce;
+	/* calls per task, and the first call of the next task to be taken */
+	unsigned long task_size;
+	unsigned long next;
+	/* the result of each call, or for a reduce, of each task */
+	lisp_value **results;
+	/* the worker runtime of each thread, once it has taken a task */
+	lisp_runtime **workers;
+	/* the first call which failed, or ULONG_MAX, and its error */
+	unsigned long error_at;
+	enum lisp_errno err_num;
+	char *error;
+};
+
+struct lisp_thread {
+	struct lisp_threads *pool;
+	int slot; /* in job->workers, where the calling thread has slot 0 */
+	pthread_t id;
+};
+
+struct lisp_threads {
+	pthread_mutex_t lock;
+	pthread_cond_t start; /* a job was posted, or the pool is stopping */
+	pthread_cond_t done;  /* the last thread finished with the job */
+	struct lisp_thread *threads;
+	int nthreads;
+	struct lisp_job *job;
+	unsigned long generation; /* incremented for each job */
+	int running;              /* threads yet to finish with the job */
+	int stop;
+};
+
+int lisp_threads_default(void)
+{
+	char *env = getenv("FUNLISP_THREADS");
+	long n = 1;
+
+	if (env)
+		n = strtol(env, NULL, 10);
+#ifdef _SC_NPROCESSORS_ONLN
+	else
+		n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	if (n < 1)
+		return 1;
+	return n > LISP_MAX_THREADS ? LISP_MAX_THREADS : (int) n;
+}
+
+static lisp_runtime *lisp_worker_new(lisp_runtime *rt)
+{
+	lisp_runtime *worker = malloc(sizeof(lisp_runtime));
+
+	lisp_init_spawned(worker, rt);
+	worker->vm = 0;
+	/* a pmap within a pmap runs on the worker's own thread */
+	worker->nthreads = 1;
+	/* the worker's stack holds nothing of the host's, so it may always
+	 * collect automatically */
+	if (!worker->gc_threshold)
+		lisp_enable_auto_gc(worker, 0);
+	return worker;
+}
+
+/*
+ * Run the calls from @a start up to @a end in @a worker. The results are held
+ * by the worker's pins until the job is done.
+ */
+static void lisp_task_run(struct lisp_threads *pool, struct lisp_job *job,
+                          lisp_runtime *worker, unsigned long start,
+                          unsigned long end)
+{
+	lisp_scope *scope;
+	lisp_value *v = NULL;
+	unsigned long i;
+	int j, outer;
+
+	/* the caller's inlined code is valid here as long as it is there */
+	worker->builtins_version = job->rt->builtins_version;
+	worker->forms_version = job->rt->forms_version;
+	/* definitions made by builtins go here, not into the caller's scope */
+	scope = lisp_new_empty_scope(worker);
+	scope->up = job->scope;
+	outer = lisp_gc_enter(worker, &v, scope, NULL, NULL);
+
+	for (i = start; i < end; i++) {
+		if (job->reduce && i == start) {
+			v = job->items[i];
+			continue;
+		}
+		lisp_values_reserve(worker, job->nargs + 2);
+		worker->vm_stack[worker->vm_sp++] = job->callable;
+		if (job->reduce)
+			worker->vm_stack[worker->vm_sp++] = v;
+		for (j = 0; j < job->nargs; j++)
+			worker->vm_stack[worker->vm_sp++] =
+				job->items[i * job->nargs + j];
+		v = lisp_call_values(worker, scope,
+			job->reduce ? 2 : job->nargs);
+		if (!v) {
+			pthread_mutex_lock(&pool->lock);
+			if (i < job->error_at) {
+				job->error_at = i;
+				job->err_num = worker->err_num;
+				job->error = worker->error;
+			}
+			pthread_mutex_unlock(&pool->lock);
+			break;
+		}
+		if (!job->reduce) {
+			job->results[i] = v;
+			lisp_pin(worker, v);
+		}
+	}
+	if (job->reduce && v) {
+		job->results[start / job->task_size] = v;
+		lisp_pin(worker, v);
+	}
+	lisp_clear_error(worker);
+	if (outer)
+		lisp_gc_leave(worker);
+}
+
+/*
+ * Take tasks of @a job until there are none left, or only ones after a call
+ * which failed.
+ */
+static void lisp_job_work(struct lisp_threads *pool, struct lisp_job *job,
+                          int slot)
+{
+	unsigned long start, end;
+
+	for (;;) {
+		pthread_mutex_lock(&pool->lock);
+		start = job->next;
+		if (start < job->ncalls && start < job->error_at)
+			job->next += job->task_size;
+		else
+			start = ULONG_MAX;
+		pthread_mutex_unlock(&pool->lock);
+		if (start == ULONG_MAX)
+			return;
+
+		end = start + job->task_size;
+		if (end > job->ncalls)
+			end = job->ncalls;
+		if (!job->workers[slot])
+			job->workers[slot] = lisp_worker_new(job->rt);
+		lisp_task_run(pool, job, job->workers[slot], start, end);
+	}
+}
+
+static void *lisp_thread_main(void *arg)
+{
+	struct lisp_thread *self = arg;
+	struct lisp_threads *pool = self->pool;
+	struct lisp_job *job;
+	unsigned long seen = 0;
+
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		while (!pool->stop && pool->generation == seen)
+			pthread_cond_wait(&pool->start, &pool->lock);
+		if (pool->stop)
+			break;
+		seen = pool->generation;
+		job = pool->job;
+		pthread_mutex_unlock(&pool->lock);
+
+		lisp_job_work(pool, job, self->slot);
+
+		pthread_mutex_lock(&pool->lock);
+		if (--pool->running == 0)
+			pthread_cond_signal(&pool->done);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+/* Start the pool's threads, all but the calling one. */
+static struct lisp_threads *lisp_threads_start(lisp_runtime *rt)
+{
+	struct lisp_threads *pool = malloc(sizeof(struct lisp_threads));
+	int i;
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->start, NULL);
+	pthread_cond_init(&pool->done, NULL);
+	pool->threads = calloc(rt->nthreads - 1, sizeof(struct lisp_thread));
+	pool->nthreads = 0;
+	pool->job = NULL;
+	pool->generation = 0;
+	pool->running = 0;
+	pool->stop = 0;
+
+	/* if a thread cannot be created, make do with those we have */
+	for (i = 0; i < rt->nthreads - 1; i++) {
+		pool->threads[i].pool = pool;
+		pool->threads[i].slot = i + 1;
+		if (pthread_create(&pool->threads[i].id, NULL,
+				lisp_thread_main, &pool->threads[i]) != 0)
+			break;
+		pool->nthreads++;
+	}
+	rt->threads = pool;
+	return pool;
+}
+
+void lisp_threads_stop(lisp_runtime *rt)
+{
+	struct lisp_threads *pool = rt->threads;
+	int i;
+
+	if (!pool)
+		return;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = 1;
+	pthread_cond_broadcast(&pool->start);
+	pthread_mutex_unlock(&pool->lock);
+	for (i = 0; i < pool->nthreads; i++)
+		pthread_join(pool->threads[i].id, NULL);
+
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->start);
+	pthread_cond_destroy(&pool->done);
+	free(pool->threads);
+	free(pool);
+	rt->threads = NULL;
+}
+
+void lisp_set_threads(lisp_runtime *rt, int n)
+{
+	if (n < 1)
+		n = 1;
+	if (n > LISP_MAX_THREADS)
+		n = LISP_MAX_THREADS;
+	if (n != rt->nthreads)
+		lisp_threads_stop(rt);
+	rt->nthreads = n;
+}
+
+/* does @a v belong to a worker, rather than to @a rt or its template? */
+#define lisp_foreign(rt, v) \
+	(!lisp_fixnum_p(v) && (v)->pool != LISP_POOL_STATIC && \
+	 (v)->gen != LISP_GEN_FROZEN && !lisp_owned(rt, v))
+
+/*
+ * Return @a v, or a copy of it in @a rt when it belongs to a worker.
+ */
+static lisp_value *lisp_adopt(lisp_runtime *rt, lisp_value *v)
+{
+	lisp_list *head = NULL, *tail = NULL, *l;
+	struct lisp_digits digits;
+	lisp_vector *vector;
+	lisp_hashmap *map;
+	lisp_value *left, *key;
+	struct iterator it;
+	struct lisp_text *t;
+	unsigned long i;
+
+	if (!lisp_foreign(rt, v))
+		return v;
+
+	if (v->type == type_integer) {
+		lisp_integer_digits((lisp_integer *) v, &digits);
+		return (lisp_value *) lisp_integer_from_digits(rt, digits.sign,
+			digits.d, digits.n);
+	}
+	if (v->type == type_string) {
+		t = (struct lisp_text *) v;
+		return (lisp_value *) lisp_string_new_len(rt, t->s, t->len,
+			LS_CPY);
+	}
+	if (v->type == type_symbol) {
+		t = (struct lisp_text *) v;
+		return (lisp_value *) lisp_symbol_new_len(rt, t->s, t->len,
+			LS_CPY);
+	}
+	if (v->type == type_vector) {
+		vector = lisp_vector_new(rt, ((lisp_vector *) v)->len);
+		for (i = 0; i < vector->len; i++) {
+			left = lisp_adopt(rt, ((lisp_vector *) v)->items[i]);
+			lisp_error_check(left);
+			lisp_vector_set(vector, i, left);
+		}
+		return (lisp_value *) vector;
+	}
+	if (v->type == type_hashmap) {
+		map = lisp_hashmap_new(rt);
+		it = pt_iter_keys(&((lisp_hashmap *) v)->table);
+		while (it.has_next(&it)) {
+			key = it.next(&it);
+			left = lisp_adopt(rt, lisp_hashmap_get((lisp_hashmap *) v,
+				key));
+			key = left ? lisp_adopt(rt, key) : NULL;
+			if (!key) {
+				it.close(&it);
+				return NULL;
+			}
+			lisp_hashmap_put(map, key, left);
+		}
+		it.close(&it);
+		return (lisp_value *) map;
+	}
+	if (v->type != type_list)
+		return lisp_error(rt, LE_TYPE,
+			"pmap: results may only hold lists, vectors, hash maps, "
+			"integers, strings and symbols");
+
+	/* copy along the list, and recursively into its items */
+	while (lisp_foreign(rt, v) && v->type == type_list) {
+		left = lisp_adopt(rt, ((lisp_list *) v)->left);
+		lisp_error_check(left);
+		l = lisp_list_new(rt, left, lisp_nil_new(rt));
+		if (tail) {
+			tail->right = (lisp_value *) l;
+			lisp_write_barrier(tail, tail->right);
+		} else {
+			head = l;
+		}
+		tail = l;
+		v = ((lisp_list *) v)->right;
+	}
+	v = lisp_adopt(rt, v);
+	lisp_error_check(v);
+	tail->right = v;
+	lisp_write_barrier(tail, v);
+	return (lisp_value *) head;
+}
+
+lisp_value *lisp_parallel(lisp_runtime *rt, lisp_scope *scope,
+                          lisp_value *callable, lisp_value **items,
+                          int nargs, unsigned long ncalls, int reduce)
+{
+	struct lisp_threads *pool = rt->threads;
+	struct lisp_job job;
+	lisp_list *rv = NULL, *tail = NULL, *l;
+	lisp_value *v = NULL;
+	unsigned long i, nresults;
+	int nworkers;
+
+	if (!pool)
+		pool = lisp_threads_start(rt);
+	nworkers = pool->nthreads + 1;
+
+	/* reading a slice may copy it, which workers must not do to ours */
+	if (rt->slices)
+		lisp_gc_unshare_slices(rt);
+
+	job.rt = rt;
+	job.scope = scope;
+	job.callable = callable;
+	job.items = items;
+	job.nargs = nargs;
+	job.ncalls = ncalls;
+	job.reduce = reduce;
+	job.task_size = ncalls / (nworkers * LISP_TASKS_PER_THREAD);
+	if (job.task_size == 0)
+		job.task_size = 1;
+	job.next = 0;
+	nresults = reduce ? (ncalls + job.task_size - 1) / job.task_size
+		: ncalls;
+	job.results = calloc(nresults, sizeof(lisp_value *));
+	job.workers = calloc(nworkers, sizeof(lisp_runtime *));
+	job.error_at = ULONG_MAX;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->job = &job;
+	pool->generation++;
+	pool->running = pool->nthreads;
+	pthread_cond_broadcast(&pool->start);
+	pthread_mutex_unlock(&pool->lock);
+
+	lisp_job_work(pool, &job, 0);
+
+	pthread_mutex_lock(&pool->lock);
+	while (pool->running)
+		pthread_cond_wait(&pool->done, &pool->lock);
+	pool->job = NULL;
+	pthread_mutex_unlock(&pool->lock);
+
+	if (job.error_at != ULONG_MAX) {
+		lisp_error(rt, job.err_num, job.error);
+	} else {
+		for (i = 0; i < nresults; i++) {
+			v = lisp_adopt(rt, job.results[i]);
+			if (!v)
+				break;
+			l = lisp_list_new(rt, v, lisp_nil_new(rt));
+			if (tail) {
+				tail->right = (lisp_value *) l;
+				lisp_write_barrier(tail, tail->right);
+			} else {
+				rv = l;
+			}
+			tail = l;
+		}
+	}
+
+	for (i = 0; i < (unsigned long) nworkers; i++)
+		if (job.workers[i])
+			lisp_runtime_free(job.workers[i]);
+	free(job.workers);
+	free(job.results);
+	if (!v)
+		return NULL;
+	return rv ? (lisp_value *) rv : lisp_nil_new(rt);
+}
@@ -15,8 +15,8 @@
 
 #define TYPE_HEADER \
 	&type_type_obj, \
-	NULL, \
-	'w'
+	LISP_GEN_OLD, \
+	LISP_POOL_STATIC
 
 /*
  * Some generic functions for types
@@ -47,8 +47,7 @@ static lisp_value *call_error(lisp_runtime *rt, lisp_scope *s, lisp_value *c,
 
 static void simple_free(lisp_runtime *rt, void *v)
 {
-	(void)rt;
-	free(v);
+	lisp_dealloc(rt, (lisp_value *) v);
 }
 
 static bool has_next_index_lt_state(struct iterator *iter)
@@ -56,6 +55,24 @@ static bool has_next_index_lt_state(struct iterator *iter)
 	return iter->index < iter->state_int;
 }
 
+/* for types which compare by pointer */
+static unsigned int hash_ptr(lisp_value *v)
+{
+	return (unsigned int) (unsigned long) v;
+}
+
+/*
+ * For types whose comparison looks too deep into them to be worth hashing,
+ * every object of the type has the same hash.
+ */
+static unsigned int hash_type(lisp_value *v)
+{
+	return (unsigned int) (unsigned long) lisp_type_of(v);
+}
+
+/* Aggregates hash this many of their items, so that long ones hash quickly. */
+#define LISP_HASH_ITEMS 8
+
 /*
  * type
  */
@@ -74,6 +91,7 @@ static lisp_type type_type_obj = {
 	/* eval */ eval_error,
 	/* call */ call_error,
 	/* compare */ type_compare,
+	/* hash */ hash_ptr,
 };
 lisp_type *type_type = &type_type_obj;
 
@@ -86,15 +104,14 @@ static void type_print(FILE *f, lisp_value *v)
 static lisp_value *type_new(lisp_runtime *rt)
 {
 	lisp_type *type;
-	(void) rt; /* unused */
 
-	type =  malloc(sizeof(lisp_type));
+	type = (lisp_type*) lisp_alloc(rt, sizeof(lisp_type));
 	return (lisp_value*)type;
 }
 
 static int type_compare(lisp_value *self, lisp_value *other)
 {
-	if (self->type != other->type || self->type != type_type)
+	if (lisp_type_of(other) != type_type)
 		return 0;
 	/* can compare by pointer since there should only ever be one of each
 	 * type */
@@ -121,87 +138,174 @@ static lisp_type type_scope_obj = {
 	/* eval */ eval_error,
 	/* call */ call_error,
 	/* compare */ scope_compare,
+	/* hash */ hash_type,
 };
 lisp_type *type_scope = &type_scope_obj;
 
 unsigned int lisp_text_hash(void *t)
 {
-	struct lisp_text **text = t;
-	return ht_string_hash(&(*text)->s);
+	struct lisp_text *text = t;
+	return text->hash;
 }
 
 int lisp_text_compare(void *left, void *right)
 {
-	lisp_symbol **sym1 = left;
-	lisp_symbol **sym2 = right;
-	return strcmp((*sym1)->s, (*sym2)->s);
+	lisp_symbol *sym1 = left;
+	lisp_symbol *sym2 = right;
+	if (sym1->len != sym2->len)
+		return 1;
+	return memcmp(sym1->s, sym2->s, sym1->len);
 }
 
 static lisp_value *scope_new(lisp_runtime *rt)
 {
 	lisp_scope *scope;
-	(void) rt; /* unused */
 
-	scope = malloc(sizeof(lisp_scope));
+	scope = (lisp_scope*) lisp_alloc(rt, sizeof(lisp_scope));
 	scope->up = NULL;
-	ht_init(&scope->scope, lisp_text_hash, lisp_text_compare, sizeof(void*), sizeof(void*));
+	scope->names = NULL;
+	scope->slots = NULL;
+	scope->nslots = 0;
+	scope->nsmall = 0;
+	scope->inlined = 0;
+	scope->table = NULL;
 	return (lisp_value*)scope;
 }
 
 static void scope_free(lisp_runtime *rt, void *v)
 {
 	lisp_scope *scope;
-	(void) rt; /* unused */
 
 	scope = (lisp_scope*) v;
-	ht_destroy(&scope->scope);
-	free(scope);
+	if (scope->table)
+		pt_delete(scope->table);
+	if (scope->slots != scope->inline_slots)
+		free(scope->slots);
+	lisp_dealloc(rt, (lisp_value *) scope);
+}
+
+static void scope_print_binding(FILE *f, lisp_value *key, lisp_value *value)
+{
+	fprintf(f, " ");
+	lisp_print(f, key);
+	fprintf(f, ": ");
+	lisp_print(f, value);
 }
 
 static void scope_print(FILE *f, lisp_value *v)
 {
 	lisp_scope *scope = (lisp_scope*) v;
-	struct iterator it = ht_iter_keys_ptr(&scope->scope);
+	struct iterator it;
+	lisp_list *names = scope->names;
+	lisp_value *key;
+	int i;
+
 	fprintf(f, "(scope:");
-	while (it.has_next(&it)) {
-		lisp_value *key = it.next(&it);
-		lisp_value *value = ht_get_ptr(&scope->scope, key);
-		fprintf(f, " ");
-		lisp_print(f, key);
-		fprintf(f, ": ");
-		lisp_print(f, value);
+	for (i = 0; i < scope->nslots; i++) {
+		scope_print_binding(f, names->left, scope->slots[i]);
+		names = (lisp_list *) names->right;
+	}
+	for (i = 0; i < scope->nsmall; i++)
+		scope_print_binding(f, (lisp_value *) scope->small_names[i],
+		                    scope->small_values[i]);
+	if (scope->table) {
+		it = pt_iter_keys(scope->table);
+		while (it.has_next(&it)) {
+			key = it.next(&it);
+			scope_print_binding(f, key, pt_get(scope->table, key));
+		}
 	}
 	fprintf(f, ")");
 }
 
+static void *scope_expand_next(struct iterator *it)
+{
+	lisp_scope *scope = (lisp_scope *) it->ds;
+	int i;
+
+	it->index++;
+	switch (it->index) {
+	case 1:
+		return scope->up;
+	case 2:
+		return scope->names;
+	}
+	i = it->index - 3;
+	if (i < scope->nslots)
+		return scope->slots[i];
+	i -= scope->nslots;
+	if (i < scope->nsmall)
+		return scope->small_names[i];
+	return scope->small_values[i - scope->nsmall];
+}
+
 static struct iterator scope_expand(lisp_value *v)
 {
 	lisp_scope *scope = (lisp_scope *) v;
-	if (scope->up) {
-		return iterator_concat3(
-			iterator_single_value(scope->up),
-			ht_iter_keys_ptr(&scope->scope),
-			ht_iter_values_ptr(&scope->scope)
-		);
-	} else {
-		return iterator_concat2(
-			ht_iter_keys_ptr(&scope->scope),
-			ht_iter_values_ptr(&scope->scope)
-		);
+	struct iterator it = {0};
+
+	it.ds = v;
+	it.state_int = 2 + scope->nslots + 2 * scope->nsmall;
+	it.index = 0;
+	it.next = scope_expand_next;
+	it.has_next = has_next_index_lt_state;
+	it.close = iterator_close_noop;
+	if (!scope->table)
+		return it;
+	return iterator_concat3(
+		it,
+		pt_iter_keys(scope->table),
+		pt_iter_values(scope->table)
+	);
+}
+
+/*
+ * Return true if every binding of @a lhs outside its frame slots has an equal
+ * binding in @a rhs.
+ */
+static int scope_bindings_in(lisp_scope *lhs, lisp_scope *rhs)
+{
+	lisp_symbol *key;
+	lisp_value *rhs_value;
+	struct iterator it;
+	int i;
+
+	for (i = 0; i < lhs->nsmall; i++) {
+		rhs_value = lisp_scope_find_local(rhs, lhs->small_names[i]);
+		if (!rhs_value || !lisp_compare(lhs->small_values[i], rhs_value))
+			return 0;
+	}
+	if (!lhs->table)
+		return 1;
+
+	it = pt_iter_keys(lhs->table);
+	while (it.has_next(&it)) {
+		key = (lisp_symbol*) it.next(&it);
+		rhs_value = lisp_scope_find_local(rhs, key);
+		if (!rhs_value ||
+				!lisp_compare(pt_get(lhs->table, key), rhs_value)) {
+			it.close(&it);
+			return 0;
+		}
 	}
+	it.close(&it);
+	return 1;
+}
+
+static unsigned long scope_nbindings(lisp_scope *scope)
+{
+	return scope->nsmall + (scope->table ? pt_length(scope->table) : 0);
 }
 
 static int scope_compare(lisp_value *self, lisp_value *other)
 {
 	lisp_scope *lhs, *rhs;
-	lisp_symbol *key;
-	lisp_value *value, *rhs_value;
-	struct iterator it;
+	int i;
 
 	/* easy quick checks - same type? same pointer value? */
 	if (self == other)
 		return 1; /* short circuit because comparison is hard */
-	if (self->type != other->type || self->type != type_scope)
+	if (lisp_type_of(other) != type_scope)
 		return 0;
 
 	lhs = (lisp_scope*) self;
@@ -218,30 +322,22 @@ static int scope_compare(lisp_value *self, lisp_value *other)
 		return 0;
 	}
 
+	/* lambda frames must have the same arguments */
+	if (lhs->nslots != rhs->nslots)
+		return 0;
+	if (lhs->nslots && !lisp_compare((lisp_value*)lhs->names,
+	                                 (lisp_value*)rhs->names))
+		return 0;
+	for (i = 0; i < lhs->nslots; i++)
+		if (!lisp_compare(lhs->slots[i], rhs->slots[i]))
+			return 0;
+
 	/* now test equality of scope contents - are they same length? */
-	if (ht_length(&lhs->scope) != ht_length(&lhs->scope))
+	if (scope_nbindings(lhs) != scope_nbindings(rhs))
 		return 0;
 
 	/* now actually compare keys and values, yawn */
-	it = ht_iter_keys_ptr(&lhs->scope);
-	while (it.has_next(&it)) {
-		key = (lisp_symbol*) it.next(&it);
-		rhs_value = (lisp_value*) ht_get_ptr(&rhs->scope, key);
-		if (!rhs_value) {
-			/* key not in other scope */
-			it.close(&it);
-			return 0;
-		}
-		value = (lisp_value*) ht_get_ptr(&lhs->scope, key);
-		if (!lisp_compare(value, rhs_value)) {
-			it.close(&it);
-			return 0;
-		}
-	}
-
-	/* fiine, they're equal, but somehow not the same pointer */
-	it.close(&it);
-	return 1;
+	return scope_bindings_in(lhs, rhs);
 }
 
 /*
@@ -253,6 +349,7 @@ static lisp_value *list_new(lisp_runtime *rt);
 static lisp_value *list_eval(lisp_runtime*, lisp_scope*, lisp_value*);
 static struct iterator list_expand(lisp_value*);
 static int list_compare(lisp_value *self, lisp_value *other);
+static unsigned int list_hash(lisp_value *self);
 
 static lisp_type type_list_obj = {
 	TYPE_HEADER,
@@ -264,6 +361,7 @@ static lisp_type type_list_obj = {
 	/* eval */ list_eval,
 	/* call */ call_error,
 	/* compare */ list_compare,
+	/* hash */ list_hash,
 };
 lisp_type *type_list = &type_list_obj;
 
@@ -276,7 +374,7 @@ static lisp_value *list_eval(lisp_runtime *rt, lisp_scope *scope, lisp_value *v)
 		return lisp_error(rt, LE_NOCALL, "Cannot call empty list");
 	}
 
-	if (list->right->type != type_list) {
+	if (lisp_type_of(list->right) != type_list) {
 		return lisp_error(rt, LE_SYNTAX, "unexpected cons cell");
 	}
 	callable = lisp_eval(rt, scope, list->left);
@@ -290,7 +388,7 @@ static void list_print_internal(FILE *f, lisp_list *list)
 		return;
 	}
 	lisp_print(f, list->left);
-	if (list->right->type != type_list) {
+	if (lisp_type_of(list->right) != type_list) {
 		fprintf(f, " . ");
 		lisp_print(f, list->right);
 		return;
@@ -310,9 +408,8 @@ static void list_print(FILE *f, lisp_value *v)
 static lisp_value *list_new(lisp_runtime *rt)
 {
 	lisp_list *list;
-	(void) rt; /* unused */
 
-	list = malloc(sizeof(lisp_list));
+	list = (lisp_list*) lisp_alloc(rt, sizeof(lisp_list));
 	list->left = NULL;
 	list->right = NULL;
 	return (lisp_value*) list;
@@ -320,7 +417,7 @@ static lisp_value *list_new(lisp_runtime *rt)
 
 int lisp_nil_p(lisp_value *l)
 {
-	return (l->type == type_list) &&
+	return (lisp_type_of(l) == type_list) &&
 		(((lisp_list*)l)->right == NULL) &&
 		(((lisp_list*)l)->left == NULL);
 }
@@ -366,7 +463,7 @@ static int list_compare(lisp_value *self, lisp_value *other)
 	lisp_list *lhs, *rhs;
 	if (self == other)
 		return 1;
-	if (self->type != other->type || self->type != type_list)
+	if (lisp_type_of(other) != type_list)
 		return 0;
 	lhs = (lisp_list*) self;
 	rhs = (lisp_list*) other;
@@ -378,6 +475,294 @@ static int list_compare(lisp_value *self, lisp_value *other)
 	        lisp_compare(lhs->right, rhs->right));
 }
 
+static unsigned int list_hash(lisp_value *v)
+{
+	lisp_list *list = (lisp_list *) v;
+	unsigned int hash = 5381;
+	int n = 0;
+
+	lisp_for_each(list) {
+		if (n++ == LISP_HASH_ITEMS)
+			break;
+		hash = hash * 31 + lisp_hash(list->left);
+	}
+	return hash;
+}
+
+/*
+ * vector
+ */
+
+static void vector_print(FILE *f, lisp_value *v);
+static lisp_value *vector_new(lisp_runtime *rt);
+static void vector_free(lisp_runtime *rt, void *v);
+static struct iterator vector_expand(lisp_value *v);
+static int vector_compare(lisp_value *self, lisp_value *other);
+static unsigned int vector_hash(lisp_value *self);
+
+static lisp_type type_vector_obj = {
+	TYPE_HEADER,
+	/* name */ "vector",
+	/* print */ vector_print,
+	/* new */ vector_new,
+	/* free */ vector_free,
+	/* expand */ vector_expand,
+	/* eval */ eval_same,
+	/* call */ call_error,
+	/* compare */ vector_compare,
+	/* hash */ vector_hash,
+};
+lisp_type *type_vector = &type_vector_obj;
+
+static void vector_print(FILE *f, lisp_value *v)
+{
+	lisp_vector *vector = (lisp_vector *) v;
+	unsigned long i;
+
+	fprintf(f, "#(");
+	for (i = 0; i < vector->len; i++) {
+		if (i)
+			fprintf(f, " ");
+		lisp_print(f, vector->items[i]);
+	}
+	fprintf(f, ")");
+}
+
+static lisp_value *vector_new(lisp_runtime *rt)
+{
+	lisp_vector *vector;
+
+	vector = (lisp_vector *) lisp_alloc(rt, sizeof(lisp_vector));
+	vector->items = NULL;
+	vector->len = 0;
+	vector->size = 0;
+	return (lisp_value *) vector;
+}
+
+static void vector_free(lisp_runtime *rt, void *v)
+{
+	lisp_vector *vector = (lisp_vector *) v;
+	lisp_storage_account(rt, lisp_storage_size((lisp_value *) vector), 0);
+	free(vector->items);
+	lisp_dealloc(rt, (lisp_value *) vector);
+}
+
+static struct iterator vector_expand(lisp_value *v)
+{
+	lisp_vector *vector = (lisp_vector *) v;
+	return iterator_array((void **) vector->items, (int) vector->len,
+		false);
+}
+
+static int vector_compare(lisp_value *self, lisp_value *other)
+{
+	lisp_vector *lhs, *rhs;
+	unsigned long i;
+
+	if (self == other)
+		return 1;
+	if (lisp_type_of(other) != type_vector)
+		return 0;
+	lhs = (lisp_vector *) self;
+	rhs = (lisp_vector *) other;
+	if (lhs->len != rhs->len)
+		return 0;
+	for (i = 0; i < lhs->len; i++)
+		if (!lisp_compare(lhs->items[i], rhs->items[i]))
+			return 0;
+	return 1;
+}
+
+static unsigned int vector_hash(lisp_value *v)
+{
+	lisp_vector *vector = (lisp_vector *) v;
+	unsigned int hash = (unsigned int) vector->len;
+	unsigned long i;
+
+	for (i = 0; i < vector->len && i < LISP_HASH_ITEMS; i++)
+		hash = hash * 31 + lisp_hash(vector->items[i]);
+	return hash;
+}
+
+/*
+ * hash map
+ */
+
+static void hashmap_print(FILE *f, lisp_value *v);
+static lisp_value *hashmap_new(lisp_runtime *rt);
+static void hashmap_free(lisp_runtime *rt, void *v);
+static struct iterator hashmap_expand(lisp_value *v);
+static int hashmap_compare(lisp_value *self, lisp_value *other);
+static unsigned int hashmap_hash(lisp_value *self);
+
+static lisp_type type_hashmap_obj = {
+	TYPE_HEADER,
+	/* name */ "hashmap",
+	/* print */ hashmap_print,
+	/* new */ hashmap_new,
+	/* free */ hashmap_free,
+	/* expand */ hashmap_expand,
+	/* eval */ eval_same,
+	/* call */ call_error,
+	/* compare */ hashmap_compare,
+	/* hash */ hashmap_hash,
+};
+lisp_type *type_hashmap = &type_hashmap_obj;
+
+static unsigned int hashmap_key_hash(void *key)
+{
+	return lisp_hash((lisp_value *) key);
+}
+
+static int hashmap_key_compare(void *left, void *right)
+{
+	return !lisp_compare((lisp_value *) left, (lisp_value *) right);
+}
+
+static void hashmap_print(FILE *f, lisp_value *v)
+{
+	lisp_hashmap *map = (lisp_hashmap *) v;
+	struct iterator it = pt_iter_keys(&map->table);
+	lisp_value *key;
+	int first = 1;
+
+	fprintf(f, "#hash(");
+	while (it.has_next(&it)) {
+		key = it.next(&it);
+		fprintf(f, first ? "(" : " (");
+		lisp_print(f, key);
+		fprintf(f, " . ");
+		lisp_print(f, pt_get(&map->table, key));
+		fprintf(f, ")");
+		first = 0;
+	}
+	it.close(&it);
+	fprintf(f, ")");
+}
+
+static lisp_value *hashmap_new(lisp_runtime *rt)
+{
+	lisp_hashmap *map;
+
+	map = (lisp_hashmap *) lisp_alloc(rt, sizeof(lisp_hashmap));
+	pt_init(&map->table, hashmap_key_hash, hashmap_key_compare);
+	return (lisp_value *) map;
+}
+
+static void hashmap_free(lisp_runtime *rt, void *v)
+{
+	lisp_hashmap *map = (lisp_hashmap *) v;
+	lisp_storage_account(rt, lisp_storage_size((lisp_value *) map), 0);
+	pt_destroy(&map->table);
+	lisp_dealloc(rt, (lisp_value *) map);
+}
+
+static struct iterator hashmap_expand(lisp_value *v)
+{
+	lisp_hashmap *map = (lisp_hashmap *) v;
+	return iterator_concat2(pt_iter_keys(&map->table),
+		pt_iter_values(&map->table));
+}
+
+static int hashmap_compare(lisp_value *self, lisp_value *other)
+{
+	lisp_hashmap *lhs, *rhs;
+	lisp_value *key, *value;
+	struct iterator it;
+	int rv = 1;
+
+	if (self == other)
+		return 1;
+	if (lisp_type_of(other) != type_hashmap)
+		return 0;
+	lhs = (lisp_hashmap *) self;
+	rhs = (lisp_hashmap *) other;
+	if (pt_length(&lhs->table) != pt_length(&rhs->table))
+		return 0;
+
+	it = pt_iter_keys(&lhs->table);
+	while (rv && it.has_next(&it)) {
+		key = it.next(&it);
+		value = pt_get(&rhs->table, key);
+		rv = value && lisp_compare(pt_get(&lhs->table, key), value);
+	}
+	it.close(&it);
+	return rv;
+}
+
+static unsigned int hashmap_hash(lisp_value *v)
+{
+	/* the items are in no particular order, so only their number counts */
+	return (unsigned int) pt_length(&((lisp_hashmap *) v)->table);
+}
+
+/*
+ * sequence
+ */
+
+static void sequence_print(FILE *f, lisp_value *v);
+static lisp_value *sequence_new(lisp_runtime *rt);
+static void sequence_free(lisp_runtime *rt, void *v);
+static struct iterator sequence_expand(lisp_value *v);
+static int sequence_compare(lisp_value *self, lisp_value *other);
+
+static lisp_type type_sequence_obj = {
+	TYPE_HEADER,
+	/* name */ "sequence",
+	/* print */ sequence_print,
+	/* new */ sequence_new,
+	/* free */ sequence_free,
+	/* expand */ sequence_expand,
+	/* eval */ eval_same,
+	/* call */ call_error,
+	/* compare */ sequence_compare,
+	/* hash */ hash_ptr,
+};
+lisp_type *type_sequence = &type_sequence_obj;
+
+static void sequence_print(FILE *f, lisp_value *v)
+{
+	(void) v;
+	fprintf(f, "<sequence>");
+}
+
+static lisp_value *sequence_new(lisp_runtime *rt)
+{
+	lisp_sequence *s;
+
+	s = (lisp_sequence *) lisp_alloc(rt, sizeof(lisp_sequence));
+	s->kind = LISP_SEQ_SOURCE;
+	s->done = 0;
+	s->upstream = NULL;
+	s->fn = NULL;
+	s->remaining = 0;
+	s->it = iterator_empty();
+	s->holder = NULL;
+	return (lisp_value *) s;
+}
+
+static void sequence_free(lisp_runtime *rt, void *v)
+{
+	lisp_sequence *s = (lisp_sequence *) v;
+
+	/* a source which was not consumed to its end is still open */
+	if (s->kind == LISP_SEQ_SOURCE && !s->done)
+		s->it.close(&s->it);
+	lisp_dealloc(rt, (lisp_value *) s);
+}
+
+static struct iterator sequence_expand(lisp_value *v)
+{
+	lisp_sequence *s = (lisp_sequence *) v;
+	return iterator_from_args(3, s->upstream, s->fn, s->holder);
+}
+
+static int sequence_compare(lisp_value *self, lisp_value *other)
+{
+	/* consuming a sequence changes it, so only the same one is equal */
+	return self == other;
+}
+
 /*
  * symbol
  */
@@ -387,6 +772,7 @@ static lisp_value *text_new(lisp_runtime *rt);
 static lisp_value *symbol_eval(lisp_runtime*, lisp_scope*, lisp_value*);
 static void text_free(lisp_runtime *rt, void *v);
 static int text_compare(lisp_value *self, lisp_value *other);
+static unsigned int text_hash(lisp_value *self);
 
 static lisp_type type_symbol_obj = {
 	TYPE_HEADER,
@@ -398,38 +784,51 @@ static lisp_type type_symbol_obj = {
 	/* eval */ symbol_eval,
 	/* call */ call_error,
 	/* commpare */ text_compare,
+	/* hash */ text_hash,
 };
 lisp_type *type_symbol = &type_symbol_obj;
 
 static void text_print(FILE *f, lisp_value *v)
 {
 	struct lisp_text *text = (struct lisp_text*) v;
-	fprintf(f, "%s", text->s);
+	fwrite(text->s, 1, text->len, f);
 }
 
 static lisp_value *text_new(lisp_runtime *rt)
 {
 	struct lisp_text *text;
-	(void) rt; /* unused */
 
-	text = malloc(sizeof(struct lisp_text));
+	text = (struct lisp_text*) lisp_alloc(rt, sizeof(struct lisp_text));
 	text->s = NULL;
+	text->len = 0;
+	text->base = NULL;
 	text->can_free = 1;
+	text->core = 0;
+	text->form = 0;
 	return (lisp_value*)text;
 }
 
+static struct iterator text_expand(lisp_value *v)
+{
+	struct lisp_text *text = (struct lisp_text *) v;
+	if (text->base)
+		return iterator_single_value(text->base);
+	return iterator_empty();
+}
+
 static void text_free(lisp_runtime *rt, void *v)
 {
 	struct lisp_text *text = (struct lisp_text*) v;
-	/* if this is cached, we must un-cache it! */
+	/* if this is cached, we must un-cache it! symbols were already removed
+	 * from their table by lisp_gc_sweep() */
 	if (text->type == type_string && rt->strcache)
 		lisp_textcache_remove(rt->strcache, text);
-	else if (text->type == type_symbol && rt->symcache)
-		lisp_textcache_remove(rt->symcache, text);
 	/* respect ownership of text */
 	if (text->can_free)
 		free(text->s);
-	free(text);
+	if (text->base)
+		rt->slices--;
+	lisp_dealloc(rt, (lisp_value *) text);
 }
 
 static lisp_value *symbol_eval(lisp_runtime *rt, lisp_scope *scope,
@@ -447,11 +846,16 @@ static int text_compare(lisp_value *self, lisp_value *other)
 	struct lisp_text *lhs, *rhs;
 	if (self == other)
 		return 1;
-	if (self->type != other->type)
+	if (lisp_type_of(other) != self->type)
 		return 0;
 	lhs = (struct lisp_text*) self;
 	rhs = (struct lisp_text*)other;
-	return strcmp(lhs->s, rhs->s) == 0;
+	return lhs->len == rhs->len && memcmp(lhs->s, rhs->s, lhs->len) == 0;
+}
+
+static unsigned int text_hash(lisp_value *v)
+{
+	return ((struct lisp_text *) v)->hash;
 }
 
 /*
@@ -461,6 +865,7 @@ static int text_compare(lisp_value *self, lisp_value *other)
 static void integer_print(FILE *f, lisp_value *v);
 static lisp_value *integer_new(lisp_runtime *rt);
 static int integer_compare(lisp_value *self, lisp_value *other);
+static unsigned int integer_hash(lisp_value *self);
 
 static lisp_type type_integer_obj = {
 	TYPE_HEADER,
@@ -472,35 +877,40 @@ static lisp_type type_integer_obj = {
 	/* eval */ eval_same,
 	/* call */ call_error,
 	/* compare */ integer_compare,
+	/* hash */ integer_hash,
 };
 lisp_type *type_integer = &type_integer_obj;
 
 static void integer_print(FILE *f, lisp_value *v)
 {
-	lisp_integer *integer = (lisp_integer*) v;
-	fprintf(f, "%d", integer->x);
+	lisp_integer_print(f, (lisp_integer *) v);
 }
 
 static lisp_value *integer_new(lisp_runtime *rt)
 {
 	lisp_integer *integer;
-	(void) rt; /* unused */
 
-	integer = malloc(sizeof(lisp_integer));
+	integer = (lisp_integer*) lisp_alloc(rt, sizeof(lisp_integer));
 	integer->x = 0;
+	integer->sign = 1;
+	integer->n = 0;
+	integer->digits = NULL;
 	return (lisp_value*)integer;
 }
 
 static int integer_compare(lisp_value *self, lisp_value *other)
 {
-	lisp_integer *lhs, *rhs;
 	if (self == other)
 		return 1;
-	if (self->type != other->type || self->type != type_integer)
+	if (lisp_type_of(other) != type_integer)
 		return 0;
-	lhs = (lisp_integer*) self;
-	rhs = (lisp_integer*) other;
-	return lhs->x == rhs->x;
+	return lisp_integer_cmp((lisp_integer *) self,
+		(lisp_integer *) other) == 0;
+}
+
+static unsigned int integer_hash(lisp_value *v)
+{
+	return lisp_integer_hash((lisp_integer *) v);
 }
 
 /* string */
@@ -511,10 +921,11 @@ static lisp_type type_string_obj = {
 	/* print */ text_print,
 	/* new */ text_new,
 	/* free */ text_free,
-	/* expand */ iterator_empty,
+	/* expand */ text_expand,
 	/* eval */ eval_same,
 	/* call */ call_error,
 	/* compare */ text_compare,
+	/* hash */ text_hash,
 };
 lisp_type *type_string = &type_string_obj;
 
@@ -527,6 +938,7 @@ static lisp_value *builtin_new(lisp_runtime *rt);
 static lisp_value *builtin_call(lisp_runtime *rt, lisp_scope *scope,
                                 lisp_value *c, lisp_list *arguments);
 static int builtin_compare(lisp_value *self, lisp_value *other);
+static unsigned int builtin_hash(lisp_value *self);
 
 static lisp_type type_builtin_obj = {
 	TYPE_HEADER,
@@ -538,6 +950,7 @@ static lisp_type type_builtin_obj = {
 	/* eval */ eval_error,
 	/* call */ builtin_call,
 	/* compare */ builtin_compare,
+	/* hash */ builtin_hash,
 };
 lisp_type *type_builtin = &type_builtin_obj;
 
@@ -550,28 +963,76 @@ static void builtin_print(FILE *f, lisp_value *v)
 static lisp_value *builtin_new(lisp_runtime *rt)
 {
 	lisp_builtin *builtin;
-	(void) rt; /* unused */
 
-	builtin = malloc(sizeof(lisp_builtin));
+	builtin = (lisp_builtin*) lisp_alloc(rt, sizeof(lisp_builtin));
 	builtin->call = NULL;
+	builtin->argv_call = NULL;
 	builtin->name = NULL;
 	builtin->evald = 0;
 	return (lisp_value*) builtin;
 }
 
+/*
+ * Create a list of the @a n values in @a argv, quoting each if @a quote is set.
+ */
+static lisp_list *values_list(lisp_runtime *rt, lisp_value **argv, int n,
+                              int quote)
+{
+	lisp_list *list = (lisp_list *) lisp_nil_new(rt);
+	lisp_value *v;
+
+	while (n-- > 0) {
+		v = argv[n];
+		if (quote)
+			v = (lisp_value *) lisp_quote(rt, v);
+		list = lisp_list_new(rt, v, (lisp_value *) list);
+	}
+	return list;
+}
+
+/*
+ * Call an evaluated @a builtin with the @a n arguments in @a argv. Builtins
+ * which take a list of arguments get one made for them.
+ */
+static lisp_value *builtin_apply(lisp_runtime *rt, lisp_scope *scope,
+                                 lisp_builtin *builtin, lisp_value **argv,
+                                 int n)
+{
+	lisp_list *arguments;
+
+	if (builtin->argv_call)
+		return builtin->argv_call(rt, scope, argv, n, builtin->user);
+	arguments = values_list(rt, argv, n, 0);
+	return builtin->call(rt, scope, arguments, builtin->user);
+}
+
 static lisp_value *builtin_call(lisp_runtime *rt, lisp_scope *scope,
                                 lisp_value *c, lisp_list *arguments)
 {
 	lisp_builtin *builtin = (lisp_builtin*) c;
-	if (builtin->evald) {
-		arguments = lisp_eval_list(rt, scope, arguments);
-		lisp_error_check(arguments);
-	} else if (lisp_is_bad_list(arguments)) {
-		/* lisp_eval_list() does this check for us, don't need to
-		 * duplicate */
+	unsigned long base = rt->vm_sp;
+	lisp_value *v;
+	int n;
+
+	if (lisp_is_bad_list(arguments))
 		return lisp_error(rt, LE_SYNTAX, "unexpected cons cell");
+	if (!builtin->evald)
+		return builtin->call(rt, scope, arguments, builtin->user);
+
+	/* evaluated arguments go on the value stack rather than into a list */
+	n = lisp_list_length(arguments);
+	lisp_values_reserve(rt, n);
+	lisp_for_each(arguments) {
+		v = lisp_eval(rt, scope, arguments->left);
+		if (!v) {
+			rt->vm_sp = base;
+			return NULL;
+		}
+		rt->vm_stack[rt->vm_sp++] = v;
 	}
-	return builtin->call(rt, scope, arguments, builtin->user);
+	v = builtin_apply(rt, scope, builtin, rt->vm_stack + base, n);
+	rt->vm_sp = base;
+	return v;
 }
 
 static int builtin_compare(lisp_value *self, lisp_value *other)
@@ -579,24 +1040,32 @@ static int builtin_compare(lisp_value *self, lisp_value *other)
 	lisp_builtin *lhs, *rhs;
 	if (self == other)
 		return 1;
-	if (self->type != other->type || self->type != type_builtin)
+	if (lisp_type_of(other) != type_builtin)
 		return 0;
 	lhs = (lisp_builtin*) self;
 	rhs = (lisp_builtin*) other;
 	return (
 		lhs->call == rhs->call
+		&& lhs->argv_call == rhs->argv_call
 		&& lhs->user == rhs->user
 		&& lhs->evald == rhs->evald
 		&& strcmp(lhs->name, rhs->name) == 0
 	);
 }
 
+static unsigned int builtin_hash(lisp_value *v)
+{
+	return ht_string_hash(&((lisp_builtin *) v)->name);
+}
+
 /*
  * lambda
  */
 
 static void lambda_print(FILE *f, lisp_value *v);
 static lisp_value *lambda_new(lisp_runtime *rt);
+static lisp_value *lambda_eval(lisp_runtime *rt, lisp_scope *scope,
+                               lisp_value *v);
 static lisp_value *lambda_call(lisp_runtime *rt, lisp_scope *scope,
                                lisp_value *c, lisp_list *arguments);
 static struct iterator lambda_expand(lisp_value *v);
@@ -609,9 +1078,10 @@ static lisp_type type_lambda_obj = {
 	/* new */ lambda_new,
 	/* free */ simple_free,
 	/* expand */ lambda_expand,
-	/* eval */ eval_error,
+	/* eval */ lambda_eval,
 	/* call */ lambda_call,
 	/* compare */ lambda_compare,
+	/* hash */ hash_type,
 };
 lisp_type *type_lambda = &type_lambda_obj;
 
@@ -629,67 +1099,221 @@ static void lambda_print(FILE *f, lisp_value *v)
 static lisp_value *lambda_new(lisp_runtime *rt)
 {
 	lisp_lambda *lambda;
-	(void) rt; /* unused */
 
-	lambda = malloc(sizeof(lisp_lambda));
+	lambda = (lisp_lambda*) lisp_alloc(rt, sizeof(lisp_lambda));
 	lambda->args = NULL;
 	lambda->code = NULL;
 	lambda->closure = NULL;
 	lambda->first_binding = NULL;
 	lambda->lambda_type = TP_LAMBDA;
+	lambda->nargs = 0;
+	lambda->compiled = NULL;
 	return (lisp_value*) lambda;
 }
 
-static lisp_value *lambda_call(lisp_runtime *rt, lisp_scope *scope,
-                               lisp_value *c, lisp_list *arguments)
+/*
+ * A lambda without a closure stands in for a lambda form within a resolved
+ * lambda body. Evaluating it creates the closure.
+ */
+static lisp_value *lambda_eval(lisp_runtime *rt, lisp_scope *scope,
+                               lisp_value *v)
 {
-	lisp_lambda *lambda = (lisp_lambda*) c;
-	lisp_list *argvalues, *it1, *it2;
-	lisp_scope *inner;
-	lisp_value *result;
+	lisp_lambda *template = (lisp_lambda *) v;
+	lisp_lambda *lambda;
 
-	if (lambda->lambda_type == TP_MACRO) {
-		/* macros receive their arguments un-evaluated */
-		argvalues = arguments;
+	if (template->closure)
+		return eval_error(rt, scope, v);
+
+	lambda = (lisp_lambda *) lisp_new(rt, type_lambda);
+	lambda->args = template->args;
+	lambda->code = template->code;
+	lambda->closure = scope;
+	lambda->lambda_type = template->lambda_type;
+	lambda->nargs = template->nargs;
+	lambda->compiled = template->compiled;
+	return (lisp_value *) lambda;
+}
+
+lisp_scope *lisp_frame_new(lisp_runtime *rt, lisp_lambda *lambda)
+{
+	lisp_scope *frame = (lisp_scope *) lisp_new(rt, type_scope);
+	int i;
+
+	frame->up = lambda->closure;
+	frame->names = lambda->args;
+	if (lambda->nargs > LISP_FRAME_INLINE) {
+		frame->slots = calloc(lambda->nargs, sizeof(lisp_value *));
 	} else {
-		/* lambdas evaluate their arguments */
-		argvalues = lisp_eval_list(rt, scope, arguments);
-		lisp_error_check(argvalues);
+		frame->slots = frame->inline_slots;
+		for (i = 0; i < lambda->nargs; i++)
+			frame->slots[i] = NULL;
 	}
+	frame->nslots = lambda->nargs;
+	return frame;
+}
 
-	if (lisp_is_bad_list(argvalues)) {
-		return lisp_error(rt, LE_SYNTAX, "unexpected cons cell");
+/*
+ * Create the frame for a call to @a lambda with @a arguments, which are
+ * evaluated in @a scope unless it is a macro.
+ */
+static lisp_scope *lambda_frame(lisp_runtime *rt, lisp_scope *scope,
+                                lisp_lambda *lambda, lisp_list *arguments)
+{
+	lisp_scope *inner;
+	lisp_value *v;
+	int i = 0;
+
+	if (lisp_is_bad_list(arguments)) {
+		return (lisp_scope *) lisp_error(rt, LE_SYNTAX, "unexpected cons cell");
 	}
 
-	inner = (lisp_scope*)lisp_new(rt, type_scope);
-	inner->up = lambda->closure;
+	/* arguments go straight into the frame, without a list of them */
+	inner = lisp_frame_new(rt, lambda);
+	lisp_for_each(arguments) {
+		v = arguments->left;
+		if (lambda->lambda_type != TP_MACRO) {
+			/* lambdas evaluate their arguments, macros do not */
+			v = lisp_eval(rt, scope, v);
+			lisp_error_check(v);
+		}
+		if (i < lambda->nargs) {
+			inner->slots[i] = v;
+			lisp_write_barrier(inner, v);
+		}
+		i++;
+	}
 
-	it1 = lambda->args;
-	it2 = argvalues;
-	while (!lisp_nil_p((lisp_value*)it1) && !lisp_nil_p((lisp_value*)it2)) {
-		lisp_scope_bind(inner, (lisp_symbol*) it1->left, it2->left);
-		it1 = (lisp_list*) it1->right;
-		it2 = (lisp_list*) it2->right;
+	if (i < lambda->nargs) {
+		return (lisp_scope *) lisp_error(rt, LE_2FEW, "not enough arguments to lambda call");
+	}
+	if (i > lambda->nargs) {
+		return (lisp_scope *) lisp_error(rt, LE_2MANY, "too many arguments to lambda call");
 	}
+	return inner;
+}
 
-	if (!lisp_nil_p((lisp_value*)it1)) {
-		return lisp_error(rt, LE_2FEW, "not enough arguments to lambda call");
+/*
+ * Evaluate the body of @a lambda in its @a scope. The last expression of the
+ * body is in tail position, and so is the final expression of a special form
+ * in tail position (see lisp_builtin_tail()). A lambda called from tail
+ * position takes over the stack frame of this call, and its body is evaluated
+ * by the same loop, so tail recursion runs in constant space.
+ */
+static lisp_value *lambda_body(lisp_runtime *rt, lisp_lambda *lambda,
+                               lisp_scope *scope)
+{
+	lisp_value *expr, *callee;
+	lisp_list *form, *args;
+	int rv = lisp_tail_progn(rt, scope, lambda->code, &expr);
+
+	while (rv == LISP_TAIL_EXPR) {
+		form = (lisp_list *) expr;
+		if (lisp_type_of(expr) != type_list || lisp_nil_p(expr) ||
+		    lisp_type_of(form->right) != type_list)
+			return lisp_eval(rt, scope, expr);
+
+		callee = lisp_eval(rt, scope, form->left);
+		lisp_error_check(callee);
+		args = (lisp_list *) form->right;
+
+		if (lisp_type_of(callee) == type_builtin &&
+		    !((lisp_builtin *) callee)->evald &&
+		    !lisp_is_bad_list(args)) {
+			rv = lisp_builtin_tail(rt, (lisp_builtin *) callee,
+				&scope, args, &expr);
+			if (rv != LISP_TAIL_NONE)
+				continue;
+		} else if (lisp_type_of(callee) == type_lambda &&
+		           ((lisp_lambda *) callee)->lambda_type == TP_LAMBDA) {
+			if (!lisp_poll_check(rt, callee))
+				return NULL;
+			lambda = (lisp_lambda *) callee;
+			scope = lambda_frame(rt, scope, lambda, args);
+			lisp_error_check(scope);
+			lisp_stack_top(rt) = callee;
+			rv = lisp_tail_progn(rt, scope, lambda->code, &expr);
+			continue;
+		}
+		return lisp_call(rt, scope, callee, args);
 	}
-	if (!lisp_nil_p((lisp_value*)it2)) {
-		return lisp_error(rt, LE_2MANY, "too many arguments to lambda call");
+	return expr;
+}
+
+/*
+ * Run @a macro on the unevaluated @a arguments of a call, returning the code it
+ * expands to. When the macro cache is enabled, the expansion of a call site is
+ * only computed again once the call's head no longer evaluates to the macro
+ * which expanded it, for instance because the macro was redefined. Calls
+ * without arguments share the nil list, so they are not cached.
+ */
+static lisp_value *macro_expand(lisp_runtime *rt, lisp_scope *scope,
+                                lisp_lambda *macro, lisp_list *arguments)
+{
+	lisp_scope *inner;
+	lisp_list *entry;
+	lisp_value *result;
+
+	if (rt->expansions) {
+		entry = pt_get(rt->expansions, arguments);
+		if (entry && entry->left == (lisp_value *) macro)
+			return entry->right;
 	}
 
-	result = lisp_progn(rt, inner, lambda->code);
+	inner = lambda_frame(rt, scope, macro, arguments);
+	lisp_error_check(inner);
+	if (rt->vm)
+		result = lisp_vm_run_body(rt, macro, inner);
+	else
+		result = lisp_progn(rt, inner, macro->code);
 	lisp_error_check(result);
 
-	if (lambda->lambda_type == TP_MACRO) {
-		/* for macros, we've now evaluated the macro to get code, now
-		 * evaluate the code */
-		result = lisp_eval(rt, scope, result);
+	if (rt->expansions && !lisp_nil_p((lisp_value *) arguments)) {
+		entry = lisp_list_new(rt, (lisp_value *) macro, result);
+		pt_insert(rt->expansions, arguments, entry);
 	}
 	return result;
 }
 
+static lisp_value *lambda_call(lisp_runtime *rt, lisp_scope *scope,
+                               lisp_value *c, lisp_list *arguments)
+{
+	lisp_lambda *lambda = (lisp_lambda*) c;
+	lisp_scope *inner;
+	lisp_value *result;
+
+	if (lambda->lambda_type == TP_LAMBDA) {
+		inner = lambda_frame(rt, scope, lambda, arguments);
+		lisp_error_check(inner);
+		if (rt->vm)
+			return lisp_vm_run_body(rt, lambda, inner);
+		return lambda_body(rt, lambda, inner);
+	}
+
+	/* for macros, we evaluate the macro to get code, then evaluate the
+	 * code */
+	result = macro_expand(rt, scope, lambda, arguments);
+	lisp_error_check(result);
+	return lisp_eval(rt, scope, result);
+}
+
+static unsigned int expansion_hash(void *p)
+{
+	return (unsigned int) ((unsigned long) p / LISP_CLASS_GRAIN);
+}
+
+void lisp_enable_macro_cache(lisp_runtime *rt)
+{
+	if (!rt->expansions)
+		rt->expansions = pt_create(expansion_hash, NULL);
+}
+
+void lisp_disable_macro_cache(lisp_runtime *rt)
+{
+	if (rt->expansions)
+		pt_delete(rt->expansions);
+	rt->expansions = NULL;
+}
+
 static void *lambda_expand_next(struct iterator *it)
 {
 	lisp_lambda *l = (lisp_lambda*)it->ds;
@@ -703,6 +1327,8 @@ static void *lambda_expand_next(struct iterator *it)
 		return l->closure;
 	case 4:
 		return l->first_binding;
+	case 5:
+		return l->compiled;
 	default:
 		return NULL;
 	}
@@ -710,10 +1336,10 @@ static void *lambda_expand_next(struct iterator *it)
 
 static struct iterator lambda_expand(lisp_value *v)
 {
-	lisp_lambda *l = (lisp_lambda *) v;
 	struct iterator it = {0};
 	it.ds = v;
-	it.state_int = l->first_binding ? 4 : 3;
+	/* first_binding and compiled may be NULL */
+	it.state_int = 5;
 	it.index = 0;
 	it.next = lambda_expand_next;
 	it.has_next = has_next_index_lt_state;
@@ -726,7 +1352,7 @@ static int lambda_compare(lisp_value *self, lisp_value *other)
 	lisp_lambda *lhs, *rhs;
 	if (self == other)
 		return 1;
-	if (self->type != other->type || self->type != type_lambda)
+	if (lisp_type_of(other) != type_lambda)
 		return 0;
 	lhs = (lisp_lambda*) self;
 	rhs = (lisp_lambda*) other;
@@ -739,61 +1365,465 @@ static int lambda_compare(lisp_value *self, lisp_value *other)
 	);
 }
 
+/*
+ * local
+ */
+
+static void local_print(FILE *f, lisp_value *v);
+static lisp_value *local_new(lisp_runtime *rt);
+static lisp_value *local_eval(lisp_runtime *rt, lisp_scope *scope,
+                              lisp_value *v);
+static struct iterator local_expand(lisp_value *v);
+static int local_compare(lisp_value *self, lisp_value *other);
+static unsigned int local_hash(lisp_value *self);
+
+static lisp_type type_local_obj = {
+	TYPE_HEADER,
+	/* name */ "local",
+	/* print */ local_print,
+	/* new */ local_new,
+	/* free */ simple_free,
+	/* expand */ local_expand,
+	/* eval */ local_eval,
+	/* call */ call_error,
+	/* compare */ local_compare,
+	/* hash */ local_hash,
+};
+lisp_type *type_local = &type_local_obj;
+
+static void local_print(FILE *f, lisp_value *v)
+{
+	lisp_local *local = (lisp_local *) v;
+	lisp_print(f, (lisp_value *) local->sym);
+}
+
+static lisp_value *local_new(lisp_runtime *rt)
+{
+	lisp_local *local;
+
+	local = (lisp_local *) lisp_alloc(rt, sizeof(lisp_local));
+	local->sym = NULL;
+	local->depth = 0;
+	local->slot = 0;
+	return (lisp_value *) local;
+}
+
+static lisp_value *local_eval(lisp_runtime *rt, lisp_scope *scope,
+                              lisp_value *v)
+{
+	lisp_local *local = (lisp_local *) v;
+	int depth;
+	(void) rt;
+
+	for (depth = local->depth; depth > 0; depth--)
+		scope = scope->up;
+	return scope->slots[local->slot];
+}
+
+static struct iterator local_expand(lisp_value *v)
+{
+	lisp_local *local = (lisp_local *) v;
+	return iterator_single_value(local->sym);
+}
+
+static int local_compare(lisp_value *self, lisp_value *other)
+{
+	lisp_local *lhs, *rhs;
+	if (self == other)
+		return 1;
+	if (lisp_type_of(other) != type_local)
+		return 0;
+	lhs = (lisp_local *) self;
+	rhs = (lisp_local *) other;
+	return (
+		lhs->depth == rhs->depth
+		&& lhs->slot == rhs->slot
+		&& lisp_symbol_eq(lhs->sym, rhs->sym)
+	);
+}
+
+static unsigned int local_hash(lisp_value *v)
+{
+	lisp_local *local = (lisp_local *) v;
+	return local->sym->hash * 31 + (unsigned int) local->slot;
+}
+
+/*
+ * inline
+ */
+
+static void inline_print(FILE *f, lisp_value *v);
+static lisp_value *inline_new(lisp_runtime *rt);
+static lisp_value *inline_eval(lisp_runtime *rt, lisp_scope *scope,
+                               lisp_value *v);
+static struct iterator inline_expand(lisp_value *v);
+static int inline_compare(lisp_value *self, lisp_value *other);
+static unsigned int inline_hash(lisp_value *self);
+
+static lisp_type type_inline_obj = {
+	TYPE_HEADER,
+	/* name */ "inline",
+	/* print */ inline_print,
+	/* new */ inline_new,
+	/* free */ simple_free,
+	/* expand */ inline_expand,
+	/* eval */ inline_eval,
+	/* call */ call_error,
+	/* compare */ inline_compare,
+	/* hash */ inline_hash,
+};
+lisp_type *type_inline = &type_inline_obj;
+
+static void inline_print(FILE *f, lisp_value *v)
+{
+	lisp_print(f, ((lisp_inline *) v)->expr);
+}
+
+static lisp_value *inline_new(lisp_runtime *rt)
+{
+	lisp_inline *node;
+
+	node = (lisp_inline *) lisp_alloc(rt, sizeof(lisp_inline));
+	node->value = NULL;
+	node->expr = NULL;
+	node->version = 0;
+	return (lisp_value *) node;
+}
+
+static lisp_value *inline_eval(lisp_runtime *rt, lisp_scope *scope,
+                               lisp_value *v)
+{
+	lisp_inline *node = (lisp_inline *) v;
+
+	if (node->version == rt->builtins_version)
+		return node->value;
+	return lisp_eval(rt, scope, node->expr);
+}
+
+static void *inline_expand_next(struct iterator *it)
+{
+	lisp_inline *node = (lisp_inline *) it->ds;
+	it->index++;
+	return it->index == 1 ? node->value : node->expr;
+}
+
+static struct iterator inline_expand(lisp_value *v)
+{
+	struct iterator it = {0};
+	it.ds = v;
+	it.state_int = 2;
+	it.index = 0;
+	it.next = inline_expand_next;
+	it.has_next = has_next_index_lt_state;
+	it.close = iterator_close_noop;
+	return it;
+}
+
+static int inline_compare(lisp_value *self, lisp_value *other)
+{
+	if (self == other)
+		return 1;
+	if (lisp_type_of(other) != type_inline)
+		return 0;
+	return lisp_compare(((lisp_inline *) self)->expr,
+		((lisp_inline *) other)->expr);
+}
+
+static unsigned int inline_hash(lisp_value *v)
+{
+	return lisp_hash(((lisp_inline *) v)->expr);
+}
+
+/*
+ * code
+ */
+
+static void code_print(FILE *f, lisp_value *v);
+static lisp_value *code_new(lisp_runtime *rt);
+static void code_free(lisp_runtime *rt, void *v);
+static struct iterator code_expand(lisp_value *v);
+static int code_compare(lisp_value *self, lisp_value *other);
+
+static lisp_type type_code_obj = {
+	TYPE_HEADER,
+	/* name */ "code",
+	/* print */ code_print,
+	/* new */ code_new,
+	/* free */ code_free,
+	/* expand */ code_expand,
+	/* eval */ eval_error,
+	/* call */ call_error,
+	/* compare */ code_compare,
+	/* hash */ hash_ptr,
+};
+lisp_type *type_code = &type_code_obj;
+
+static void code_print(FILE *f, lisp_value *v)
+{
+	lisp_code *code = (lisp_code *) v;
+	fprintf(f, "<code %d ops>", code->nops);
+}
+
+static lisp_value *code_new(lisp_runtime *rt)
+{
+	lisp_code *code;
+
+	code = (lisp_code *) lisp_alloc(rt, sizeof(lisp_code));
+	code->ops = NULL;
+	code->nops = 0;
+	code->ops_size = 0;
+	code->consts = NULL;
+	code->nconsts = 0;
+	code->consts_size = 0;
+	code->maxstack = 0;
+	code->version = 0;
+	return (lisp_value *) code;
+}
+
+static void code_free(lisp_runtime *rt, void *v)
+{
+	lisp_code *code = (lisp_code *) v;
+	free(code->ops);
+	free(code->consts);
+	lisp_dealloc(rt, (lisp_value *) code);
+}
+
+static struct iterator code_expand(lisp_value *v)
+{
+	lisp_code *code = (lisp_code *) v;
+	return iterator_array((void **) code->consts, code->nconsts, false);
+}
+
+static int code_compare(lisp_value *self, lisp_value *other)
+{
+	return self == other;
+}
+
 /*
  * some shortcuts for accessing these type methods on lisp values
  */
 
 void lisp_print(FILE *f, lisp_value *value)
 {
-	value->type->print(f, value);
+	lisp_type_of(value)->print(f, value);
 }
 
 void lisp_free(lisp_runtime *rt, lisp_value *value)
 {
-	value->type->free(rt, value);
+	if (!lisp_fixnum_p(value))
+		value->type->free(rt, value);
 }
 
 lisp_value *lisp_eval(lisp_runtime *rt, lisp_scope *scope, lisp_value *value)
 {
-	return value->type->eval(rt, scope, value);
+	lisp_value *rv;
+	int outer = lisp_gc_enter(rt, &rv, scope, value, NULL);
+	rv = lisp_type_of(value)->eval(rt, scope, value);
+	if (outer)
+		lisp_gc_leave(rt);
+	return rv;
 }
 
 lisp_value *lisp_call(lisp_runtime *rt, lisp_scope *scope,
                       lisp_value *callable, lisp_list *args)
 {
 	lisp_value *rv;
-	/* create new stack frame */
-	rt->stack = lisp_list_new(rt, callable, (lisp_value *) rt->stack);
-	rt->stack_depth++;
+	int outer = lisp_gc_enter(rt, &rv, scope, callable, args);
+	/* create new stack frame, unless a limit stops the call */
+	if (lisp_stack_push(rt, callable)) {
+		/* make function call */
+		rv = lisp_type_of(callable)->call(rt, scope, callable, args);
+
+		/* get rid of stack frame */
+		lisp_stack_pop(rt);
+	} else {
+		rv = NULL;
+	}
+	if (outer)
+		lisp_gc_leave(rt);
+	return rv;
+}
+
+int lisp_stack_grow(lisp_runtime *rt)
+{
+	unsigned int size = rt->stack_size ? 2 * rt->stack_size : 64;
+
+	/* the stack never grows past the maximum depth */
+	if (rt->max_depth && size > rt->max_depth)
+		size = rt->max_depth;
+	if (size <= rt->stack_depth) {
+		lisp_error(rt, LE_LIMIT, "maximum call depth exceeded");
+		return 0;
+	}
+	rt->stack_size = size;
+	rt->stack = realloc(rt->stack, rt->stack_size * sizeof(lisp_value *));
+	return 1;
+}
+
+void lisp_values_reserve(lisp_runtime *rt, unsigned long n)
+{
+	if (rt->vm_sp + n <= rt->vm_size)
+		return;
+	while (rt->vm_sp + n > rt->vm_size)
+		rt->vm_size = rt->vm_size ? 2 * rt->vm_size : 256;
+	rt->vm_stack = realloc(rt->vm_stack, rt->vm_size * sizeof(lisp_value *));
+}
+
+void lisp_values_push(lisp_runtime *rt, lisp_value *value)
+{
+	lisp_values_reserve(rt, 1);
+	rt->vm_stack[rt->vm_sp++] = value;
+}
+
+lisp_scope *lisp_frame_values(lisp_runtime *rt, lisp_lambda *lambda, int n)
+{
+	lisp_scope *frame;
+	lisp_value **args;
+	int i;
+
+	if (n < lambda->nargs)
+		return (lisp_scope *) lisp_error(rt, LE_2FEW, "not enough arguments to lambda call");
+	if (n > lambda->nargs)
+		return (lisp_scope *) lisp_error(rt, LE_2MANY, "too many arguments to lambda call");
+	frame = lisp_frame_new(rt, lambda);
+	args = rt->vm_stack + rt->vm_sp - n;
+	for (i = 0; i < n; i++)
+		frame->slots[i] = args[i];
+	rt->vm_sp -= n + 1;
+	return frame;
+}
+
+lisp_value *lisp_apply_values(lisp_runtime *rt, lisp_scope *scope, int n)
+{
+	unsigned long base = rt->vm_sp - n - 1;
+	lisp_value *callee = rt->vm_stack[base];
+	lisp_lambda *lambda = (lisp_lambda *) callee;
+	lisp_list *arguments;
+	lisp_scope *frame;
+	lisp_value *rv;
 
-	/* make function call */
-	rv = callable->type->call(rt, scope, callable, args);
+	if (lisp_type_of(callee) == type_lambda &&
+	    lambda->lambda_type == TP_LAMBDA) {
+		frame = lisp_frame_values(rt, lambda, n);
+		if (!frame) {
+			rt->vm_sp = base;
+			return NULL;
+		}
+		if (rt->vm)
+			return lisp_vm_run_body(rt, lambda, frame);
+		return lambda_body(rt, lambda, frame);
+	}
 
-	/* get rid of stack frame */
-	rt->stack = (lisp_list*) rt->stack->right;
-	rt->stack_depth--;
+	if (lisp_type_of(callee) == type_builtin &&
+	    ((lisp_builtin *) callee)->evald) {
+		rv = builtin_apply(rt, scope, (lisp_builtin *) callee,
+			rt->vm_stack + base + 1, n);
+		rt->vm_sp = base;
+		return rv;
+	}
+
+	/* callees which take unevaluated arguments get them quoted */
+	arguments = values_list(rt, rt->vm_stack + base + 1, n, 1);
+	rt->vm_sp = base;
+	return lisp_type_of(callee)->call(rt, scope, callee, arguments);
+}
+
+lisp_value *lisp_call_values(lisp_runtime *rt, lisp_scope *scope, int n)
+{
+	lisp_value *rv;
+
+	if (!lisp_stack_push(rt, rt->vm_stack[rt->vm_sp - n - 1])) {
+		rt->vm_sp -= n + 1;
+		return NULL;
+	}
+	rv = lisp_apply_values(rt, scope, n);
+	lisp_stack_pop(rt);
 	return rv;
 }
 
-lisp_value *lisp_new(lisp_runtime *rt, lisp_type *typ)
+/*
+ * Give the garbage collector its chance to run before an allocation.
+ */
+static void lisp_new_begin(lisp_runtime *rt)
+{
+	rt->gc_allocs++;
+	if (rt->gc_allocs >= rt->gc_trigger && rt->gc_threshold && rt->stack_base)
+		lisp_gc_collect(rt);
+
+	if (rt->max_heap && rt->pool.bytes > rt->max_heap && !rt->heap_over)
+		lisp_heap_exceeded(rt);
+
+	/* incremental sweeping makes progress as we allocate */
+	if (rt->sweeping)
+		lisp_gc_step(rt, LISP_SWEEP_PER_ALLOC);
+}
+
+static lisp_value *lisp_new_end(lisp_runtime *rt, lisp_value *new,
+                                lisp_type *typ)
 {
-	lisp_value *new = typ->new(rt);
 	new->type = typ;
-	new->next = NULL;
-	new->mark = GC_NOMARK;
-	if (rt->head == NULL) {
-		rt->head = new;
-		rt->tail = new;
-	} else {
-		rt->tail->next = new;
-		rt->tail = new;
-	}
+	new->gen = LISP_GEN_YOUNG;
+	lisp_gc_add_young(rt, new);
 	return new;
 }
 
+lisp_value *lisp_new(lisp_runtime *rt, lisp_type *typ)
+{
+	lisp_new_begin(rt);
+	return lisp_new_end(rt, typ->new(rt), typ);
+}
+
+unsigned long lisp_storage_size(lisp_value *v)
+{
+	if (lisp_fixnum_p(v))
+		return 0;
+	if (v->type == type_vector)
+		return ((lisp_vector *) v)->size * sizeof(lisp_value *);
+	if (v->type == type_hashmap)
+		return ((lisp_hashmap *) v)->table.allocated *
+			sizeof(struct pt_slot);
+	return 0;
+}
+
+lisp_integer *lisp_integer_alloc(lisp_runtime *rt, int n)
+{
+	lisp_integer *integer;
+
+	lisp_new_begin(rt);
+	integer = (lisp_integer *) lisp_alloc(rt,
+		sizeof(lisp_integer) + n * sizeof(lisp_digit));
+	integer->x = 0;
+	integer->sign = 1;
+	integer->n = n;
+	integer->digits = (lisp_digit *) (integer + 1);
+	return (lisp_integer *) lisp_new_end(rt, (lisp_value *) integer,
+		type_integer);
+}
+
+struct lisp_text *lisp_text_alloc(lisp_runtime *rt, lisp_type *typ,
+                                  unsigned long extra)
+{
+	struct lisp_text *text;
+
+	lisp_new_begin(rt);
+	text = (struct lisp_text *) lisp_alloc(rt, sizeof(struct lisp_text) + extra);
+	text->s = NULL;
+	text->len = 0;
+	text->base = NULL;
+	text->can_free = 0;
+	text->core = 0;
+	text->form = 0;
+	return (struct lisp_text *) lisp_new_end(rt, (lisp_value *) text, typ);
+}
+
 int lisp_compare(lisp_value *self, lisp_value *other)
 {
-	return self->type->compare(self, other);
+	return lisp_type_of(self)->compare(self, other);
+}
+
+unsigned int lisp_hash(lisp_value *v)
+{
+	return lisp_type_of(v)->hash(v);
 }
 
 /*
@@ -815,15 +1845,15 @@ static lisp_type type_module_obj = {
 	/* eval */ eval_error,
 	/* call */ call_error,
 	/* compare */ module_compare,
+	/* hash */ hash_ptr,
 };
 lisp_type *type_module = &type_module_obj;
 
 static lisp_value *module_new(lisp_runtime *rt)
 {
 	lisp_module *module;
-	(void) rt; /* unused */
 
-	module = malloc(sizeof(lisp_module));
+	module = (lisp_module*) lisp_alloc(rt, sizeof(lisp_module));
 	module->contents = NULL;
 	module->name = NULL;
 	module->name = NULL;
@@ -35,44 +35,145 @@ const char *lisp_error_name[LE_MAX_ERR] = {
 	"LE_ASSERT",
 	"LE_VALUE",
 	"LE_ERRNO",
+	"LE_LIMIT",
 };
 
+int lisp_symbol_eq(lisp_symbol *left, lisp_symbol *right)
+{
+	/* symbols are interned */
+	return left == right;
+}
+
+/*
+ * Return the index of the slot of a lambda frame named @a symbol, or -1.
+ */
+static int lisp_frame_slot(lisp_scope *scope, lisp_symbol *symbol)
+{
+	lisp_list *names = scope->names;
+	int i;
+
+	for (i = 0; i < scope->nslots; i++) {
+		if (lisp_symbol_eq((lisp_symbol *) names->left, symbol))
+			return i;
+		names = (lisp_list *) names->right;
+	}
+	return -1;
+}
+
+/*
+ * Return the index of the small binding named @a symbol, or -1.
+ */
+static int lisp_small_slot(lisp_scope *scope, lisp_symbol *symbol)
+{
+	int i;
+
+	for (i = 0; i < scope->nsmall; i++)
+		if (lisp_symbol_eq(scope->small_names[i], symbol))
+			return i;
+	return -1;
+}
+
+/*
+ * Move the small bindings of a scope into a new table.
+ */
+static void lisp_scope_grow(lisp_scope *scope)
+{
+	int i;
+
+	scope->table = pt_create(lisp_text_hash, NULL);
+	for (i = 0; i < scope->nsmall; i++) {
+		pt_insert(scope->table, scope->small_names[i], scope->small_values[i]);
+		scope->small_names[i] = NULL;
+		scope->small_values[i] = NULL;
+	}
+	scope->nsmall = 0;
+}
+
 void lisp_scope_bind(lisp_scope *scope, lisp_symbol *symbol, lisp_value *value)
 {
 	lisp_lambda *l;
-	ht_insert_ptr(&scope->scope, symbol, value);
+	int slot;
 
-	/* for nicer debugging, record the first name binding for lambdas */
-	if (value->type == type_lambda) {
+	if (scope->slots && (slot = lisp_frame_slot(scope, symbol)) >= 0) {
+		scope->slots[slot] = value;
+	} else if ((slot = lisp_small_slot(scope, symbol)) >= 0) {
+		scope->small_values[slot] = value;
+	} else {
+		if (!scope->table && scope->nsmall < LISP_SCOPE_SMALL) {
+			scope->small_names[scope->nsmall] = symbol;
+			scope->small_values[scope->nsmall] = value;
+			scope->nsmall++;
+		} else {
+			if (!scope->table)
+				lisp_scope_grow(scope);
+			pt_insert(scope->table, symbol, value);
+		}
+		lisp_write_barrier(scope, (lisp_value *) symbol);
+	}
+	lisp_write_barrier(scope, value);
+
+	/* code which inlined the builtin this may shadow must look it up, but
+	 * new scopes, such as those of let and lambda calls, shadow nothing */
+	if (symbol->core && scope->inlined)
+		lisp_runtime_of(scope)->builtins_version++;
+
+	/* compiled code must stop specializing a form named by this, unless
+	 * it names the same builtin, as when a new default scope is filled */
+	if (symbol->form && (lisp_type_of(value) != type_builtin ||
+	    strcmp(((lisp_builtin *) value)->name, symbol->s) != 0))
+		lisp_runtime_of(scope)->forms_version++;
+
+	/* for nicer debugging, record the first name binding for lambdas, unless
+	 * they are shared with other runtimes, which must not write them */
+	if (lisp_type_of(value) == type_lambda) {
 		l = (lisp_lambda *) value;
-		if (!l->first_binding) {
+		if (!l->first_binding && l->gen != LISP_GEN_FROZEN &&
+				lisp_page_of(l)->owner == lisp_page_of(scope)->owner) {
 			l->first_binding = symbol;
+			lisp_write_barrier(l, (lisp_value *) symbol);
 		}
 	}
 }
 
+lisp_value *lisp_scope_find_local(lisp_scope *scope, lisp_symbol *symbol)
+{
+	int slot;
+
+	if (scope->slots && (slot = lisp_frame_slot(scope, symbol)) >= 0)
+		return scope->slots[slot];
+	if (scope->nsmall && (slot = lisp_small_slot(scope, symbol)) >= 0)
+		return scope->small_values[slot];
+	if (scope->table)
+		return pt_get(scope->table, symbol);
+	return NULL;
+}
+
+lisp_value *lisp_scope_find(lisp_scope *scope, lisp_symbol *symbol)
+{
+	lisp_value *v;
+
+	for (; scope; scope = scope->up)
+		if ((v = lisp_scope_find_local(scope, symbol)))
+			return v;
+	return NULL;
+}
+
 lisp_value *lisp_scope_lookup(lisp_runtime *rt, lisp_scope *scope,
                               lisp_symbol *symbol)
 {
-	lisp_value *v = ht_get_ptr(&scope->scope, symbol);
-	if (!v) {
-		if (scope->up) {
-			return lisp_scope_lookup(rt, scope->up, symbol);
-		} else {
-			return lisp_error(rt, LE_NOTFOUND, "symbol not found in scope");
-		}
-	} else {
-		return v;
-	}
+	lisp_value *v = lisp_scope_find(scope, symbol);
+	if (!v)
+		return lisp_error(rt, LE_NOTFOUND, "symbol not found in scope");
+	return v;
 }
 
 lisp_value *lisp_scope_lookup_string(lisp_runtime *rt, lisp_scope *scope, char *name)
 {
-	/* a dirty hack but why allocate here? */
-	lisp_symbol symbol;
-	symbol.type = type_symbol;
-	symbol.s = name;
-	return lisp_scope_lookup(rt, scope, &symbol);
+	/* a name which was never interned cannot be bound */
+	lisp_symbol *symbol = lisp_symbol_find(rt, name);
+	if (!symbol)
+		return lisp_error(rt, LE_NOTFOUND, "symbol not found in scope");
+	return lisp_scope_lookup(rt, scope, symbol);
 }
 
 void lisp_scope_add_builtin(lisp_runtime *rt, lisp_scope *scope, char *name,
@@ -83,6 +184,15 @@ void lisp_scope_add_builtin(lisp_runtime *rt, lisp_scope *scope, char *name,
 	lisp_scope_bind(scope, symbol, (lisp_value*)builtin);
 }
 
+void lisp_scope_add_builtin_argv(lisp_runtime *rt, lisp_scope *scope,
+                                 char *name, lisp_builtin_argv_func call,
+                                 void *user)
+{
+	lisp_symbol *symbol = lisp_symbol_new(rt, name, 0);
+	lisp_builtin *builtin = lisp_builtin_new_argv(rt, name, call, user);
+	lisp_scope_bind(scope, symbol, (lisp_value*)builtin);
+}
+
 lisp_value *lisp_mapper_eval(lisp_runtime *rt, lisp_scope *scope, void *user,
                              lisp_value *input)
 {
@@ -92,10 +202,15 @@ lisp_value *lisp_mapper_eval(lisp_runtime *rt, lisp_scope *scope, void *user,
 
 lisp_list *lisp_eval_list(lisp_runtime *rt, lisp_scope *scope, lisp_list *list)
 {
-	return lisp_map(rt, scope, NULL, lisp_mapper_eval, list);
+	lisp_list *rv;
+	int outer = lisp_gc_enter(rt, &rv, scope, list, NULL);
+	rv = lisp_map(rt, scope, NULL, lisp_mapper_eval, list);
+	if (outer)
+		lisp_gc_leave(rt);
+	return rv;
 }
 
-lisp_value *lisp_progn(lisp_runtime *rt, lisp_scope *scope, lisp_list *l)
+static lisp_value *progn(lisp_runtime *rt, lisp_scope *scope, lisp_list *l)
 {
 	lisp_value *v;
 
@@ -113,6 +228,16 @@ lisp_value *lisp_progn(lisp_runtime *rt, lisp_scope *scope, lisp_list *l)
 	}
 }
 
+lisp_value *lisp_progn(lisp_runtime *rt, lisp_scope *scope, lisp_list *l)
+{
+	lisp_value *rv;
+	int outer = lisp_gc_enter(rt, &rv, scope, l, NULL);
+	rv = progn(rt, scope, l);
+	if (outer)
+		lisp_gc_leave(rt);
+	return rv;
+}
+
 int lisp_list_length(lisp_list *list)
 {
 	int length = 0;
@@ -147,6 +272,12 @@ static lisp_type *lisp_get_type(char c)
 		return type_integer;
 	case 'l':
 		return type_list;
+	case 'v':
+		return type_vector;
+	case 'h':
+		return type_hashmap;
+	case 'q':
+		return type_sequence;
 	case 's':
 		return type_symbol;
 	case 'S':
@@ -161,10 +292,36 @@ static lisp_type *lisp_get_type(char c)
 	return NULL;
 }
 
+static int lisp_get_arg(lisp_runtime *rt, lisp_value *arg, char format,
+                        lisp_value **v)
+{
+	lisp_type *type = lisp_get_type(format);
+	if (type != NULL && type != lisp_type_of(arg)) {
+		rt->error = "incorrect argument type";
+		rt->err_num = LE_TYPE;
+		return 0;
+	}
+	*v = arg;
+	return 1;
+}
+
+static int lisp_get_args_end(lisp_runtime *rt, char format, int more)
+{
+	if (format != '\0') {
+		rt->error = "not enough arguments";
+		rt->err_num = LE_2FEW;
+		return 0;
+	} else if (more) {
+		rt->error = "too many arguments";
+		rt->err_num = LE_2MANY;
+		return 0;
+	}
+	return 1;
+}
+
 int lisp_get_args(lisp_runtime *rt, lisp_list *list, char *format, ...)
 {
 	lisp_value **v;
-	lisp_type *type;
 	va_list va;
 
 	va_start(va, format);
@@ -180,26 +337,30 @@ int lisp_get_args(lisp_runtime *rt, lisp_list *list, char *format, ...)
 			*v = (lisp_value *) list;
 			return 1;
 		}
-		type = lisp_get_type(*format);
-		if (type != NULL && type != list->left->type) {
-			rt->error = "incorrect argument type";
-			rt->err_num = LE_TYPE;
+		if (!lisp_get_arg(rt, list->left, *format, v))
 			return 0;
-		}
-		*v = list->left;
 		list = (lisp_list*)list->right;
 		format += 1;
 	}
-	if (*format != '\0') {
-		rt->error = "not enough arguments";
-		rt->err_num = LE_2FEW;
-		return 0;
-	} else if(!lisp_nil_p((lisp_value*)list)) {
-		rt->error = "too many arguments";
-		rt->err_num = LE_2MANY;
-		return 0;
+	return lisp_get_args_end(rt, *format, !lisp_nil_p((lisp_value*)list));
+}
+
+int lisp_get_argv(lisp_runtime *rt, lisp_value **argv, int argc, char *format,
+                  ...)
+{
+	lisp_value **v;
+	va_list va;
+
+	va_start(va, format);
+	while (argc > 0 && *format != '\0') {
+		v = va_arg(va, lisp_value**);
+		if (!lisp_get_arg(rt, *argv, *format, v))
+			return 0;
+		argv++;
+		argc--;
+		format += 1;
 	}
-	return 1;
+	return lisp_get_args_end(rt, *format, argc > 0);
 }
 
 lisp_list *lisp_list_of_strings(lisp_runtime *rt, char **list, size_t n, int flags)
@@ -242,6 +403,13 @@ lisp_runtime *lisp_runtime_new(void)
 	return rt;
 }
 
+lisp_runtime *lisp_runtime_spawn(lisp_runtime *template)
+{
+	lisp_runtime *rt = malloc(sizeof(lisp_runtime));
+	lisp_init_spawned(rt, template);
+	return rt;
+}
+
 void lisp_runtime_set_ctx(lisp_runtime *rt, void *user)
 {
 	rt->user = user;
@@ -260,7 +428,7 @@ void lisp_runtime_free(lisp_runtime *rt)
 
 int lisp_is(lisp_value *value, lisp_type *type)
 {
-	return value->type == type;
+	return lisp_type_of(value) == type;
 }
 
 lisp_scope *lisp_new_empty_scope(lisp_runtime *rt)
@@ -275,6 +443,13 @@ lisp_scope *lisp_new_default_scope(lisp_runtime *rt)
 	return scope;
 }
 
+lisp_scope *lisp_new_template_scope(lisp_runtime *rt)
+{
+	lisp_scope *scope = lisp_new_empty_scope(rt);
+	scope->up = rt->parent->frozen_scope;
+	return scope;
+}
+
 lisp_value *lisp_run_main_if_exists(lisp_runtime *rt, lisp_scope *scope,
                                     int argc, char **argv)
 {
@@ -304,6 +479,17 @@ lisp_builtin *lisp_builtin_new(lisp_runtime *rt, char *name,
 	return builtin;
 }
 
+lisp_builtin *lisp_builtin_new_argv(lisp_runtime *rt, char *name,
+                                    lisp_builtin_argv_func call, void *user)
+{
+	lisp_builtin *builtin = (lisp_builtin*)lisp_new(rt, type_builtin);
+	builtin->argv_call = call;
+	builtin->name = name;
+	builtin->user = user;
+	builtin->evald = 1;
+	return builtin;
+}
+
 lisp_value *lisp_nil_new(lisp_runtime *rt)
 {
 	if (rt->nil == NULL) {
@@ -312,8 +498,23 @@ lisp_value *lisp_nil_new(lisp_runtime *rt)
 	return rt->nil;
 }
 
+void lisp_string_unshare(lisp_string *s)
+{
+	char *copy = malloc(s->len + 1);
+
+	memcpy(copy, s->s, s->len);
+	copy[s->len] = '\0';
+	s->s = copy;
+	s->can_free = 1;
+	s->base = NULL;
+	lisp_runtime_of(s)->slices--;
+}
+
 char *lisp_string_get(lisp_string *s)
 {
+	/* a slice is usually not followed by a NUL, so it needs its own copy */
+	if (s->base && s->s[s->len] != '\0')
+		lisp_string_unshare(s);
 	return s->s;
 }
 
@@ -343,11 +544,13 @@ lisp_value *lisp_list_get_right(lisp_list *l)
 void lisp_list_set_left(lisp_list *l, lisp_value *left)
 {
 	l->left = left;
+	lisp_write_barrier(l, left);
 }
 
 void lisp_list_set_right(lisp_list *l, lisp_value *right)
 {
 	l->right = right;
+	lisp_write_barrier(l, right);
 }
 
 void lisp_list_append(lisp_runtime *rt, lisp_list **head, lisp_list **tail, lisp_value *item)
@@ -358,26 +561,443 @@ void lisp_list_append(lisp_runtime *rt, lisp_list **head, lisp_list **tail, lisp
 	} else {
 		(*tail)->right = (lisp_value*)lisp_list_new(
 				rt, item, lisp_nil_new(rt));
+		lisp_write_barrier(*tail, (*tail)->right);
 		*tail = (lisp_list*) (*tail)->right;
 	}
 }
 
+lisp_vector *lisp_vector_new(lisp_runtime *rt, unsigned long len)
+{
+	lisp_vector *v = (lisp_vector *) lisp_new(rt, type_vector);
+	unsigned long i;
+
+	if (len) {
+		v->items = malloc(len * sizeof(lisp_value *));
+		for (i = 0; i < len; i++)
+			v->items[i] = rt->nil;
+	}
+	v->len = v->size = len;
+	lisp_storage_account(rt, 0, lisp_storage_size((lisp_value *) v));
+	return v;
+}
+
+lisp_vector *lisp_vector_from_array(lisp_runtime *rt, lisp_value **items,
+                                    unsigned long n)
+{
+	lisp_vector *v = (lisp_vector *) lisp_new(rt, type_vector);
+
+	if (n) {
+		v->items = malloc(n * sizeof(lisp_value *));
+		memcpy(v->items, items, n * sizeof(lisp_value *));
+	}
+	v->len = v->size = n;
+	lisp_storage_account(rt, 0, lisp_storage_size((lisp_value *) v));
+	return v;
+}
+
+lisp_vector *lisp_vector_of_integers(lisp_runtime *rt, const int *items,
+                                     unsigned long n)
+{
+	lisp_vector *v = lisp_vector_new(rt, n);
+	unsigned long i;
+
+	for (i = 0; i < n; i++)
+		lisp_vector_set(v, i, (lisp_value *) lisp_integer_new(rt, items[i]));
+	return v;
+}
+
+lisp_vector *lisp_vector_of_strings(lisp_runtime *rt, char **list,
+                                    unsigned long n, int flags)
+{
+	lisp_vector *v = lisp_vector_new(rt, n);
+	unsigned long i;
+
+	for (i = 0; i < n; i++)
+		lisp_vector_set(v, i,
+			(lisp_value *) lisp_string_new(rt, list[i], flags));
+	return v;
+}
+
+unsigned long lisp_vector_length(lisp_vector *v)
+{
+	return v->len;
+}
+
+lisp_value *lisp_vector_get(lisp_vector *v, unsigned long i)
+{
+	return i < v->len ? v->items[i] : NULL;
+}
+
+void lisp_vector_set(lisp_vector *v, unsigned long i, lisp_value *item)
+{
+	v->items[i] = item;
+	lisp_write_barrier(v, item);
+}
+
+void lisp_vector_push(lisp_vector *v, lisp_value *item)
+{
+	unsigned long old;
+
+	if (v->len == v->size) {
+		old = lisp_storage_size((lisp_value *) v);
+		v->size = v->size ? v->size * 2 : 8;
+		v->items = realloc(v->items, v->size * sizeof(lisp_value *));
+		lisp_storage_account(lisp_runtime_of(v), old,
+			lisp_storage_size((lisp_value *) v));
+	}
+	v->items[v->len++] = item;
+	lisp_write_barrier(v, item);
+}
+
+lisp_hashmap *lisp_hashmap_new(lisp_runtime *rt)
+{
+	return (lisp_hashmap *) lisp_new(rt, type_hashmap);
+}
+
+lisp_value *lisp_hashmap_get(lisp_hashmap *map, lisp_value *key)
+{
+	return pt_get(&map->table, key);
+}
+
+void lisp_hashmap_put(lisp_hashmap *map, lisp_value *key, lisp_value *value)
+{
+	unsigned long old = lisp_storage_size((lisp_value *) map);
+
+	pt_insert(&map->table, key, value);
+	if (lisp_storage_size((lisp_value *) map) != old)
+		lisp_storage_account(lisp_runtime_of(map), old,
+			lisp_storage_size((lisp_value *) map));
+	lisp_write_barrier(map, key);
+	lisp_write_barrier(map, value);
+}
+
+int lisp_hashmap_remove(lisp_hashmap *map, lisp_value *key)
+{
+	return pt_remove(&map->table, key) == 0;
+}
+
+unsigned long lisp_hashmap_length(lisp_hashmap *map)
+{
+	return pt_length(&map->table);
+}
+
+int lisp_writable(lisp_runtime *rt, lisp_value *v)
+{
+	if (v->gen == LISP_GEN_FROZEN || !lisp_owned(rt, v)) {
+		lisp_error(rt, LE_VALUE,
+			"cannot modify an object shared with another runtime");
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Sources of sequences. A list source keeps the rest of the list in ds, and a
+ * vector source its position in index, so that a vector which grows while it
+ * is consumed yields the new items too.
+ */
+
+static bool seq_list_has_next(struct iterator *it)
+{
+	lisp_value *l = (lisp_value *) it->ds;
+	return lisp_type_of(l) == type_list && !lisp_nil_p(l);
+}
+
+static void *seq_list_next(struct iterator *it)
+{
+	lisp_list *l = (lisp_list *) it->ds;
+	it->ds = l->right;
+	it->index++;
+	return l->left;
+}
+
+static bool seq_vector_has_next(struct iterator *it)
+{
+	return (unsigned long) it->index < ((lisp_vector *) it->ds)->len;
+}
+
+static void *seq_vector_next(struct iterator *it)
+{
+	return ((lisp_vector *) it->ds)->items[it->index++];
+}
+
+struct seq_range {
+	lisp_runtime *rt;
+	long next;
+	long end;
+};
+
+static bool seq_range_has_next(struct iterator *it)
+{
+	struct seq_range *range = (struct seq_range *) it->ds;
+	return range->next < range->end;
+}
+
+static void *seq_range_next(struct iterator *it)
+{
+	struct seq_range *range = (struct seq_range *) it->ds;
+	return lisp_integer_new_long(range->rt, range->next++);
+}
+
+static void seq_free_ds(struct iterator *it)
+{
+	free(it->ds);
+}
+
+/*
+ * A host function has to be called to find out whether there is another item,
+ * which is kept in item until next() returns it. Nothing is allocated in
+ * between, so the item needs no root.
+ */
+struct seq_host {
+	lisp_runtime *rt;
+	lisp_sequence_func next;
+	lisp_sequence_close_func close;
+	void *user;
+	lisp_value *item;
+};
+
+static bool seq_host_has_next(struct iterator *it)
+{
+	struct seq_host *host = (struct seq_host *) it->ds;
+	int rv = host->next(host->rt, host->user, &host->item);
+
+	if (rv < 0)
+		it->state_int = -1;
+	return rv > 0;
+}
+
+static void *seq_host_next(struct iterator *it)
+{
+	it->index++;
+	return ((struct seq_host *) it->ds)->item;
+}
+
+static void seq_host_close(struct iterator *it)
+{
+	struct seq_host *host = (struct seq_host *) it->ds;
+	if (host->close)
+		host->close(host->user);
+	free(host);
+}
+
+lisp_sequence *lisp_sequence_of_iterator(lisp_runtime *rt, struct iterator it,
+                                         lisp_value *holder)
+{
+	lisp_sequence *s = (lisp_sequence *) lisp_new(rt, type_sequence);
+	s->kind = LISP_SEQ_SOURCE;
+	s->it = it;
+	s->holder = holder;
+	return s;
+}
+
+lisp_sequence *lisp_sequence_of(lisp_runtime *rt, lisp_value *v)
+{
+	lisp_type *type = lisp_type_of(v);
+	struct iterator it = {0};
+
+	if (type == type_sequence)
+		return (lisp_sequence *) v;
+	if (type == type_list) {
+		it.has_next = seq_list_has_next;
+		it.next = seq_list_next;
+	} else if (type == type_vector) {
+		it.has_next = seq_vector_has_next;
+		it.next = seq_vector_next;
+	} else {
+		lisp_error(rt, LE_TYPE, "expected a list, vector or sequence");
+		return NULL;
+	}
+	it.ds = v;
+	it.close = iterator_close_noop;
+	return lisp_sequence_of_iterator(rt, it, v);
+}
+
+lisp_sequence *lisp_sequence_range(lisp_runtime *rt, long start, long end)
+{
+	struct seq_range *range = malloc(sizeof(struct seq_range));
+	struct iterator it = {0};
+
+	range->rt = rt;
+	range->next = start;
+	range->end = end;
+	it.ds = range;
+	it.has_next = seq_range_has_next;
+	it.next = seq_range_next;
+	it.close = seq_free_ds;
+	return lisp_sequence_of_iterator(rt, it, NULL);
+}
+
+lisp_sequence *lisp_sequence_new(lisp_runtime *rt, lisp_sequence_func next,
+                                 lisp_sequence_close_func close, void *user)
+{
+	struct seq_host *host = malloc(sizeof(struct seq_host));
+	struct iterator it = {0};
+
+	host->rt = rt;
+	host->next = next;
+	host->close = close;
+	host->user = user;
+	host->item = NULL;
+	it.ds = host;
+	it.has_next = seq_host_has_next;
+	it.next = seq_host_next;
+	it.close = seq_host_close;
+	return lisp_sequence_of_iterator(rt, it, NULL);
+}
+
+lisp_sequence *lisp_sequence_stage(lisp_runtime *rt, enum lisp_seq_kind kind,
+                                   lisp_sequence *upstream, lisp_value *fn,
+                                   unsigned long remaining)
+{
+	lisp_sequence *s = (lisp_sequence *) lisp_new(rt, type_sequence);
+	s->kind = kind;
+	s->upstream = upstream;
+	s->fn = fn;
+	s->remaining = remaining;
+	return s;
+}
+
+/* Call @a fn with @a item, as an argument on the value stack. */
+static lisp_value *lisp_sequence_apply(lisp_runtime *rt, lisp_scope *scope,
+                                       lisp_value *fn, lisp_value *item)
+{
+	lisp_values_reserve(rt, 2);
+	rt->vm_stack[rt->vm_sp++] = fn;
+	rt->vm_stack[rt->vm_sp++] = item;
+	return lisp_call_values(rt, scope, 1);
+}
+
+int lisp_sequence_pull(lisp_runtime *rt, lisp_scope *scope, lisp_sequence *s,
+                       lisp_value **item)
+{
+	lisp_value *v, *keep;
+	int rv = 0;
+
+	if (s->done)
+		return 0;
+	if (!lisp_writable(rt, (lisp_value *) s))
+		return -1;
+
+	switch (s->kind) {
+	case LISP_SEQ_SOURCE:
+		/* consumers such as seq->list allocate without making calls */
+		if (!lisp_heap_ok(rt))
+			return -1;
+		if (s->it.has_next(&s->it)) {
+			*item = s->it.next(&s->it);
+			return 1;
+		}
+		rv = s->it.state_int < 0 ? -1 : 0;
+		s->it.close(&s->it);
+		s->done = 1;
+		return rv;
+	case LISP_SEQ_MAP:
+		rv = lisp_sequence_pull(rt, scope, s->upstream, &v);
+		if (rv > 0) {
+			*item = lisp_sequence_apply(rt, scope, s->fn, v);
+			return *item ? 1 : -1;
+		}
+		break;
+	case LISP_SEQ_FILTER:
+		/* v is on this stack, where the collector finds it */
+		while ((rv = lisp_sequence_pull(rt, scope, s->upstream, &v)) > 0) {
+			keep = lisp_sequence_apply(rt, scope, s->fn, v);
+			if (!keep)
+				return -1;
+			if (lisp_truthy(keep)) {
+				*item = v;
+				return 1;
+			}
+		}
+		break;
+	case LISP_SEQ_TAKE:
+		/* once enough items passed, the rest are never produced */
+		if (s->remaining) {
+			s->remaining--;
+			rv = lisp_sequence_pull(rt, scope, s->upstream, item);
+		}
+		break;
+	}
+	if (rv == 0)
+		s->done = 1;
+	return rv;
+}
+
+int lisp_sequence_next(lisp_runtime *rt, lisp_scope *scope, lisp_sequence *seq,
+                       lisp_value **item)
+{
+	int rv;
+	int outer = lisp_gc_enter(rt, &rv, scope, seq, NULL);
+	rv = lisp_sequence_pull(rt, scope, seq, item);
+	if (outer)
+		lisp_gc_leave(rt);
+	return rv;
+}
+
 lisp_integer *lisp_integer_new(lisp_runtime *rt, int n)
 {
-	lisp_integer *integer = (lisp_integer *) lisp_new(rt, type_integer);
+	return lisp_integer_new_long(rt, n);
+}
+
+lisp_integer *lisp_integer_new_long(lisp_runtime *rt, long n)
+{
+	lisp_integer *integer;
+
+	if (lisp_fixnum_fits(n))
+		return (lisp_integer *) lisp_fixnum_new(n);
+
+	integer = (lisp_integer *) lisp_new(rt, type_integer);
 	integer->x = n;
 	return integer;
 }
 
 int lisp_integer_get(lisp_integer *integer)
 {
-	return integer->x;
+	long x;
+
+	if (lisp_fixnum_p(integer))
+		x = lisp_fixnum_get(integer);
+	else if (integer->n)
+		return integer->sign > 0 ? INT_MAX : INT_MIN;
+	else
+		x = integer->x;
+
+	if (x > INT_MAX)
+		return INT_MAX;
+	if (x < INT_MIN)
+		return INT_MIN;
+	return (int) x;
+}
+
+int lisp_integer_get_long(lisp_integer *integer, long *n)
+{
+	if (lisp_fixnum_p(integer))
+		*n = lisp_fixnum_get(integer);
+	else if (integer->n)
+		return 0;
+	else
+		*n = integer->x;
+	return 1;
+}
+
+static void lisp_dump_frames(lisp_value **frames, unsigned int depth,
+                             FILE *file)
+{
+	fprintf(file, "Stack trace (most recent call first):\n");
+	while (depth > 0) {
+		fprintf(file, "  ");
+		lisp_print(file, frames[--depth]);
+		fprintf(file, "\n");
+	}
 }
 
 void lisp_dump_stack(lisp_runtime *rt, lisp_list *stack, FILE *file)
 {
-	if (!stack)
-		stack = rt->stack;
+	if (!stack) {
+		lisp_dump_frames(rt->stack, rt->stack_depth, file);
+		return;
+	}
 
 	fprintf(file, "Stack trace (most recent call first):\n");
 	lisp_for_each(stack) {
@@ -391,7 +1011,16 @@ lisp_value *lisp_error(lisp_runtime *rt, enum lisp_errno err_num, char *message)
 {
 	rt->error = message;
 	rt->err_num = err_num;
-	rt->error_stack = rt->stack;
+	/* the stack is about to unwind, so keep a copy of it */
+	if (rt->error_size < rt->stack_depth) {
+		rt->error_size = rt->stack_size;
+		rt->error_stack = realloc(rt->error_stack,
+			rt->error_size * sizeof(lisp_value *));
+	}
+	if (rt->stack_depth)
+		memcpy(rt->error_stack, rt->stack,
+			rt->stack_depth * sizeof(lisp_value *));
+	rt->error_depth = rt->stack_depth;
 	return NULL;
 }
 
@@ -408,7 +1037,7 @@ enum lisp_errno lisp_get_errno(lisp_runtime *rt)
 void lisp_clear_error(lisp_runtime *rt)
 {
 	rt->error = NULL;
-	rt->error_stack = NULL;
+	rt->error_depth = 0;
 	rt->error_line = 0;
 	rt->err_num = 0;
 }
@@ -432,8 +1061,8 @@ void lisp_print_error(lisp_runtime *rt, FILE *file)
 		fprintf(file, "Error %s: %s\n", lisp_error_name[rt->err_num], rt->error);
 	}
 
-	if (rt->error_stack)
-		lisp_dump_stack(rt, rt->error_stack, file);
+	if (rt->error_depth)
+		lisp_dump_frames(rt->error_stack, rt->error_depth, file);
 }
 
 enum lisp_errno lisp_sym_to_errno(lisp_symbol *sym)
@@ -447,20 +1076,20 @@ enum lisp_errno lisp_sym_to_errno(lisp_symbol *sym)
 
 int lisp_is_bad_list(lisp_list *l)
 {
-	if (l->type != type_list) return 1;
+	if (lisp_type_of(l) != type_list) return 1;
 	lisp_for_each(l) {} /* go to first item which is not an empty list */
-	return l->type != type_list;
+	return lisp_type_of(l) != type_list;
 }
 
 int lisp_is_bad_list_of_lists(lisp_list *l)
 {
-	if (l->type != type_list) return 1;
+	if (lisp_type_of(l) != type_list) return 1;
 	lisp_for_each(l) {
 		if (lisp_is_bad_list((lisp_list*)l->left)) {
 			return 1;
 		}
 	}
-	return l->type != type_list;
+	return lisp_type_of(l) != type_list;
 }
 
 lisp_list *lisp_map(lisp_runtime *rt, lisp_scope *scope, void *user,
@@ -484,7 +1113,7 @@ lisp_list *lisp_map(lisp_runtime *rt, lisp_scope *scope, void *user,
 		lisp_error_check(new_node->left);
 	}
 
-	if (list->type != type_list) {
+	if (lisp_type_of(list) != type_list) {
 		/* badly behaved cons cell in list */
 		return (lisp_list*) lisp_error(rt, LE_SYNTAX, "unexpected cons cell in list");
 	}
@@ -494,5 +1123,6 @@ lisp_list *lisp_map(lisp_runtime *rt, lisp_scope *scope, void *user,
 
 int lisp_truthy(lisp_value *v)
 {
-	return v->type == type_integer && ((lisp_integer*)v)->x;
+	return lisp_type_of(v) == type_integer &&
+		lisp_integer_get((lisp_integer *) v);
 }
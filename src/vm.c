@@ -0,0 +1,611 @@
+/*
+ * vm.c: bytecode compiler and virtual machine for funlisp
+ *
+ * The evaluator in types.c walks the code itself: every value it evaluates is
+ * dispatched through its type, and so is every call. When the bytecode VM is
+ * enabled, the body of each lambda is instead compiled the first time it is
+ * called, into a lisp_code object. The VM runs it on a value stack owned by
+ * the runtime. Arguments of a lambda
+ * called by compiled code go straight from the value stack into its frame,
+ * and the special forms if, cond, progn, let and define become jumps and
+ * scope instructions rather than builtin calls. Top level code loaded with
+ * lisp_load_file() is compiled and run the same way.
+ *
+ * The compiler need not understand everything. An expression it does not
+ * handle is kept as a constant, and evaluated by the tree-walking evaluator.
+ * If the callee of a call turns out at runtime to take its arguments
+ * unevaluated (a macro, or a builtin like quote), the call is handed to
+ * lisp_call() with the original argument list. So, code means the same thing
+ * in both evaluators. Evaluated arguments are passed to builtins and lambdas
+ * on the value stack (see lisp_apply_values()).
+ *
+ * Like the resolver in builtins.c, the compiler decides which forms are
+ * special forms by looking up their head when it compiles them. Their heads
+ * may be bound to something else later, so each special form it compiles
+ * begins with OP_FORM, which evaluates the form with the tree walker instead
+ * once the names of special forms have been rebound. Code compiled before
+ * that is compiled again the next time it is called.
+ *
+ * Stephen Brennan <stephen@brennan.io>
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "funlisp_internal.h"
+
+/*
+ * Instructions, followed by their operands. Constant operands are indices
+ * into the consts array, and jump targets are indices into the ops array.
+ */
+enum lisp_op {
+	OP_CONST,      /* k: push consts[k] */
+	OP_LOCAL,      /* depth slot: push an argument, as lisp_local does */
+	OP_GLOBAL,     /* k: push the value bound to the symbol consts[k] */
+	OP_EVAL,       /* k: push consts[k], evaluated by the tree walker */
+	OP_INLINE,     /* k: push the value of the lisp_inline consts[k] */
+	OP_FORM,       /* k target: if special forms were rebound since the
+	                  code was compiled, push consts[k], evaluated by the
+	                  tree walker, and jump */
+	OP_POP,        /* discard the top value */
+	OP_JUMP,       /* target */
+	OP_JUMP_FALSE, /* target: pop a value, and jump if it is false */
+	OP_PREPARE,    /* k target: begin a call, see lisp_vm_run() */
+	OP_CALL,       /* n: call the callee below n arguments */
+	OP_TAIL_CALL,  /* n: the same, but a lambda replaces the running one */
+	OP_DEFINE,     /* k: bind the symbol consts[k] to the top value */
+	OP_SCOPE,      /* enter a new scope, for let */
+	OP_UNSCOPE,    /* return to the scope above */
+	OP_RETURN      /* pop the result */
+};
+
+struct lisp_compiler {
+	lisp_runtime *rt;
+	lisp_scope *scope; /* where the heads of forms are looked up */
+	lisp_code *code;
+	int depth;         /* values on the stack at this point */
+};
+
+static int lisp_emit(struct lisp_compiler *c, int op)
+{
+	lisp_code *code = c->code;
+
+	if (code->nops == code->ops_size) {
+		code->ops_size = code->ops_size ? 2 * code->ops_size : 16;
+		code->ops = realloc(code->ops, code->ops_size * sizeof(int));
+	}
+	code->ops[code->nops] = op;
+	return code->nops++;
+}
+
+static void lisp_emit_const(struct lisp_compiler *c, int op, lisp_value *v)
+{
+	lisp_code *code = c->code;
+
+	if (code->nconsts == code->consts_size) {
+		code->consts_size = code->consts_size ? 2 * code->consts_size : 8;
+		code->consts = realloc(code->consts,
+			code->consts_size * sizeof(lisp_value *));
+	}
+	code->consts[code->nconsts] = v;
+	lisp_emit(c, op);
+	lisp_emit(c, code->nconsts++);
+}
+
+static void lisp_stack_effect(struct lisp_compiler *c, int delta)
+{
+	c->depth += delta;
+	if (c->depth > c->code->maxstack)
+		c->code->maxstack = c->depth;
+}
+
+static void lisp_compile_expr(struct lisp_compiler *c, lisp_value *expr,
+                              int tail);
+
+/*
+ * Must @a lambda be compiled before it runs? Stale code of other runtimes'
+ * lambdas, which may not be written, still runs correctly, only slower.
+ */
+static int lisp_vm_stale(lisp_runtime *rt, lisp_lambda *lambda)
+{
+	if (!lambda->compiled)
+		return 1;
+	return lambda->compiled->version != rt->forms_version &&
+		lisp_owned(rt, (lisp_value *) lambda);
+}
+
+static int lisp_proper_form(lisp_value *expr)
+{
+	return lisp_type_of(expr) == type_list && !lisp_nil_p(expr) &&
+		!lisp_is_bad_list((lisp_list *) expr);
+}
+
+static lisp_value *lisp_nth(lisp_list *list, int n)
+{
+	while (n-- > 0)
+		list = (lisp_list *) list->right;
+	return list->left;
+}
+
+/*
+ * Compile a sequence of expressions, leaving the value of the last one. When
+ * @a tail is set, here and below, the value is the result of the lambda.
+ */
+static void lisp_compile_progn(struct lisp_compiler *c, lisp_list *body,
+                               int tail)
+{
+	if (lisp_nil_p((lisp_value *) body)) {
+		lisp_emit_const(c, OP_CONST, lisp_nil_new(c->rt));
+		lisp_stack_effect(c, 1);
+		return;
+	}
+	for (;;) {
+		if (lisp_nil_p(body->right)) {
+			lisp_compile_expr(c, body->left, tail);
+			return;
+		}
+		lisp_compile_expr(c, body->left, 0);
+		lisp_emit(c, OP_POP);
+		lisp_stack_effect(c, -1);
+		body = (lisp_list *) body->right;
+	}
+}
+
+static lisp_code *lisp_compile(lisp_runtime *rt, lisp_scope *scope,
+                               lisp_value *expr, lisp_list *body, int tail)
+{
+	struct lisp_compiler c;
+
+	c.rt = rt;
+	c.scope = scope;
+	c.code = (lisp_code *) lisp_new(rt, type_code);
+	c.code->version = rt->forms_version;
+	c.depth = 0;
+	if (body)
+		lisp_compile_progn(&c, body, tail);
+	else
+		lisp_compile_expr(&c, expr, tail);
+	lisp_emit(&c, OP_RETURN);
+	return c.code;
+}
+
+static void lisp_compile_if(struct lisp_compiler *c, lisp_list *form,
+                            int tail)
+{
+	int to_false, to_end;
+
+	lisp_compile_expr(c, lisp_nth(form, 1), 0);
+	lisp_emit(c, OP_JUMP_FALSE);
+	to_false = lisp_emit(c, 0);
+	lisp_stack_effect(c, -1);
+
+	lisp_compile_expr(c, lisp_nth(form, 2), tail);
+	lisp_emit(c, OP_JUMP);
+	to_end = lisp_emit(c, 0);
+	lisp_stack_effect(c, -1);
+
+	c->code->ops[to_false] = c->code->nops;
+	lisp_compile_expr(c, lisp_nth(form, 3), tail);
+	c->code->ops[to_end] = c->code->nops;
+}
+
+static int lisp_cond_ok(lisp_list *form)
+{
+	lisp_list *it = (lisp_list *) form->right;
+
+	if (lisp_nil_p((lisp_value *) it))
+		return 0;
+	lisp_for_each(it) {
+		if (!lisp_proper_form(it->left) ||
+		    lisp_list_length((lisp_list *) it->left) != 2)
+			return 0;
+	}
+	return 1;
+}
+
+static void lisp_compile_cond(struct lisp_compiler *c, lisp_list *form,
+                              int tail)
+{
+	lisp_list *it = (lisp_list *) form->right, *clause;
+	int to_next, to_end, ends = -1;
+
+	lisp_for_each(it) {
+		clause = (lisp_list *) it->left;
+		lisp_compile_expr(c, clause->left, 0);
+		lisp_emit(c, OP_JUMP_FALSE);
+		to_next = lisp_emit(c, 0);
+		lisp_stack_effect(c, -1);
+
+		lisp_compile_expr(c, lisp_nth(clause, 1), tail);
+		lisp_emit(c, OP_JUMP);
+		/* chain the jumps to the end through their operands */
+		ends = lisp_emit(c, ends);
+		lisp_stack_effect(c, -1);
+		c->code->ops[to_next] = c->code->nops;
+	}
+	lisp_emit_const(c, OP_CONST, lisp_nil_new(c->rt));
+	lisp_stack_effect(c, 1);
+
+	while (ends >= 0) {
+		to_end = c->code->ops[ends];
+		c->code->ops[ends] = c->code->nops;
+		ends = to_end;
+	}
+}
+
+static int lisp_let_ok(lisp_list *form)
+{
+	lisp_list *it, *binding;
+
+	if (lisp_list_length(form) < 3)
+		return 0;
+	it = (lisp_list *) lisp_nth(form, 1);
+	if (lisp_type_of((lisp_value *) it) != type_list || lisp_is_bad_list(it))
+		return 0;
+	lisp_for_each(it) {
+		binding = (lisp_list *) it->left;
+		if (!lisp_proper_form((lisp_value *) binding) ||
+		    lisp_list_length(binding) != 2 ||
+		    lisp_type_of(binding->left) != type_symbol)
+			return 0;
+	}
+	return 1;
+}
+
+static void lisp_compile_let(struct lisp_compiler *c, lisp_list *form,
+                             int tail)
+{
+	lisp_list *it = (lisp_list *) lisp_nth(form, 1), *binding;
+
+	lisp_emit(c, OP_SCOPE);
+	lisp_for_each(it) {
+		binding = (lisp_list *) it->left;
+		lisp_compile_expr(c, lisp_nth(binding, 1), 0);
+		lisp_emit_const(c, OP_DEFINE, binding->left);
+		lisp_emit(c, OP_POP);
+		lisp_stack_effect(c, -1);
+	}
+	lisp_compile_progn(c, (lisp_list *) ((lisp_list *) form->right)->right,
+		tail);
+	lisp_emit(c, OP_UNSCOPE);
+}
+
+/*
+ * A function call. The callee is evaluated first, and OP_PREPARE decides
+ * whether its arguments are evaluated here. If not, it jumps past OP_CALL.
+ */
+static void lisp_compile_call(struct lisp_compiler *c, lisp_list *form,
+                              int tail)
+{
+	lisp_list *it = (lisp_list *) form->right;
+	int to_end, n = 0;
+
+	lisp_compile_expr(c, form->left, 0);
+	lisp_emit_const(c, OP_PREPARE, form->right);
+	to_end = lisp_emit(c, 0);
+	lisp_for_each(it) {
+		lisp_compile_expr(c, it->left, 0);
+		n++;
+	}
+	lisp_emit(c, tail ? OP_TAIL_CALL : OP_CALL);
+	lisp_emit(c, n);
+	lisp_stack_effect(c, -n);
+	c->code->ops[to_end] = c->code->nops;
+}
+
+static void lisp_compile_form(struct lisp_compiler *c, lisp_list *form,
+                              int tail)
+{
+	int length = lisp_list_length(form);
+	enum lisp_form kind = lisp_classify(c->scope, NULL, form->left);
+	int ok, to_end;
+
+	switch (kind) {
+	case FORM_QUOTE:
+		ok = length == 2;
+		break;
+	case FORM_IF:
+		ok = length == 4;
+		break;
+	case FORM_COND:
+		ok = lisp_cond_ok(form);
+		break;
+	case FORM_PROGN:
+		ok = 1;
+		break;
+	case FORM_LET:
+		ok = lisp_let_ok(form);
+		break;
+	case FORM_DEFINE:
+		ok = length == 3 && lisp_type_of(lisp_nth(form, 1)) == type_symbol;
+		break;
+	default:
+		ok = 0;
+		break;
+	}
+	if (!ok) {
+		lisp_compile_call(c, form, tail);
+		return;
+	}
+
+	lisp_emit_const(c, OP_FORM, (lisp_value *) form);
+	to_end = lisp_emit(c, 0);
+	switch (kind) {
+	case FORM_QUOTE:
+		lisp_emit_const(c, OP_CONST, lisp_nth(form, 1));
+		lisp_stack_effect(c, 1);
+		break;
+	case FORM_IF:
+		lisp_compile_if(c, form, tail);
+		break;
+	case FORM_COND:
+		lisp_compile_cond(c, form, tail);
+		break;
+	case FORM_PROGN:
+		lisp_compile_progn(c, (lisp_list *) form->right, tail);
+		break;
+	case FORM_LET:
+		lisp_compile_let(c, form, tail);
+		break;
+	default:
+		lisp_compile_expr(c, lisp_nth(form, 2), 0);
+		lisp_emit_const(c, OP_DEFINE, lisp_nth(form, 1));
+		break;
+	}
+	c->code->ops[to_end] = c->code->nops;
+}
+
+static void lisp_compile_expr(struct lisp_compiler *c, lisp_value *expr,
+                              int tail)
+{
+	lisp_type *type = lisp_type_of(expr);
+	lisp_lambda *template;
+	lisp_local *local;
+
+	if (type == type_symbol) {
+		lisp_emit_const(c, OP_GLOBAL, expr);
+	} else if (type == type_inline) {
+		lisp_emit_const(c, OP_INLINE, expr);
+	} else if (type == type_local) {
+		local = (lisp_local *) expr;
+		lisp_emit(c, OP_LOCAL);
+		lisp_emit(c, local->depth);
+		lisp_emit(c, local->slot);
+	} else if (type == type_integer || type == type_string ||
+	           type == type_vector || type == type_hashmap ||
+	           type == type_sequence) {
+		lisp_emit_const(c, OP_CONST, expr);
+	} else if (lisp_proper_form(expr)) {
+		lisp_compile_form(c, (lisp_list *) expr, tail);
+		return;
+	} else {
+		/*
+		 * Lambdas nested in a resolved body are compiled along with
+		 * it, so that their closures share the compiled code.
+		 */
+		template = (lisp_lambda *) expr;
+		if (type == type_lambda && !template->closure &&
+		    lisp_vm_stale(c->rt, template)) {
+			template->compiled = lisp_compile(c->rt, c->scope,
+				NULL, template->code,
+				template->lambda_type == TP_LAMBDA);
+			lisp_write_barrier(template, (lisp_value *) template->compiled);
+		}
+		lisp_emit_const(c, OP_EVAL, expr);
+	}
+	lisp_stack_effect(c, 1);
+}
+
+/*
+ * May @a callee be called with arguments evaluated by the VM?
+ */
+static int lisp_vm_direct(lisp_value *callee)
+{
+	lisp_type *type = lisp_type_of(callee);
+
+	if (type == type_lambda)
+		return ((lisp_lambda *) callee)->lambda_type == TP_LAMBDA;
+	if (type == type_builtin)
+		return ((lisp_builtin *) callee)->evald;
+	return 0;
+}
+
+void lisp_vm_compile(lisp_runtime *rt, lisp_lambda *lambda)
+{
+	if (!lisp_vm_stale(rt, lambda))
+		return;
+	lambda->compiled = lisp_compile(rt, lambda->closure, NULL, lambda->code,
+		lambda->lambda_type == TP_LAMBDA);
+	lisp_write_barrier(lambda, (lisp_value *) lambda->compiled);
+}
+
+#define PUSH(v) (rt->vm_stack[rt->vm_sp++] = (v))
+#define TOP (rt->vm_stack[rt->vm_sp - 1])
+
+static lisp_value *lisp_vm_run(lisp_runtime *rt, lisp_code *code,
+                               lisp_scope *scope)
+{
+	unsigned long base = rt->vm_sp;
+	unsigned int stack_depth = rt->stack_depth;
+	int *ops, pc, i;
+	lisp_value **consts;
+	lisp_lambda *lambda;
+	lisp_inline *node;
+	lisp_value *v;
+	lisp_scope *s;
+
+start:
+	ops = code->ops;
+	consts = code->consts;
+	pc = 0;
+	/* the code must stay alive while it runs */
+	lisp_values_reserve(rt, code->maxstack + 1);
+	PUSH((lisp_value *) code);
+
+	for (;;) {
+		switch (ops[pc++]) {
+		case OP_CONST:
+			PUSH(consts[ops[pc++]]);
+			break;
+		case OP_LOCAL:
+			s = scope;
+			for (i = ops[pc++]; i > 0; i--)
+				s = s->up;
+			PUSH(s->slots[ops[pc++]]);
+			break;
+		case OP_GLOBAL:
+			v = lisp_scope_lookup(rt, scope,
+				(lisp_symbol *) consts[ops[pc++]]);
+			if (!v)
+				goto error;
+			PUSH(v);
+			break;
+		case OP_EVAL:
+			v = lisp_eval(rt, scope, consts[ops[pc++]]);
+			if (!v)
+				goto error;
+			PUSH(v);
+			break;
+		case OP_INLINE:
+			node = (lisp_inline *) consts[ops[pc++]];
+			if (node->version == rt->builtins_version) {
+				PUSH(node->value);
+				break;
+			}
+			v = lisp_eval(rt, scope, node->expr);
+			if (!v)
+				goto error;
+			PUSH(v);
+			break;
+		case OP_FORM:
+			if (code->version == rt->forms_version) {
+				pc += 2;
+				break;
+			}
+			v = lisp_eval(rt, scope, consts[ops[pc]]);
+			if (!v)
+				goto error;
+			PUSH(v);
+			pc = ops[pc + 1];
+			break;
+		case OP_POP:
+			rt->vm_sp--;
+			break;
+		case OP_JUMP:
+			pc = ops[pc];
+			break;
+		case OP_JUMP_FALSE:
+			if (lisp_truthy(rt->vm_stack[--rt->vm_sp]))
+				pc++;
+			else
+				pc = ops[pc];
+			break;
+		case OP_PREPARE:
+			/*
+			 * Push a stack frame for the callee, as lisp_call()
+			 * does, or let lisp_call() handle the whole call.
+			 */
+			if (lisp_vm_direct(TOP)) {
+				if (!lisp_stack_push(rt, TOP))
+					goto error;
+				pc += 2;
+			} else {
+				v = lisp_call(rt, scope, TOP,
+					(lisp_list *) consts[ops[pc]]);
+				if (!v)
+					goto error;
+				TOP = v;
+				pc = ops[pc + 1];
+			}
+			break;
+		case OP_CALL:
+			v = lisp_apply_values(rt, scope, ops[pc++]);
+			if (!v)
+				goto error;
+			lisp_stack_pop(rt);
+			PUSH(v);
+			break;
+		case OP_TAIL_CALL:
+			i = ops[pc++];
+			v = rt->vm_stack[rt->vm_sp - i - 1];
+			if (lisp_type_of(v) != type_lambda) {
+				v = lisp_apply_values(rt, scope, i);
+				if (!v)
+					goto error;
+				lisp_stack_pop(rt);
+				PUSH(v);
+				break;
+			}
+			/*
+			 * The callee takes over the stack frame of the running
+			 * lambda, and runs in place of it.
+			 */
+			lambda = (lisp_lambda *) v;
+			scope = lisp_frame_values(rt, lambda, i);
+			if (!scope)
+				goto error;
+			lisp_stack_pop(rt);
+			lisp_stack_top(rt) = v;
+			lisp_vm_compile(rt, lambda);
+			code = lambda->compiled;
+			rt->vm_sp = base;
+			goto start;
+		case OP_DEFINE:
+			lisp_scope_bind(scope, (lisp_symbol *) consts[ops[pc++]],
+				TOP);
+			break;
+		case OP_SCOPE:
+			s = lisp_new_empty_scope(rt);
+			s->up = scope;
+			scope = s;
+			break;
+		case OP_UNSCOPE:
+			scope = scope->up;
+			break;
+		case OP_RETURN:
+			v = rt->vm_stack[--rt->vm_sp];
+			rt->vm_sp--;
+			return v;
+		}
+	}
+
+error:
+	rt->vm_sp = base;
+	if (rt->profiling)
+		lisp_profile_return(rt);
+	rt->stack_depth = stack_depth;
+	return NULL;
+}
+
+#undef PUSH
+#undef TOP
+
+lisp_value *lisp_vm_run_body(lisp_runtime *rt, lisp_lambda *lambda,
+                             lisp_scope *frame)
+{
+	lisp_vm_compile(rt, lambda);
+	return lisp_vm_run(rt, lambda->compiled, frame);
+}
+
+lisp_value *lisp_vm_eval(lisp_runtime *rt, lisp_scope *scope,
+                         lisp_value *value)
+{
+	lisp_code *code;
+	lisp_value *rv;
+	int outer = lisp_gc_enter(rt, &rv, scope, value, NULL);
+	/* no tail calls, since top level code has no stack frame of its own */
+	code = lisp_compile(rt, scope, value, NULL, 0);
+	rv = lisp_vm_run(rt, code, scope);
+	if (outer)
+		lisp_gc_leave(rt);
+	return rv;
+}
+
+void lisp_enable_bytecode(lisp_runtime *rt)
+{
+	rt->vm = 1;
+}
+
+void lisp_disable_bytecode(lisp_runtime *rt)
+{
+	rt->vm = 0;
+}
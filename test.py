@@ -13,6 +13,17 @@ import sys
 ERROR_EXITCODE = 211
 
 
+def get_script_options(script):
+    # a script may ask for options of its own, such as limits to run within
+    options_re = re.compile(r'; OPTIONS\((.*)\)')
+    with open(script, 'r') as f:
+        for line in f:
+            match = options_re.match(line)
+            if match:
+                return match.group(1).split()
+    return []
+
+
 def get_expected_code_and_output(script):
     reading_output = False
     output = ''
@@ -28,27 +39,31 @@ def get_expected_code_and_output(script):
     return code, output
 
 
-def run_test_script(script, runner):
+def run_test_script(script, runner, options):
     command = [
         'valgrind',
         '-q',
         '--error-exitcode={}'.format(ERROR_EXITCODE),
         runner,
+    ] + options + get_script_options(script) + [
         script,
     ]
+    # valgrind cannot see inside the object pool, so use plain malloc()
+    env = dict(os.environ, FUNLISP_NOPOOL='1')
     proc = subprocess.Popen(
-        command, stderr=subprocess.PIPE, stdout=subprocess.PIPE)
+        command, stderr=subprocess.PIPE, stdout=subprocess.PIPE, env=env)
     stdout, stderr = proc.communicate()
     return proc.returncode, stdout, stderr
 
 
-def test_case(script, runner):
-    print('[{}] {}: '.format(runner, script), end='')
+def test_case(script, runner, options):
+    print('[{}] {}: '.format(' '.join([runner] + options), script), end='')
     sys.stdout.flush()
 
     exp_code, exp_stdout = get_expected_code_and_output(script)
     assert exp_code != ERROR_EXITCODE
-    act_code, act_stdout, act_stderr = run_test_script(script, runner)
+    act_code, act_stdout, act_stderr = run_test_script(
+        script, runner, options)
     act_stdout = act_stdout.decode('utf-8')
     act_stderr = act_stderr.decode('utf-8')
 
@@ -79,10 +94,16 @@ def test_case(script, runner):
         return True
 
 
+# every script runs with the tree-walking evaluator, and with the bytecode VM,
+# and then with each evaluator expanding macro calls once, and optimizing
+OPTIONS = [[], ['-B'], ['-M'], ['-B', '-M'], ['-O'], ['-B', '-O']]
+
+
 def run_tests(test_files, runner):
-    for script in test_files:
-        if not test_case(script, runner):
-            sys.exit(1)
+    for options in OPTIONS:
+        for script in test_files:
+            if not test_case(script, runner, options):
+                sys.exit(1)
 
 
 if __name__ == '__main__':
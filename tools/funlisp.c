@@ -21,8 +21,13 @@
 
 #include "funlisp.h"
 
-int disable_symcache = 0;
 int disable_strcache = 0;
+int enable_bytecode = 0;
+int enable_macro_cache = 0;
+int enable_optimizer = 0;
+int enable_debug = 0;
+unsigned long max_heap = 0;
+char *profile_file = NULL;
 int line_continue = 0;
 extern char **environ;
 
@@ -30,32 +35,40 @@ extern char **environ;
  * Return a complete line of input from the command line, given an EditLine.
  *
  * This function allows the user to compose a multi-line expression (or series
- * of expressions), only returning once the input is complete. It reads lines,
- * adding each line to the current input buffer if the parser returns LE_EOF.
- * All other errors are returned to the caller. If Control-D is sent, we return
- * error LE_EXIT.
+ * of expressions), only returning once the input is complete. It feeds each
+ * line to an incremental parser, and keeps reading lines while the parser
+ * holds an incomplete expression. Parse errors are returned to the caller. If
+ * Control-D is sent, we return error LE_EXIT.
  * @param rt runtime
  * @return a fully parsed progn containing maybe an arg
  * @retval NULL on error - use lisp_get_errno() to test the error code
  */
 static lisp_value *repl_parse_single_input(lisp_runtime *rt, EditLine *el, History *hist)
 {
+	lisp_parser *parser = lisp_parser_new(rt);
+	lisp_list *progn, *tail;
+	lisp_value *value;
 	char *input = NULL;
 	char *line;
 	int input_len = 0;
 	int line_len;
-	lisp_value *rv;
+	int rv;
 	HistEvent ev;
 
 	line_continue = 0;
+	progn = tail = (lisp_list *) lisp_nil_new(rt);
+	lisp_list_append(rt, &progn, &tail,
+	                 (lisp_value *) lisp_symbol_new(rt, "progn", 0));
 
 	for (;;) {
 		line = (char*)el_gets(el, &line_len);
 		if (line_len <= 0) { /* 0 is EOF, -1 error */
 			if (input) free(input);
+			lisp_parser_free(parser);
 			return lisp_error(rt, LE_EXIT, "");
 		}
 
+		/* the whole input is kept only for the history */
 		if (!input) {
 			/* first time, our input is just the line */
 			input = malloc(line_len + 1);
@@ -68,16 +81,21 @@ static lisp_value *repl_parse_single_input(lisp_runtime *rt, EditLine *el, Histo
 			input_len += line_len;
 		}
 
-		rv = lisp_parse_progn(rt, input);
-		if (rv) {
-			/* complete input! */
-			history(hist, &ev, H_ENTER, input);
-			free(input);
-			return rv;
-		} else if (lisp_get_errno(rt) != LE_EOF) {
+		lisp_parser_feed(parser, line, line_len);
+		while ((rv = lisp_parser_next(parser, &value)) > 0)
+			lisp_list_append(rt, &progn, &tail, value);
+
+		if (rv < 0) {
 			/* syntax error */
 			free(input);
+			lisp_parser_free(parser);
 			return NULL;
+		} else if (!lisp_parser_pending(parser)) {
+			/* complete input! */
+			history(hist, &ev, H_ENTER, input);
+			free(input);
+			lisp_parser_free(parser);
+			return (lisp_value *) progn;
 		}
 		/* otherwise, partial line (EOF not expected) */
 		line_continue = 1;
@@ -182,6 +200,35 @@ void repl_run_with_rt(lisp_runtime *rt, lisp_scope *scope)
 	el_end(el);
 }
 
+/*
+ * Profile the runtime from its creation, sampling every 100 microseconds.
+ */
+void profile_start(lisp_runtime *rt)
+{
+	if (profile_file)
+		lisp_profile_start(rt, 100);
+}
+
+/*
+ * Write the folded stacks to the profile file, and the table to stderr.
+ */
+void profile_finish(lisp_runtime *rt)
+{
+	FILE *file;
+
+	if (!profile_file)
+		return;
+	lisp_profile_stop(rt);
+	file = fopen(profile_file, "w");
+	if (!file) {
+		perror("open profile");
+	} else {
+		lisp_profile_write_folded(rt, file);
+		fclose(file);
+	}
+	lisp_profile_report(rt, stderr);
+}
+
 /**
  * Run a REPL :)
  */
@@ -191,13 +238,24 @@ int repl_run(void)
 	lisp_scope *scope;
 
 	rt = lisp_runtime_new();
-	if (!disable_symcache)
-		lisp_enable_symcache(rt);
 	if (!disable_strcache)
 		lisp_enable_strcache(rt);
+	if (enable_bytecode)
+		lisp_enable_bytecode(rt);
+	if (enable_macro_cache)
+		lisp_enable_macro_cache(rt);
+	if (enable_optimizer)
+		lisp_enable_optimizer(rt);
+	lisp_enable_auto_gc(rt, 0);
+	profile_start(rt);
 	scope = lisp_new_default_scope(rt);
+	if (enable_debug)
+		lisp_scope_populate_debug(rt, scope);
+	if (max_heap)
+		lisp_set_max_heap(rt, max_heap);
 
 	repl_run_with_rt(rt, scope);
+	profile_finish(rt);
 	lisp_runtime_free(rt); /* implicitly sweeps everything */
 	return 0;
 }
@@ -220,15 +278,26 @@ int file_run(char *name, int argc, char **argv, int repl)
 	}
 
 	rt = lisp_runtime_new();
-	if (!disable_symcache)
-		lisp_enable_symcache(rt);
 	if (!disable_strcache)
 		lisp_enable_strcache(rt);
+	if (enable_bytecode)
+		lisp_enable_bytecode(rt);
+	if (enable_macro_cache)
+		lisp_enable_macro_cache(rt);
+	if (enable_optimizer)
+		lisp_enable_optimizer(rt);
+	lisp_enable_auto_gc(rt, 0);
+	profile_start(rt);
 	scope = lisp_new_default_scope(rt);
+	if (enable_debug)
+		lisp_scope_populate_debug(rt, scope);
+	if (max_heap)
+		lisp_set_max_heap(rt, max_heap);
 
 	if (!lisp_load_file(rt, scope, file)) {
 		fclose(file);
 		lisp_print_error(rt, stderr);
+		profile_finish(rt);
 		lisp_runtime_free(rt);
 		return -1;
 	}
@@ -236,6 +305,7 @@ int file_run(char *name, int argc, char **argv, int repl)
 
 	if (repl) {
 		repl_run_with_rt(rt, scope);
+		profile_finish(rt);
 		lisp_runtime_free(rt);
 		return 0;
 	}
@@ -246,22 +316,39 @@ int file_run(char *name, int argc, char **argv, int repl)
 	} else if (lisp_is(result, type_integer)) {
 		rv = lisp_integer_get((lisp_integer *) result);
 	}
+	profile_finish(rt);
 	lisp_runtime_free(rt);
 	return rv;
 }
 
 int help(void)
 {
-	puts(
+	/* C89 only promises string literals of 509 characters, so split it up */
+	fputs(
 		"Usage: funlisp [options...] [file]  load file and run main\n"
 		"   or: funlisp [options...]         run a REPL\n"
 		"\n"
 		"Options:\n"
 		" -h   Show this help message and exit\n"
 		" -v   Show the funlisp version and exit\n"
-		" -x   When file is specified, load it and run REPL rather than main\n"
+		" -x   When file is specified, load it and run REPL rather than main\n",
+		stdout
+	);
+	fputs(
+		" -B   Run code with the Bytecode VM\n"
+		" -D   Add Debugging builtins for tests, such as inlined?\n"
+		" -M   Expand each Macro call once, and reuse its expansion\n"
+		" -O   Optimize lambdas: inline core builtins and fold constants\n"
 		" -T   Disable sTring caching\n"
-		" -Y   Disable sYmbol caching"
+		" -H BYTES\n"
+		"      Limit the Heap to BYTES, raising LE_LIMIT beyond it\n",
+		stdout
+	);
+	fputs(
+		" -p FILE, --profile FILE\n"
+		"      Profile the run: write folded stacks for a flame graph to\n"
+		"      FILE, and print a table of calls and times to stderr\n",
+		stdout
 	);
 	return 0;
 }
@@ -274,9 +361,15 @@ int version(void)
 
 int main(int argc, char **argv)
 {
-	int opt;
+	int opt, i;
 	int file_repl = 0;
-	while ((opt = getopt(argc, argv, "hvxYT")) != -1) {
+
+	/* getopt() has no long options, so spell --profile the short way */
+	for (i = 1; i < argc && argv[i][0] == '-'; i++)
+		if (strcmp(argv[i], "--profile") == 0)
+			argv[i] = "-p";
+
+	while ((opt = getopt(argc, argv, "hvxBDMOYTH:p:")) != -1) {
 		switch (opt) {
 		case 'x':
 			file_repl = 1;
@@ -284,11 +377,29 @@ int main(int argc, char **argv)
 		case 'v':
 			return version();
 			break;
+		case 'B':
+			enable_bytecode = 1;
+			break;
+		case 'D':
+			enable_debug = 1;
+			break;
+		case 'M':
+			enable_macro_cache = 1;
+			break;
+		case 'O':
+			enable_optimizer = 1;
+			break;
 		case 'T':
 			disable_strcache = 1;
 			break;
+		case 'H':
+			max_heap = strtoul(optarg, NULL, 10);
+			break;
+		case 'p':
+			profile_file = optarg;
+			break;
 		case 'Y':
-			disable_symcache = 1;
+			/* symbols are always interned now, accept the old option */
 			break;
 		case 'h': /* fall through */
 		default:
@@ -6,9 +6,28 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "funlisp.h"
 
+/*
+ * With --profile FILE, write folded stacks to FILE for a flame graph, and a
+ * table of the calls and time of each function to stderr.
+ */
+static void write_profile(lisp_runtime *rt, char *name)
+{
+	FILE *output;
+
+	lisp_profile_stop(rt);
+	output = fopen(name, "w");
+	if (!output) {
+		perror("open profile");
+	} else {
+		lisp_profile_write_folded(rt, output);
+		fclose(output);
+	}
+	lisp_profile_report(rt, stderr);
+}
 
 int main(int argc, char **argv)
 {
@@ -16,8 +35,15 @@ int main(int argc, char **argv)
 	lisp_runtime *rt;
 	lisp_scope *scope;
 	lisp_value *result;
+	char *profile = NULL;
 	int rv;
 
+	if (argc >= 3 && strcmp(argv[1], "--profile") == 0) {
+		profile = argv[2];
+		argc -= 2;
+		argv += 2;
+	}
+
 	if (argc < 2) {
 		fprintf(stderr, "error: expected at least one argument\n");
 		return EXIT_FAILURE;
@@ -30,6 +56,9 @@ int main(int argc, char **argv)
 	}
 
 	rt = lisp_runtime_new();
+	lisp_enable_auto_gc(rt, 0);
+	if (profile)
+		lisp_profile_start(rt, 100); /* sample every 100 microseconds */
 	scope = lisp_new_default_scope(rt);
 
 	lisp_load_file(rt, scope, input);
@@ -49,6 +78,8 @@ int main(int argc, char **argv)
 		rv = 0;
 	}
 out:
+	if (profile)
+		write_profile(rt, profile);
 	lisp_runtime_free(rt); /* sweeps everything before exit */
 	return rv;
 }